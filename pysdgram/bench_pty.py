@@ -0,0 +1,229 @@
+#
+# Benchmark of pysdgram against the C++ Net over a pty.
+#
+# Starts the C++ echo program (sdgram_test_x64/sdgram_pty_echo) on
+# one side of a pty and sends datagrams to it from the other side.
+# For each payload size and offered load it reports the datagrams
+# echoed per second, the goodput, the round trip percentiles and
+# the CPU time per datagram on each side. The CPU utilization of
+# each side shows which one is the bottleneck. Results are written
+# as JSON.
+#
+# usage: python3 bench_pty.py <pty_echo binary> [--sizes 4,24,56]
+#            [--loads 100,1000,0] [--duration 2] [--output file]
+#
+# A load of 0 sends as fast as the window of outstanding datagrams
+# allows. Needs a POSIX system.
+#
+# author: aleksandar
+#
+
+import argparse
+import fcntl
+import json
+import os
+import select
+import struct
+import subprocess
+import termios
+import time
+import tty
+
+from sdgram import SerialDatagram
+
+EchoPort = 1
+StatsPort = 2
+QuitPort = 3
+
+# echoed, dropped, cpu_ns
+StatsFmt = '<IIQ'
+SeqFmt = '<I'
+
+# Datagrams in flight at most, so that an unlimited load does not
+# overrun the buffers of the echo end.
+Window = 16
+
+# How long to wait for the last echoes of a run.
+DrainTime = 0.5
+
+class PtySerial:
+    """The master side of a pty, with the interface of pyserial
+    that SerialDatagram uses."""
+    def __init__(self, fd):
+        self._fd = fd
+        os.set_blocking(fd, False)
+
+    @property
+    def in_waiting(self):
+        buf = fcntl.ioctl(self._fd, termios.FIONREAD, b'\0\0\0\0')
+        return struct.unpack('i', buf)[0]
+
+    def read(self, count):
+        try:
+            return os.read(self._fd, count)
+        except BlockingIOError:
+            return b''
+
+    def write(self, data):
+        try:
+            return os.write(self._fd, data)
+        except BlockingIOError:
+            select.select([], [self._fd], [], 0.01)
+            return 0
+
+    def fileno(self):
+        return self._fd
+
+class EchoPeer:
+    def __init__(self, binary):
+        master, slave = os.openpty()
+        tty.setraw(master)
+        tty.setraw(slave)
+
+        self._proc = subprocess.Popen([binary, os.ttyname(slave)])
+        os.close(slave)
+
+        self.serial = PtySerial(master)
+        self.net = SerialDatagram(self.serial)
+        self._stats = None
+        self.net.register_struct(StatsPort, StatsFmt, self._on_stats)
+
+    def stats(self, timeout=2.0):
+        """Ask the echo end for its counters."""
+        self._stats = None
+        self.net.send_bytes(StatsPort, b'\0')
+        deadline = time.monotonic() + timeout
+
+        while self._stats is None:
+            if time.monotonic() > deadline:
+                raise RuntimeError('no stats from the echo end')
+            self.wait(deadline - time.monotonic())
+            self.net.process()
+
+        return self._stats
+
+    def wait(self, timeout):
+        select.select([self.serial], [], [], max(0, min(timeout, 0.01)))
+
+    def close(self):
+        self.net.send_bytes(QuitPort, b'\0')
+        try:
+            self._proc.wait(timeout=2)
+        except subprocess.TimeoutExpired:
+            self._proc.kill()
+        os.close(self.serial.fileno())
+
+    def _on_stats(self, echoed, dropped, cpu_ns):
+        self._stats = (echoed, dropped, cpu_ns)
+
+def percentile_us(sorted_values, p):
+    if not sorted_values:
+        return None
+    return sorted_values[min(len(sorted_values) - 1, int(len(sorted_values) * p / 100))] * 1e6
+
+def run(peer, size, load, duration):
+    sent = {}
+    rtts = []
+
+    def on_echo(payload):
+        seq = struct.unpack(SeqFmt, payload[:struct.calcsize(SeqFmt)])[0]
+        start = sent.pop(seq, None)
+        if start is not None:
+            rtts.append(time.perf_counter() - start)
+
+    peer.net.register_rcv(EchoPort, on_echo)
+
+    padding = bytes(size - struct.calcsize(SeqFmt))
+    interval = 1.0 / load if load else 0
+
+    echoed_before, dropped_before, cpu_ns_before = peer.stats()
+    cpu_before = time.process_time()
+    start = time.perf_counter()
+    end = start + duration
+    next_send = start
+    seq = 0
+
+    while True:
+        now = time.perf_counter()
+
+        if now >= end:
+            if not sent or now >= end + DrainTime:
+                break
+        elif len(sent) < Window and now >= next_send:
+            sent[seq] = now
+            peer.net.send_bytes(EchoPort, struct.pack(SeqFmt, seq) + padding)
+            seq += 1
+            next_send = next_send + interval if load else now
+            continue
+
+        peer.net.process()
+
+        if not peer.serial.in_waiting:
+            peer.wait(next_send - now if now < end and len(sent) < Window else 0.01)
+
+    elapsed = min(time.perf_counter(), end) - start
+    cpu_py = time.process_time() - cpu_before
+    echoed_after, dropped_after, cpu_ns_after = peer.stats()
+    cpu_cpp = (cpu_ns_after - cpu_ns_before) / 1e9
+
+    rtts.sort()
+    received = len(rtts)
+
+    return {
+        'payload': size,
+        'offered_msgs_per_s': load or None,
+        'sent': seq,
+        'received': received,
+        'lost': len(sent),
+        'dropped_by_cpp': dropped_after - dropped_before,
+        'msgs_per_s': received / elapsed,
+        'goodput_bytes_per_s': received * size / elapsed,
+        'rtt_us': {
+            'p50': percentile_us(rtts, 50),
+            'p90': percentile_us(rtts, 90),
+            'p99': percentile_us(rtts, 99),
+            'max': percentile_us(rtts, 100),
+        },
+        'cpu_us_per_msg': {
+            'python': cpu_py / received * 1e6 if received else None,
+            'cpp': cpu_cpp / max(1, echoed_after - echoed_before) * 1e6,
+        },
+        'cpu_utilization': {
+            'python': cpu_py / elapsed,
+            'cpp': cpu_cpp / elapsed,
+        },
+    }
+
+def main():
+    parser = argparse.ArgumentParser(description='pysdgram against the C++ Net over a pty')
+    parser.add_argument('echo', help='path to the pty_echo binary')
+    parser.add_argument('--sizes', default='4,24,56')
+    parser.add_argument('--loads', default='100,1000,0')
+    parser.add_argument('--duration', type=float, default=2.0)
+    parser.add_argument('--output', help='write the JSON here instead of stdout')
+    args = parser.parse_args()
+
+    sizes = [int(s) for s in args.sizes.split(',')]
+    loads = [int(l) for l in args.loads.split(',')]
+
+    for size in sizes:
+        if size < struct.calcsize(SeqFmt) or size > SerialDatagram._MaxPayloadSize:
+            parser.error('payload sizes must be within 4 and 56')
+
+    peer = EchoPeer(args.echo)
+
+    try:
+        runs = [run(peer, size, load, args.duration) for size in sizes for load in loads]
+    finally:
+        peer.close()
+
+    report = json.dumps({ 'window': Window, 'duration_s': args.duration, 'runs': runs }, indent=2)
+
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(report + '\n')
+    else:
+        print(report)
+
+if __name__ == '__main__':
+    main()
@@ -29,7 +29,9 @@ class SerialDatagramStats:
         self.rcv_error_crc = 0
         self.rcv_error_size = 0
         self.rcv_error_trl = 0
+        # neither a callback nor a subscriber took the port
         self.rcv_error_no_rcv = 0
+        self.rcv_error_struct = 0
 
 class SerialDatagram:
     """Simple datagram communication over a serial interface.
@@ -64,6 +66,7 @@ class SerialDatagram:
         self._trl_magic = struct.pack(SerialDatagram._TrlMagicFmt, SerialDatagram._TrlMagic)
 
         self._rcv_table = { }
+        self._subscriptions = []
         self._rcv_buf = bytearray()
         self._rcv_state = _ReceiverState.START_SEARCH
         self._rcv_total_msg_size = 0
@@ -115,6 +118,29 @@ class SerialDatagram:
     #
     def register_rcv(self, endp, cb):
         self._rcv_table[endp] = cb
+
+    def subscribe(self, cb, first=0, last=0xff):
+        """Register a callback that shares the ports from first to
+        last with other callbacks. By default it gets every port,
+        such as for a logger. The callback registered for the port
+        goes first, then the subscribers in the order they
+        subscribed, all with the same payload. A datagram that only
+        subscribers get does not count in rcv_error_no_rcv."""
+        self._subscriptions.append((first, last, cb))
+
+    def register_struct(self, endp, fmt, cb):
+        """Register a callback that gets the payload unpacked with
+        a struct format, such as the Format() of a C++ schema.
+        Payloads of another size are dropped."""
+        size = struct.calcsize(fmt)
+
+        def unpack(payload):
+            if len(payload) != size:
+                self._stats.rcv_error_struct += 1
+                return
+            cb(*struct.unpack(fmt, payload))
+
+        self.register_rcv(endp, unpack)
         
     def process(self):
         """Process all received data. This function needs to be invoked
@@ -216,10 +242,19 @@ class SerialDatagram:
         self._stats.rcv_bytes += self._rcv_total_msg_size
 
         port = self._rcv_hdr_port()
+        payload = self._rcv_buf[self._hdr_len : self._hdr_len + self._rcv_hdr_size()]
+        received = False
+
         if port in self._rcv_table:
-            payload = self._rcv_buf[self._hdr_len : self._hdr_len + self._rcv_hdr_size()]
             self._rcv_table[port](payload)
-        else:
+            received = True
+
+        for first, last, cb in self._subscriptions:
+            if first <= port <= last:
+                cb(payload)
+                received = True
+
+        if not received:
             self._stats.rcv_error_no_rcv += 1
 
     def _start_next_msg(self):
@@ -0,0 +1,138 @@
+#
+# Remote procedure calls over a pair of ports.
+#
+# The wire format matches sdgram_rpc.h:
+#
+#   request:  tag, method, arguments
+#   response: tag, status, result
+#
+# author: aleksandar
+#
+
+import struct
+import time
+from enum import IntEnum
+
+class RpcStatus(IntEnum):
+    OK = 0
+    NO_METHOD = 1
+    FAILED = 2
+    TIMEOUT = 3
+
+class RpcError(Exception):
+    def __init__(self, status):
+        super().__init__('rpc call failed: {0}'.format(status.name))
+        self.status = status
+
+class RpcClientStats:
+    def __init__(self):
+        self.clear()
+
+    def clear(self):
+        self.calls = 0
+        self.responses = 0
+        self.timeouts = 0
+        self.late = 0
+
+class RpcClient:
+    """Client side of the RPC layer. Calls are matched to responses
+    by an 8-bit tag, so several calls can be outstanding at once.
+    A call without a response within its timeout completes with
+    RpcStatus.TIMEOUT and a late response is dropped."""
+
+    _HdrFmt = '=BB'
+    _MaxPending = 128
+
+    def __init__(self, net, request_port, response_port, clock=time.monotonic):
+        self._net = net
+        self._request_port = request_port
+        self._response_port = response_port
+        self._clock = clock
+        self._hdr_len = struct.calcsize(RpcClient._HdrFmt)
+
+        self._stats = RpcClientStats()
+        self._next_tag = 0
+
+        # tag -> (callback, deadline)
+        self._pending = { }
+
+        net.register_rcv(response_port, self._on_response)
+
+    @property
+    def stats(self):
+        return self._stats
+
+    @property
+    def pending(self):
+        return len(self._pending)
+
+    def call_async(self, method, args, callback, timeout):
+        """Send a request and return its tag. The callback is invoked
+        once with the tag, the status and the result, either from
+        process() or from the response callback of the net."""
+        if len(self._pending) >= RpcClient._MaxPending:
+            raise RuntimeError('too many outstanding calls')
+
+        tag = self._alloc_tag()
+        self._pending[tag] = (callback, self._clock() + timeout)
+        self._stats.calls += 1
+
+        self._net.send_bytes(self._request_port,
+            struct.pack(RpcClient._HdrFmt, tag, method) + bytes(args))
+
+        return tag
+
+    def call(self, method, args, timeout=1.0):
+        """Send a request and wait for its result. Raises RpcError
+        unless the call succeeds."""
+        done = []
+
+        self.call_async(method, args, lambda tag, status, result: done.append((status, result)), timeout)
+
+        while not done:
+            self._net.process()
+            self.process()
+
+        status, result = done[0]
+
+        if status != RpcStatus.OK:
+            raise RpcError(status)
+
+        return result
+
+    def process(self):
+        """Complete the calls that timed out."""
+        now = self._clock()
+        expired = [tag for tag, (_, deadline) in self._pending.items() if now >= deadline]
+
+        for tag in expired:
+            self._stats.timeouts += 1
+            self._complete(tag, RpcStatus.TIMEOUT, bytes())
+
+    def _alloc_tag(self):
+        while self._next_tag in self._pending:
+            self._next_tag = (self._next_tag + 1) & 0xff
+
+        tag = self._next_tag
+        self._next_tag = (self._next_tag + 1) & 0xff
+        return tag
+
+    def _on_response(self, payload):
+        if len(payload) < self._hdr_len:
+            self._stats.late += 1
+            return
+
+        tag, status = struct.unpack(RpcClient._HdrFmt, payload[:self._hdr_len])
+
+        if tag not in self._pending:
+            self._stats.late += 1
+            return
+
+        self._stats.responses += 1
+        status = RpcStatus(status)
+        result = bytes(payload[self._hdr_len:]) if status == RpcStatus.OK else bytes()
+        self._complete(tag, status, result)
+
+    def _complete(self, tag, status, result):
+        callback, _ = self._pending.pop(tag)
+        callback(tag, status, result)
@@ -20,6 +20,7 @@ class SerialChannelMock:
 
     def write(self, data):
         self._rcv_buf = self._rcv_buf + data
+        return len(data)
 
 class SerialChannelMockPair:
     def __init__(self):
@@ -45,4 +46,4 @@ class SerialMockEndp:
         return self._r.read(count)
 
     def write(self, data):
-        self._w.write(data)
+        return self._w.write(data)
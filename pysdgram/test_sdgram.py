@@ -233,3 +233,149 @@ def test_error_no_rcv():
     assert test.net.stats.rcv_bytes == len(packet)
     assert test.net.stats.rcv_error_no_rcv == 1
     assert test.net.stats.rcv_dropped_bytes == 0
+
+def test_subscribe():
+    test = SdgramTestBase()
+    calls = []
+    test.net.register_rcv(1, lambda payload: calls.append(('ctrl', payload)))
+    test.net.subscribe(lambda payload: calls.append(('ui', payload)), 1, 1)
+    test.net.subscribe(lambda payload: calls.append(('log', payload)))
+
+    test.serial_b.write(test.net.create_datagram_from_struct(1, '=BB', 1, 2))
+    test.serial_b.write(test.net.create_datagram_from_struct(7, '=BB', 3, 4))
+
+    test.net.process()
+
+    assert calls == [('ctrl', b'\x01\x02'), ('ui', b'\x01\x02'), ('log', b'\x01\x02'), ('log', b'\x03\x04')]
+    assert test.net.stats.rcv_error_no_rcv == 0
+
+def test_subscribe_before_register():
+    test = SdgramTestBase()
+    calls = []
+    test.net.subscribe(lambda payload: calls.append(('log', payload)))
+    test.net.register_rcv(1, lambda payload: calls.append(('ctrl', payload)))
+
+    test.serial_b.write(test.net.create_datagram_from_struct(1, '=BB', 1, 2))
+
+    test.net.process()
+
+    assert calls == [('ctrl', b'\x01\x02'), ('log', b'\x01\x02')]
+
+def test_rcv_struct():
+    test = SdgramTestBase()
+    msgs = []
+    # the format of the Telemetry schema in the C++ tests
+    test.net.register_struct(12, '<HhBBf', lambda *fields: msgs.append(fields))
+
+    test.serial_b.write(test.net.create_datagram_from_struct(12, '<HhBBf', 5000, -120, 1, 2, 21.5))
+    test.serial_b.write(test.net.create_datagram_from_struct(12, '<HhBB', 5000, -120, 1, 2))
+
+    test.net.process()
+
+    assert msgs == [(5000, -120, 1, 2, 21.5)]
+    assert test.net.stats.rcv_error_struct == 1
+
+#
+# RPC tests.
+#
+from sdgram_rpc import RpcClient, RpcStatus, RpcError
+
+RpcRequestPort = 10
+RpcResponsePort = 11
+RpcMethodAdd = 1
+
+class FakeClock:
+    def __init__(self):
+        self.now = 0.0
+
+    def __call__(self):
+        return self.now
+
+class RpcTestBase(SdgramTestBase):
+    """The b side plays the device: it answers the add method and
+    reports any other method as unknown."""
+    def __init__(self):
+        super().__init__()
+        self.clock = FakeClock()
+        self.client = RpcClient(self.net, RpcRequestPort, RpcResponsePort, self.clock)
+        self.device = SerialDatagram(self.serial_b)
+        self.device.register_rcv(RpcRequestPort, self._serve)
+        self.answer = True
+
+    def _serve(self, payload):
+        if not self.answer:
+            return
+        tag, method = struct.unpack('=BB', payload[:2])
+        if method == RpcMethodAdd:
+            a, b = struct.unpack('=HH', payload[2:])
+            self.device.send_bytes(RpcResponsePort, struct.pack('=BBH', tag, RpcStatus.OK, a + b))
+        else:
+            self.device.send_bytes(RpcResponsePort, struct.pack('=BB', tag, RpcStatus.NO_METHOD))
+
+    def run(self):
+        self.device.process()
+        self.net.process()
+        self.client.process()
+
+def test_rpc_pipelined():
+    test = RpcTestBase()
+    done = {}
+
+    for i in range(8):
+        test.client.call_async(RpcMethodAdd, struct.pack('=HH', i, 100),
+            lambda tag, status, result: done.update({tag: (status, result)}), 1.0)
+
+    assert test.client.pending == 8
+
+    test.run()
+
+    assert test.client.pending == 0
+    assert len(done) == 8
+    for tag, (status, result) in done.items():
+        assert status == RpcStatus.OK
+        assert struct.unpack('=H', result)[0] == tag + 100
+
+def test_rpc_errors():
+    test = RpcTestBase()
+    statuses = []
+
+    test.client.call_async(7, bytes(), lambda tag, status, result: statuses.append(status), 1.0)
+    test.run()
+
+    assert statuses == [RpcStatus.NO_METHOD]
+
+def test_rpc_timeout():
+    test = RpcTestBase()
+    test.answer = False
+    statuses = []
+
+    tag = test.client.call_async(RpcMethodAdd, struct.pack('=HH', 1, 2),
+        lambda tag, status, result: statuses.append(status), 0.5)
+    test.run()
+    assert statuses == []
+
+    test.clock.now = 0.5
+    test.run()
+    assert statuses == [RpcStatus.TIMEOUT]
+    assert test.client.stats.timeouts == 1
+
+    # the response arrives after the call gave up
+    test.device.send_bytes(RpcResponsePort, struct.pack('=BBH', tag, RpcStatus.OK, 3))
+    test.run()
+    assert statuses == [RpcStatus.TIMEOUT]
+    assert test.client.stats.late == 1
+
+def test_rpc_blocking_call():
+    test = RpcTestBase()
+
+    # the device answers when the client processes the net
+    test.net.process = lambda: (test.device.process(), SerialDatagram.process(test.net))
+    result = test.client.call(RpcMethodAdd, struct.pack('=HH', 2, 3))
+
+    assert struct.unpack('=H', result)[0] == 5
+
+    try:
+        test.client.call(9, bytes())
+        assert False
+    except RpcError as e:
+        assert e.status == RpcStatus.NO_METHOD
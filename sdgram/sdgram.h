@@ -15,40 +15,160 @@
 #endif /* ARDUINO */
 
 #include "sdgram_defs.h"
+#include "sdgram_config.h"
 #include "sdgram_buf_alloc.h"
 #include "sdgram_prot.h"
 #include "sdgram_rcv_table.h"
 #include "sdgram_receiver.h"
 #include "sdgram_sender.h"
 #include "sdgram_rcv_stats.h"
+#include "sdgram_flow_control.h"
+#include "sdgram_compression.h"
+#include "sdgram_frame_size.h"
+#include "sdgram_ping.h"
+#include "sdgram_framing.h"
+#include "sdgram_cobs.h"
+#include "sdgram_compact.h"
+#include "sdgram_fec.h"
 
 namespace SerialDatagram {
 
-template<typename Stream>
+template<
+    typename Stream,
+    typename Config = DefaultConfig>
 class Net {
 public:
     // user payload size
-    static constexpr BufferLen MaxBufferLen = 56;
+    static constexpr BufferLen MaxBufferLen = Config::MaxBufferLen;
 
     // buffers for parallel sends
-    static constexpr uint16_t TotalBufs = 4;
+    static constexpr uint16_t TotalBufs = Config::TotalBufs;
 
     Net(
         Stream &stream)
             : stream(stream),
+            rx_alloc(buf_alloc),
             receiver(
                 stream,
-                rcv_table),
+                rcv_table,
+                rx_alloc,
+                flow_control,
+                codec),
             sender(
                 stream,
-                buf_alloc) {
-        // empty
+                buf_alloc,
+                flow_control),
+            control_rcv(*this),
+            diag_rcv(*this),
+            buf_listener(nullptr),
+            buf_wanted(false),
+            send_turn(false) {
+        if constexpr(HasControl) {
+            rcv_table.Register(ControlPort, control_rcv);
+        }
+
+        if constexpr(Ping::Enabled) {
+            rcv_table.Register(DiagPort, diag_rcv);
+        }
+
+        for(auto &port : coalesced_ports) {
+            port = InvalidPort;
+        }
     }
 
-    void Process() {
-        receiver.Process();
+    // Returns true if any bytes were read or written.
+    bool Process() {
+        bool read = receiver.Process();
+
+        ProcessFlowControl();
+        ProcessFrameSize();
+
+        bool written = sender.Process();
 
-        sender.Process();
+        NotifyBufferFree();
+
+        return read || written;
+    }
+
+    // Does at most the work that the budget allows, so that a loop
+    // with other deadlines knows how long a call takes. Receiving a
+    // frame takes turns with sending a datagram, also from one call
+    // to the next, so that a flood of incoming frames does not hold
+    // up sending, nor the other way round. Returns true if it
+    // stopped on the budget with bytes still to read, or datagrams
+    // or a control datagram still to send, and false otherwise. A
+    // partial frame may still wait for its timeout then, which
+    // HasWork() tells.
+    bool Process(const Budget &budget) {
+        bool more = ProcessTurns(budget);
+
+        NotifyBufferFree();
+
+        return more;
+    }
+
+    // While a receiver callback runs, keeps its payload after the
+    // callback returns, so that it can be processed later without
+    // holding up receiving. Returns a null buffer if no receive
+    // buffer is free. The payload goes back with ReleaseFrame().
+    Buffer HoldFrame() {
+        return receiver.HoldFrame();
+    }
+
+    void ReleaseFrame(Buffer buf) {
+        receiver.ReleaseFrame(buf);
+    }
+
+    // Sends a ping of len bytes, at least a DiagPing, to the peer.
+    // Its reply adds the round-trip time to the ping stats.
+    Status SendPing(BufferLen len = sizeof(DiagPing)) {
+        if constexpr(Ping::Enabled) {
+            if(len < sizeof(DiagPing) || len > MaxBufferLen) {
+                return Status::Failure;
+            }
+
+            auto buf = AllocBuffer();
+
+            if(!buf.ptr) {
+                return Status::NoMoreSpace;
+            }
+
+            auto msg = ping.CreatePing();
+
+            memcpy(buf.ptr, &msg, sizeof(msg));
+            memset(static_cast<uint8_t *>(buf.ptr) + sizeof(msg), 0, len - sizeof(msg));
+            buf.len = len;
+
+            auto status = Send(DiagPort, buf);
+
+            if(status == Status::Success) {
+                ping.PingSent();
+            } else {
+                FreeBuffer(buf);
+            }
+
+            return status;
+        } else {
+            return Status::Failure;
+        }
+    }
+
+    // Parses bytes read by the caller rather than by Process(),
+    // which must not read the stream as well. See Receiver::Feed.
+    void Feed(const uint8_t *bytes, size_t len) {
+        receiver.Feed(bytes, len);
+    }
+
+    // True if Process() has anything to do: bytes to read,
+    // datagrams or a control datagram to write, an advert that
+    // is due, a partial frame that may time out, or a buffer
+    // listener to tell.
+    bool HasWork() {
+        return stream.available() > 0
+            || sender.HasPending()
+            || receiver.HasPendingTimeout()
+            || IsAdvertDue()
+            || (buf_wanted && buf_listener && buf_alloc.HasFree());
     }
 
     // To send a message, the client first allocates a buffer.
@@ -56,24 +176,51 @@ public:
     // After filling in the buffer and setting the buffer len,
     // the client can either invoke send or first prepare
     // the datagram and then send the prepared datagram.
-    // The prepared path is mostly used for tests.
+    // The prepared path is mostly used for tests. When no buffer
+    // is free, the buffer listener hears when one is.
     Buffer AllocBuffer() {
         auto ptr = buf_alloc.Alloc();
 
         if(ptr) {
-            ptr = static_cast<DatagramHdr *>(ptr) + 1;
+            ptr = static_cast<uint8_t *>(ptr) + Framing::HdrRoom;
+        } else {
+            buf_wanted = true;
         }
 
         return Buffer { ptr, MaxBufferLen }; 
     }
 
-    // The buffer ownership is passed to the network object.
+    // Gives back a buffer that is not going to be sent.
+    void FreeBuffer(Buffer buf) {
+        buf_alloc.Free(buf.ptr);
+    }
+
+    // The buffer ownership is passed to the network object, unless
+    // the send queue is full. Then NoMoreSpace is returned and the
+    // buffer stays with the caller, to send again after Process()
+    // or to free.
     Status Send(Port port, Buffer buf) {
-        return sender.Send(port, buf);
+        return Send(port, buf, nullptr, 0);
+    }
+
+    // Like Send(), and done gets the token once the last byte of
+    // the datagram is written to the stream, or when coalescing
+    // replaced the datagram. That may be before Send() returns.
+    Status Send(Port port, Buffer buf, SendDone *done, uint16_t token) {
+        auto coalesce = IsCoalesced(port);
+
+        // the encoding must not run twice
+        if(!sender.Accepts(port, coalesce)) {
+            return Status::NoMoreSpace;
+        }
+
+        auto size_flags = Encode(port, buf);
+
+        return sender.Send(port, buf, size_flags, coalesce, done, token);
     }
 
     void PrepareDatagram(Port port, Buffer &buf) {
-        sender.PrepareDatagram(port, buf);
+        sender.PrepareDatagram(port, buf, Encode(port, buf));
     }
 
     // Send an already prepared datagram.
@@ -81,18 +228,205 @@ public:
         return sender.SendDatagram(buf);
     }
 
+    // Sends a frame received by a network with the same framing.
+    // The frame is copied as it is when the port stays the same.
+    // Otherwise the received payload is framed again for the new
+    // port, keeping its size flags.
+    Status SendFrame(Port port, const RcvFrame &frame) {
+        auto buf = AllocBuffer();
+
+        if(!buf.ptr) {
+            return Status::NoMoreSpace;
+        }
+
+        if(frame.frame.ptr && frame.port == port && frame.frame.len <= TotalBufLen) {
+            buf.ptr = static_cast<uint8_t *>(buf.ptr) - Framing::HdrRoom;
+            buf.len = frame.frame.len;
+            memcpy(buf.ptr, frame.frame.ptr, buf.len);
+        } else if(frame.payload.len <= MaxBufferLen) {
+            buf.len = frame.payload.len;
+            memcpy(buf.ptr, frame.payload.ptr, buf.len);
+            sender.PrepareDatagram(port, buf, frame.size_flags);
+        } else {
+            buf_alloc.Free(buf.ptr);
+            return Status::Failure;
+        }
+
+        auto status = sender.SendDatagram(buf, port, IsCoalesced(port));
+
+        if(status != Status::Success) {
+            buf_alloc.Free(buf.ptr);
+        }
+
+        return status;
+    }
+
+    // The frame being delivered, while a receiver
+    // callback runs. Null otherwise.
+    const RcvFrame *CurrentFrame() const {
+        return receiver.CurrentFrame();
+    }
+
+    // Bytes waiting for room in the stream.
+    uint16_t QueuedBytes() const {
+        return sender.QueuedBytes();
+    }
+
+    // Total bytes written to the stream. The counter wraps.
+    uint16_t SentBytes() const {
+        return sender.SentBytes();
+    }
+
+    // Datagrams written to the stream in full or replaced by
+    // coalescing. The counter wraps.
+    uint16_t SentFrames() const {
+        return sender.SentFrames();
+    }
+
+    // Datagrams replaced by coalescing. The counter wraps.
+    uint16_t CoalescedFrames() const {
+        return sender.CoalescedFrames();
+    }
+
+    // Process() tells the listener when a send buffer is free
+    // again after AllocBuffer() found none. Null stops telling.
+    void SetBufferListener(BufListener *listener) {
+        buf_listener = listener;
+    }
+
+    // True if the buffer was allocated by this network.
+    bool OwnsBuffer(Buffer buf) const {
+        return buf_alloc.Owns(buf.ptr);
+    }
+
     Status RegisterReceiver(
             Port port,
             Rcv &rcv) {
         return rcv_table.Register(port, rcv);
     }
 
+    // Stops telling the listener about the datagrams it queued,
+    // for example before it goes away.
+    void ForgetSendDone(SendDone &done) {
+        sender.ForgetDone(done);
+    }
+
+    // Removes a receiver that RegisterReceiver() added, so that
+    // the port can take another one.
+    Status UnregisterReceiver(
+            Port port,
+            Rcv &rcv) {
+        return rcv_table.Unregister(port, rcv);
+    }
+
+    // Adds a receiver for the ports from first to last, which it
+    // shares with the registered receiver of each port and with
+    // other subscribers, such as a logger of every port. A frame
+    // goes first to the registered receiver of its port and then
+    // to the subscribers in the order they subscribed, as the same
+    // buffer, so none of them may change it, and only one of them
+    // can hold it. The range takes one receiver slot. A range that
+    // covers ControlPort gets flow control datagrams.
+    //
+    // A frame that a subscriber gets counts as received, so with a
+    // subscriber of every port, rcv_error no longer counts frames
+    // of ports without a registered receiver.
+    Status Subscribe(Port first, Port last, Rcv &rcv) {
+        return rcv_table.Subscribe(first, last, rcv);
+    }
+
+    Status Subscribe(Port port, Rcv &rcv) {
+        return rcv_table.Subscribe(port, port, rcv);
+    }
+
     const RcvStats &GetRcvStats() const {
         return receiver.GetStats();
     }
 
     void ClearRcvStats() {
         receiver.ClearStats();
+
+        if constexpr(FrameSize::Enabled) {
+            frame_size.StatsCleared();
+        }
+    }
+
+    const typename Config::FlowControl &GetFlowControl() const {
+        return flow_control;
+    }
+
+    const typename Config::FrameSize &GetFrameSize() const {
+        return frame_size;
+    }
+
+    // GetStats() of the ping service tells the round-trip times.
+    const typename Config::Ping &GetPing() const {
+        return ping;
+    }
+
+    void ClearPingStats() {
+        if constexpr(Ping::Enabled) {
+            ping.ClearStats();
+        }
+    }
+
+    // The payload size the peer gets the most through the link
+    // with, when both ends adapt their frame sizes. MaxBufferLen
+    // otherwise, and until the peer tells.
+    BufferLen FramePayload() const {
+        if constexpr(FrameSize::Enabled) {
+            return frame_size.TxLen(MaxBufferLen);
+        } else {
+            return MaxBufferLen;
+        }
+    }
+
+    // Payloads on the port are compressed when it helps.
+    // The peer needs to enable the port too.
+    Status EnableCompression(Port port) {
+        if constexpr(Codec::Enabled) {
+            if(Codec::UsesDelta && IsCoalesced(port)) {
+                return Status::Failure;
+            }
+
+            return codec.EnablePort(port);
+        } else {
+            return Status::Failure;
+        }
+    }
+
+    // A datagram sent on the port replaces the port's previous
+    // datagram if that one still waits in the queue, so that
+    // a backed up link sends the latest values and does not run
+    // out of buffers. Meant for periodic samples. Delta
+    // compression needs every datagram, so it cannot be
+    // combined with coalescing.
+    Status EnableCoalescing(Port port) {
+        if constexpr(Codec::Enabled) {
+            if(Codec::UsesDelta && codec.IsPortEnabled(port)) {
+                return Status::Failure;
+            }
+        }
+
+        Port *empty = nullptr;
+
+        for(auto &coalesced : coalesced_ports) {
+            if(coalesced == port) {
+                return Status::Duplicate;
+            }
+
+            if(coalesced == InvalidPort && !empty) {
+                empty = &coalesced;
+            }
+        }
+
+        if(!empty) {
+            return Status::NoMoreSpace;
+        }
+
+        *empty = port;
+
+        return Status::Success;
     }
 
 private:
@@ -101,30 +435,349 @@ private:
     //
     static constexpr uint16_t TotalBufLen =
         MaxBufferLen +
-        sizeof(DatagramHdr) +
-        sizeof(DatagramTrl);
+        Config::Framing::HdrRoom +
+        Config::Framing::TrlRoom;
+
+    static_assert(MaxBufferLen <= Config::Framing::MaxPayload);
 
-    static constexpr uint8_t MaxReceivers = 4;
+    // Buffer and frame lengths are 8-bit.
+    static_assert(TotalBufLen <= 0xff);
+
+    static_assert(
+        Config::SharedRxBufs ? TotalBufs >= 2 : Config::RxBufs >= 1,
+        "the receiver needs a buffer");
+
+    // The control port takes an extra receiver slot when
+    // the network needs it.
+    static constexpr bool HasControl =
+        Config::FlowControl::Enabled ||
+        Config::FrameSize::Enabled;
+
+    static constexpr uint8_t MaxReceivers =
+        Config::MaxReceivers +
+        (HasControl ? 1 : 0) +
+        (Config::Ping::Enabled ? 1 : 0);
+
+    static constexpr uint16_t NoLimit = 0xffff;
 
     //
     // Types.
     //
+    using FlowControl = typename Config::FlowControl;
+    using FrameSize = typename Config::FrameSize;
+    using Ping = typename Config::Ping;
+    using Framing = typename Config::Framing;
+    using Codec = typename Config::Compression::template Codec<MaxBufferLen>;
+    using BudgetClock = typename Config::BudgetClock;
     using BufAlloc_ = BufAlloc<TotalBufLen, TotalBufs>;
+    using RxBufAlloc_ = RxBufAlloc<
+        BufAlloc_,
+        TotalBufLen,
+        Config::RxBufs,
+        Config::SharedRxBufs>;
     using RcvTable_ = RcvTable<MaxReceivers>;
-    using Receiver_ = Receiver<Stream, RcvTable_, TotalBufLen>;
-    using Sender_ = Sender<Stream, BufAlloc_, TotalBufs>;
+    using Receiver_ = Receiver<
+        Stream,
+        RcvTable_,
+        TotalBufLen,
+        RxBufAlloc_,
+        FlowControl,
+        Codec,
+        Framing,
+        typename Config::Clock,
+        Config::FrameTimeout>;
+    using Sender_ = Sender<Stream, BufAlloc_, TotalBufs, FlowControl, Framing>;
+
+    static_assert(
+        Framing::SizeFlags || !Codec::Enabled,
+        "the framing cannot mark compressed datagrams");
+
+    class ControlRcv : public Rcv {
+    public:
+        ControlRcv(Net &net)
+                : net(net) {
+            // empty
+        }
+
+        virtual ~ControlRcv() = default;
+
+        void ProcessMsg(Buffer buf) override {
+            net.ProcessControlMsg(buf);
+        }
+
+    private:
+        Net &net;
+    };
+
+    class DiagRcv : public Rcv {
+    public:
+        DiagRcv(Net &net)
+                : net(net) {
+            // empty
+        }
+
+        virtual ~DiagRcv() = default;
+
+        void ProcessMsg(Buffer buf) override {
+            net.ProcessDiagMsg(buf);
+        }
+
+    private:
+        Net &net;
+    };
+
+    //
+    // Functions.
+    //
+    // Returns the header size flags.
+    uint8_t Encode(Port port, Buffer &buf) {
+        if constexpr(Codec::Enabled) {
+            if(codec.Encode(port, buf)) {
+                return DatagramFlagCompressed;
+            }
+        }
+
+        return 0;
+    }
+
+    void NotifyBufferFree() {
+        if(buf_wanted && buf_listener && buf_alloc.HasFree()) {
+            buf_wanted = false;
+            buf_listener->BufferFree();
+        }
+    }
+
+    bool ProcessTurns(const Budget &budget) {
+        uint16_t bytes = budget.bytes;
+        uint16_t frames = budget.frames;
+        uint8_t idle_turns = 0;
+        auto start = BudgetClock::Now();
+
+        while(true) {
+            // a missing limit starts over every turn
+            if(!budget.bytes) {
+                bytes = NoLimit;
+            }
+
+            if(!budget.frames) {
+                frames = NoLimit;
+            }
+
+            if(!bytes || !frames) {
+                break;
+            }
+
+            bool worked;
+
+            if(send_turn) {
+                worked = Turn(sender, bytes, frames);
+            } else {
+                worked = Turn(receiver, bytes, frames);
+
+                ProcessFlowControl();
+                ProcessFrameSize();
+            }
+
+            send_turn = !send_turn;
+
+            if(worked) {
+                idle_turns = 0;
+            } else if(++idle_turns == 2) {
+                return false;
+            }
+
+            if(budget.time && static_cast<uint32_t>(BudgetClock::Now() - start) >= budget.time) {
+                break;
+            }
+        }
+
+        return stream.available() > 0
+            || sender.HasPending();
+    }
+
+    // A turn handles one frame of the receiver or the sender,
+    // and returns true if it did any work.
+    template<typename Part>
+    static bool Turn(Part &part, uint16_t &bytes, uint16_t &frames) {
+        uint16_t turn = 1;
+        auto before = bytes;
+
+        part.Process(bytes, turn);
+        frames -= 1 - turn;
+
+        return bytes != before || !turn;
+    }
+
+    bool IsCoalesced(Port port) const {
+        for(auto coalesced : coalesced_ports) {
+            if(coalesced == port) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void ProcessControlMsg(Buffer buf) {
+        if constexpr(FlowControl::Enabled) {
+            flow_control.ControlReceived(
+                Framing::FrameLen(ControlPort, buf.len));
+        }
+
+        if(buf.len < sizeof(CtrlHdr)) {
+            return;
+        }
+
+        auto type = static_cast<CtrlType>(
+            static_cast<const CtrlHdr *>(buf.ptr)->type);
+
+        if(type == CtrlType::CreditAdvert || type == CtrlType::CreditReset) {
+            if constexpr(FlowControl::Enabled) {
+                if(buf.len == sizeof(CtrlCreditAdvert)) {
+                    flow_control.AdvertReceived(
+                        *static_cast<const CtrlCreditAdvert *>(buf.ptr));
+                }
+            }
+        } else if(type == CtrlType::CreditProbe) {
+            if constexpr(FlowControl::Enabled) {
+                flow_control.ProbeReceived();
+            }
+        } else if(type == CtrlType::FrameSize) {
+            if constexpr(FrameSize::Enabled) {
+                if(buf.len == sizeof(CtrlFrameSize)) {
+                    frame_size.AdvertReceived(
+                        *static_cast<const CtrlFrameSize *>(buf.ptr));
+                }
+            }
+        }
+    }
+
+    // Answers a request while the receiver delivers it.
+    void ProcessDiagMsg(Buffer buf) {
+        if constexpr(Ping::Enabled) {
+            if(buf.len < sizeof(DiagHdr)) {
+                return;
+            }
+
+            auto type = static_cast<DiagType>(
+                static_cast<const DiagHdr *>(buf.ptr)->type);
+
+            if(type == DiagType::Reply) {
+                if(buf.len >= sizeof(DiagPing)) {
+                    ping.ReplyReceived(*static_cast<const DiagPing *>(buf.ptr));
+                }
+
+                return;
+            }
+
+            if(type != DiagType::Request) {
+                return;
+            }
+
+            auto ptr = buf_alloc.Alloc();
+
+            if(!ptr) {
+                ping.EchoDropped();
+                return;
+            }
+
+            Buffer reply {
+                static_cast<uint8_t *>(ptr) + Framing::HdrRoom,
+                buf.len };
+
+            memcpy(reply.ptr, buf.ptr, buf.len);
+            static_cast<DiagHdr *>(reply.ptr)->type = static_cast<uint8_t>(DiagType::Reply);
+
+            if(sender.Send(DiagPort, reply) == Status::Success) {
+                ping.Echoed();
+            } else {
+                buf_alloc.Free(ptr);
+                ping.EchoDropped();
+            }
+        }
+    }
+
+    bool IsAdvertDue() const {
+        if constexpr(FlowControl::Enabled) {
+            if(flow_control.NeedAdvert()) {
+                return true;
+            }
+        }
+
+        if constexpr(FrameSize::Enabled) {
+            if(frame_size.NeedAdvert()) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void ProcessFlowControl() {
+        if constexpr(FlowControl::Enabled) {
+            if(flow_control.NeedAdvert()) {
+                auto advert = flow_control.CreateAdvert();
+
+                if(sender.SendControl(&advert, sizeof(advert)) == Status::Success) {
+                    flow_control.AdvertSent(advert);
+                }
+            }
+
+            if(flow_control.NeedProbe(sender.IsBlocked())) {
+                CtrlHdr probe { static_cast<uint8_t>(CtrlType::CreditProbe) };
+
+                sender.SendControl(&probe, sizeof(probe));
+            }
+        }
+    }
+
+    void ProcessFrameSize() {
+        if constexpr(FrameSize::Enabled) {
+            frame_size.Sample(
+                receiver.GetStats(),
+                MaxBufferLen,
+                static_cast<uint8_t>(Framing::FrameLen(0, 0)));
+
+            if(frame_size.NeedAdvert()) {
+                auto advert = frame_size.CreateAdvert();
+
+                if(sender.SendControl(&advert, sizeof(advert)) == Status::Success) {
+                    frame_size.AdvertSent();
+                }
+            }
+        }
+    }
 
     //
     // Data.
     //
     Stream &stream;
 
+    FlowControl flow_control;
+    FrameSize frame_size;
+    Ping ping;
+    Codec codec;
+
     BufAlloc_ buf_alloc;
+    RxBufAlloc_ rx_alloc;
 
     RcvTable_ rcv_table;
 
     Receiver_ receiver;
     Sender_ sender;
+
+    ControlRcv control_rcv;
+    DiagRcv diag_rcv;
+
+    Port coalesced_ports[Config::MaxCoalescedPorts];
+
+    BufListener *buf_listener;
+
+    // AllocBuffer() found no free buffer
+    bool buf_wanted;
+
+    // whose turn a budgeted Process() starts with
+    bool send_turn;
 };
 
 }
@@ -0,0 +1,526 @@
+//
+// Bonding several streams into one logical network.
+//
+// Every link runs its own Net. Datagrams are spread over the
+// links in proportion to how fast each link drains, measured as
+// the bytes its stream accepted per Process() call while the link
+// had more to write. Until a link has been measured, the room it
+// reports for writing stands in for its rate. A link that stops
+// accepting bytes is soon left out. Each payload starts
+// with a per-port sequence number, which the receiving side uses
+// to restore the order within a port.
+//
+// A datagram that never arrives, for example because its link
+// went silent, holds back the later datagrams of its port until
+// either the reorder window fills up or GapTimeout calls to
+// Process() pass. The missing datagram is then skipped. The
+// default window covers every buffer of every link, which is as
+// far as the links can get out of step.
+//
+// Both ends need to bond the same number of links.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+#pragma pack(push, 1)
+struct BondHdr {
+    uint8_t seq;
+};
+#pragma pack(pop)
+
+struct BondStats {
+    void Clear() {
+        in_order = 0;
+        reordered = 0;
+        skipped = 0;
+        stale = 0;
+    }
+
+    uint16_t in_order;
+    uint16_t reordered;
+
+    // sequence numbers given up on
+    uint16_t skipped;
+
+    // duplicates and datagrams that arrived after being skipped
+    uint16_t stale;
+};
+
+template<
+    typename Stream,
+    uint8_t Links,
+    typename Config = DefaultConfig,
+    uint8_t ReorderDepth = Links * Config::TotalBufs,
+    uint16_t GapTimeout = 64>
+class Bond {
+public:
+    using Net_ = Net<Stream, Config>;
+
+    static constexpr BufferLen MaxBufferLen =
+        Net_::MaxBufferLen - sizeof(BondHdr);
+
+    // Datagrams 0x80 or more ahead count as stale, so slots past
+    // that could never be used.
+    static_assert(ReorderDepth > 0 && ReorderDepth <= 0x80);
+
+    template<typename... Streams>
+    Bond(Streams &... streams)
+            : links { streams... },
+            link_streams { &streams... },
+            rates(),
+            sent(),
+            next_link(0),
+            tx_ports(),
+            rx_ports(),
+            stats() {
+        static_assert(sizeof...(Streams) == Links);
+
+        for(auto &rx : rx_ports) {
+            rx.bond = this;
+        }
+    }
+
+    void Process() {
+        for(uint8_t i = 0;i < Links;i++) {
+            links[i].Process();
+
+            UpdateRate(i);
+        }
+
+        for(auto &rx : rx_ports) {
+            if(rx.held && ++rx.gap_age > GapTimeout) {
+                SkipGap(rx);
+            }
+        }
+    }
+
+    // The buffer comes from the link expected to write it out
+    // first, judged by its queued bytes and drain rate. When that
+    // link has no free buffer, another link may take the datagram
+    // if it would still finish about as soon. Otherwise no buffer
+    // is returned, so that slow links do not pick up the slack and
+    // fall behind by more than the reorder window.
+    Buffer AllocBuffer() {
+        SeedRates();
+
+        bool tried[Links] = { };
+        uint8_t first = Links;
+
+        while(true) {
+            uint8_t best = Links;
+
+            for(uint8_t i = 0;i < Links;i++) {
+                auto link = static_cast<uint8_t>((next_link + i) % Links);
+
+                if(!tried[link] && (best == Links || DrainsSooner(link, best))) {
+                    best = link;
+                }
+            }
+
+            if(best == Links) {
+                break;
+            }
+
+            if(first == Links) {
+                first = best;
+            } else if(!DrainsWithin(best, first)) {
+                break;
+            }
+
+            tried[best] = true;
+
+            auto buf = links[best].AllocBuffer();
+
+            if(buf.ptr) {
+                next_link = (best + 1) % Links;
+
+                return Buffer {
+                    static_cast<uint8_t *>(buf.ptr) + sizeof(BondHdr),
+                    MaxBufferLen };
+            }
+        }
+
+        return Buffer { nullptr, MaxBufferLen };
+    }
+
+    // Gives back a buffer that is not going to be sent.
+    void FreeBuffer(Buffer buf) {
+        auto link_buf = LinkBuffer(buf);
+
+        for(auto &link : links) {
+            if(link.OwnsBuffer(link_buf)) {
+                link.FreeBuffer(link_buf);
+                return;
+            }
+        }
+    }
+
+    // The buffer ownership is passed to the bond. On failure the
+    // buffer stays with the caller.
+    Status Send(Port port, Buffer buf) {
+        auto seq = NextSeq(port);
+        auto link_buf = LinkBuffer(buf);
+
+        for(auto &link : links) {
+            if(!link.OwnsBuffer(link_buf)) {
+                continue;
+            }
+
+            if(!seq) {
+                return Status::NoMoreSpace;
+            }
+
+            static_cast<BondHdr *>(link_buf.ptr)->seq = *seq;
+
+            auto status = link.Send(port, link_buf);
+
+            // a datagram that is not sent leaves no gap
+            if(status == Status::Success) {
+                (*seq)++;
+            }
+
+            return status;
+        }
+
+        return Status::Failure;
+    }
+
+    // The receiver is registered on every link.
+    Status RegisterReceiver(
+            Port port,
+            Rcv &rcv) {
+        for(auto &rx : rx_ports) {
+            if(rx.rcv && rx.port == port) {
+                return Status::Duplicate;
+            }
+        }
+
+        for(auto &rx : rx_ports) {
+            if(rx.rcv) {
+                continue;
+            }
+
+            for(uint8_t i = 0;i < Links;i++) {
+                auto status = links[i].RegisterReceiver(port, rx);
+
+                if(status != Status::Success) {
+                    // the links before it let go again
+                    while(i--) {
+                        links[i].UnregisterReceiver(port, rx);
+                    }
+
+                    return status;
+                }
+            }
+
+            rx.port = port;
+            rx.rcv = &rcv;
+
+            return Status::Success;
+        }
+
+        return Status::NoMoreSpace;
+    }
+
+    Net_ &GetLink(uint8_t link) {
+        return links[link];
+    }
+
+    const RcvStats &GetRcvStats(uint8_t link) const {
+        return links[link].GetRcvStats();
+    }
+
+    const BondStats &GetBondStats() const {
+        return stats;
+    }
+
+    void ClearBondStats() {
+        stats.Clear();
+    }
+
+private:
+    //
+    // Constants.
+    //
+
+    // Rates are in bytes per Process() call, with four
+    // fractional bits. Zero means not measured yet.
+    static constexpr uint16_t RateOne = 16;
+
+    //
+    // Types.
+    //
+    struct TxPort {
+        Port port;
+        uint8_t seq;
+        bool used;
+    };
+
+    struct Held {
+        BufferLen len;
+        uint8_t data[MaxBufferLen];
+    };
+
+    class RxPort : public Rcv {
+    public:
+        RxPort()
+                : bond(nullptr),
+                rcv(nullptr),
+                port(InvalidPort),
+                expected(0),
+                base(0),
+                held(0),
+                gap_age(0),
+                stale_run(0),
+                present(),
+                slots() {
+            // empty
+        }
+
+        void ProcessMsg(Buffer buf) override {
+            bond->Reorder(*this, buf);
+        }
+
+        Bond *bond;
+        Rcv *rcv;
+        Port port;
+
+        uint8_t expected;
+
+        // the slot of the expected sequence number
+        uint8_t base;
+
+        uint8_t held;
+        uint16_t gap_age;
+        uint8_t stale_run;
+
+        // a ring that starts at the expected sequence number,
+        // as the depth need not divide the sequence numbers
+        bool present[ReorderDepth];
+        Held slots[ReorderDepth];
+    };
+
+    //
+    // Functions.
+    //
+    static Buffer LinkBuffer(Buffer buf) {
+        return Buffer {
+            static_cast<uint8_t *>(buf.ptr) - sizeof(BondHdr),
+            static_cast<BufferLen>(buf.len + sizeof(BondHdr)) };
+    }
+
+    template<typename T>
+    static void Swap(T &a, T &b) {
+        T tmp = a;
+        a = b;
+        b = tmp;
+    }
+
+    // A moving average over about eight calls.
+    void UpdateRate(uint8_t link) {
+        auto now = links[link].SentBytes();
+        uint16_t delta = now - sent[link];
+
+        sent[link] = now;
+
+        // An idle link says nothing about its speed.
+        if(!links[link].QueuedBytes()) {
+            return;
+        }
+
+        uint32_t rate = rates[link]
+            ? rates[link] - (rates[link] >> 3) +
+                static_cast<uint32_t>(delta) * RateOne / 8
+            : static_cast<uint32_t>(delta) * RateOne;
+
+        rates[link] = rate > 0xffff
+            ? 0xffff
+            : static_cast<uint16_t>(rate);
+    }
+
+    // Compares (queued_a + len) / rate_a with
+    // (queued_b + len) / rate_b.
+    bool DrainsSooner(uint8_t a, uint8_t b) const {
+        uint32_t bytes_a = links[a].QueuedBytes() + MaxBufferLen;
+        uint32_t bytes_b = links[b].QueuedBytes() + MaxBufferLen;
+
+        return bytes_a * rates[b] < bytes_b * rates[a];
+    }
+
+    // True if a datagram on the link would be written out before
+    // the reference link could write its queue and two datagrams.
+    bool DrainsWithin(uint8_t link, uint8_t ref) const {
+        uint32_t bytes = links[link].QueuedBytes() + MaxBufferLen;
+        uint32_t ref_bytes = links[ref].QueuedBytes() + 2 * MaxBufferLen;
+
+        return bytes * rates[ref] <= ref_bytes * rates[link];
+    }
+
+    // An idle link that has not been measured yet gets
+    // the room it reports as its rate.
+    void SeedRates() {
+        for(uint8_t i = 0;i < Links;i++) {
+            if(rates[i] || links[i].QueuedBytes()) {
+                continue;
+            }
+
+            uint32_t room = link_streams[i]->availableForWrite();
+
+            rates[i] = room * RateOne > 0xffff
+                ? 0xffff
+                : static_cast<uint16_t>(room * RateOne);
+        }
+    }
+
+    uint8_t *NextSeq(Port port) {
+        TxPort *empty = nullptr;
+
+        for(auto &tx : tx_ports) {
+            if(tx.used && tx.port == port) {
+                return &tx.seq;
+            }
+
+            if(!tx.used && !empty) {
+                empty = &tx;
+            }
+        }
+
+        if(!empty) {
+            return nullptr;
+        }
+
+        empty->used = true;
+        empty->port = port;
+        empty->seq = 0;
+
+        return &empty->seq;
+    }
+
+    void Reorder(RxPort &rx, Buffer buf) {
+        if(buf.len < sizeof(BondHdr)) {
+            return;
+        }
+
+        auto seq = static_cast<const BondHdr *>(buf.ptr)->seq;
+        Buffer payload {
+            static_cast<uint8_t *>(buf.ptr) + sizeof(BondHdr),
+            static_cast<BufferLen>(buf.len - sizeof(BondHdr)) };
+
+        uint8_t ahead = seq - rx.expected;
+
+        if(ahead >= 0x80) {
+            // Far behind means that the sender has restarted.
+            if(++rx.stale_run <= ReorderDepth) {
+                stats.stale++;
+                return;
+            }
+
+            Restart(rx, seq);
+            ahead = 0;
+        }
+
+        rx.stale_run = 0;
+
+        if(!ahead) {
+            stats.in_order++;
+            Deliver(rx, payload);
+            DeliverHeld(rx);
+            return;
+        }
+
+        while(ahead >= ReorderDepth) {
+            SkipGap(rx);
+            ahead = seq - rx.expected;
+        }
+
+        auto slot = (rx.base + ahead) % ReorderDepth;
+
+        if(rx.present[slot]) {
+            stats.stale++;
+            return;
+        }
+
+        rx.present[slot] = true;
+        rx.slots[slot].len = payload.len;
+        memcpy(rx.slots[slot].data, payload.ptr, payload.len);
+        rx.held++;
+    }
+
+    void Deliver(RxPort &rx, Buffer payload) {
+        Advance(rx);
+        rx.gap_age = 0;
+
+        rx.rcv->ProcessMsg(payload);
+    }
+
+    void DeliverHeld(RxPort &rx) {
+        while(rx.held) {
+            auto slot = rx.base;
+
+            if(!rx.present[slot]) {
+                return;
+            }
+
+            rx.present[slot] = false;
+            rx.held--;
+            stats.reordered++;
+
+            Deliver(rx, Buffer { rx.slots[slot].data, rx.slots[slot].len });
+        }
+    }
+
+    // Gives up on the expected datagram and on any other missing
+    // ones before the next held datagram.
+    void SkipGap(RxPort &rx) {
+        if(!rx.held) {
+            Advance(rx);
+            stats.skipped++;
+            return;
+        }
+
+        while(!rx.present[rx.base]) {
+            Advance(rx);
+            stats.skipped++;
+        }
+
+        DeliverHeld(rx);
+    }
+
+    static void Advance(RxPort &rx) {
+        rx.expected++;
+        rx.base = (rx.base + 1) % ReorderDepth;
+    }
+
+    void Restart(RxPort &rx, uint8_t seq) {
+        for(auto &present : rx.present) {
+            present = false;
+        }
+
+        rx.held = 0;
+        rx.gap_age = 0;
+        rx.expected = seq;
+        rx.base = 0;
+    }
+
+    //
+    // Data.
+    //
+    Net_ links[Links];
+    Stream *link_streams[Links];
+    uint16_t rates[Links];
+    uint16_t sent[Links];
+    uint8_t next_link;
+
+    TxPort tx_ports[Config::MaxReceivers];
+    RxPort rx_ports[Config::MaxReceivers];
+
+    BondStats stats;
+};
+
+}
@@ -30,13 +30,27 @@ public:
         return ret;
     }
 
+    // The pointer can point anywhere inside the buffer, since
+    // frames do not always start at the beginning of it.
     void Free(void *ptr) {
-        auto buf = static_cast<FreeBuf *>(ptr);
+        auto offset = static_cast<uint8_t *>(ptr) - buffers;
+        auto buf = reinterpret_cast<FreeBuf *>(
+            buffers + offset - offset % BufSize);
 
         buf->next = free;
         free = buf;
     }
 
+    bool HasFree() const {
+        return free != nullptr;
+    }
+
+    bool Owns(const void *ptr) const {
+        auto byte = static_cast<const uint8_t *>(ptr);
+
+        return byte >= buffers && byte < buffers + sizeof(buffers);
+    }
+
 private:
     //
     // Types.
@@ -65,4 +79,60 @@ private:
     FreeBuf *free;
 };
 
+// Receive buffers of a network. Separate ones are reserved for
+// receiving, while shared ones come from the send buffers as
+// needed, which saves memory on small boards.
+template<
+    typename TxAlloc,
+    BufferLen BufSize,
+    uint16_t BufCount,
+    bool Shared>
+class RxBufAlloc {
+public:
+    RxBufAlloc(TxAlloc &)
+            : bufs() {
+        // empty
+    }
+
+    void *Alloc() {
+        return bufs.Alloc();
+    }
+
+    void Free(void *ptr) {
+        bufs.Free(ptr);
+    }
+
+private:
+    //
+    // Data.
+    //
+    BufAlloc<BufSize, BufCount> bufs;
+};
+
+template<
+    typename TxAlloc,
+    BufferLen BufSize,
+    uint16_t BufCount>
+class RxBufAlloc<TxAlloc, BufSize, BufCount, true> {
+public:
+    RxBufAlloc(TxAlloc &tx_alloc)
+            : tx_alloc(tx_alloc) {
+        // empty
+    }
+
+    void *Alloc() {
+        return tx_alloc.Alloc();
+    }
+
+    void Free(void *ptr) {
+        tx_alloc.Free(ptr);
+    }
+
+private:
+    //
+    // Data.
+    //
+    TxAlloc &tx_alloc;
+};
+
 }
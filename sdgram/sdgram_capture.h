@@ -0,0 +1,307 @@
+//
+// Capturing the bytes of a link.
+//
+// CaptureStream wraps the stream of a network and records every
+// byte read from it and written to it, with the time, so that a
+// misbehaving link can be replayed offline:
+//
+//   FILE *file = fopen("link.sdcap", "wb");
+//   CaptureStream<FdSerial> capture(serial, file);
+//   Net<CaptureStream<FdSerial>> net(capture);
+//
+// A capture starts with the magic "SDCAP1", followed by records of
+// up to 128 bytes that went the same way at the same time:
+//
+//   time delta, dir/len, bytes
+//
+// The time delta is the microseconds since the previous record,
+// as an unsigned LEB128 varint. The dir/len byte holds the length
+// less one in the low seven bits, and its top bit is set for the
+// bytes written. Bytes read are stamped with the time available()
+// found new bytes, so reading a burst takes one clock call.
+//
+// CaptureReader reads the records back. The replay tool in
+// sdgram_test_x64/sdgram_replay parses them with a Receiver.
+//
+// This uses stdio, so it is for hosts only.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#if defined(ARDUINO)
+#error "sdgram_capture.h is for hosts only"
+#endif
+
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+
+#include "sdgram_defs.h"
+#include "sdgram_clock.h"
+
+namespace SerialDatagram {
+
+//
+// Constants.
+//
+constexpr char CaptureMagic[] = { 'S', 'D', 'C', 'A', 'P', '1' };
+
+constexpr uint8_t CaptureMaxRun = 128;
+constexpr uint8_t CaptureDirWritten = 0x80;
+
+//
+// Types.
+//
+enum class CaptureDir : uint8_t {
+    Read,
+    Written,
+};
+
+struct CaptureRecord {
+    // microseconds since the capture started
+    uint64_t time;
+
+    CaptureDir dir;
+    uint8_t len;
+    uint8_t bytes[CaptureMaxRun];
+};
+
+template<
+    typename Stream,
+    typename Clock = DefaultMicrosClock>
+class CaptureStream {
+public:
+    // The caller closes the file after the stream goes away.
+    CaptureStream(
+        Stream &stream,
+        FILE *file)
+            : stream(stream),
+            file(file),
+            last_time(Clock::Now()),
+            read_time(last_time),
+            unread(0),
+            pending() {
+        fwrite(CaptureMagic, 1, sizeof(CaptureMagic), file);
+    }
+
+    ~CaptureStream() {
+        Flush();
+    }
+
+    auto available() {
+        auto count = stream.available();
+        uint32_t now_unread = count > 0 ? static_cast<uint32_t>(count) : 0;
+
+        if(now_unread > unread) {
+            read_time = Clock::Now();
+        }
+
+        unread = now_unread;
+
+        return count;
+    }
+
+    auto read() {
+        auto byte = stream.read();
+
+        if constexpr(std::is_signed_v<decltype(byte)>) {
+            if(byte < 0) {
+                return byte;
+            }
+        }
+
+        uint8_t value = static_cast<uint8_t>(byte);
+
+        if(unread) {
+            unread--;
+        }
+
+        Record(CaptureDir::Read, read_time, &value, 1);
+
+        return byte;
+    }
+
+    auto availableForWrite() {
+        return stream.availableForWrite();
+    }
+
+    auto write(uint8_t *buf, uint16_t len) {
+        auto written = stream.write(buf, len);
+
+        if(written > 0) {
+            Record(
+                CaptureDir::Written,
+                Clock::Now(),
+                buf,
+                static_cast<uint16_t>(written));
+        }
+
+        return written;
+    }
+
+    // Writes out the record being collected and the file buffers.
+    void Flush() {
+        WritePending();
+        fflush(file);
+    }
+
+private:
+    //
+    // Types.
+    //
+    struct Pending {
+        uint32_t time;
+        CaptureDir dir;
+        uint8_t len;
+        uint8_t bytes[CaptureMaxRun];
+    };
+
+    //
+    // Functions.
+    //
+    void Record(CaptureDir dir, uint32_t time, const uint8_t *bytes, uint16_t len) {
+        while(len) {
+            if(pending.len && (pending.dir != dir || pending.time != time || pending.len == CaptureMaxRun)) {
+                WritePending();
+            }
+
+            if(!pending.len) {
+                pending.time = time;
+                pending.dir = dir;
+            }
+
+            uint16_t room = CaptureMaxRun - pending.len;
+            uint16_t run = len < room ? len : room;
+
+            memcpy(pending.bytes + pending.len, bytes, run);
+            pending.len = static_cast<uint8_t>(pending.len + run);
+
+            bytes += run;
+            len -= run;
+        }
+    }
+
+    void WritePending() {
+        if(!pending.len) {
+            return;
+        }
+
+        uint8_t hdr[6];
+        uint8_t hdr_len = 0;
+
+        // wraps like the clock
+        uint32_t delta = pending.time - last_time;
+
+        do {
+            uint8_t bits = delta & 0x7f;
+            delta >>= 7;
+
+            hdr[hdr_len++] = delta ? bits | 0x80 : bits;
+        } while(delta);
+
+        hdr[hdr_len++] = static_cast<uint8_t>(
+            (pending.dir == CaptureDir::Written ? CaptureDirWritten : 0) | (pending.len - 1));
+
+        fwrite(hdr, 1, hdr_len, file);
+        fwrite(pending.bytes, 1, pending.len, file);
+
+        last_time = pending.time;
+        pending.len = 0;
+    }
+
+    //
+    // Data.
+    //
+    Stream &stream;
+    FILE *file;
+
+    // of the last record written
+    uint32_t last_time;
+
+    // when available() last found new bytes
+    uint32_t read_time;
+    uint32_t unread;
+
+    Pending pending;
+};
+
+class CaptureReader {
+public:
+    CaptureReader(FILE *file)
+            : file(file),
+            time(0),
+            valid(ReadMagic()) {
+        // empty
+    }
+
+    // False if the file is not a capture.
+    bool IsValid() const {
+        return valid;
+    }
+
+    // Returns false at the end of the capture, and on a record
+    // cut short.
+    bool Next(CaptureRecord &record) {
+        if(!valid) {
+            return false;
+        }
+
+        uint32_t delta = 0;
+
+        for(uint8_t shift = 0;;shift += 7) {
+            auto byte = getc(file);
+
+            if(byte == EOF || shift > 28) {
+                return false;
+            }
+
+            delta |= static_cast<uint32_t>(byte & 0x7f) << shift;
+
+            if(!(byte & 0x80)) {
+                break;
+            }
+        }
+
+        auto dir_len = getc(file);
+
+        if(dir_len == EOF) {
+            return false;
+        }
+
+        record.dir = (dir_len & CaptureDirWritten)
+            ? CaptureDir::Written
+            : CaptureDir::Read;
+        record.len = static_cast<uint8_t>((dir_len & (CaptureDirWritten - 1)) + 1);
+
+        if(fread(record.bytes, 1, record.len, file) != record.len) {
+            return false;
+        }
+
+        time += delta;
+        record.time = time;
+
+        return true;
+    }
+
+private:
+    //
+    // Functions.
+    //
+    bool ReadMagic() {
+        char magic[sizeof(CaptureMagic)];
+
+        return fread(magic, 1, sizeof(magic), file) == sizeof(magic)
+            && !memcmp(magic, CaptureMagic, sizeof(magic));
+    }
+
+    //
+    // Data.
+    //
+    FILE *file;
+    uint64_t time;
+    bool valid;
+};
+
+}
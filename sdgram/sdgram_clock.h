@@ -0,0 +1,66 @@
+//
+// Millisecond and microsecond clocks.
+//
+// A clock is a type with a static Now() that returns
+// milliseconds in a wrapping 32-bit counter. Tests can
+// supply a clock that only moves when told to. Microsecond
+// clocks work the same way and time the budgets of Process().
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#if !defined(ARDUINO)
+#include <chrono>
+#endif
+
+#include "sdgram_stdint.h"
+
+namespace SerialDatagram {
+
+#if defined(ARDUINO)
+
+struct MillisClock {
+    static uint32_t Now() {
+        return millis();
+    }
+};
+
+using DefaultClock = MillisClock;
+
+struct MicrosClock {
+    static uint32_t Now() {
+        return micros();
+    }
+};
+
+using DefaultMicrosClock = MicrosClock;
+
+#else
+
+struct SteadyClock {
+    static uint32_t Now() {
+        auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+
+        return static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::milliseconds>(since_epoch).count());
+    }
+};
+
+using DefaultClock = SteadyClock;
+
+struct SteadyMicrosClock {
+    static uint32_t Now() {
+        auto since_epoch = std::chrono::steady_clock::now().time_since_epoch();
+
+        return static_cast<uint32_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(since_epoch).count());
+    }
+};
+
+using DefaultMicrosClock = SteadyMicrosClock;
+
+#endif
+
+}
@@ -0,0 +1,374 @@
+//
+// Framing with Consistent Overhead Byte Stuffing.
+//
+// A frame holds a short header and the payload, encoded so that
+// it contains no zero bytes, followed by a zero delimiter:
+//
+//   COBS(size, port, crc, payload) 0x00
+//
+// The delimiter cannot appear inside a frame, so the receiver
+// finds frame boundaries without searching for a header and
+// resynchronizes at the next delimiter after an error. Encoding
+// costs one byte per frame, since frames are shorter than 254
+// bytes. Both encoding and decoding are done in place.
+//
+// This framing is not understood by pysdgram.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <crc16.h>
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_rcv_stats.h"
+#include "sdgram_framing.h"
+#include "sdgram_log.h"
+
+#define LOGGER_PREFIX_RCV "[SDGRAM-RCV] "
+
+namespace SerialDatagram {
+
+#pragma pack(push, 1)
+struct CobsHdr {
+    uint8_t size;
+    uint8_t port;
+    uint16_t crc;
+};
+#pragma pack(pop)
+
+class CobsFraming {
+public:
+    static constexpr bool SizeFlags = true;
+
+    // Room the sender reserves around the payload. The encoded
+    // frame starts one byte before the header.
+    static constexpr uint16_t HdrRoom = sizeof(DatagramHdr);
+    static constexpr uint16_t TrlRoom = sizeof(DatagramTrl);
+
+    static_assert(HdrRoom >= sizeof(CobsHdr) + 1);
+    static_assert(TrlRoom >= 1);
+
+    static constexpr uint16_t Overhead = sizeof(CobsHdr) + 2;
+
+    // The payload with its room fits the 8-bit buffer length.
+    static constexpr uint16_t MaxPayload = 0xff - HdrRoom - TrlRoom;
+
+    // Keeps every frame a single COBS block.
+    static_assert(sizeof(CobsHdr) + MaxPayload <= 0xfe);
+
+    static constexpr uint16_t FrameLen(Port, BufferLen len) {
+        return Overhead + len;
+    }
+
+    static void CreateFrame(Port port, Buffer &buf, uint8_t size_flags) {
+        auto payload = static_cast<uint8_t *>(buf.ptr);
+        auto hdr = reinterpret_cast<CobsHdr *>(payload - sizeof(CobsHdr));
+
+        hdr->size = buf.len | size_flags;
+        hdr->port = port;
+        hdr->crc = 0;
+
+        uint16_t len = sizeof(CobsHdr) + buf.len;
+        hdr->crc = Crc16Usb::Calc(hdr, len);
+
+        auto frame = reinterpret_cast<uint8_t *>(hdr) - 1;
+        uint16_t code = 0;
+
+        for(uint16_t i = 1;i <= len;i++) {
+            if(!frame[i]) {
+                frame[code] = static_cast<uint8_t>(i - code);
+                code = i;
+            }
+        }
+
+        frame[code] = static_cast<uint8_t>(len + 1 - code);
+        frame[len + 1] = Delimiter;
+
+        buf.ptr = frame;
+        buf.len = static_cast<BufferLen>(len + 2);
+    }
+
+    template<
+        uint16_t TotalBufLen,
+        uint8_t SizeMask>
+    class Parser;
+
+private:
+    static constexpr uint8_t Delimiter = 0;
+};
+
+template<
+    uint16_t TotalBufLen,
+    uint8_t SizeMask>
+class CobsFraming::Parser {
+public:
+    Parser(RcvStats &stats, uint8_t *buf)
+            : stats(stats),
+            data(buf),
+            next(0),
+            scanned(0),
+            frame_len(0),
+            discarding(false) {
+        // empty
+    }
+
+    uint16_t MaxBytesToRead() const {
+        return scanned < next
+            ? 0
+            : TotalBufLen - next;
+    }
+
+    uint8_t *WritePtr() {
+        return data + next;
+    }
+
+    void BytesAdded(uint16_t bytes) {
+        next += bytes;
+    }
+
+    bool Parse(RcvFrame &frame) {
+        while(scanned < next) {
+            if(data[scanned] != Delimiter) {
+                scanned++;
+                continue;
+            }
+
+            frame_len = scanned + 1;
+
+            if(discarding) {
+                stats.dropped_bytes += frame_len;
+                discarding = false;
+            } else if(frame_len > 1 && Decode(data, frame)) {
+                return true;
+            }
+
+            FrameDone();
+        }
+
+        if(next == TotalBufLen) {
+            // No delimiter in a full buffer. Drop everything up
+            // to the next delimiter.
+            if(!discarding) {
+                LogMsgTooLarge();
+                stats.size_error++;
+            }
+
+            stats.dropped_bytes += next;
+            next = 0;
+            scanned = 0;
+            discarding = true;
+        }
+
+        return false;
+    }
+
+    void FrameDone() {
+        if(next != frame_len) {
+            memmove(
+                reinterpret_cast<void *>(data),
+                reinterpret_cast<void *>(data + frame_len),
+                next - frame_len);
+        }
+
+        next -= frame_len;
+        scanned = 0;
+        frame_len = 0;
+    }
+
+    uint8_t *TakeFrame(uint8_t *fresh) {
+        auto taken = data;
+
+        next -= frame_len;
+        memcpy(fresh, taken + frame_len, next);
+        data = fresh;
+
+        scanned = 0;
+        frame_len = 0;
+
+        return taken;
+    }
+
+    bool HasPartialFrame() const {
+        return next != 0;
+    }
+
+    // Parse() leaves no delimiter in the buffer, so all of it
+    // belongs to the partial frame. Whatever comes next starts
+    // a new frame.
+    void DropPartialFrame() {
+        stats.dropped_bytes += next;
+        next = 0;
+        scanned = 0;
+        discarding = false;
+    }
+
+    // A frame has to be decoded, so it is decoded from the bytes
+    // of the caller into the buffer.
+    bool FindFrame(const uint8_t *bytes, uint16_t len, RcvFrame &frame, uint16_t &used) {
+        uint16_t start = 0;
+
+        for(uint16_t curr = 0;curr < len;curr++) {
+            if(bytes[curr] != Delimiter) {
+                continue;
+            }
+
+            frame_len = curr - start + 1;
+
+            if(discarding) {
+                stats.dropped_bytes += frame_len;
+                discarding = false;
+            } else if(frame_len > TotalBufLen) {
+                LogMsgTooLarge();
+                stats.size_error++;
+                stats.dropped_bytes += frame_len;
+            } else if(frame_len > 1 && Decode(bytes + start, frame)) {
+                used = curr + 1;
+                frame_len = 0;
+
+                return true;
+            }
+
+            start = curr + 1;
+        }
+
+        frame_len = 0;
+
+        if(len - start >= TotalBufLen) {
+            // Same as a full buffer without a delimiter.
+            if(!discarding) {
+                LogMsgTooLarge();
+                stats.size_error++;
+            }
+
+            stats.dropped_bytes += len - start;
+            discarding = true;
+            start = len;
+        } else if(discarding) {
+            stats.dropped_bytes += len - start;
+            start = len;
+        }
+
+        used = start;
+
+        return false;
+    }
+
+    void LogBuffer() {
+        char hex[3];
+
+        LogVerbose(LOGGER_PREFIX_RCV "Buf: ");
+
+        for(uint8_t i = 0;i < next;i++) {
+            sprintf(hex, "%02X", data[i]);
+            LogVerbose(hex);
+            LogVerbose(" ");
+        }
+
+        LogVerboseLn(" EOB");
+    }
+
+private:
+    //
+    // Functions.
+    //
+    CobsHdr &Hdr() {
+        return *reinterpret_cast<CobsHdr *>(data);
+    }
+
+    // Decodes the frame into the buffer, which may also hold the
+    // encoded frame. The delimiter is at frame_len - 1.
+    bool Decode(const uint8_t *encoded, RcvFrame &frame) {
+        uint16_t encoded_len = frame_len - 1;
+        uint16_t in = 0;
+        uint16_t out = 0;
+
+        while(in < encoded_len) {
+            uint8_t code = encoded[in++];
+
+            if(in + code - 1 > encoded_len) {
+                LogBadEncoding();
+                return Reject(stats.size_error);
+            }
+
+            for(uint8_t i = 1;i < code;i++) {
+                data[out++] = encoded[in++];
+            }
+
+            if(code != 0xff && in < encoded_len) {
+                data[out++] = 0;
+            }
+        }
+
+        if(out < sizeof(CobsHdr)
+                || (Hdr().size & SizeMask) != out - sizeof(CobsHdr)) {
+            LogBadSize(out);
+            return Reject(stats.size_error);
+        }
+
+        auto rcv = Hdr().crc;
+
+        Hdr().crc = 0;
+
+        if(Crc16Usb::Calc(data, out) != rcv) {
+            LogCrcMismatch();
+            return Reject(stats.crc_error);
+        }
+
+        frame.port = Hdr().port;
+        frame.size_flags = Hdr().size & ~SizeMask;
+        frame.payload = Buffer {
+            reinterpret_cast<void *>(data + sizeof(CobsHdr)),
+            static_cast<BufferLen>(out - sizeof(CobsHdr)) };
+        frame.wire_len = frame_len;
+
+        // decoded in place
+        frame.frame = Buffer { nullptr, 0 };
+
+        return true;
+    }
+
+    bool Reject(uint16_t &error) {
+        error++;
+        stats.dropped_bytes += frame_len;
+
+        return false;
+    }
+
+    // logging
+    static void LogCrcMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "CRC mismatch");
+    }
+
+    static void LogBadEncoding() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "bad COBS encoding");
+    }
+
+    static void LogBadSize(uint16_t decoded) {
+        LogVerbose(LOGGER_PREFIX_RCV "size does not match the frame ");
+        LogVerboseLn(decoded);
+    }
+
+    static void LogMsgTooLarge() {
+        LogVerbose(LOGGER_PREFIX_RCV "no delimiter within ");
+        LogVerboseLn(TotalBufLen);
+    }
+
+    //
+    // Data.
+    //
+    RcvStats &stats;
+
+    // TotalBufLen bytes
+    uint8_t *data;
+
+    uint16_t next;
+    uint16_t scanned;
+    uint16_t frame_len;
+
+    bool discarding;
+};
+
+}
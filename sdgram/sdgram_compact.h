@@ -0,0 +1,465 @@
+//
+// Compact framing for small datagrams.
+//
+// The header takes three bytes for ports 0 to 2 and four bytes
+// for other ports, and the payload is followed by its CRC:
+//
+//   sync, size/port, [port], crc8, payload, crc16, [trailer]
+//
+// The size/port byte holds the size in the low six bits and the
+// port in the top two. Port code 3 means that the port follows
+// in a separate byte. The CRC-8 covers the header, so a corrupted
+// size is rejected as soon as the header arrives, and the CRC-16
+// covers the payload. The trailer byte is optional.
+//
+// This framing carries no size flags, so it cannot be combined
+// with compression. It is not understood by pysdgram.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <crc16.h>
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_rcv_stats.h"
+#include "sdgram_crc.h"
+#include "sdgram_framing.h"
+#include "sdgram_log.h"
+
+#define LOGGER_PREFIX_RCV "[SDGRAM-RCV] "
+
+namespace SerialDatagram {
+
+template<bool Trailer = false>
+class CompactFraming {
+public:
+    static constexpr bool SizeFlags = false;
+
+    static constexpr uint16_t HdrRoom = sizeof(DatagramHdr);
+    static constexpr uint16_t TrlRoom = sizeof(uint16_t) + (Trailer ? 1 : 0);
+
+    static constexpr uint16_t MaxPayload = 0x3f;
+
+    // sync, size/port and crc8 for the ports with a short header
+    static constexpr uint16_t Overhead = 3 + TrlRoom;
+
+    static constexpr uint16_t FrameLen(Port port, BufferLen len) {
+        return HdrLen(port) + len + TrlRoom;
+    }
+
+    static void CreateFrame(Port port, Buffer &buf, uint8_t) {
+        auto payload = static_cast<uint8_t *>(buf.ptr);
+        auto hdr_len = HdrLen(port);
+        auto hdr = payload - hdr_len;
+
+        hdr[0] = Sync;
+
+        if(port < PortEscape) {
+            hdr[1] = static_cast<uint8_t>((port << PortShift) | buf.len);
+        } else {
+            hdr[1] = static_cast<uint8_t>((PortEscape << PortShift) | buf.len);
+            hdr[2] = port;
+        }
+
+        hdr[hdr_len - 1] = Crc8::Calc(hdr, hdr_len - 1);
+
+        uint16_t crc = Crc16Usb::Calc(payload, buf.len);
+        memcpy(payload + buf.len, &crc, sizeof(crc));
+
+        if(Trailer) {
+            payload[buf.len + sizeof(crc)] = TrlMagic;
+        }
+
+        buf.ptr = hdr;
+        buf.len = static_cast<BufferLen>(hdr_len + buf.len + TrlRoom);
+    }
+
+    template<
+        uint16_t TotalBufLen,
+        uint8_t SizeMask>
+    class Parser;
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint8_t Sync = 0xa5;
+    static constexpr uint8_t TrlMagic = 0x5a;
+
+    static constexpr uint8_t SizeBits = MaxPayload;
+    static constexpr uint8_t PortShift = 6;
+    static constexpr uint8_t PortEscape = 3;
+
+    static constexpr uint16_t ShortHdrLen = Overhead - TrlRoom;
+
+    //
+    // Functions.
+    //
+    static constexpr uint8_t HdrLen(Port port) {
+        return port < PortEscape
+            ? ShortHdrLen
+            : ShortHdrLen + 1;
+    }
+};
+
+template<bool Trailer>
+template<
+    uint16_t TotalBufLen,
+    uint8_t SizeMask>
+class CompactFraming<Trailer>::Parser {
+public:
+    Parser(RcvStats &stats, uint8_t *buf)
+            : stats(stats),
+            data(buf),
+            state(State::SearchStart),
+            next(0),
+            frame_ready(false) {
+        // empty
+    }
+
+    uint16_t MaxBytesToRead() const {
+        if(state == State::SearchStart) {
+            return next < MinMsgSize
+                ? MinMsgSize - next
+                : 0;
+        }
+
+        return TotalMsgSize() - next;
+    }
+
+    uint8_t *WritePtr() {
+        return data + next;
+    }
+
+    void BytesAdded(uint16_t bytes) {
+        next += bytes;
+    }
+
+    bool Parse(RcvFrame &frame) {
+        if(state == State::SearchStart) {
+            ProcessSearchStart();
+        } else {
+            ProcessSearchEnd();
+        }
+
+        if(!frame_ready) {
+            return false;
+        }
+
+        frame.port = FramePort();
+        frame.size_flags = 0;
+        frame.payload = Buffer {
+            reinterpret_cast<void *>(data + HdrLen()),
+            PayloadSize() };
+        frame.wire_len = TotalMsgSize();
+        frame.frame = Buffer {
+            reinterpret_cast<void *>(data),
+            static_cast<BufferLen>(TotalMsgSize()) };
+
+        return true;
+    }
+
+    void FrameDone() {
+        frame_ready = false;
+        state = State::SearchStart;
+
+        Drop(TotalMsgSize(), false);
+    }
+
+    // Hands over the buffer that holds the ready frame, in place of
+    // FrameDone(), and continues in the fresh buffer.
+    uint8_t *TakeFrame(uint8_t *fresh) {
+        auto total_msg_size = TotalMsgSize();
+        auto taken = data;
+
+        frame_ready = false;
+        state = State::SearchStart;
+
+        next -= total_msg_size;
+        memcpy(fresh, taken + total_msg_size, next);
+        data = fresh;
+
+        return taken;
+    }
+
+    bool HasPartialFrame() const {
+        return next != 0;
+    }
+
+    void DropPartialFrame() {
+        if(state == State::SearchEnd) {
+            Recover();
+            return;
+        }
+
+        Drop(next, true);
+    }
+
+    bool FindFrame(const uint8_t *bytes, uint16_t len, RcvFrame &frame, uint16_t &used) {
+        uint16_t curr = 0;
+
+        for(;curr < len;curr++) {
+            if(bytes[curr] != Sync) {
+                continue;
+            }
+
+            auto hdr = bytes + curr;
+            uint16_t left = len - curr;
+
+            if(left < ShortHdrLen) {
+                break;
+            }
+
+            bool escaped = (hdr[1] >> PortShift) == PortEscape;
+            uint8_t hdr_len = escaped ? ShortHdrLen + 1 : ShortHdrLen;
+
+            if(left < hdr_len) {
+                break;
+            }
+
+            if(Crc8::Calc(hdr, hdr_len - 1) != hdr[hdr_len - 1]) {
+                LogHdrCrcMismatch();
+                stats.hdr_error++;
+                continue;
+            }
+
+            uint8_t payload_size = hdr[1] & SizeBits;
+            uint16_t total_msg_size = hdr_len + payload_size + TrlRoom;
+
+            if(total_msg_size > TotalBufLen) {
+                LogMsgTooLarge();
+                stats.size_error++;
+                continue;
+            }
+
+            if(left < total_msg_size) {
+                break;
+            }
+
+            auto payload = hdr + hdr_len;
+            auto trl = payload + payload_size;
+
+            if(Trailer && trl[sizeof(uint16_t)] != TrlMagic) {
+                LogTrailerMismatch();
+                stats.trl_error++;
+                continue;
+            }
+
+            uint16_t crc;
+            memcpy(&crc, trl, sizeof(crc));
+
+            if(Crc16Usb::Calc(payload, payload_size) != crc) {
+                LogCrcMismatch();
+                stats.crc_error++;
+                continue;
+            }
+
+            stats.dropped_bytes += curr;
+
+            // Receivers only read the frame.
+            auto frame_data = const_cast<uint8_t *>(hdr);
+
+            frame.port = escaped ? hdr[2] : static_cast<Port>(hdr[1] >> PortShift);
+            frame.size_flags = 0;
+            frame.payload = Buffer {
+                reinterpret_cast<void *>(frame_data + hdr_len),
+                payload_size };
+            frame.wire_len = total_msg_size;
+            frame.frame = Buffer {
+                reinterpret_cast<void *>(frame_data),
+                static_cast<BufferLen>(total_msg_size) };
+
+            used = curr + total_msg_size;
+
+            return true;
+        }
+
+        stats.dropped_bytes += curr;
+        used = curr;
+
+        return false;
+    }
+
+    void LogBuffer() {
+        char hex[3];
+
+        LogVerbose(LOGGER_PREFIX_RCV "Buf: ");
+
+        for(uint8_t i = 0;i < next;i++) {
+            sprintf(hex, "%02X", data[i]);
+            LogVerbose(hex);
+            LogVerbose(" ");
+        }
+
+        LogVerboseLn(" EOB");
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t MinMsgSize = ShortHdrLen + TrlRoom;
+
+    //
+    // Types.
+    //
+    enum class State {
+        SearchStart,
+        SearchEnd
+    };
+
+    //
+    // Functions.
+    //
+    uint8_t HdrLen() const {
+        return (data[1] >> PortShift) == PortEscape
+            ? ShortHdrLen + 1
+            : ShortHdrLen;
+    }
+
+    Port FramePort() const {
+        auto port = data[1] >> PortShift;
+
+        return port == PortEscape
+            ? data[2]
+            : static_cast<Port>(port);
+    }
+
+    uint8_t PayloadSize() const {
+        return data[1] & SizeBits;
+    }
+
+    uint16_t TotalMsgSize() const {
+        return HdrLen() + PayloadSize() + TrlRoom;
+    }
+
+    void ProcessSearchStart() {
+        while(next) {
+            uint16_t curr = 0;
+
+            while(curr < next && data[curr] != Sync) {
+                curr++;
+            }
+
+            Drop(curr, true);
+
+            if(next < ShortHdrLen || next < HdrLen()) {
+                LogIncompleteHdr();
+                return;
+            }
+
+            auto hdr_len = HdrLen();
+
+            if(Crc8::Calc(data, hdr_len - 1) != data[hdr_len - 1]) {
+                LogHdrCrcMismatch();
+                stats.hdr_error++;
+                Drop(1, true);
+                continue;
+            }
+
+            if(TotalMsgSize() > TotalBufLen) {
+                LogMsgTooLarge();
+                stats.size_error++;
+                Drop(1, true);
+                continue;
+            }
+
+            state = State::SearchEnd;
+            ProcessSearchEnd();
+
+            return;
+        }
+    }
+
+    void ProcessSearchEnd() {
+        if(next < TotalMsgSize()) {
+            return;
+        }
+
+        auto payload = data + HdrLen();
+        auto trl = payload + PayloadSize();
+
+        if(Trailer && trl[sizeof(uint16_t)] != TrlMagic) {
+            LogTrailerMismatch();
+            stats.trl_error++;
+            Recover();
+            return;
+        }
+
+        uint16_t crc;
+        memcpy(&crc, trl, sizeof(crc));
+
+        if(Crc16Usb::Calc(payload, PayloadSize()) != crc) {
+            LogCrcMismatch();
+            stats.crc_error++;
+            Recover();
+            return;
+        }
+
+        frame_ready = true;
+    }
+
+    void Recover() {
+        state = State::SearchStart;
+
+        Drop(1, true);
+        ProcessSearchStart();
+    }
+
+    void Drop(uint16_t bytes, bool count) {
+        if(!bytes) {
+            return;
+        }
+
+        if(count) {
+            stats.dropped_bytes += bytes;
+        }
+
+        memmove(
+            reinterpret_cast<void *>(data),
+            reinterpret_cast<void *>(data + bytes),
+            next - bytes);
+        next -= bytes;
+    }
+
+    // logging
+    static void LogIncompleteHdr() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "not enough bytes for header");
+    }
+
+    static void LogHdrCrcMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "header CRC mismatch");
+    }
+
+    static void LogCrcMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "CRC mismatch");
+    }
+
+    static void LogTrailerMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "trailer mismatch");
+    }
+
+    static void LogMsgTooLarge() {
+        LogVerbose(LOGGER_PREFIX_RCV "message too large ");
+        LogVerboseLn(TotalBufLen);
+    }
+
+    //
+    // Data.
+    //
+    RcvStats &stats;
+
+    // TotalBufLen bytes
+    uint8_t *data;
+
+    State state;
+
+    uint16_t next;
+
+    bool frame_ready;
+};
+
+}
@@ -0,0 +1,430 @@
+//
+// Optional payload compression.
+//
+// Payloads are run-length encoded, with short encodings for
+// runs of zeros. With delta enabled, a payload is first XORed
+// with the previous payload on the same port, so that fields
+// which did not change turn into zeros.
+//
+// Compression is enabled per port, on both ends. A compressed
+// payload is marked by a flag in the header size field and
+// starts with an info byte holding the delta flag and a 7-bit
+// sequence number. A delta payload is decoded only if the
+// receiver holds the payload it was computed against, and a key
+// frame is sent periodically so that a lost datagram breaks
+// only a bounded number of the following ones. Payloads that do
+// not shrink are sent uncompressed.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+
+namespace SerialDatagram {
+
+// Token encoding:
+//   0x00 - 0x7f: a literal run of (token + 1) bytes follows
+//   0x80 - 0xbf: a run of ((token & 0x3f) + 1) zeros
+//   0xc0 - 0xff: the next byte repeated ((token & 0x3f) + 3) times
+class Rle {
+public:
+    // Returns the encoded length, or zero if the output
+    // does not fit into max_out bytes.
+    static uint16_t Encode(
+            const uint8_t *in,
+            uint16_t len,
+            uint8_t *out,
+            uint16_t max_out) {
+        uint16_t out_len = 0;
+        uint16_t literal = 0;
+        uint16_t i = 0;
+
+        while(i < len) {
+            auto run = RunLength(in + i, len - i);
+            auto is_zero_run = in[i] == 0 && run >= 2;
+
+            if(!is_zero_run && run < MinRepeatRun) {
+                if(literal == MaxLiteralRun) {
+                    literal = 0;
+                }
+
+                if(!literal) {
+                    if(out_len == max_out) {
+                        return 0;
+                    }
+
+                    out[out_len++] = 0;
+                } else {
+                    out[out_len - literal - 1]++;
+                }
+
+                if(out_len == max_out) {
+                    return 0;
+                }
+
+                out[out_len++] = in[i++];
+                literal++;
+
+                continue;
+            }
+
+            literal = 0;
+
+            if(is_zero_run) {
+                if(run > MaxZeroRun) {
+                    run = MaxZeroRun;
+                }
+
+                if(out_len == max_out) {
+                    return 0;
+                }
+
+                out[out_len++] = static_cast<uint8_t>(
+                    ZeroRunToken | (run - 1));
+            } else {
+                if(run > MaxRepeatRun) {
+                    run = MaxRepeatRun;
+                }
+
+                if(out_len + 2 > max_out) {
+                    return 0;
+                }
+
+                out[out_len++] = static_cast<uint8_t>(
+                    RepeatRunToken | (run - MinRepeatRun));
+                out[out_len++] = in[i];
+            }
+
+            i += run;
+        }
+
+        return out_len;
+    }
+
+    // Returns the decoded length, or zero if the input
+    // is malformed or does not fit into max_out bytes.
+    static uint16_t Decode(
+            const uint8_t *in,
+            uint16_t len,
+            uint8_t *out,
+            uint16_t max_out) {
+        uint16_t out_len = 0;
+        uint16_t i = 0;
+
+        while(i < len) {
+            auto token = in[i++];
+
+            if(token < ZeroRunToken) {
+                uint16_t run = token + 1;
+
+                if(i + run > len || out_len + run > max_out) {
+                    return 0;
+                }
+
+                memcpy(out + out_len, in + i, run);
+                i += run;
+                out_len += run;
+            } else if(token < RepeatRunToken) {
+                uint16_t run = (token & RunMask) + 1;
+
+                if(out_len + run > max_out) {
+                    return 0;
+                }
+
+                memset(out + out_len, 0, run);
+                out_len += run;
+            } else {
+                uint16_t run = (token & RunMask) + MinRepeatRun;
+
+                if(i == len || out_len + run > max_out) {
+                    return 0;
+                }
+
+                memset(out + out_len, in[i++], run);
+                out_len += run;
+            }
+        }
+
+        return out_len;
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint8_t ZeroRunToken = 0x80;
+    static constexpr uint8_t RepeatRunToken = 0xc0;
+    static constexpr uint8_t RunMask = 0x3f;
+
+    static constexpr uint16_t MaxLiteralRun = 0x80;
+    static constexpr uint16_t MaxZeroRun = RunMask + 1;
+    static constexpr uint16_t MinRepeatRun = 3;
+    static constexpr uint16_t MaxRepeatRun = RunMask + MinRepeatRun;
+
+    //
+    // Functions.
+    //
+    static uint16_t RunLength(const uint8_t *in, uint16_t len) {
+        uint16_t run = 1;
+
+        while(run < len && in[run] == in[0]) {
+            run++;
+        }
+
+        return run;
+    }
+};
+
+// Compression that is never applied.
+struct NoCompression {
+    template<BufferLen MaxLen>
+    class Codec {
+    public:
+        static constexpr bool Enabled = false;
+    };
+};
+
+template<
+    BufferLen MaxLen,
+    uint8_t MaxPorts,
+    bool Delta,
+    uint8_t KeyFrameInterval>
+class RleCodec {
+public:
+    static constexpr bool Enabled = true;
+
+    // Deltas need every datagram of the port.
+    static constexpr bool UsesDelta = Delta;
+
+    static_assert(MaxLen <= DatagramSizeMask);
+
+    RleCodec() {
+        for(uint8_t i = 0;i < MaxPorts;i++) {
+            ports[i] = InvalidPort;
+            tx[i].Clear();
+            rx[i].Clear();
+        }
+    }
+
+    Status EnablePort(Port port) {
+        if(Find(port) != MaxPorts) {
+            return Status::Duplicate;
+        }
+
+        auto slot = Find(InvalidPort);
+
+        if(slot == MaxPorts) {
+            return Status::NoMoreSpace;
+        }
+
+        ports[slot] = port;
+
+        return Status::Success;
+    }
+
+    bool IsPortEnabled(Port port) const {
+        return Find(port) != MaxPorts;
+    }
+
+    // Compresses the payload in place if the port has compression
+    // enabled and the payload shrinks. Returns true if it did.
+    bool Encode(Port port, Buffer &buf) {
+        auto slot = Find(port);
+
+        if(slot == MaxPorts) {
+            return false;
+        }
+
+        auto &state = tx[slot];
+        auto in = static_cast<uint8_t *>(buf.ptr);
+        auto delta = Delta
+            && state.valid
+            && state.since_key + 1 < KeyFrameInterval;
+
+        if(delta) {
+            state.Xor(in, buf.len, true);
+        } else {
+            state.Store(in, buf.len);
+        }
+
+        auto encoded_len = Rle::Encode(
+            in,
+            buf.len,
+            tx_scratch + sizeof(uint8_t),
+            MaxLen - sizeof(uint8_t));
+
+        if(!encoded_len || encoded_len + sizeof(uint8_t) >= buf.len) {
+            // The receiver stores the uncompressed payload, but
+            // cannot tell its sequence, so start over with a key.
+            if(delta) {
+                memcpy(in, state.prev, buf.len);
+            }
+
+            state.valid = false;
+
+            return false;
+        }
+
+        state.seq = (state.seq + 1) & SeqMask;
+        state.since_key = delta ? state.since_key + 1 : 0;
+        state.valid = Delta;
+
+        tx_scratch[0] = state.seq | (delta ? DeltaFlag : 0);
+        buf.len = static_cast<BufferLen>(encoded_len + sizeof(uint8_t));
+        memcpy(in, tx_scratch, buf.len);
+
+        return true;
+    }
+
+    // Decompresses the payload into an internal buffer.
+    // Returns false if the payload cannot be decoded.
+    bool Decode(Port port, bool compressed, Buffer &buf) {
+        auto slot = Find(port);
+        auto in = static_cast<const uint8_t *>(buf.ptr);
+
+        if(!compressed) {
+            if(slot != MaxPorts && Delta) {
+                rx[slot].Store(in, buf.len);
+                rx[slot].valid = false;
+            }
+
+            return true;
+        }
+
+        if(buf.len < sizeof(uint8_t)) {
+            return false;
+        }
+
+        uint8_t seq = in[0] & SeqMask;
+        bool delta = in[0] & DeltaFlag;
+
+        if(delta) {
+            if(slot == MaxPorts
+                    || !rx[slot].valid
+                    || rx[slot].seq != ((seq - 1) & SeqMask)) {
+                return false;
+            }
+        }
+
+        auto decoded_len = Rle::Decode(
+            in + sizeof(uint8_t),
+            buf.len - sizeof(uint8_t),
+            rx_scratch,
+            MaxLen);
+
+        if(!decoded_len) {
+            if(slot != MaxPorts) {
+                rx[slot].valid = false;
+            }
+
+            return false;
+        }
+
+        if(slot != MaxPorts && Delta) {
+            auto &state = rx[slot];
+
+            if(delta) {
+                state.Xor(rx_scratch, decoded_len, false);
+            } else {
+                state.Store(rx_scratch, decoded_len);
+            }
+
+            state.seq = seq;
+            state.valid = true;
+        }
+
+        buf.ptr = rx_scratch;
+        buf.len = static_cast<BufferLen>(decoded_len);
+
+        return true;
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint8_t DeltaFlag = 0x80;
+    static constexpr uint8_t SeqMask = 0x7f;
+
+    static constexpr uint8_t PrevLen = Delta ? MaxLen : 1;
+
+    //
+    // Types.
+    //
+    struct PortState {
+        void Clear() {
+            prev_len = 0;
+            seq = 0;
+            since_key = 0;
+            valid = false;
+        }
+
+        void Store(const uint8_t *payload, BufferLen len) {
+            if(Delta) {
+                memcpy(prev, payload, len);
+                prev_len = len;
+            }
+        }
+
+        // XORs the payload with the previous one and stores the
+        // plain payload as the next reference. The payload is
+        // plain on input when encoding and on output when decoding.
+        void Xor(uint8_t *payload, BufferLen len, bool encoding) {
+            for(BufferLen i = 0;i < len;i++) {
+                uint8_t ref = i < prev_len ? prev[i] : 0;
+                uint8_t plain = encoding ? payload[i] : payload[i] ^ ref;
+
+                payload[i] ^= ref;
+                prev[i] = plain;
+            }
+
+            prev_len = len;
+        }
+
+        uint8_t prev[PrevLen];
+        BufferLen prev_len;
+        uint8_t seq;
+        uint8_t since_key;
+        bool valid;
+    };
+
+    //
+    // Functions.
+    //
+    uint8_t Find(Port port) const {
+        for(uint8_t i = 0;i < MaxPorts;i++) {
+            if(ports[i] == port) {
+                return i;
+            }
+        }
+
+        return MaxPorts;
+    }
+
+    //
+    // Data.
+    //
+    Port ports[MaxPorts];
+
+    PortState tx[MaxPorts];
+    PortState rx[MaxPorts];
+
+    uint8_t tx_scratch[MaxLen];
+
+    // Decoded payloads are delivered from here.
+    uint8_t rx_scratch[MaxLen];
+};
+
+template<
+    uint8_t MaxPorts,
+    bool Delta = true,
+    uint8_t KeyFrameInterval = 16>
+struct RleCompression {
+    template<BufferLen MaxLen>
+    using Codec = RleCodec<MaxLen, MaxPorts, Delta, KeyFrameInterval>;
+};
+
+}
@@ -0,0 +1,77 @@
+//
+// Compile-time configuration of the network.
+//
+// To change the defaults, derive from DefaultConfig and
+// override the members that need to change:
+//
+//   struct MyConfig : SerialDatagram::DefaultConfig {
+//       using FlowControl = SerialDatagram::CreditFlowControl<48>;
+//   };
+//
+//   SerialDatagram::Net<SoftwareSerial, MyConfig> net(serial);
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram_defs.h"
+#include "sdgram_flow_control.h"
+#include "sdgram_compression.h"
+#include "sdgram_frame_size.h"
+#include "sdgram_framing.h"
+#include "sdgram_ping.h"
+#include "sdgram_clock.h"
+
+namespace SerialDatagram {
+
+struct DefaultConfig {
+    // user payload size
+    static constexpr BufferLen MaxBufferLen = 56;
+
+    // buffers for parallel sends
+    static constexpr uint16_t TotalBufs = 4;
+
+    // Buffers for receiving. One takes the frame being received,
+    // and the others let receivers hold frames for later with
+    // HoldFrame(). Shared receive buffers come from the send
+    // buffers instead, so TotalBufs needs to count them.
+    static constexpr uint16_t RxBufs = 1;
+    static constexpr bool SharedRxBufs = false;
+
+    static constexpr uint8_t MaxReceivers = 4;
+
+    // ports that send only their latest datagram when backed up
+    static constexpr uint8_t MaxCoalescedPorts = 2;
+
+    // Both ends need to use the same kind of flow control.
+    using FlowControl = NoFlowControl;
+
+    // Compressed ports need to be enabled on both ends.
+    using Compression = NoCompression;
+
+    // AdaptiveFrameSize tells the peer which payload size gets
+    // the most through the link. See FramePayload().
+    using FrameSize = FixedFrameSize;
+
+    // PingService answers requests on DiagPort and measures the
+    // round-trip times of SendPing(). It takes a receiver slot.
+    using Ping = NoPing;
+
+    // Both ends need to use the same framing. Only the magic
+    // word framing is understood by pysdgram.
+    using Framing = MagicFraming<>;
+
+    // Milliseconds without new bytes after which a partly
+    // received frame is dropped. Zero waits forever. It needs
+    // to be longer than any pause the sender makes within a
+    // frame, which at low baud rates includes the frame time.
+    static constexpr uint16_t FrameTimeout = 0;
+
+    using Clock = DefaultClock;
+
+    // Times the budgets of Process(), in microseconds.
+    using BudgetClock = DefaultMicrosClock;
+};
+
+}
@@ -0,0 +1,839 @@
+//
+// Coroutine interface for host programs.
+//
+// A host that runs many conversations at once can write each of
+// them as a C++20 coroutine instead of a state machine:
+//
+//   Task Echo(AsyncNet<Net_> &net) {
+//       while(true) {
+//           auto msg = co_await net.Receive(EchoPort);
+//
+//           co_await net.SendAsync(EchoPort, *msg);
+//       }
+//   }
+//
+// An Executor resumes the coroutines, expires their timeouts and
+// calls Process() on a network only when the network has bytes
+// to read or to write. A waiting coroutine costs its frame and a
+// list entry, so thousands of them are fine.
+//
+// Received payloads are copied out of the receive buffer, so the
+// coroutine owns what it gets. SendAsync() completes when the
+// frame has been written to the stream in full, which the network
+// tells through SendDone, so other datagrams may be sent on the
+// network besides those of the AsyncNet.
+//
+// This needs C++20 and the standard library, so it is for hosts
+// only. The Arduino code does not include it.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#if !defined(__cpp_impl_coroutine)
+#error "sdgram_coro.h needs C++20 coroutines"
+#endif
+
+#include <chrono>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+// A coroutine started by Executor::Spawn(). The executor destroys
+// its frame after it returns.
+class Task {
+public:
+    struct promise_type {
+        Task get_return_object() {
+            return Task(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+
+        std::suspend_always initial_suspend() noexcept {
+            return {};
+        }
+
+        std::suspend_always final_suspend() noexcept {
+            return {};
+        }
+
+        void return_void() {
+            // empty
+        }
+
+        void unhandled_exception() {
+            std::terminate();
+        }
+    };
+
+    Task(Task &&other)
+            : handle(other.handle) {
+        other.handle = nullptr;
+    }
+
+    Task(const Task &) = delete;
+    Task &operator=(const Task &) = delete;
+
+    ~Task() {
+        if(handle) {
+            handle.destroy();
+        }
+    }
+
+    // The caller takes over the coroutine.
+    std::coroutine_handle<> Release() {
+        std::coroutine_handle<> ret = handle;
+        handle = nullptr;
+
+        return ret;
+    }
+
+private:
+    explicit Task(std::coroutine_handle<promise_type> handle)
+            : handle(handle) {
+        // empty
+    }
+
+    std::coroutine_handle<promise_type> handle;
+};
+
+// Something the executor polls, such as an AsyncNet.
+class Pollable {
+public:
+    Pollable() = default;
+    virtual ~Pollable() = default;
+
+    // Returns true if anything moved.
+    virtual bool Poll() = 0;
+};
+
+template<typename Clock = std::chrono::steady_clock>
+class Executor {
+public:
+    using Duration = typename Clock::duration;
+    using TimePoint = typename Clock::time_point;
+
+    // No timeout.
+    static constexpr Duration Forever = Duration::max();
+
+    class Timer {
+    public:
+        Timer() = default;
+        virtual ~Timer() = default;
+
+        // The timer is already stopped when this is invoked.
+        virtual void Expired() = 0;
+    };
+
+    using TimerId = typename std::multimap<TimePoint, Timer *>::iterator;
+
+    Executor() = default;
+
+    Executor(const Executor &) = delete;
+    Executor &operator=(const Executor &) = delete;
+
+    ~Executor() {
+        for(auto address : tasks) {
+            std::coroutine_handle<>::from_address(address).destroy();
+        }
+    }
+
+    // The task first runs on the next RunOnce().
+    void Spawn(Task task) {
+        auto handle = task.Release();
+
+        tasks.insert(handle.address());
+        ready.push_back(handle);
+    }
+
+    // Schedules a suspended task to be resumed.
+    void Resume(std::coroutine_handle<> handle) {
+        ready.push_back(handle);
+    }
+
+    void Add(Pollable &pollable) {
+        pollables.push_back(&pollable);
+    }
+
+    void Remove(Pollable &pollable) {
+        for(auto it = pollables.begin();it != pollables.end();++it) {
+            if(*it == &pollable) {
+                pollables.erase(it);
+                return;
+            }
+        }
+    }
+
+    TimerId StartTimer(Duration timeout, Timer &timer) {
+        return timers.emplace(Clock::now() + timeout, &timer);
+    }
+
+    void StopTimer(TimerId id) {
+        timers.erase(id);
+    }
+
+    // Polls, expires timers and resumes the tasks that are ready,
+    // without waiting. Returns false if nothing happened.
+    bool RunOnce() {
+        bool progress = false;
+
+        for(auto pollable : pollables) {
+            if(pollable->Poll()) {
+                progress = true;
+            }
+        }
+
+        if(ExpireTimers()) {
+            progress = true;
+        }
+
+        if(ResumeReady()) {
+            progress = true;
+        }
+
+        return progress;
+    }
+
+    void RunUntilIdle() {
+        while(RunOnce()) {
+            // empty
+        }
+    }
+
+    // Runs until every task returns. When nothing happens, it
+    // sleeps until the next timer, but no longer than the poll
+    // interval, since streams cannot wake it up. The clock has
+    // to follow real time.
+    void Run(Duration poll_interval = std::chrono::milliseconds(1)) {
+        while(!tasks.empty()) {
+            if(RunOnce()) {
+                continue;
+            }
+
+            auto wake = Clock::now() + poll_interval;
+
+            if(!timers.empty() && timers.begin()->first < wake) {
+                wake = timers.begin()->first;
+            }
+
+            std::this_thread::sleep_until(wake);
+        }
+    }
+
+    // Tasks that have not returned yet.
+    size_t TaskCount() const {
+        return tasks.size();
+    }
+
+    class SleepAwaiter : public Timer {
+    public:
+        SleepAwaiter(Executor &executor, Duration duration)
+                : executor(executor),
+                duration(duration) {
+            // empty
+        }
+
+        bool await_ready() const {
+            return duration <= Duration::zero();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->handle = handle;
+            executor.StartTimer(duration, *this);
+        }
+
+        void await_resume() {
+            // empty
+        }
+
+        void Expired() override {
+            executor.Resume(handle);
+        }
+
+    private:
+        Executor &executor;
+        Duration duration;
+        std::coroutine_handle<> handle;
+    };
+
+    SleepAwaiter Sleep(Duration duration) {
+        return SleepAwaiter(*this, duration);
+    }
+
+private:
+    //
+    // Functions.
+    //
+    bool ExpireTimers() {
+        bool expired = false;
+        auto now = Clock::now();
+
+        while(!timers.empty() && timers.begin()->first <= now) {
+            auto timer = timers.begin()->second;
+
+            timers.erase(timers.begin());
+            timer->Expired();
+
+            expired = true;
+        }
+
+        return expired;
+    }
+
+    // Tasks made ready while these run wait for the next round.
+    bool ResumeReady() {
+        if(ready.empty()) {
+            return false;
+        }
+
+        std::deque<std::coroutine_handle<>> batch;
+        batch.swap(ready);
+
+        for(auto handle : batch) {
+            handle.resume();
+
+            if(handle.done()) {
+                tasks.erase(handle.address());
+                handle.destroy();
+            }
+        }
+
+        return true;
+    }
+
+    //
+    // Data.
+    //
+    std::unordered_set<void *> tasks;
+    std::deque<std::coroutine_handle<>> ready;
+    std::multimap<TimePoint, Timer *> timers;
+    std::vector<Pollable *> pollables;
+};
+
+template<
+    typename Net,
+    typename Clock = std::chrono::steady_clock>
+class AsyncNet : public Pollable, public SendDone {
+public:
+    using Executor_ = Executor<Clock>;
+    using Duration = typename Executor_::Duration;
+    using Payload = std::vector<uint8_t>;
+
+    static constexpr Duration Forever = Executor_::Forever;
+
+    // Payloads kept per port until a coroutine receives them.
+    // The oldest one is dropped when more arrive.
+    static constexpr size_t MaxQueued = 64;
+
+    AsyncNet(Executor_ &executor, Net &net)
+            : executor(executor),
+            net(net),
+            submitting(nullptr),
+            next_token(0),
+            dropped(0) {
+        executor.Add(*this);
+    }
+
+    AsyncNet(const AsyncNet &) = delete;
+    AsyncNet &operator=(const AsyncNet &) = delete;
+
+    // Tasks still waiting on the network are left suspended
+    // until the executor destroys them. The network lets go of
+    // the receivers and of the sends, and may be used on.
+    ~AsyncNet() {
+        executor.Remove(*this);
+        net.ForgetSendDone(*this);
+
+        for(auto &rx : rx_ports) {
+            net.UnregisterReceiver(rx.first, *rx.second);
+
+            for(auto waiter : rx.second->waiters) {
+                waiter->Detach();
+            }
+        }
+
+        for(auto waiter : buf_waiters) {
+            waiter->Detach();
+        }
+
+        for(auto waiter : tx_waiters) {
+            waiter->Detach();
+        }
+    }
+
+    class ReceiveAwaiter;
+    class SendAwaiter;
+
+    // Resolves to the next payload on the port, or to nothing if
+    // the timeout passes first or the port cannot be registered.
+    ReceiveAwaiter Receive(Port port, Duration timeout = Forever) {
+        return ReceiveAwaiter(*this, RxPortFor(port), timeout);
+    }
+
+    // Sends a buffer allocated from the network. The buffer
+    // ownership is passed to the network.
+    SendAwaiter SendAsync(Port port, Buffer buf, Duration timeout = Forever) {
+        return SendAwaiter(*this, port, buf, nullptr, timeout);
+    }
+
+    // Copies the payload into a buffer, waiting for one to become
+    // free if needed. The payload has to stay valid until the
+    // send completes, which holds for a co_await argument.
+    SendAwaiter SendAsync(Port port, const Payload &payload, Duration timeout = Forever) {
+        return SendAwaiter(*this, port, Buffer { nullptr, 0 }, &payload, timeout);
+    }
+
+    bool Poll() override {
+        bool progress = false;
+
+        if(net.HasWork()) {
+            progress = net.Process();
+        }
+
+        if(CompleteSends()) {
+            progress = true;
+        }
+
+        if(StartWaitingSends()) {
+            progress = true;
+        }
+
+        return progress;
+    }
+
+    // The frame of a send went to the stream, or a newer datagram
+    // of a coalesced port took its place.
+    void Done(uint16_t token, bool) override {
+        if(submitting && submitting->Token() == token) {
+            submitting->MarkSent();
+            return;
+        }
+
+        for(auto waiter : tx_waiters) {
+            if(waiter->Token() == token) {
+                waiter->MarkSent();
+                return;
+            }
+        }
+    }
+
+    // Payloads dropped because nothing received them in time.
+    uint32_t Dropped() const {
+        return dropped;
+    }
+
+    Net &GetNet() {
+        return net;
+    }
+
+private:
+    //
+    // Types.
+    //
+    class RxPort : public Rcv {
+    public:
+        RxPort(AsyncNet &async)
+                : async(async) {
+            // empty
+        }
+
+        void ProcessMsg(Buffer buf) override {
+            async.Received(*this, buf);
+        }
+
+        AsyncNet &async;
+
+        std::deque<Payload> queued;
+        std::list<ReceiveAwaiter *> waiters;
+    };
+
+public:
+    class ReceiveAwaiter : public Executor_::Timer {
+    public:
+        ReceiveAwaiter(AsyncNet &async, RxPort *rx, Duration timeout)
+                : executor(async.executor),
+                rx(rx),
+                timeout(timeout),
+                waiting(false),
+                timed(false) {
+            // empty
+        }
+
+        // A task destroyed while it waits leaves nothing behind.
+        ~ReceiveAwaiter() {
+            if(waiting) {
+                rx->waiters.erase(waiter);
+            }
+
+            Detach();
+        }
+
+        void Detach() {
+            waiting = false;
+
+            if(timed) {
+                executor.StopTimer(timer);
+                timed = false;
+            }
+        }
+
+        bool await_ready() {
+            if(!rx) {
+                return true;
+            }
+
+            if(!rx->queued.empty()) {
+                result = std::move(rx->queued.front());
+                rx->queued.pop_front();
+                return true;
+            }
+
+            return timeout <= Duration::zero();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->handle = handle;
+            waiter = rx->waiters.insert(rx->waiters.end(), this);
+            waiting = true;
+
+            if(timeout != Forever) {
+                timer = executor.StartTimer(timeout, *this);
+                timed = true;
+            }
+        }
+
+        std::optional<Payload> await_resume() {
+            return std::move(result);
+        }
+
+        // The awaiter is already off the waiting list.
+        void Complete(Payload &&payload) {
+            result = std::move(payload);
+            waiting = false;
+
+            if(timed) {
+                executor.StopTimer(timer);
+                timed = false;
+            }
+
+            executor.Resume(handle);
+        }
+
+        void Expired() override {
+            rx->waiters.erase(waiter);
+            waiting = false;
+            timed = false;
+
+            executor.Resume(handle);
+        }
+
+    private:
+        Executor_ &executor;
+        RxPort *rx;
+        Duration timeout;
+
+        std::coroutine_handle<> handle;
+        typename std::list<ReceiveAwaiter *>::iterator waiter;
+        typename Executor_::TimerId timer;
+        bool waiting;
+        bool timed;
+
+        std::optional<Payload> result;
+    };
+
+    // Resolves to Success once the frame is written out, or to
+    // Timeout. A frame that timed out may still be sent later.
+    class SendAwaiter : public Executor_::Timer {
+    public:
+        SendAwaiter(
+            AsyncNet &async,
+            Port port,
+            Buffer buf,
+            const Payload *payload,
+            Duration timeout)
+                : async(async),
+                executor(async.executor),
+                port(port),
+                buf(buf),
+                payload(payload),
+                timeout(timeout),
+                token(0),
+                sent(false),
+                list(nullptr),
+                timed(false),
+                status(Status::Success) {
+            // empty
+        }
+
+        ~SendAwaiter() {
+            if(list) {
+                list->erase(waiter);
+            }
+
+            Detach();
+        }
+
+        void Detach() {
+            list = nullptr;
+
+            if(timed) {
+                executor.StopTimer(timer);
+                timed = false;
+            }
+        }
+
+        bool await_ready() {
+            if(payload) {
+                if(payload->size() > Net::MaxBufferLen) {
+                    status = Status::Failure;
+                    return true;
+                }
+
+                if(!TakeBuffer()) {
+                    return TimedOut();
+                }
+            }
+
+            if(!Submit() || sent) {
+                return true;
+            }
+
+            return TimedOut();
+        }
+
+        void await_suspend(std::coroutine_handle<> handle) {
+            this->handle = handle;
+
+            Wait(payload && !buf.ptr
+                ? async.buf_waiters
+                : async.tx_waiters);
+
+            if(timeout != Forever) {
+                timer = executor.StartTimer(timeout, *this);
+                timed = true;
+            }
+        }
+
+        Status await_resume() const {
+            return status;
+        }
+
+        Status Result() const {
+            return status;
+        }
+
+        // Invoked when a buffer is free.
+        bool TakeBuffer() {
+            buf = async.net.AllocBuffer();
+
+            if(!buf.ptr) {
+                return false;
+            }
+
+            buf.len = static_cast<BufferLen>(payload->size());
+            memcpy(buf.ptr, payload->data(), buf.len);
+
+            return true;
+        }
+
+        // Returns false if the network refused the buffer. The
+        // frame may be written out before this returns.
+        bool Submit() {
+            token = async.next_token;
+
+            async.submitting = this;
+            status = async.net.Send(port, buf, &async, token);
+            async.submitting = nullptr;
+
+            if(status != Status::Success) {
+                async.net.FreeBuffer(buf);
+                return false;
+            }
+
+            async.next_token++;
+
+            return true;
+        }
+
+        void Wait(std::list<SendAwaiter *> &waiters) {
+            list = &waiters;
+            waiter = waiters.insert(waiters.end(), this);
+        }
+
+        uint16_t Token() const {
+            return token;
+        }
+
+        bool IsSent() const {
+            return sent;
+        }
+
+        void MarkSent() {
+            sent = true;
+        }
+
+        void Complete(Status status) {
+            this->status = status;
+            list = nullptr;
+
+            if(timed) {
+                executor.StopTimer(timer);
+                timed = false;
+            }
+
+            executor.Resume(handle);
+        }
+
+        void Expired() override {
+            list->erase(waiter);
+            list = nullptr;
+            timed = false;
+            status = Status::Timeout;
+
+            executor.Resume(handle);
+        }
+
+    private:
+        // A zero timeout does not wait at all.
+        bool TimedOut() {
+            if(timeout > Duration::zero()) {
+                return false;
+            }
+
+            status = Status::Timeout;
+            return true;
+        }
+
+        AsyncNet &async;
+        Executor_ &executor;
+        Port port;
+        Buffer buf;
+        const Payload *payload;
+        Duration timeout;
+
+        // tells the frame apart from the others in flight
+        uint16_t token;
+        bool sent;
+
+        std::coroutine_handle<> handle;
+        std::list<SendAwaiter *> *list;
+        typename std::list<SendAwaiter *>::iterator waiter;
+        typename Executor_::TimerId timer;
+        bool timed;
+
+        Status status;
+    };
+
+private:
+    //
+    // Functions.
+    //
+    RxPort *RxPortFor(Port port) {
+        auto found = rx_ports.find(port);
+
+        if(found != rx_ports.end()) {
+            return found->second.get();
+        }
+
+        auto rx = std::make_unique<RxPort>(*this);
+
+        if(net.RegisterReceiver(port, *rx) != Status::Success) {
+            return nullptr;
+        }
+
+        return rx_ports.emplace(port, std::move(rx)).first->second.get();
+    }
+
+    void Received(RxPort &rx, Buffer buf) {
+        auto data = static_cast<const uint8_t *>(buf.ptr);
+        Payload payload(data, data + buf.len);
+
+        if(!rx.waiters.empty()) {
+            auto waiter = rx.waiters.front();
+
+            rx.waiters.pop_front();
+            waiter->Complete(std::move(payload));
+            return;
+        }
+
+        if(rx.queued.size() == MaxQueued) {
+            rx.queued.pop_front();
+            dropped++;
+        }
+
+        rx.queued.push_back(std::move(payload));
+    }
+
+    // Waiters whose frame went out, in any order, as a newer
+    // datagram may replace an older one.
+    bool CompleteSends() {
+        bool any = false;
+
+        for(auto it = tx_waiters.begin();it != tx_waiters.end();) {
+            auto waiter = *it;
+
+            if(!waiter->IsSent()) {
+                ++it;
+                continue;
+            }
+
+            it = tx_waiters.erase(it);
+            waiter->Complete(Status::Success);
+
+            any = true;
+        }
+
+        return any;
+    }
+
+    bool StartWaitingSends() {
+        bool any = false;
+
+        while(!buf_waiters.empty() && buf_waiters.front()->TakeBuffer()) {
+            auto waiter = buf_waiters.front();
+
+            buf_waiters.pop_front();
+            any = true;
+
+            if(!waiter->Submit()) {
+                waiter->Complete(waiter->Result());
+            } else if(waiter->IsSent()) {
+                waiter->Complete(Status::Success);
+            } else {
+                waiter->Wait(tx_waiters);
+            }
+        }
+
+        return any;
+    }
+
+    //
+    // Data.
+    //
+    Executor_ &executor;
+    Net &net;
+
+    std::map<Port, std::unique_ptr<RxPort>> rx_ports;
+
+    std::list<SendAwaiter *> buf_waiters;
+    std::list<SendAwaiter *> tx_waiters;
+
+    // the awaiter in Submit(), whose frame may go out at once
+    SendAwaiter *submitting;
+    uint16_t next_token;
+
+    uint32_t dropped;
+};
+
+}
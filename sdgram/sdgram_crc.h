@@ -0,0 +1,69 @@
+//
+// Checksums computed by the library itself.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram_stdint.h"
+
+namespace SerialDatagram {
+
+// CRC-8 with polynomial 0x07, as used for ATM cell headers.
+// It is cheap enough to protect a few header bytes on its own.
+class Crc8 {
+public:
+    static uint8_t Calc(const void *buf, size_t len, uint8_t crc = 0) {
+        auto data = static_cast<const uint8_t *>(buf);
+
+        for(size_t i = 0;i < len;i++) {
+            crc ^= data[i];
+
+            for(uint8_t bit = 0;bit < 8;bit++) {
+                crc = (crc & 0x80)
+                    ? static_cast<uint8_t>((crc << 1) ^ Poly)
+                    : static_cast<uint8_t>(crc << 1);
+            }
+        }
+
+        return crc;
+    }
+
+private:
+    static constexpr uint8_t Poly = 0x07;
+};
+
+// CRC-16/USB computed over several pieces, with the same result
+// as Crc16Usb::Calc of the crc16 library over the pieces joined.
+// It checks a frame that cannot be changed to clear its CRC field.
+class Crc16UsbParts {
+public:
+    static constexpr uint16_t Init = 0xffff;
+
+    static uint16_t Update(uint16_t crc, const void *buf, size_t len) {
+        auto data = static_cast<const uint8_t *>(buf);
+
+        for(size_t i = 0;i < len;i++) {
+            crc ^= data[i];
+
+            for(uint8_t bit = 0;bit < 8;bit++) {
+                crc = (crc & 1)
+                    ? static_cast<uint16_t>((crc >> 1) ^ Poly)
+                    : static_cast<uint16_t>(crc >> 1);
+            }
+        }
+
+        return crc;
+    }
+
+    static uint16_t Final(uint16_t crc) {
+        return crc ^ 0xffff;
+    }
+
+private:
+    // 0x8005 reflected
+    static constexpr uint16_t Poly = 0xa001;
+};
+
+}
@@ -16,6 +16,7 @@ enum class Status {
     Duplicate,
     NoMoreSpace,
     NoReceiver,
+    Timeout,
 };
 
 using BufferLen = uint8_t;
@@ -28,6 +29,16 @@ struct Buffer {
     BufferLen len;
 };
 
+// Limits the work of one Process() call. Frames count both
+// the frames received and the datagrams sent, bytes count
+// both the bytes read and written, and the time is in
+// microseconds. A limit of zero is no limit.
+struct Budget {
+    uint16_t frames;
+    uint16_t bytes;
+    uint32_t time;
+};
+
 class Rcv {
 public:
     Rcv() = default;
@@ -39,4 +50,26 @@ public:
     virtual void ProcessMsg(Buffer buf) = 0;
 };
 
+// Tells when a datagram sent with a token leaves the network.
+class SendDone {
+public:
+    SendDone() = default;
+    virtual ~SendDone() = default;
+
+    // The last byte of the datagram went to the stream. If written
+    // is false, a newer datagram of a coalesced port took its place
+    // before it was started.
+    virtual void Done(uint16_t token, bool written) = 0;
+};
+
+// Tells a producer that ran out of send buffers that it can
+// allocate again.
+class BufListener {
+public:
+    BufListener() = default;
+    virtual ~BufListener() = default;
+
+    virtual void BufferFree() = 0;
+};
+
 }
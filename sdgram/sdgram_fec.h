@@ -0,0 +1,792 @@
+//
+// Framing with forward error correction.
+//
+// On a noisy link one flipped bit costs a whole frame. This framing
+// adds Reed-Solomon parity, so that the receiver repairs a few
+// corrupted bytes before it checks the CRC:
+//
+//   sync, [size, port, hdr parity], [payload, crc16, parity]
+//
+// The bracketed parts are Reed-Solomon codewords over bytes. The
+// header codeword has two parity bytes and corrects one corrupted
+// byte, and the body codeword has Parity bytes and corrects
+// Parity / 2 of them. A burst of errors spoils at most one byte
+// more than it covers, so the codewords need no interleaving. The
+// sync word is still found with one of its bits flipped. The CRC
+// covers the header codeword and the payload, and catches frames
+// with more errors than the code corrects.
+//
+// Checking a clean frame costs Parity table lookups per byte, on
+// AVR from tables in flash. The decoder runs only for frames with
+// errors, and costs about Parity / 2 times as much again. Frames
+// repaired are counted in the corrected receiver stat.
+//
+// This framing is not understood by pysdgram.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <crc16.h>
+
+#if defined(__AVR__)
+#include <avr/pgmspace.h>
+#endif
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_rcv_stats.h"
+#include "sdgram_framing.h"
+#include "sdgram_log.h"
+
+#define LOGGER_PREFIX_RCV "[SDGRAM-RCV] "
+
+namespace SerialDatagram {
+
+//
+// Types.
+//
+// Logarithms in GF(2^8) with the polynomial 0x11d.
+struct GfTables {
+    uint8_t exp[255];
+    uint8_t log[256];
+};
+
+//
+// Functions.
+//
+constexpr GfTables MakeGfTables() {
+    GfTables tables {};
+    uint16_t x = 1;
+
+    for(uint8_t i = 0;i < 255;i++) {
+        tables.exp[i] = static_cast<uint8_t>(x);
+        tables.log[x] = i;
+
+        x <<= 1;
+
+        if(x & 0x100) {
+            x ^= 0x11d;
+        }
+    }
+
+    return tables;
+}
+
+//
+// Data.
+//
+#if defined(__AVR__)
+inline constexpr GfTables GfTable PROGMEM = MakeGfTables();
+#else
+inline constexpr GfTables GfTable = MakeGfTables();
+#endif
+
+class Gf256 {
+public:
+    static uint8_t Exp(uint16_t power) {
+        while(power >= 255) {
+            power -= 255;
+        }
+
+        return Read(GfTable.exp[power]);
+    }
+
+    static uint8_t Log(uint8_t x) {
+        return Read(GfTable.log[x]);
+    }
+
+    static uint8_t Mul(uint8_t a, uint8_t b) {
+        return a && b
+            ? Exp(Log(a) + Log(b))
+            : 0;
+    }
+
+    static uint8_t Div(uint8_t a, uint8_t b) {
+        return a
+            ? Exp(Log(a) + 255 - Log(b))
+            : 0;
+    }
+
+    // At compile time, where flash needs no special reads.
+    static constexpr uint8_t ConstMul(uint8_t a, uint8_t b) {
+        return a && b
+            ? GfTable.exp[(GfTable.log[a] + GfTable.log[b]) % 255]
+            : 0;
+    }
+
+private:
+    static uint8_t Read(const uint8_t &entry) {
+#if defined(__AVR__)
+        return pgm_read_byte(&entry);
+#else
+        return entry;
+#endif
+    }
+};
+
+// Systematic Reed-Solomon code, shortened to the codeword length,
+// with the roots 1, a, ..., a^(Parity - 1) of the generator.
+template<uint8_t Parity>
+class ReedSolomon {
+public:
+    static_assert(Parity >= 2 && Parity <= 16 && Parity % 2 == 0);
+
+    static constexpr uint8_t MaxErrors = Parity / 2;
+
+    // Appends Parity bytes to the len bytes of data.
+    static void Encode(uint8_t *data, uint16_t len) {
+        uint8_t *parity = data + len;
+
+        memset(parity, 0, Parity);
+
+        for(uint16_t i = 0;i < len;i++) {
+            uint8_t feedback = data[i] ^ parity[0];
+
+            memmove(parity, parity + 1, Parity - 1);
+            parity[Parity - 1] = 0;
+
+            if(!feedback) {
+                continue;
+            }
+
+            uint8_t log = Gf256::Log(feedback);
+
+            for(uint8_t j = 0;j < Parity;j++) {
+                if(Gen.coef[j]) {
+                    parity[j] ^= Gf256::Exp(log + Gen.log[j]);
+                }
+            }
+        }
+    }
+
+    // True if the len bytes, parity included, form a codeword.
+    static bool Check(const uint8_t *code, uint16_t len) {
+        uint8_t synd[Parity];
+
+        return Syndromes(code, len, synd);
+    }
+
+    // Corrects up to MaxErrors bytes of the codeword in place.
+    // Returns how many it corrected, or -1 if there are more.
+    static int8_t Correct(uint8_t *code, uint16_t len) {
+        uint8_t synd[Parity];
+
+        if(Syndromes(code, len, synd)) {
+            return 0;
+        }
+
+        // Berlekamp-Massey finds the error locator.
+        uint8_t locator[Parity + 1] = { 1 };
+        uint8_t prev[Parity + 1] = { 1 };
+        uint8_t saved[Parity + 1];
+        uint8_t errors = 0;
+        uint8_t shift = 1;
+        uint8_t prev_delta = 1;
+
+        for(uint8_t n = 0;n < Parity;n++) {
+            uint8_t delta = synd[n];
+
+            for(uint8_t i = 1;i <= errors;i++) {
+                delta ^= Gf256::Mul(locator[i], synd[n - i]);
+            }
+
+            if(!delta) {
+                shift++;
+                continue;
+            }
+
+            uint8_t scale = Gf256::Div(delta, prev_delta);
+            bool grow = 2 * errors <= n;
+
+            if(grow) {
+                memcpy(saved, locator, sizeof(saved));
+            }
+
+            for(uint8_t i = shift;i <= Parity;i++) {
+                locator[i] ^= Gf256::Mul(scale, prev[i - shift]);
+            }
+
+            if(grow) {
+                errors = static_cast<uint8_t>(n + 1 - errors);
+                memcpy(prev, saved, sizeof(prev));
+                prev_delta = delta;
+                shift = 1;
+            } else {
+                shift++;
+            }
+        }
+
+        if(errors > MaxErrors) {
+            return -1;
+        }
+
+        // The error evaluator, syndromes times locator.
+        uint8_t evaluator[Parity];
+
+        for(uint8_t k = 0;k < Parity;k++) {
+            evaluator[k] = 0;
+
+            for(uint8_t i = 0;i <= k && i <= errors;i++) {
+                evaluator[k] ^= Gf256::Mul(locator[i], synd[k - i]);
+            }
+        }
+
+        // Chien search for the roots of the locator, and Forney for
+        // the error values. The byte i stands for the power
+        // len - 1 - i of a.
+        uint16_t where[MaxErrors];
+        uint8_t values[MaxErrors];
+        uint8_t found = 0;
+
+        for(uint16_t i = 0;i < len;i++) {
+            uint16_t power = len - 1 - i;
+            uint16_t inv = 255 - power;
+
+            uint8_t sum = 0;
+
+            for(uint8_t k = 0;k <= errors;k++) {
+                if(locator[k]) {
+                    sum ^= Gf256::Exp(Gf256::Log(locator[k]) + inv * k);
+                }
+            }
+
+            if(sum) {
+                continue;
+            }
+
+            if(found == errors) {
+                return -1;
+            }
+
+            uint8_t num = 0;
+            uint8_t den = 0;
+
+            for(uint8_t k = 0;k < Parity;k++) {
+                if(evaluator[k]) {
+                    num ^= Gf256::Exp(Gf256::Log(evaluator[k]) + inv * k);
+                }
+            }
+
+            // the formal derivative keeps the odd terms
+            for(uint8_t k = 1;k <= errors;k += 2) {
+                if(locator[k]) {
+                    den ^= Gf256::Exp(Gf256::Log(locator[k]) + inv * (k - 1));
+                }
+            }
+
+            if(!den) {
+                return -1;
+            }
+
+            where[found] = i;
+            values[found] = Gf256::Mul(Gf256::Exp(power), Gf256::Div(num, den));
+            found++;
+        }
+
+        if(found != errors) {
+            return -1;
+        }
+
+        for(uint8_t k = 0;k < found;k++) {
+            code[where[k]] ^= values[k];
+        }
+
+        return static_cast<int8_t>(found);
+    }
+
+private:
+    //
+    // Types.
+    //
+    // The generator below its leading term, highest power first.
+    struct Generator {
+        uint8_t coef[Parity];
+        uint8_t log[Parity];
+    };
+
+    //
+    // Functions.
+    //
+    static constexpr Generator MakeGenerator() {
+        uint8_t poly[Parity + 1] = { 1 };
+
+        for(uint8_t root = 0;root < Parity;root++) {
+            uint8_t a = GfTable.exp[root];
+
+            for(uint8_t i = root + 1;i > 0;i--) {
+                poly[i] ^= Gf256::ConstMul(a, poly[i - 1]);
+            }
+        }
+
+        Generator gen {};
+
+        for(uint8_t j = 0;j < Parity;j++) {
+            gen.coef[j] = poly[j + 1];
+            gen.log[j] = GfTable.log[poly[j + 1]];
+        }
+
+        return gen;
+    }
+
+    // Returns true if all syndromes are zero.
+    static bool Syndromes(const uint8_t *code, uint16_t len, uint8_t *synd) {
+        uint8_t any = 0;
+
+        for(uint8_t j = 0;j < Parity;j++) {
+            uint8_t s = 0;
+
+            for(uint16_t i = 0;i < len;i++) {
+                s = code[i] ^ (s ? Gf256::Exp(Gf256::Log(s) + j) : 0);
+            }
+
+            synd[j] = s;
+            any |= s;
+        }
+
+        return !any;
+    }
+
+    //
+    // Data.
+    //
+    static constexpr Generator Gen = MakeGenerator();
+};
+
+template<uint8_t Parity = 4>
+class FecFraming {
+public:
+    static constexpr bool SizeFlags = true;
+
+    // sync, size, port and the two header parity bytes
+    static constexpr uint16_t HdrRoom = sizeof(DatagramHdr);
+    static constexpr uint16_t TrlRoom = sizeof(uint16_t) + Parity;
+
+    static constexpr uint16_t Overhead = HdrRoom + TrlRoom;
+
+    // A whole frame fits the 8-bit buffer length, which also
+    // keeps the body a single codeword.
+    static constexpr uint16_t MaxPayload = 0xff - Overhead;
+
+    static constexpr uint16_t FrameLen(Port, BufferLen len) {
+        return Overhead + len;
+    }
+
+    static void CreateFrame(Port port, Buffer &buf, uint8_t size_flags) {
+        auto payload = static_cast<uint8_t *>(buf.ptr);
+        auto frame = payload - HdrRoom;
+
+        frame[0] = Sync0;
+        frame[1] = Sync1;
+        frame[2] = buf.len | size_flags;
+        frame[3] = port;
+
+        HdrCode::Encode(frame + SyncLen, HdrCodeLen - HdrParity);
+
+        uint16_t crc = Crc16Usb::Calc(frame + SyncLen, HdrCodeLen + buf.len);
+        memcpy(payload + buf.len, &crc, sizeof(crc));
+
+        BodyCode::Encode(payload, buf.len + sizeof(crc));
+
+        buf.ptr = frame;
+        buf.len = static_cast<BufferLen>(Overhead + buf.len);
+    }
+
+    template<
+        uint16_t TotalBufLen,
+        uint8_t SizeMask>
+    class Parser;
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint8_t Sync0 = 0xe1;
+    static constexpr uint8_t Sync1 = 0x1e;
+
+    static constexpr uint8_t SyncLen = 2;
+    static constexpr uint8_t HdrParity = 2;
+    static constexpr uint8_t HdrCodeLen = 2 + HdrParity;
+
+    static_assert(HdrRoom == SyncLen + HdrCodeLen);
+
+    //
+    // Types.
+    //
+    using HdrCode = ReedSolomon<HdrParity>;
+    using BodyCode = ReedSolomon<Parity>;
+
+    //
+    // Functions.
+    //
+    // Allows one flipped bit.
+    static bool IsSync(uint8_t first, uint8_t second) {
+        uint16_t diff = static_cast<uint16_t>(((first ^ Sync0) << 8) | (second ^ Sync1));
+
+        return !(diff & (diff - 1));
+    }
+};
+
+template<uint8_t Parity>
+template<
+    uint16_t TotalBufLen,
+    uint8_t SizeMask>
+class FecFraming<Parity>::Parser {
+public:
+    Parser(RcvStats &stats, uint8_t *buf)
+            : stats(stats),
+            data(buf),
+            state(State::SearchStart),
+            next(0),
+            hdr_fixed(false),
+            frame_ready(false) {
+        // empty
+    }
+
+    uint16_t MaxBytesToRead() const {
+        if(state == State::SearchStart) {
+            return next < Overhead
+                ? Overhead - next
+                : 0;
+        }
+
+        return TotalMsgSize() - next;
+    }
+
+    uint8_t *WritePtr() {
+        return data + next;
+    }
+
+    void BytesAdded(uint16_t bytes) {
+        next += bytes;
+    }
+
+    bool Parse(RcvFrame &frame) {
+        if(state == State::SearchStart) {
+            ProcessSearchStart();
+        } else {
+            ProcessSearchEnd();
+        }
+
+        if(!frame_ready) {
+            return false;
+        }
+
+        frame.port = data[3];
+        frame.size_flags = data[2] & ~SizeMask;
+        frame.payload = Buffer {
+            reinterpret_cast<void *>(data + HdrRoom),
+            PayloadSize() };
+        frame.wire_len = TotalMsgSize();
+        frame.frame = Buffer {
+            reinterpret_cast<void *>(data),
+            static_cast<BufferLen>(TotalMsgSize()) };
+
+        return true;
+    }
+
+    void FrameDone() {
+        frame_ready = false;
+        state = State::SearchStart;
+
+        Drop(TotalMsgSize(), false);
+    }
+
+    // Hands over the buffer that holds the ready frame, in place of
+    // FrameDone(), and continues in the fresh buffer.
+    uint8_t *TakeFrame(uint8_t *fresh) {
+        auto total_msg_size = TotalMsgSize();
+        auto taken = data;
+
+        frame_ready = false;
+        state = State::SearchStart;
+
+        next -= total_msg_size;
+        memcpy(fresh, taken + total_msg_size, next);
+        data = fresh;
+
+        return taken;
+    }
+
+    bool HasPartialFrame() const {
+        return next != 0;
+    }
+
+    void DropPartialFrame() {
+        if(state == State::SearchEnd) {
+            Recover();
+            return;
+        }
+
+        Drop(next, true);
+    }
+
+    // A clean frame is delivered from the bytes of the caller. One
+    // that needs correcting is copied to the buffer and corrected
+    // there.
+    bool FindFrame(const uint8_t *bytes, uint16_t len, RcvFrame &frame, uint16_t &used) {
+        uint16_t curr = 0;
+
+        for(;curr + 1 < len;curr++) {
+            if(!IsSync(bytes[curr], bytes[curr + 1])) {
+                continue;
+            }
+
+            auto start = bytes + curr;
+            uint16_t left = len - curr;
+
+            if(left < HdrRoom) {
+                break;
+            }
+
+            uint8_t hdr[HdrCodeLen];
+            memcpy(hdr, start + SyncLen, HdrCodeLen);
+
+            auto fixed = HdrCode::Correct(hdr, HdrCodeLen);
+
+            if(fixed < 0) {
+                LogHdrUncorrectable();
+                stats.hdr_error++;
+                continue;
+            }
+
+            uint8_t payload_size = hdr[0] & SizeMask;
+            uint16_t total_msg_size = Overhead + payload_size;
+
+            if(payload_size > MaxPayload || total_msg_size > TotalBufLen) {
+                LogMsgTooLarge();
+                stats.size_error++;
+                continue;
+            }
+
+            if(left < total_msg_size) {
+                break;
+            }
+
+            auto frame_data = const_cast<uint8_t *>(start);
+            uint16_t body_len = total_msg_size - HdrRoom;
+            bool repair = fixed || start[0] != Sync0 || start[1] != Sync1;
+
+            if(repair || !BodyCode::Check(start + HdrRoom, body_len)) {
+                memcpy(data, start, total_msg_size);
+
+                data[0] = Sync0;
+                data[1] = Sync1;
+                memcpy(data + SyncLen, hdr, HdrCodeLen);
+
+                if(BodyCode::Correct(data + HdrRoom, body_len) < 0) {
+                    LogUncorrectable();
+                    stats.crc_error++;
+                    continue;
+                }
+
+                frame_data = data;
+            }
+
+            if(!CheckCrc(frame_data, payload_size)) {
+                LogCrcMismatch();
+                stats.crc_error++;
+                continue;
+            }
+
+            if(frame_data == data) {
+                stats.corrected++;
+            }
+
+            stats.dropped_bytes += curr;
+
+            frame.port = frame_data[3];
+            frame.size_flags = frame_data[2] & ~SizeMask;
+            frame.payload = Buffer {
+                reinterpret_cast<void *>(frame_data + HdrRoom),
+                payload_size };
+            frame.wire_len = total_msg_size;
+            frame.frame = Buffer {
+                reinterpret_cast<void *>(frame_data),
+                static_cast<BufferLen>(total_msg_size) };
+
+            used = curr + total_msg_size;
+
+            return true;
+        }
+
+        stats.dropped_bytes += curr;
+        used = curr;
+
+        return false;
+    }
+
+    void LogBuffer() {
+        char hex[3];
+
+        LogVerbose(LOGGER_PREFIX_RCV "Buf: ");
+
+        for(uint8_t i = 0;i < next;i++) {
+            sprintf(hex, "%02X", data[i]);
+            LogVerbose(hex);
+            LogVerbose(" ");
+        }
+
+        LogVerboseLn(" EOB");
+    }
+
+private:
+    //
+    // Types.
+    //
+    enum class State {
+        SearchStart,
+        SearchEnd
+    };
+
+    //
+    // Functions.
+    //
+    uint8_t PayloadSize() const {
+        return data[2] & SizeMask;
+    }
+
+    uint16_t TotalMsgSize() const {
+        return Overhead + PayloadSize();
+    }
+
+    static bool CheckCrc(const uint8_t *frame, uint8_t payload_size) {
+        uint16_t crc;
+        memcpy(&crc, frame + HdrRoom + payload_size, sizeof(crc));
+
+        return Crc16Usb::Calc(frame + SyncLen, HdrCodeLen + payload_size) == crc;
+    }
+
+    void ProcessSearchStart() {
+        while(next) {
+            uint16_t curr = 0;
+
+            while(curr + 1 < next && !IsSync(data[curr], data[curr + 1])) {
+                curr++;
+            }
+
+            Drop(curr, true);
+
+            if(next < HdrRoom) {
+                LogIncompleteHdr();
+                return;
+            }
+
+            auto fixed = HdrCode::Correct(data + SyncLen, HdrCodeLen);
+
+            if(fixed < 0) {
+                LogHdrUncorrectable();
+                stats.hdr_error++;
+                Drop(1, true);
+                continue;
+            }
+
+            if(PayloadSize() > MaxPayload || TotalMsgSize() > TotalBufLen) {
+                LogMsgTooLarge();
+                stats.size_error++;
+                Drop(1, true);
+                continue;
+            }
+
+            hdr_fixed = fixed || data[0] != Sync0 || data[1] != Sync1;
+
+            state = State::SearchEnd;
+            ProcessSearchEnd();
+
+            return;
+        }
+    }
+
+    void ProcessSearchEnd() {
+        if(next < TotalMsgSize()) {
+            return;
+        }
+
+        auto fixed = BodyCode::Correct(data + HdrRoom, TotalMsgSize() - HdrRoom);
+
+        if(fixed < 0) {
+            LogUncorrectable();
+            stats.crc_error++;
+            Recover();
+            return;
+        }
+
+        if(!CheckCrc(data, PayloadSize())) {
+            LogCrcMismatch();
+            stats.crc_error++;
+            Recover();
+            return;
+        }
+
+        if(fixed || hdr_fixed) {
+            stats.corrected++;
+        }
+
+        frame_ready = true;
+    }
+
+    void Recover() {
+        state = State::SearchStart;
+
+        Drop(1, true);
+        ProcessSearchStart();
+    }
+
+    void Drop(uint16_t bytes, bool count) {
+        if(!bytes) {
+            return;
+        }
+
+        if(count) {
+            stats.dropped_bytes += bytes;
+        }
+
+        memmove(
+            reinterpret_cast<void *>(data),
+            reinterpret_cast<void *>(data + bytes),
+            next - bytes);
+        next -= bytes;
+    }
+
+    // logging
+    static void LogIncompleteHdr() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "not enough bytes for header");
+    }
+
+    static void LogHdrUncorrectable() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "header beyond correction");
+    }
+
+    static void LogUncorrectable() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "frame beyond correction");
+    }
+
+    static void LogCrcMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "CRC mismatch");
+    }
+
+    static void LogMsgTooLarge() {
+        LogVerbose(LOGGER_PREFIX_RCV "message too large ");
+        LogVerboseLn(TotalBufLen);
+    }
+
+    //
+    // Data.
+    //
+    RcvStats &stats;
+
+    // TotalBufLen bytes
+    uint8_t *data;
+
+    State state;
+
+    uint16_t next;
+
+    // the sync word or header of the frame was corrected
+    bool hdr_fixed;
+
+    bool frame_ready;
+};
+
+}
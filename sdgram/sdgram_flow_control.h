@@ -0,0 +1,212 @@
+//
+// Credit based flow control.
+//
+// The receiving end advertises how many bytes it has consumed
+// from its stream so far and the size of its receive window.
+// The sending end writes data only while the bytes it has in
+// flight fit into the window. Both counters wrap at 16 bits and
+// adverts carry absolute values, so a lost advert is repaired
+// by the next one.
+//
+// Control datagrams are not subject to the window, but they are
+// counted as sent and consumed. The window should leave room for
+// a couple of control datagrams in the receive buffer.
+//
+// A data frame is started only when the credits cover all of it,
+// or the whole window for a frame that is larger. Control frames
+// go out between data frames, so a frame left half written for
+// lack of credits would hold back the adverts of its own end, and
+// with both ends sending, neither would get credits again. A
+// sender that waits for credits with too few bytes in flight for
+// the peer to advertise probes the peer at once.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+
+namespace SerialDatagram {
+
+// Flow control that never limits the sender.
+class NoFlowControl {
+public:
+    static constexpr bool Enabled = false;
+
+    uint16_t TxAllowance(uint16_t available) const {
+        return available;
+    }
+
+    bool CanStart(uint16_t) const {
+        return true;
+    }
+
+    void Sent(uint16_t) {
+        // empty
+    }
+
+    void Consumed(uint16_t) {
+        // empty
+    }
+};
+
+template<
+    uint16_t RcvWindow,
+    uint16_t ProbeInterval = 256>
+class CreditFlowControl {
+public:
+    static constexpr bool Enabled = true;
+
+    static_assert(RcvWindow > 0 && RcvWindow < 0x8000);
+
+    CreditFlowControl()
+            : tx_sent(0),
+            tx_consumed(0),
+            tx_window(RcvWindow),
+            probe_countdown(ProbeInterval),
+            probed(false),
+            rx_consumed(0),
+            rx_advertised(0),
+            rx_ctrl(0),
+            advert_needed(true),
+            restarted(true) {
+        // empty
+    }
+
+    //
+    // Sending side.
+    //
+    uint16_t TxCredits() const {
+        uint16_t in_flight = tx_sent - tx_consumed;
+
+        return in_flight < tx_window
+            ? tx_window - in_flight
+            : 0;
+    }
+
+    uint16_t TxAllowance(uint16_t available) const {
+        auto credits = TxCredits();
+
+        return available < credits
+            ? available
+            : credits;
+    }
+
+    // True if a frame of len bytes may be started.
+    bool CanStart(uint16_t len) const {
+        return TxCredits() >= (len < tx_window ? len : tx_window);
+    }
+
+    void Sent(uint16_t bytes) {
+        tx_sent += bytes;
+    }
+
+    void AdvertReceived(const CtrlCreditAdvert &advert) {
+        uint16_t in_flight = tx_sent - advert.consumed;
+
+        // Either end restarted if the peer consumed more than
+        // we sent, or if far more than a window is in flight.
+        if(static_cast<CtrlType>(advert.hdr.type) == CtrlType::CreditReset
+                || in_flight > advert.window + MaxCtrlInFlight) {
+            tx_sent = advert.consumed;
+        }
+
+        tx_consumed = advert.consumed;
+        tx_window = advert.window;
+    }
+
+    // Invoked on each processing round. Returns true if the
+    // sender should ask the peer to repeat its advert. The peer
+    // advertises after it consumed half of the window, so while
+    // fewer bytes are in flight and the next frame waits for
+    // credits, it asks at once. Otherwise it asks when it has
+    // waited for long enough, in case an advert got lost.
+    bool NeedProbe(bool blocked) {
+        if(!blocked) {
+            probe_countdown = ProbeInterval;
+            probed = false;
+            return false;
+        }
+
+        if(!probed && static_cast<uint16_t>(tx_sent - tx_consumed) < tx_window / 2) {
+            probed = true;
+            return true;
+        }
+
+        if(--probe_countdown) {
+            return false;
+        }
+
+        probe_countdown = ProbeInterval;
+
+        return true;
+    }
+
+    //
+    // Receiving side.
+    //
+    void Consumed(uint16_t bytes) {
+        rx_consumed += bytes;
+    }
+
+    // Control datagrams do not trigger adverts on their own,
+    // otherwise the two ends could keep advertising forever.
+    void ControlReceived(uint16_t bytes) {
+        rx_ctrl += bytes;
+    }
+
+    void ProbeReceived() {
+        advert_needed = true;
+    }
+
+    // Adverts are coalesced: one is sent after half of the
+    // window has been consumed.
+    bool NeedAdvert() const {
+        uint16_t pending = rx_consumed - rx_advertised - rx_ctrl;
+
+        return advert_needed || pending >= RcvWindow / 2;
+    }
+
+    CtrlCreditAdvert CreateAdvert() const {
+        auto type = restarted
+            ? CtrlType::CreditReset
+            : CtrlType::CreditAdvert;
+
+        return CtrlCreditAdvert {
+            CtrlHdr { static_cast<uint8_t>(type) },
+            rx_consumed,
+            RcvWindow };
+    }
+
+    void AdvertSent(const CtrlCreditAdvert &advert) {
+        rx_advertised = advert.consumed;
+        rx_ctrl = 0;
+        advert_needed = false;
+        restarted = false;
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t MaxCtrlInFlight = 64;
+
+    //
+    // Data.
+    //
+    uint16_t tx_sent;
+    uint16_t tx_consumed;
+    uint16_t tx_window;
+    uint16_t probe_countdown;
+    bool probed;
+
+    uint16_t rx_consumed;
+    uint16_t rx_advertised;
+    uint16_t rx_ctrl;
+    bool advert_needed;
+    bool restarted;
+};
+
+}
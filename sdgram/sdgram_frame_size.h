@@ -0,0 +1,292 @@
+//
+// Adapting the frame size to the link.
+//
+// A single bit error loses the whole frame, so on a noisy link
+// long frames lose more than they carry, while on a clean link
+// short frames waste the bandwidth on headers. The receiving end
+// counts the frames that arrive intact and the frames lost to
+// errors, and every Interval frames lets a policy choose the
+// payload size that brings the most goodput. It tells the peer
+// the size with a control datagram, which it repeats every few
+// intervals in case one is lost.
+//
+// The size is advice to the sending end: Send() still takes
+// payloads up to MaxBufferLen, and FramePayload() of the network
+// tells how long they should be. Packer splits and merges
+// messages to match it.
+//
+// Both ends need adaptive frame sizes to use them, though an end
+// without them ignores the adverts.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <math.h>
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_rcv_stats.h"
+
+namespace SerialDatagram {
+
+// Frames always carry up to MaxBufferLen.
+class FixedFrameSize {
+public:
+    static constexpr bool Enabled = false;
+};
+
+// Halves the size when more than HighLossPct percent of the frames
+// are lost, and grows it by Step after Patience intervals with less
+// than LowLossPct percent lost. Cheap enough for small boards. The
+// sizes with the best goodput lose a fair share of their frames,
+// a quarter of them or more on a noisy link, so the thresholds
+// are high.
+template<
+    BufferLen MinLen = 8,
+    uint8_t HighLossPct = 40,
+    uint8_t LowLossPct = 15,
+    BufferLen Step = 8,
+    uint8_t Patience = 4>
+class StepFramePolicy {
+public:
+    static_assert(LowLossPct < HighLossPct);
+
+    StepFramePolicy()
+            : clean(0) {
+        // empty
+    }
+
+    BufferLen Choose(
+            BufferLen len,
+            BufferLen max_len,
+            uint8_t,
+            uint16_t good,
+            uint16_t bad) {
+        uint32_t lost = 100ul * bad;
+        uint32_t total = static_cast<uint32_t>(good) + bad;
+
+        if(lost > HighLossPct * total) {
+            clean = 0;
+
+            return len / 2 > MinLen ? len / 2 : MinLen;
+        }
+
+        if(lost >= LowLossPct * total) {
+            clean = 0;
+            return len;
+        }
+
+        if(++clean < Patience) {
+            return len;
+        }
+
+        clean = 0;
+
+        return max_len - len > Step ? len + Step : max_len;
+    }
+
+private:
+    //
+    // Data.
+    //
+    uint8_t clean;
+};
+
+// Estimates the bit error rate from the frames lost at the current
+// size, and picks the size with the best expected goodput, which is
+// the payload share of the frame times the chance that all its bits
+// arrive. The estimate is averaged over intervals, and the size
+// only changes when the new one promises GainPct percent more
+// goodput, so that noise in the counts does not make it swing.
+template<
+    BufferLen MinLen = 8,
+    uint8_t GainPct = 10>
+class GoodputFramePolicy {
+public:
+    GoodputFramePolicy()
+            : ber(0) {
+        // empty
+    }
+
+    BufferLen Choose(
+            BufferLen len,
+            BufferLen max_len,
+            uint8_t overhead,
+            uint16_t good,
+            uint16_t bad) {
+        float bits = 8.0f * (len + overhead);
+        float lost = static_cast<float>(bad) / (static_cast<float>(good) + bad);
+
+        // a frame that survives has survived all its bits
+        float sample = lost < 1
+            ? 1 - powf(1 - lost, 1 / bits)
+            : 1;
+
+        // the first errors count in full
+        ber = ber > 0
+            ? ber + (sample - ber) / 4
+            : sample;
+
+        BufferLen best = max_len;
+
+        // With frames of n bytes, the goodput (n - o) / n * e^(-a * n),
+        // where a = -8 * ln(1 - ber), peaks at the n that solves
+        // a * n * (n - o) = o.
+        if(ber > 0) {
+            float a = -8 * log1pf(-ber);
+            float o = overhead;
+            float peak = (sqrtf(o * o + 4 * o / a) - o) / 2;
+
+            if(peak < max_len) {
+                best = peak > MinLen ? static_cast<BufferLen>(peak) : MinLen;
+            }
+        }
+
+        if(Goodput(best, overhead) * 100 >= Goodput(len, overhead) * (100 + GainPct)) {
+            return best;
+        }
+
+        return len;
+    }
+
+private:
+    //
+    // Functions.
+    //
+    float Goodput(BufferLen len, uint8_t overhead) const {
+        float frame = static_cast<float>(len + overhead);
+
+        return len / frame * expf(8 * frame * log1pf(-ber));
+    }
+
+    //
+    // Data.
+    //
+    float ber;
+};
+
+template<
+    typename Policy = GoodputFramePolicy<>,
+    uint16_t Interval = 64,
+    uint8_t RepeatIntervals = 8>
+class AdaptiveFrameSize {
+public:
+    static constexpr bool Enabled = true;
+
+    static_assert(Interval > 0 && RepeatIntervals > 0);
+
+    AdaptiveFrameSize()
+            : policy(),
+            rx_len(0),
+            tx_len(0),
+            seen_good(0),
+            seen_bad(0),
+            good(0),
+            bad(0),
+            intervals(0),
+            advert_needed(false) {
+        // empty
+    }
+
+    //
+    // Receiving side.
+    //
+    // Invoked on each processing round with the receiver stats. The
+    // overhead is the framing bytes of a frame.
+    void Sample(
+            const RcvStats &stats,
+            BufferLen max_len,
+            uint8_t overhead) {
+        uint16_t now_good = stats.msgs + stats.rcv_error + stats.decode_error;
+        uint16_t now_bad = stats.crc_error
+            + stats.hdr_error
+            + stats.trl_error
+            + stats.size_error
+            + stats.frame_timeout;
+
+        good += static_cast<uint16_t>(now_good - seen_good);
+        bad += static_cast<uint16_t>(now_bad - seen_bad);
+        seen_good = now_good;
+        seen_bad = now_bad;
+
+        if(static_cast<uint32_t>(good) + bad < Interval) {
+            return;
+        }
+
+        if(!rx_len) {
+            rx_len = max_len;
+        }
+
+        auto len = policy.Choose(rx_len, max_len, overhead, good, bad);
+
+        good = 0;
+        bad = 0;
+
+        if(len != rx_len || ++intervals >= RepeatIntervals) {
+            rx_len = len;
+            advert_needed = true;
+        }
+    }
+
+    // The receiver stats were cleared.
+    void StatsCleared() {
+        seen_good = 0;
+        seen_bad = 0;
+    }
+
+    bool NeedAdvert() const {
+        return advert_needed;
+    }
+
+    CtrlFrameSize CreateAdvert() const {
+        return CtrlFrameSize {
+            CtrlHdr { static_cast<uint8_t>(CtrlType::FrameSize) },
+            rx_len };
+    }
+
+    void AdvertSent() {
+        advert_needed = false;
+        intervals = 0;
+    }
+
+    // The payload size asked of the peer, zero until the first
+    // interval.
+    BufferLen RxLen() const {
+        return rx_len;
+    }
+
+    //
+    // Sending side.
+    //
+    void AdvertReceived(const CtrlFrameSize &advert) {
+        tx_len = advert.len;
+    }
+
+    BufferLen TxLen(BufferLen max_len) const {
+        return tx_len && tx_len < max_len ? tx_len : max_len;
+    }
+
+private:
+    //
+    // Data.
+    //
+    Policy policy;
+
+    BufferLen rx_len;
+    BufferLen tx_len;
+
+    // counters of the stats at the last sample
+    uint16_t seen_good;
+    uint16_t seen_bad;
+
+    // frames in the current interval
+    uint16_t good;
+    uint16_t bad;
+
+    uint8_t intervals;
+    bool advert_needed;
+};
+
+}
@@ -0,0 +1,660 @@
+//
+// Framing of datagrams on the stream.
+//
+// A framing policy turns a payload into a frame on the sending
+// side and finds frames in the received bytes on the receiving
+// side. The default framing delimits datagrams with magic header
+// and trailer words and is the format pysdgram understands.
+//
+// The magic framing can add a CRC-8 of the header after it. The
+// receiver then rejects a corrupted size as soon as the header
+// arrives, instead of waiting for bytes of the following frames
+// and failing the frame CRC. pysdgram does not support it.
+//
+// The Integrity policy computes the check value of the frame, over
+// the whole frame with the check bytes as zero. The first two bytes
+// of the value take the CRC field of the header, and the rest
+// follows the payload, before the trailer. With NoIntegrity the
+// field stays zero. pysdgram only understands Crc16Integrity. See
+// sdgram_integrity.h.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <crc16.h>
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_rcv_stats.h"
+#include "sdgram_crc.h"
+#include "sdgram_integrity.h"
+#include "sdgram_log.h"
+
+#define LOGGER_PREFIX_RCV "[SDGRAM-RCV] "
+
+namespace SerialDatagram {
+
+// A validated frame, as found by a parser.
+struct RcvFrame {
+    Port port;
+    uint8_t size_flags;
+    Buffer payload;
+
+    // bytes the frame took on the stream
+    uint16_t wire_len;
+
+    // The frame as it was received. The pointer is null if the
+    // parser had to change the bytes to find the payload.
+    Buffer frame;
+};
+
+// The parsers share this interface:
+//
+//   // Bytes that can be appended to the buffer now. Zero
+//   // means that the buffered bytes need to be parsed first.
+//   uint16_t MaxBytesToRead() const;
+//   uint8_t *WritePtr();
+//   void BytesAdded(uint16_t bytes);
+//
+//   // Returns true if a valid frame is ready. The frame stays
+//   // valid until FrameDone() is invoked.
+//   bool Parse(RcvFrame &frame);
+//   void FrameDone();
+//
+//   // Ends the ready frame like FrameDone(), but leaves it in its
+//   // buffer, which the caller takes over. The parser moves the
+//   // bytes that follow the frame to the fresh buffer and goes on
+//   // in it.
+//   uint8_t *TakeFrame(uint8_t *fresh);
+//
+//   // Bytes are buffered that do not form a frame yet. Dropping
+//   // gives up on the frame they start, for example after a
+//   // timeout, and looks for the next frame among the rest.
+//   bool HasPartialFrame() const;
+//   void DropPartialFrame();
+//
+//   // Looks for a frame in bytes the caller holds, while no bytes
+//   // are buffered. Sets used to the bytes before the frame and
+//   // the frame itself, or, without a frame, to the bytes that
+//   // cannot start one. The frame may point into the bytes of the
+//   // caller and stays valid as long as they do.
+//   bool FindFrame(const uint8_t *bytes, uint16_t len, RcvFrame &frame, uint16_t &used);
+//
+// Framings with SizeFlags set keep the size flags on the stream.
+// SizeMask selects the bits of the size field that hold the
+// payload size. The remaining bits are reported as size flags.
+
+template<
+    bool HdrCheck = false,
+    typename Integrity = Crc16Integrity>
+class MagicFraming {
+public:
+    // The size field has spare bits for size flags.
+    static constexpr bool SizeFlags = true;
+
+    static_assert(Integrity::Len == 0 || Integrity::Len == 2 || Integrity::Len == 4);
+
+    // check bytes that do not fit the header CRC field
+    static constexpr uint16_t ExtraCheckLen =
+        Integrity::Len > sizeof(uint16_t)
+            ? Integrity::Len - sizeof(uint16_t)
+            : 0;
+
+    // Room the sender reserves around the payload.
+    static constexpr uint16_t HdrRoom =
+        sizeof(DatagramHdr) + (HdrCheck ? 1 : 0);
+    static constexpr uint16_t TrlRoom = ExtraCheckLen + sizeof(DatagramTrl);
+
+    static constexpr uint16_t Overhead = HdrRoom + TrlRoom;
+
+    // A whole frame fits the 8-bit buffer length.
+    static constexpr uint16_t MaxPayload = 0xff - Overhead;
+
+    // Bytes a frame takes on the stream.
+    static constexpr uint16_t FrameLen(Port, BufferLen len) {
+        return Overhead + len;
+    }
+
+    // Adds the header and the trailer to the payload.
+    static void CreateFrame(Port port, Buffer &buf, uint8_t size_flags) {
+        auto buf_ptr = static_cast<uint8_t *>(buf.ptr);
+        auto len = static_cast<BufferLen>(buf.len + Overhead);
+
+        auto hdr = reinterpret_cast<DatagramHdr *>(buf_ptr - HdrRoom);
+
+        hdr->magic = DatagramHdrMagic;
+        hdr->port = port;
+        hdr->crc = 0;
+        hdr->size = buf.len | size_flags;
+
+        if(HdrCheck) {
+            buf_ptr[-1] = CalcHdrCheck(hdr);
+        }
+
+        memset(buf_ptr + buf.len, 0, ExtraCheckLen);
+
+        auto trl = reinterpret_cast<DatagramTrl *>(
+            buf_ptr + buf.len + ExtraCheckLen);
+        trl->magic = DatagramTrlMagic;
+
+        if(Integrity::Len) {
+            WriteCheck(
+                reinterpret_cast<uint8_t *>(hdr),
+                buf.len,
+                Integrity::Calc(hdr, len));
+        }
+
+        buf.ptr = hdr;
+        buf.len = len;
+    }
+
+    template<
+        uint16_t TotalBufLen,
+        uint8_t SizeMask>
+    class Parser;
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t CrcOffset = sizeof(DatagramHdr) - sizeof(uint16_t);
+
+    static constexpr uint16_t HdrCheckLen =
+        Integrity::Len < sizeof(uint16_t)
+            ? Integrity::Len
+            : sizeof(uint16_t);
+
+    //
+    // Types.
+    //
+    using CheckValue = typename Integrity::Value;
+
+    //
+    // Functions.
+    //
+    // Covers the magic, size and port, which are known
+    // before the frame CRC is.
+    static uint8_t CalcHdrCheck(const DatagramHdr *hdr) {
+        return Crc8::Calc(hdr, sizeof(DatagramHdr) - sizeof(hdr->crc));
+    }
+
+    static CheckValue ReadCheck(const uint8_t *frame, uint16_t payload_len) {
+        CheckValue value = 0;
+        auto bytes = reinterpret_cast<uint8_t *>(&value);
+
+        memcpy(bytes, frame + CrcOffset, HdrCheckLen);
+        memcpy(bytes + HdrCheckLen, frame + HdrRoom + payload_len, ExtraCheckLen);
+
+        return value;
+    }
+
+    static void WriteCheck(uint8_t *frame, uint16_t payload_len, CheckValue value) {
+        auto bytes = reinterpret_cast<const uint8_t *>(&value);
+
+        memcpy(frame + CrcOffset, bytes, HdrCheckLen);
+        memcpy(frame + HdrRoom + payload_len, bytes + HdrCheckLen, ExtraCheckLen);
+    }
+};
+
+template<
+    bool HdrCheck,
+    typename Integrity>
+template<
+    uint16_t TotalBufLen,
+    uint8_t SizeMask>
+class MagicFraming<HdrCheck, Integrity>::Parser {
+public:
+    Parser(RcvStats &stats, uint8_t *buf)
+            : stats(stats),
+            data(buf),
+            state(State::SearchStart),
+            next(0),
+            frame_ready(false) {
+        // empty
+    }
+
+    uint16_t MaxBytesToRead() const {
+        if(state == State::SearchStart) {
+            return next < MinMsgSize
+                ? MinMsgSize - next :
+                0;
+        }
+
+        if(next < HdrRoom) {
+            return MinMsgSize - next;
+        }
+
+        auto bytes_to_read = TotalMsgSize() - next;
+
+        auto ret = bytes_to_read + next <= TotalBufLen
+            ? bytes_to_read
+            : 0;
+
+        return ret;
+    }
+
+    uint8_t *WritePtr() {
+        return data + next;
+    }
+
+    void BytesAdded(uint16_t bytes) {
+        next += bytes;
+    }
+
+    bool Parse(RcvFrame &frame) {
+        if(state == State::SearchStart) {
+            ProcessSearchStart();
+        } else {
+            ProcessSearchEnd();
+        }
+
+        if(!frame_ready) {
+            return false;
+        }
+
+        frame.port = Hdr().port;
+        frame.size_flags = Hdr().size & ~SizeMask;
+        frame.payload = Buffer {
+            reinterpret_cast<void *>(data + HdrRoom),
+            PayloadSize() };
+        frame.wire_len = TotalMsgSize();
+        frame.frame = Buffer {
+            reinterpret_cast<void *>(data),
+            static_cast<BufferLen>(TotalMsgSize()) };
+
+        return true;
+    }
+
+    void FrameDone() {
+        frame_ready = false;
+
+        StartNextMsg(TotalMsgSize());
+    }
+
+    // Hands over the buffer that holds the ready frame, in place of
+    // FrameDone(), and continues in the fresh buffer.
+    uint8_t *TakeFrame(uint8_t *fresh) {
+        auto total_msg_size = TotalMsgSize();
+        auto taken = data;
+
+        frame_ready = false;
+        state = State::SearchStart;
+
+        next -= total_msg_size;
+        memcpy(fresh, taken + total_msg_size, next);
+        data = fresh;
+
+        return taken;
+    }
+
+    bool HasPartialFrame() const {
+        return next != 0;
+    }
+
+    void DropPartialFrame() {
+        if(state == State::SearchEnd) {
+            Recover();
+            return;
+        }
+
+        stats.dropped_bytes += next;
+        next = 0;
+    }
+
+    // Checks the frame the same way as Parse(), and skips the
+    // header magic after an error the same way as Recover().
+    bool FindFrame(const uint8_t *bytes, uint16_t len, RcvFrame &frame, uint16_t &used) {
+        uint16_t curr = 0;
+
+        while(curr + 1 < len) {
+            uint16_t magic;
+            memcpy(&magic, bytes + curr, sizeof(magic));
+
+            if(magic != DatagramHdrMagic) {
+                curr++;
+                continue;
+            }
+
+            if(len - curr < HdrRoom) {
+                break;
+            }
+
+            DatagramHdr hdr;
+            memcpy(&hdr, bytes + curr, sizeof(hdr));
+
+            if(HdrCheck && CalcHdrCheck(&hdr) != bytes[curr + HdrRoom - 1]) {
+                LogHdrCheckMismatch();
+                stats.hdr_error++;
+                curr += sizeof(magic);
+                continue;
+            }
+
+            uint16_t total_msg_size = (hdr.size & SizeMask) + Overhead;
+
+            if(total_msg_size > TotalBufLen) {
+                LogMsgTooLarge(total_msg_size);
+                stats.size_error++;
+                curr += sizeof(magic);
+                continue;
+            }
+
+            if(len - curr < total_msg_size) {
+                break;
+            }
+
+            auto frame_ptr = bytes + curr;
+            uint16_t trl_magic;
+            memcpy(&trl_magic, frame_ptr + total_msg_size - sizeof(DatagramTrl), sizeof(trl_magic));
+
+            if(trl_magic != DatagramTrlMagic) {
+                LogTrailerMismatch(trl_magic);
+                stats.trl_error++;
+                curr += sizeof(magic);
+                continue;
+            }
+
+            if(!CheckCrc(frame_ptr, total_msg_size)) {
+                LogCrcMismatch();
+                stats.crc_error++;
+                curr += sizeof(magic);
+                continue;
+            }
+
+            stats.dropped_bytes += curr;
+
+            // Receivers only read the frame.
+            auto frame_data = const_cast<uint8_t *>(frame_ptr);
+
+            frame.port = hdr.port;
+            frame.size_flags = hdr.size & ~SizeMask;
+            frame.payload = Buffer {
+                reinterpret_cast<void *>(frame_data + HdrRoom),
+                static_cast<BufferLen>(hdr.size & SizeMask) };
+            frame.wire_len = total_msg_size;
+            frame.frame = Buffer {
+                reinterpret_cast<void *>(frame_data),
+                static_cast<BufferLen>(total_msg_size) };
+
+            used = curr + total_msg_size;
+
+            return true;
+        }
+
+        stats.dropped_bytes += curr;
+        used = curr;
+
+        return false;
+    }
+
+    void LogBuffer() {
+        char hex[3];
+
+        LogVerbose(LOGGER_PREFIX_RCV "Buf: ");
+
+        for(uint8_t i = 0;i < next;i++) {
+            sprintf(hex, "%02X", data[i]);
+            LogVerbose(hex);
+            LogVerbose(" ");
+        }
+
+        LogVerboseLn(" EOB");
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t MinMsgSize = Overhead;
+
+    //
+    // Types.
+    //
+    enum class State {
+        SearchStart,
+        SearchEnd
+    };
+
+    //
+    // Functions.
+    //
+    DatagramHdr &Hdr() {
+        return *reinterpret_cast<DatagramHdr *>(data);
+    }
+
+    const DatagramHdr &Hdr() const {
+        return *reinterpret_cast<const DatagramHdr *>(data);
+    }
+
+    bool IsHdrReceived() const {
+        return next >= HdrRoom;
+    }
+
+    uint8_t PayloadSize() const {
+        return Hdr().size & SizeMask;
+    }
+
+    uint16_t TotalMsgSize() const {
+        return PayloadSize() + Overhead;
+    }
+
+    uint16_t TrlOffset() const {
+        return PayloadSize() + HdrRoom + ExtraCheckLen;
+    }
+
+    void ProcessSearchStart(uint16_t curr = 0) {
+        if(next < sizeof(DatagramHdrMagic)) {
+            LogIncompleteHdrMagic();
+            return;
+        }
+
+        while(curr < next - 1) {
+            uint16_t val = *reinterpret_cast<uint16_t *>(data + curr);
+
+            if(val == DatagramHdrMagic) {
+                LogFoundHdrMagic();
+
+                // We rarely need to copy data. This is only needed
+                // when we are recovering the lost sync.
+                if(curr) {
+                    LogBufMemmove();
+
+                    memmove(
+                        reinterpret_cast<void *>(data),
+                        reinterpret_cast<void *>(data + curr),
+                        next - curr);
+                    next -= curr;
+
+                    stats.dropped_bytes += curr;
+                }
+
+                state = State::SearchEnd;
+
+                if(IsHdrReceived()) {
+                    ProcessSearchEnd();
+                }
+
+                return;
+            }
+
+            ++curr;
+        }
+
+        // curr should be next - 1
+        if(curr != 0) {
+            data[0] = data[curr];
+            stats.dropped_bytes += curr;
+            next = sizeof(uint8_t);
+        }
+    }
+
+    const DatagramTrl &Trl() const {
+        return *reinterpret_cast<const DatagramTrl *>(
+            data + TrlOffset());
+    }
+
+    void ProcessSearchEnd() {
+        if(!IsHdrReceived()) {
+            return;
+        }
+
+        if(HdrCheck && CalcHdrCheck(&Hdr()) != data[HdrRoom - 1]) {
+            LogHdrCheckMismatch();
+            stats.hdr_error++;
+            Recover();
+            return;
+        }
+
+        auto total_msg_size = TotalMsgSize();
+
+        if(total_msg_size > TotalBufLen) {
+            LogMsgTooLarge(total_msg_size);
+            stats.size_error++;
+            Recover();
+            return;
+        }
+
+        if(next < total_msg_size) {
+            LogIncompleteMsg(total_msg_size);
+            return;
+        }
+
+        if(Trl().magic != DatagramTrlMagic) {
+            LogTrailerMismatch();
+            stats.trl_error++;
+
+            Recover();
+            return;
+        }
+
+        if(!CheckCrc()) {
+            LogCrcMismatch();
+            stats.crc_error++;
+
+            Recover();
+            return;
+        }
+
+        frame_ready = true;
+    }
+
+    void Recover() {
+        state = State::SearchStart;
+        ProcessSearchStart(sizeof(uint16_t));
+    }
+
+    bool CheckCrc() {
+        if(!Integrity::Len) {
+            return true;
+        }
+
+        auto payload_len = PayloadSize();
+        auto rcv = ReadCheck(data, payload_len);
+
+        WriteCheck(data, payload_len, 0);
+        auto calc = Integrity::Calc(data, static_cast<size_t>(TotalMsgSize()));
+        WriteCheck(data, payload_len, rcv);
+
+        return calc == rcv;
+    }
+
+    // Computes the check value as if the check bytes were zero.
+    static bool CheckCrc(const uint8_t *frame_ptr, uint16_t total_msg_size) {
+        if(!Integrity::Len) {
+            return true;
+        }
+
+        const uint8_t zero[sizeof(uint32_t)] = { };
+        uint16_t payload_len = total_msg_size - Overhead;
+        uint16_t extra_offset = HdrRoom + payload_len;
+
+        auto crc = Integrity::Update(Integrity::Init, frame_ptr, CrcOffset);
+        crc = Integrity::Update(crc, zero, HdrCheckLen);
+        crc = Integrity::Update(
+            crc,
+            frame_ptr + sizeof(DatagramHdr),
+            extra_offset - sizeof(DatagramHdr));
+        crc = Integrity::Update(crc, zero, ExtraCheckLen);
+        crc = Integrity::Update(
+            crc,
+            frame_ptr + extra_offset + ExtraCheckLen,
+            sizeof(DatagramTrl));
+
+        return Integrity::Final(crc) == ReadCheck(frame_ptr, payload_len);
+    }
+
+    void StartNextMsg(uint16_t total_msg_size) {
+        state = State::SearchStart;
+
+        if(next != total_msg_size) {
+            memmove(
+                reinterpret_cast<void *>(data),
+                reinterpret_cast<void *>(data + total_msg_size),
+                next - total_msg_size);
+            next -= total_msg_size;
+        } else {
+            next = 0;
+        }
+    }
+
+    // logging
+    static void LogCrcMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "CRC mismatch");
+    }
+
+    static void LogHdrCheckMismatch() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "header check mismatch");
+    }
+
+    void LogTrailerMismatch() const {
+        LogTrailerMismatch(Trl().magic);
+    }
+
+    static void LogTrailerMismatch(uint16_t magic) {
+        LogVerbose(LOGGER_PREFIX_RCV "trailer mismatch ");
+        LogVerboseLn(magic);
+    }
+
+    static void LogMsgTooLarge(uint16_t total_msg_size) {
+        LogVerbose(LOGGER_PREFIX_RCV "message too large (could be because of dropped bytes) ");
+        LogVerbose(total_msg_size);
+        LogVerbose(" > ");
+        LogVerboseLn(TotalBufLen);
+    }
+
+    void LogIncompleteMsg(uint16_t total_msg_size) const {
+        LogVerbose(LOGGER_PREFIX_RCV "not enough bytes in the message ");
+        LogVerbose(total_msg_size);
+        LogVerbose(" > ");
+        LogVerboseLn(next);
+    }
+
+    static void LogBufMemmove() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "moving buffer data");
+    }
+
+    static void LogFoundHdrMagic() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "found header magic");
+    }
+
+    static void LogIncompleteHdrMagic() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "not enough bytes for header magic");
+    }
+
+    //
+    // Data.
+    //
+    RcvStats &stats;
+
+    // TotalBufLen bytes
+    uint8_t *data;
+
+    State state;
+
+    uint16_t next;
+
+    bool frame_ready;
+};
+
+}
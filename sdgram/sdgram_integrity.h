@@ -0,0 +1,271 @@
+//
+// Integrity checks of the magic framing.
+//
+// An integrity policy computes the check value that the magic
+// framing stores with each frame:
+//
+//   static constexpr uint8_t Len;     // bytes on the wire, 0, 2 or 4
+//   using Value = ...;                // holds Len bytes
+//   static Value Calc(const void *buf, size_t len);
+//
+//   // the same over several pieces
+//   static constexpr Value Init;
+//   static Value Update(Value value, const void *buf, size_t len);
+//   static Value Final(Value value);
+//
+// Crc16Integrity is the CRC-16/USB that pysdgram understands.
+// Crc32cIntegrity is stronger for long frames, and on hosts with
+// SSE4.2 or the ARMv8 CRC extension it is also cheaper per byte.
+// The instructions are looked for at run time, and without them a
+// table is used, or on boards a loop over the bits. NoIntegrity
+// checks nothing, for transports that cannot corrupt bytes, such
+// as memory shared within a machine.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <crc16.h>
+
+#include "sdgram_stdint.h"
+#include "sdgram_crc.h"
+
+#if !defined(ARDUINO)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define SDGRAM_CRC32C_X86
+#include <nmmintrin.h>
+#elif defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#define SDGRAM_CRC32C_X86
+#include <intrin.h>
+#include <nmmintrin.h>
+#elif defined(__GNUC__) && defined(__aarch64__)
+#define SDGRAM_CRC32C_ARM
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+#endif
+
+namespace SerialDatagram {
+
+class NoIntegrity {
+public:
+    static constexpr uint8_t Len = 0;
+
+    using Value = uint16_t;
+
+    static constexpr Value Init = 0;
+
+    static Value Calc(const void *, size_t) {
+        return 0;
+    }
+
+    static Value Update(Value, const void *, size_t) {
+        return 0;
+    }
+
+    static Value Final(Value) {
+        return 0;
+    }
+};
+
+class Crc16Integrity {
+public:
+    static constexpr uint8_t Len = sizeof(uint16_t);
+
+    using Value = uint16_t;
+
+    static constexpr Value Init = Crc16UsbParts::Init;
+
+    static Value Calc(const void *buf, size_t len) {
+        return Crc16Usb::Calc(buf, len);
+    }
+
+    static Value Update(Value crc, const void *buf, size_t len) {
+        return Crc16UsbParts::Update(crc, buf, len);
+    }
+
+    static Value Final(Value crc) {
+        return Crc16UsbParts::Final(crc);
+    }
+};
+
+//
+// Constants.
+//
+// the Castagnoli polynomial 0x1edc6f41 reflected
+constexpr uint32_t Crc32cPoly = 0x82f63b78;
+
+//
+// Types.
+//
+struct Crc32cTable {
+    uint32_t entries[256];
+};
+
+//
+// Functions.
+//
+constexpr Crc32cTable MakeCrc32cTable() {
+    Crc32cTable table {};
+
+    for(uint16_t i = 0;i < 256;i++) {
+        uint32_t crc = i;
+
+        for(uint8_t bit = 0;bit < 8;bit++) {
+            crc = (crc & 1)
+                ? (crc >> 1) ^ Crc32cPoly
+                : crc >> 1;
+        }
+
+        table.entries[i] = crc;
+    }
+
+    return table;
+}
+
+//
+// Data.
+//
+#if !defined(ARDUINO)
+inline constexpr Crc32cTable Crc32cLookup = MakeCrc32cTable();
+#endif
+
+class Crc32cIntegrity {
+public:
+    static constexpr uint8_t Len = sizeof(uint32_t);
+
+    using Value = uint32_t;
+
+    static constexpr Value Init = 0xffffffff;
+
+    static Value Calc(const void *buf, size_t len) {
+        return Final(Update(Init, buf, len));
+    }
+
+    static Value Update(Value crc, const void *buf, size_t len) {
+#if defined(SDGRAM_CRC32C_X86) || defined(SDGRAM_CRC32C_ARM)
+        static const UpdateFn update = Accelerated()
+            ? UpdateHardware
+            : UpdateSoftware;
+
+        return update(crc, buf, len);
+#else
+        return UpdateSoftware(crc, buf, len);
+#endif
+    }
+
+    static Value Final(Value crc) {
+        return ~crc;
+    }
+
+    // True if CPU instructions compute the CRC.
+    static bool Accelerated() {
+#if defined(SDGRAM_CRC32C_X86) && defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 1);
+
+        return info[2] & (1 << 20);
+#elif defined(SDGRAM_CRC32C_X86)
+        return __builtin_cpu_supports("sse4.2");
+#elif defined(SDGRAM_CRC32C_ARM) && defined(__APPLE__)
+        return true;
+#elif defined(SDGRAM_CRC32C_ARM) && defined(__linux__)
+        return getauxval(AT_HWCAP) & HWCAP_CRC32;
+#else
+        return false;
+#endif
+    }
+
+    static Value UpdateSoftware(Value crc, const void *buf, size_t len) {
+        auto data = static_cast<const uint8_t *>(buf);
+
+#if defined(ARDUINO)
+        for(size_t i = 0;i < len;i++) {
+            crc ^= data[i];
+
+            for(uint8_t bit = 0;bit < 8;bit++) {
+                crc = (crc & 1)
+                    ? (crc >> 1) ^ Crc32cPoly
+                    : crc >> 1;
+            }
+        }
+#else
+        for(size_t i = 0;i < len;i++) {
+            crc = Crc32cLookup.entries[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+        }
+#endif
+
+        return crc;
+    }
+
+private:
+    //
+    // Types.
+    //
+    using UpdateFn = Value (*)(Value, const void *, size_t);
+
+    //
+    // Functions.
+    //
+#if defined(SDGRAM_CRC32C_X86)
+#if defined(__GNUC__)
+    __attribute__((target("sse4.2")))
+#endif
+    static Value UpdateHardware(Value crc, const void *buf, size_t len) {
+        auto data = static_cast<const uint8_t *>(buf);
+
+#if defined(__x86_64__) || defined(_M_X64)
+        uint64_t wide = crc;
+
+        for(;len >= sizeof(uint64_t);len -= sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+
+            wide = _mm_crc32_u64(wide, word);
+            data += sizeof(word);
+        }
+
+        crc = static_cast<Value>(wide);
+#endif
+
+        for(;len >= sizeof(uint32_t);len -= sizeof(uint32_t)) {
+            uint32_t word;
+            memcpy(&word, data, sizeof(word));
+
+            crc = _mm_crc32_u32(crc, word);
+            data += sizeof(word);
+        }
+
+        while(len--) {
+            crc = _mm_crc32_u8(crc, *data++);
+        }
+
+        return crc;
+    }
+#elif defined(SDGRAM_CRC32C_ARM)
+    __attribute__((target("+crc")))
+    static Value UpdateHardware(Value crc, const void *buf, size_t len) {
+        auto data = static_cast<const uint8_t *>(buf);
+
+        for(;len >= sizeof(uint64_t);len -= sizeof(uint64_t)) {
+            uint64_t word;
+            memcpy(&word, data, sizeof(word));
+
+            crc = __crc32cd(crc, word);
+            data += sizeof(word);
+        }
+
+        while(len--) {
+            crc = __crc32cb(crc, *data++);
+        }
+
+        return crc;
+    }
+#endif
+};
+
+}
@@ -0,0 +1,436 @@
+//
+// Sharing one link between several clients.
+//
+// A Mux owns the network of the link and a network for each client,
+// which typically runs over a Unix domain socket or a ShmStream to
+// a local process. A client attaches to the ports it wants with a
+// message on MuxPort, which SendMuxAttach() sends:
+//
+//   type, first port, last port
+//
+// A frame received from the link is parsed once and copied as it is
+// into the send queue of every client attached to its port, so its
+// CRC is not computed again. A client that falls more than the
+// queue limit of bytes behind misses datagrams rather than holding
+// up the link or the other clients.
+//
+// The datagrams a client sends wait in a queue of its own, and the
+// link takes one datagram from each client in turn. A client whose
+// queue is full is not read until the link takes from it, so its
+// stream pushes back on it. The frames are copied to the link as
+// they are, like the other way.
+//
+// The link and the clients need the same configuration. Ports from
+// MuxPort up are not forwarded.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+#pragma pack(push, 1)
+struct MuxMsg {
+    uint8_t type;
+    Port first;
+    Port last;
+};
+#pragma pack(pop)
+
+// Messages of the clients to the mux.
+constexpr Port MuxPort = 0xfc;
+
+enum class MuxType : uint8_t {
+    Attach = 1,
+    Detach = 2,
+};
+
+struct MuxClientStats {
+    void Clear() {
+        sent = 0;
+        received = 0;
+        bytes_sent = 0;
+        bytes_received = 0;
+        send_dropped = 0;
+        rcv_dropped = 0;
+    }
+
+    // datagrams from the client to the link, and the other way
+    uint32_t sent;
+    uint32_t received;
+
+    uint32_t bytes_sent;
+    uint32_t bytes_received;
+
+    // sent with the queue full, or refused by the link
+    uint32_t send_dropped;
+
+    // received while the client was behind
+    uint32_t rcv_dropped;
+};
+
+// Asks the mux at the other end of the network for the datagrams
+// of the ports from first to last.
+template<typename Net>
+Status SendMuxAttach(
+        Net &net,
+        Port first,
+        Port last,
+        MuxType type = MuxType::Attach) {
+    auto buf = net.AllocBuffer();
+
+    if(!buf.ptr) {
+        return Status::NoMoreSpace;
+    }
+
+    MuxMsg msg { static_cast<uint8_t>(type), first, last };
+
+    memcpy(buf.ptr, &msg, sizeof(msg));
+    buf.len = sizeof(msg);
+
+    auto status = net.Send(MuxPort, buf);
+
+    if(status != Status::Success) {
+        net.FreeBuffer(buf);
+    }
+
+    return status;
+}
+
+template<typename Net>
+Status SendMuxDetach(Net &net, Port first, Port last) {
+    return SendMuxAttach(net, first, last, MuxType::Detach);
+}
+
+template<
+    typename LinkStream,
+    typename ClientStream,
+    typename Config = DefaultConfig,
+    uint8_t MaxClients = 8,
+    uint8_t QueueLen = 4>
+class Mux : public Rcv {
+public:
+    using LinkNet = Net<LinkStream, Config>;
+    using ClientNet = Net<ClientStream, Config>;
+
+    static constexpr uint16_t DefaultQueueLimit = 256;
+
+    static_assert(QueueLen > 0);
+
+    Mux(
+        LinkNet &link,
+        uint16_t queue_limit = DefaultQueueLimit)
+            : link(link),
+            queue_limit(queue_limit),
+            next_client(0) {
+        for(auto &client : clients) {
+            client.mux = this;
+        }
+    }
+
+    // Starts taking the frames of the link.
+    Status Start() {
+        return link.Subscribe(0, MuxPort - 1, *this);
+    }
+
+    // The client network must outlive its place in the mux, and
+    // must not be given to it again. Returns the client index in
+    // client_idx.
+    Status AddClient(
+            ClientNet &net,
+            uint8_t *client_idx = nullptr) {
+        for(uint8_t i = 0;i < MaxClients;i++) {
+            auto &client = clients[i];
+
+            if(client.net) {
+                continue;
+            }
+
+            auto status = net.Subscribe(0, DiagPort - 1, client);
+
+            if(status != Status::Success) {
+                return status;
+            }
+
+            client.net = &net;
+            client.head = 0;
+            client.queued = 0;
+            client.stats.Clear();
+
+            memset(client.ports, 0, sizeof(client.ports));
+
+            if(client_idx) {
+                *client_idx = i;
+            }
+
+            return Status::Success;
+        }
+
+        return Status::NoMoreSpace;
+    }
+
+    // Drops the client and what it still had to send.
+    void RemoveClient(uint8_t client_idx) {
+        clients[client_idx].net = nullptr;
+    }
+
+    // Attaches the client to the ports from first to last, as
+    // if it had asked for them.
+    void Attach(
+            uint8_t client_idx,
+            Port first,
+            Port last,
+            bool attach = true) {
+        auto &client = clients[client_idx];
+
+        if(last >= MuxPort) {
+            last = MuxPort - 1;
+        }
+
+        for(uint16_t port = first;port <= last;port++) {
+            uint8_t bit = 1 << (port & 7);
+
+            if(attach) {
+                client.ports[port >> 3] |= bit;
+            } else {
+                client.ports[port >> 3] &= ~bit;
+            }
+        }
+    }
+
+    // Returns true if any network read or wrote bytes, or the
+    // link took datagrams of the clients.
+    bool Process() {
+        bool worked = link.Process();
+
+        for(auto &client : clients) {
+            if(!client.net || client.queued == QueueLen) {
+                continue;
+            }
+
+            // receives no more frames than the queue holds
+            Budget budget { static_cast<uint16_t>(QueueLen - client.queued), 0, 0 };
+
+            if(client.net->Process(budget) && client.queued < QueueLen) {
+                worked = true;
+            }
+        }
+
+        return Forward() || worked;
+    }
+
+    uint8_t ClientCount() const {
+        uint8_t count = 0;
+
+        for(auto &client : clients) {
+            count += client.net ? 1 : 0;
+        }
+
+        return count;
+    }
+
+    const MuxClientStats &GetClientStats(uint8_t client_idx) const {
+        return clients[client_idx].stats;
+    }
+
+    void ClearClientStats() {
+        for(auto &client : clients) {
+            client.stats.Clear();
+        }
+    }
+
+    // A frame of the link.
+    void ProcessMsg(Buffer) override {
+        auto frame = link.CurrentFrame();
+
+        for(auto &client : clients) {
+            if(!client.net || !client.IsAttached(frame->port)) {
+                continue;
+            }
+
+            if(client.net->QueuedBytes() + frame->wire_len > queue_limit
+                    || client.net->SendFrame(frame->port, *frame) != Status::Success) {
+                LogClientBehind(frame->port);
+                client.stats.rcv_dropped++;
+                continue;
+            }
+
+            client.stats.received++;
+            client.stats.bytes_received += frame->payload.len;
+        }
+    }
+
+private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t MaxFrameLen =
+        Config::MaxBufferLen +
+        Config::Framing::HdrRoom +
+        Config::Framing::TrlRoom;
+
+    //
+    // Types.
+    //
+    // A frame a client sent, with the bytes it points to.
+    struct Queued {
+        RcvFrame frame;
+        uint8_t bytes[MaxFrameLen];
+    };
+
+    class Client : public Rcv {
+    public:
+        Client()
+                : mux(nullptr),
+                net(nullptr),
+                head(0),
+                queued(0),
+                stats() {
+            memset(ports, 0, sizeof(ports));
+        }
+
+        bool IsAttached(Port port) const {
+            return ports[port >> 3] & (1 << (port & 7));
+        }
+
+        void ProcessMsg(Buffer buf) override {
+            mux->ProcessClientMsg(*this, buf);
+        }
+
+        Mux *mux;
+        ClientNet *net;
+
+        uint8_t ports[0x100 / 8];
+
+        Queued queue[QueueLen];
+        uint8_t head;
+        uint8_t queued;
+
+        MuxClientStats stats;
+    };
+
+    //
+    // Functions.
+    //
+    void ProcessClientMsg(Client &client, Buffer buf) {
+        auto frame = client.net->CurrentFrame();
+
+        if(frame->port == MuxPort) {
+            ProcessMuxMsg(client, buf);
+            return;
+        }
+
+        if(client.queued == QueueLen) {
+            client.stats.send_dropped++;
+            return;
+        }
+
+        auto &entry = client.queue[(client.head + client.queued) % QueueLen];
+        auto frame_bytes = static_cast<const uint8_t *>(frame->frame.ptr);
+        auto payload = static_cast<const uint8_t *>(frame->payload.ptr);
+
+        entry.frame = *frame;
+
+        // the frame as it is when it holds the payload, or else
+        // the payload to frame again
+        if(frame_bytes && frame->frame.len <= MaxFrameLen
+                && payload >= frame_bytes
+                && payload + frame->payload.len <= frame_bytes + frame->frame.len) {
+            memcpy(entry.bytes, frame_bytes, frame->frame.len);
+
+            entry.frame.frame.ptr = entry.bytes;
+            entry.frame.payload.ptr = entry.bytes + (payload - frame_bytes);
+        } else {
+            memcpy(entry.bytes, payload, frame->payload.len);
+
+            entry.frame.frame = Buffer { nullptr, 0 };
+            entry.frame.payload.ptr = entry.bytes;
+        }
+
+        client.queued++;
+    }
+
+    void ProcessMuxMsg(Client &client, Buffer buf) {
+        if(buf.len < sizeof(MuxMsg)) {
+            return;
+        }
+
+        MuxMsg msg;
+        memcpy(&msg, buf.ptr, sizeof(msg));
+
+        if(msg.type == static_cast<uint8_t>(MuxType::Attach)
+                || msg.type == static_cast<uint8_t>(MuxType::Detach)) {
+            Attach(
+                static_cast<uint8_t>(&client - clients),
+                msg.first,
+                msg.last,
+                msg.type == static_cast<uint8_t>(MuxType::Attach));
+        }
+    }
+
+    // Gives the link one datagram of each client in turn, for as
+    // long as it takes them. Returns true if it took any.
+    bool Forward() {
+        bool forwarded = false;
+        bool more = true;
+
+        while(more) {
+            more = false;
+
+            for(uint8_t turn = 0;turn < MaxClients;turn++) {
+                auto &client = clients[next_client];
+
+                if(!client.net || !client.queued) {
+                    next_client = (next_client + 1) % MaxClients;
+                    continue;
+                }
+
+                auto &entry = client.queue[client.head];
+                auto status = link.SendFrame(entry.frame.port, entry.frame);
+
+                // the client goes first next time
+                if(status == Status::NoMoreSpace) {
+                    return forwarded;
+                }
+
+                if(status == Status::Success) {
+                    client.stats.sent++;
+                    client.stats.bytes_sent += entry.frame.payload.len;
+                } else {
+                    client.stats.send_dropped++;
+                }
+
+                client.head = (client.head + 1) % QueueLen;
+                client.queued--;
+
+                next_client = (next_client + 1) % MaxClients;
+                forwarded = true;
+                more = true;
+            }
+        }
+
+        return forwarded;
+    }
+
+    // logging
+#define LOGGER_PREFIX_MUX "[SDGRAM-MUX] "
+
+    static void LogClientBehind(Port port) {
+        LogVerbose(LOGGER_PREFIX_MUX "client behind on port ");
+        LogVerboseLn(port);
+    }
+
+    //
+    // Data.
+    //
+    LinkNet &link;
+    uint16_t queue_limit;
+
+    Client clients[MaxClients];
+    uint8_t next_client;
+};
+
+}
@@ -0,0 +1,350 @@
+//
+// Packing messages into frames of the size the link wants.
+//
+// Messages sent through a Packer go out on one port of the network
+// as a stream of records, cut into payloads of FramePayload()
+// bytes, so that they follow the frame size the peer asks for:
+//
+//   payload: seq, first, bytes of the records
+//   record:  port, len, message
+//
+// Messages sent between two Flush() calls share frames, and a long
+// message spans several. The sequence number tells the receiving
+// end that frames were lost, and first is the offset of the first
+// record that starts in the payload, 0xff if none does. After a
+// loss the message being assembled is dropped, and receiving picks
+// up again at the next record.
+//
+// A received message that lies within one frame is delivered
+// straight from it. Others are assembled in a buffer of the packer.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+#pragma pack(push, 1)
+struct PackHdr {
+    uint8_t seq;
+    uint8_t first;
+};
+
+struct PackRecordHdr {
+    uint8_t port;
+    uint8_t len;
+};
+#pragma pack(pop)
+
+constexpr uint8_t PackNoRecord = 0xff;
+
+struct PackStats {
+    void Clear() {
+        sent = 0;
+        frames_sent = 0;
+        received = 0;
+        frames_received = 0;
+        lost_frames = 0;
+        dropped = 0;
+        no_receiver = 0;
+        malformed = 0;
+    }
+
+    uint16_t sent;
+    uint16_t frames_sent;
+    uint16_t received;
+    uint16_t frames_received;
+
+    // frames missing from the sequence
+    uint16_t lost_frames;
+
+    // messages cut short by a lost frame
+    uint16_t dropped;
+
+    uint16_t no_receiver;
+    uint16_t malformed;
+};
+
+template<
+    typename Net,
+    uint16_t StagingLen = 0xff + sizeof(PackRecordHdr),
+    uint8_t MaxReceivers = 4>
+class Packer : public Rcv {
+public:
+    static constexpr uint16_t MaxMsgLen =
+        StagingLen - sizeof(PackRecordHdr) < 0xff
+            ? StagingLen - sizeof(PackRecordHdr)
+            : 0xff;
+
+    static_assert(Net::MaxBufferLen > sizeof(PackHdr));
+    static_assert(StagingLen > sizeof(PackRecordHdr));
+
+    Packer(
+        Net &net,
+        Port port)
+            : net(net),
+            port(port),
+            staged_len(0),
+            tx_record_left(0),
+            tx_seq(0),
+            rx_seq(0),
+            rx_seq_valid(false),
+            rx_synced(false),
+            rx_hdr_have(0),
+            rx_have(0),
+            stats() {
+        stats.Clear();
+    }
+
+    // Starts receiving messages.
+    Status Start() {
+        return net.RegisterReceiver(port, *this);
+    }
+
+    Status RegisterReceiver(
+            Port msg_port,
+            Rcv &rcv) {
+        return rcv_table.Register(msg_port, rcv);
+    }
+
+    // Copies the message to the packer. It goes out with the next
+    // Flush(), together with the other messages sent until then.
+    Status Send(Port msg_port, const void *msg, uint16_t len) {
+        if(len > MaxMsgLen) {
+            return Status::Failure;
+        }
+
+        if(staged_len + sizeof(PackRecordHdr) + len > StagingLen) {
+            return Status::NoMoreSpace;
+        }
+
+        auto record = staged + staged_len;
+
+        record[0] = msg_port;
+        record[1] = static_cast<uint8_t>(len);
+        if(len) {
+            memcpy(record + sizeof(PackRecordHdr), msg, len);
+        }
+
+        staged_len = static_cast<uint16_t>(staged_len + sizeof(PackRecordHdr) + len);
+        stats.sent++;
+
+        return Status::Success;
+    }
+
+    // Sends the messages, in frames of FramePayload() bytes, as far
+    // as the network has buffers. Returns true if all went out.
+    bool Flush() {
+        while(staged_len) {
+            auto buf = net.AllocBuffer();
+
+            if(!buf.ptr) {
+                return false;
+            }
+
+            uint16_t payload = net.FramePayload();
+
+            if(payload <= sizeof(PackHdr)) {
+                payload = sizeof(PackHdr) + 1;
+            }
+
+            uint16_t take = payload - sizeof(PackHdr);
+
+            if(take > staged_len) {
+                take = staged_len;
+            }
+
+            auto hdr = static_cast<PackHdr *>(buf.ptr);
+
+            hdr->seq = tx_seq;
+            hdr->first = tx_record_left < take
+                ? static_cast<uint8_t>(tx_record_left)
+                : PackNoRecord;
+
+            memcpy(hdr + 1, staged, take);
+            buf.len = static_cast<BufferLen>(sizeof(PackHdr) + take);
+
+            if(net.Send(port, buf) != Status::Success) {
+                net.FreeBuffer(buf);
+                return false;
+            }
+
+            tx_seq++;
+            stats.frames_sent++;
+
+            Consume(take);
+        }
+
+        return true;
+    }
+
+    // Bytes of records waiting for Flush().
+    uint16_t StagedBytes() const {
+        return staged_len;
+    }
+
+    void ProcessMsg(Buffer buf) override {
+        if(buf.len < sizeof(PackHdr)) {
+            stats.malformed++;
+            return;
+        }
+
+        auto hdr = static_cast<const PackHdr *>(buf.ptr);
+        auto bytes = reinterpret_cast<const uint8_t *>(hdr + 1);
+        uint16_t len = buf.len - sizeof(PackHdr);
+        uint16_t pos = 0;
+
+        stats.frames_received++;
+
+        bool lost = rx_seq_valid && hdr->seq != rx_seq;
+
+        if(lost) {
+            stats.lost_frames += static_cast<uint8_t>(hdr->seq - rx_seq);
+        }
+
+        rx_seq = hdr->seq + 1;
+        rx_seq_valid = true;
+
+        if(lost && rx_hdr_have) {
+            stats.dropped++;
+        }
+
+        // picks up at the next record
+        if(lost || !rx_synced) {
+            rx_hdr_have = 0;
+            rx_have = 0;
+            rx_synced = hdr->first < len;
+
+            if(!rx_synced) {
+                return;
+            }
+
+            pos = hdr->first;
+        }
+
+        while(pos < len) {
+            uint16_t left = len - pos;
+
+            if(!rx_hdr_have && left >= sizeof(PackRecordHdr)) {
+                auto record = reinterpret_cast<const PackRecordHdr *>(bytes + pos);
+
+                if(left - sizeof(PackRecordHdr) >= record->len) {
+                    pos += sizeof(PackRecordHdr);
+
+                    Deliver(record->port, bytes + pos, record->len);
+
+                    pos += record->len;
+                    continue;
+                }
+            }
+
+            pos += Assemble(bytes + pos, len - pos);
+        }
+    }
+
+    const PackStats &GetStats() const {
+        return stats;
+    }
+
+    void ClearStats() {
+        stats.Clear();
+    }
+
+private:
+    //
+    // Functions.
+    //
+    // Drops the bytes that went out and finds how much of the
+    // record they ended in is still to go.
+    void Consume(uint16_t take) {
+        uint16_t pos = tx_record_left;
+
+        while(pos < take) {
+            pos += sizeof(PackRecordHdr) + staged[pos + 1];
+        }
+
+        tx_record_left = pos - take;
+        staged_len -= take;
+
+        memmove(staged, staged + take, staged_len);
+    }
+
+    // Takes the bytes of a record that spans frames, and returns
+    // how many it took.
+    uint16_t Assemble(const uint8_t *bytes, uint16_t len) {
+        uint16_t taken = 0;
+
+        while(rx_hdr_have < sizeof(PackRecordHdr) && taken < len) {
+            rx_hdr[rx_hdr_have++] = bytes[taken++];
+        }
+
+        if(rx_hdr_have < sizeof(PackRecordHdr)) {
+            return taken;
+        }
+
+        uint16_t want = rx_hdr[1] - rx_have;
+
+        if(want > len - taken) {
+            want = len - taken;
+        }
+
+        memcpy(rx_msg + rx_have, bytes + taken, want);
+        rx_have = static_cast<uint8_t>(rx_have + want);
+        taken += want;
+
+        if(rx_have == rx_hdr[1]) {
+            Deliver(rx_hdr[0], rx_msg, rx_have);
+
+            rx_hdr_have = 0;
+            rx_have = 0;
+        }
+
+        return taken;
+    }
+
+    void Deliver(Port msg_port, const uint8_t *msg, uint8_t len) {
+        Buffer buf { const_cast<uint8_t *>(msg), len };
+
+        if(rcv_table.Received(msg_port, buf) == Status::NoReceiver) {
+            stats.no_receiver++;
+        } else {
+            stats.received++;
+        }
+    }
+
+    //
+    // Data.
+    //
+    Net &net;
+    Port port;
+
+    RcvTable<MaxReceivers> rcv_table;
+
+    uint8_t staged[StagingLen];
+    uint16_t staged_len;
+
+    // bytes at the start of staged that finish a record begun
+    // in an earlier frame
+    uint16_t tx_record_left;
+
+    uint8_t tx_seq;
+
+    uint8_t rx_seq;
+    bool rx_seq_valid;
+
+    // at a record boundary, or within a record seen from its start
+    bool rx_synced;
+
+    // the record being assembled
+    uint8_t rx_hdr[sizeof(PackRecordHdr)];
+    uint8_t rx_hdr_have;
+    uint8_t rx_have;
+    uint8_t rx_msg[0xff];
+
+    PackStats stats;
+};
+
+}
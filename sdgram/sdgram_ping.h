@@ -0,0 +1,256 @@
+//
+// Echo and ping on the diagnostic port.
+//
+// A network with a ping service answers every request on DiagPort
+// right from the receiver callback, sending the payload back with
+// the type changed to a reply. Anything sent as a request comes
+// back as an echo, which a receiver subscribed to DiagPort sees.
+//
+// A ping is a request that carries a sequence number and the time
+// of the sender's clock, so the reply tells the round-trip time
+// without the clocks of the two ends agreeing:
+//
+//   type, seq, stamp, [padding]
+//
+// The round-trip times go into a histogram with fixed buckets,
+// which tells the minimum, the median, the 99th percentile and the
+// maximum. The time includes the wait in the send queue, as the
+// datagrams of the application see it.
+//
+// Both ends need a ping service. A device that only answers can
+// keep the histogram at a single bucket.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_clock.h"
+
+namespace SerialDatagram {
+
+// Pings are neither sent nor answered.
+class NoPing {
+public:
+    static constexpr bool Enabled = false;
+};
+
+// Counts samples in buckets a quarter of a power of two wide, so
+// that a percentile is off by at most a quarter. Values below 8
+// have a bucket each, and values beyond the last bucket go into it.
+template<uint8_t Buckets>
+class RttHistogram {
+public:
+    static_assert(Buckets > 0);
+
+    RttHistogram() {
+        Clear();
+    }
+
+    void Clear() {
+        for(auto &count : counts) {
+            count = 0;
+        }
+
+        total = 0;
+        min = 0;
+        max = 0;
+    }
+
+    void Add(uint32_t value) {
+        if(!total || value < min) {
+            min = value;
+        }
+
+        if(!total || value > max) {
+            max = value;
+        }
+
+        counts[Bucket(value)]++;
+        total++;
+    }
+
+    uint32_t Count() const {
+        return total;
+    }
+
+    uint32_t Min() const {
+        return min;
+    }
+
+    uint32_t Max() const {
+        return max;
+    }
+
+    // The top of the bucket that holds the percentile, but no more
+    // than the maximum. Zero without samples.
+    uint32_t Percentile(uint8_t pct) const {
+        if(!total) {
+            return 0;
+        }
+
+        uint64_t rank = (static_cast<uint64_t>(total) * pct + 99) / 100;
+        uint64_t seen = 0;
+
+        if(!rank) {
+            rank = 1;
+        }
+
+        for(uint8_t bucket = 0;bucket < Buckets;bucket++) {
+            seen += counts[bucket];
+
+            if(seen >= rank) {
+                uint32_t top = Top(bucket);
+
+                return top < max ? top : max;
+            }
+        }
+
+        return max;
+    }
+
+    uint32_t P50() const {
+        return Percentile(50);
+    }
+
+    uint32_t P99() const {
+        return Percentile(99);
+    }
+
+private:
+    //
+    // Functions.
+    //
+    static uint8_t Bucket(uint32_t value) {
+        uint16_t bucket;
+
+        if(value < 8) {
+            bucket = static_cast<uint16_t>(value);
+        } else {
+            uint8_t msb = 3;
+
+            while(msb < 31 && value >> (msb + 1)) {
+                msb++;
+            }
+
+            uint8_t quarter = (value >> (msb - 2)) & 3;
+
+            bucket = static_cast<uint16_t>(8 + (msb - 3) * 4 + quarter);
+        }
+
+        return bucket < Buckets
+            ? static_cast<uint8_t>(bucket)
+            : Buckets - 1;
+    }
+
+    static uint32_t Top(uint8_t bucket) {
+        if(bucket == Buckets - 1) {
+            return 0xffffffff;
+        }
+
+        if(bucket < 8) {
+            return bucket;
+        }
+
+        uint8_t msb = static_cast<uint8_t>(3 + (bucket - 8) / 4);
+        uint8_t quarter = (bucket - 8) % 4;
+
+        if(msb > 31) {
+            return 0xffffffff;
+        }
+
+        uint64_t next = static_cast<uint64_t>(5 + quarter) << (msb - 2);
+
+        return static_cast<uint32_t>(next - 1);
+    }
+
+    //
+    // Data.
+    //
+    uint32_t counts[Buckets];
+    uint32_t total;
+    uint32_t min;
+    uint32_t max;
+};
+
+template<uint8_t Buckets>
+struct PingStats {
+    void Clear() {
+        sent = 0;
+        replies = 0;
+        echoed = 0;
+        echo_dropped = 0;
+        rtt.Clear();
+    }
+
+    uint16_t sent;
+    uint16_t replies;
+
+    // requests of the peer answered, and those left unanswered
+    // for want of a buffer or room in the send queue
+    uint16_t echoed;
+    uint16_t echo_dropped;
+
+    // microseconds, or the units of the clock
+    RttHistogram<Buckets> rtt;
+};
+
+// The default buckets reach about two seconds.
+template<
+    uint8_t Buckets = 80,
+    typename Clock = DefaultMicrosClock>
+class PingService {
+public:
+    static constexpr bool Enabled = true;
+
+    PingService()
+            : seq(0),
+            stats() {
+        stats.Clear();
+    }
+
+    DiagPing CreatePing() {
+        return DiagPing {
+            DiagHdr { static_cast<uint8_t>(DiagType::Request) },
+            seq,
+            Clock::Now() };
+    }
+
+    void PingSent() {
+        seq++;
+        stats.sent++;
+    }
+
+    void ReplyReceived(const DiagPing &reply) {
+        stats.replies++;
+        stats.rtt.Add(Clock::Now() - reply.stamp);
+    }
+
+    void Echoed() {
+        stats.echoed++;
+    }
+
+    void EchoDropped() {
+        stats.echo_dropped++;
+    }
+
+    const PingStats<Buckets> &GetStats() const {
+        return stats;
+    }
+
+    void ClearStats() {
+        stats.Clear();
+    }
+
+private:
+    //
+    // Data.
+    //
+    uint16_t seq;
+
+    PingStats<Buckets> stats;
+};
+
+}
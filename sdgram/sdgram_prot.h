@@ -7,6 +7,7 @@
 #pragma once
 
 #include "sdgram_stdint.h"
+#include "sdgram_defs.h"
 
 namespace SerialDatagram {
 
@@ -21,6 +22,31 @@ struct DatagramHdr {
 struct DatagramTrl {
     uint16_t magic;
 };
+
+struct CtrlHdr {
+    uint8_t type;
+};
+
+struct CtrlCreditAdvert {
+    CtrlHdr hdr;
+    uint16_t consumed;
+    uint16_t window;
+};
+
+struct CtrlFrameSize {
+    CtrlHdr hdr;
+    uint8_t len;
+};
+
+struct DiagHdr {
+    uint8_t type;
+};
+
+struct DiagPing {
+    DiagHdr hdr;
+    uint16_t seq;
+    uint32_t stamp;
+};
 #pragma pack(pop)
 
 constexpr size_t DatagramHdrSize = 6;
@@ -32,4 +58,29 @@ static_assert(sizeof(DatagramTrl) == DatagramTrlSize);
 constexpr uint16_t DatagramHdrMagic = 0xa357;
 constexpr uint16_t DatagramTrlMagic = 0xc69b;
 
+// The top bit of the header size field marks a compressed
+// payload. Without compression, sizes must stay below it.
+constexpr uint8_t DatagramSizeMask = 0x7f;
+constexpr uint8_t DatagramFlagCompressed = 0x80;
+
+// Datagrams on the control port carry protocol messages
+// rather than user data.
+constexpr Port ControlPort = 0xfe;
+
+enum class CtrlType : uint8_t {
+    CreditAdvert = 1,
+    CreditReset = 2,
+    CreditProbe = 3,
+    FrameSize = 4,
+};
+
+// Requests on the diagnostic port come back as replies when the
+// peer has a ping service.
+constexpr Port DiagPort = 0xfd;
+
+enum class DiagType : uint8_t {
+    Request = 1,
+    Reply = 2,
+};
+
 }
@@ -16,18 +16,34 @@ struct RcvStats {
         bytes = 0;
         dropped_bytes = 0;
         crc_error = 0;
+        hdr_error = 0;
         trl_error = 0;
         size_error = 0;
         rcv_error = 0;
+        decode_error = 0;
+        frame_timeout = 0;
+        corrected = 0;
     }
 
     uint16_t msgs;
     uint16_t bytes;
     uint16_t dropped_bytes;
     uint16_t crc_error;
+    uint16_t hdr_error;
     uint16_t trl_error;
     uint16_t size_error;
+
+    // frames that neither a registered receiver nor a subscriber
+    // of their port got
     uint16_t rcv_error;
+
+    uint16_t decode_error;
+
+    // partial frames dropped after FrameTimeout
+    uint16_t frame_timeout;
+
+    // frames repaired by forward error correction
+    uint16_t corrected;
 };
 
 }
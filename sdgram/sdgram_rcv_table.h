@@ -13,35 +13,98 @@ namespace SerialDatagram {
 template<uint8_t MaxReceiverCount>
 class RcvTable {
 public:
+    RcvTable()
+            : used(0) {
+        // empty
+    }
+
+    // A port has one registered receiver at most, next to any
+    // number of subscribers.
     Status Register(Port port, Rcv &rcv) {
-        auto existing = FindRegistered(port);
+        for(uint8_t i = 0;i < used;i++) {
+            if(!registered[i].shared && registered[i].first == port) {
+                return Status::Duplicate;
+            }
+        }
 
-        if(existing != nullptr) {
-            return Status::Duplicate;
+        return Add(port, port, rcv, false);
+    }
+
+    // Adds a receiver for a range of ports, which it shares with
+    // the other receivers of the ports.
+    Status Subscribe(Port first, Port last, Rcv &rcv) {
+        if(first > last) {
+            return Status::Failure;
         }
 
-        auto empty = FindEmptySlot();
+        for(uint8_t i = 0;i < used;i++) {
+            auto &entry = registered[i];
 
-        if(empty == nullptr) {
-            return Status::NoMoreSpace;
+            if(entry.shared && entry.rcv == &rcv && entry.first == first && entry.last == last) {
+                return Status::Duplicate;
+            }
         }
 
-        empty->port = port;
-        empty->rcv = &rcv;
+        return Add(first, last, rcv, true);
+    }
 
-        return Status::Success;
+    // Removes the registered receiver of the port. Not to be
+    // invoked from a receiver callback.
+    Status Unregister(Port port, Rcv &rcv) {
+        for(uint8_t i = 0;i < used;i++) {
+            auto &entry = registered[i];
+
+            if(entry.shared || entry.first != port || entry.rcv != &rcv) {
+                continue;
+            }
+
+            // the others keep their order
+            for(uint8_t j = i + 1;j < used;j++) {
+                registered[j - 1] = registered[j];
+            }
+
+            used--;
+
+            return Status::Success;
+        }
+
+        return Status::Failure;
     }
 
+    // Every receiver of the port gets the same buffer: first the
+    // registered receiver, then the subscribers in the order they
+    // were added. A frame that only subscribers get counts as
+    // received too.
     Status Received(Port port, Buffer buf) {
-        auto existing = FindRegistered(port);
+        bool any = false;
+
+        // receivers added by a callback wait for the next datagram
+        auto count = used;
+
+        for(uint8_t i = 0;i < count;i++) {
+            auto &entry = registered[i];
 
-        if(existing == nullptr) {
-            return Status::NoReceiver;
+            if(!entry.shared && entry.first == port) {
+                entry.rcv->ProcessMsg(buf);
+                any = true;
+                break;
+            }
         }
 
-        existing->rcv->ProcessMsg(buf);
+        for(uint8_t i = 0;i < count;i++) {
+            auto &entry = registered[i];
 
-        return Status::Success;
+            if(!entry.shared || port < entry.first || port > entry.last) {
+                continue;
+            }
+
+            entry.rcv->ProcessMsg(buf);
+            any = true;
+        }
+
+        return any
+            ? Status::Success
+            : Status::NoReceiver;
     }
 
 private:
@@ -49,37 +112,30 @@ private:
     // Types.
     //
     struct Registered {
-        Registered()
-                : port(InvalidPort),
-                rcv(nullptr) {
-            // empty
-        }
-
-        Port port;
+        Port first;
+        Port last;
         Rcv *rcv;
+        bool shared;
     };
 
     //
     // Functions.
     //
-    Registered *FindRegistered(Port port) {
-        for(uint16_t i = 0;i < MaxReceiverCount;i++) {
-            if(registered[i].port == port) {
-                return registered + i;
-            }
+    Status Add(Port first, Port last, Rcv &rcv, bool shared) {
+        if(used == MaxReceiverCount) {
+            return Status::NoMoreSpace;
         }
 
-        return nullptr;
-    }
+        registered[used++] = Registered { first, last, &rcv, shared };
 
-    Registered *FindEmptySlot() {
-        return FindRegistered(InvalidPort);
+        return Status::Success;
     }
 
     //
     // Data.
     //
     Registered registered[MaxReceiverCount];
+    uint8_t used;
 };
 
 }
@@ -6,11 +6,13 @@
 
 #pragma once
 
-#include <crc16.h>
-
 #include "sdgram_defs.h"
 #include "sdgram_prot.h"
 #include "sdgram_rcv_stats.h"
+#include "sdgram_flow_control.h"
+#include "sdgram_compression.h"
+#include "sdgram_framing.h"
+#include "sdgram_clock.h"
 #include "sdgram_log.h"
 
 namespace SerialDatagram {
@@ -18,29 +20,127 @@ namespace SerialDatagram {
 template<
     typename Stream,
     typename RcvTable,
-    uint16_t TotalBufLen>
+    uint16_t TotalBufLen,
+    typename RxAlloc,
+    typename FlowControl = NoFlowControl,
+    typename Codec = NoCompression::Codec<0>,
+    typename Framing = MagicFraming<>,
+    typename Clock = DefaultClock,
+    uint16_t FrameTimeout = 0>
 class Receiver {
 public:
     Receiver(
         Stream &stream,
-        RcvTable &rcv_table)
+        RcvTable &rcv_table,
+        RxAlloc &rx_alloc,
+        FlowControl &flow_control,
+        Codec &codec)
             : stream(stream),
             rcv_table(rcv_table),
-            state(State::SearchStart),
-            next(0) {
+            rx_alloc(rx_alloc),
+            flow_control(flow_control),
+            codec(codec),
+            stats(),
+            parser(stats, static_cast<uint8_t *>(rx_alloc.Alloc())),
+            current(nullptr),
+            current_payload { nullptr, 0 },
+            current_in_parser(false),
+            held(false),
+            taken(false),
+            last_read(0) {
         stats.Clear();
     }
 
-    void Process() {
-        while(ReadMoreData()) {
-            LogBuffer();
-            
-            if(state == State::SearchStart) {
-                ProcessSearchStart();
-            } else {
-                ProcessSearchEnd();
+    // Returns true if any bytes were read.
+    //
+    // Reads the stream straight into the parser buffer rather than
+    // through Feed(), which would need a second staging buffer that
+    // AVR cannot spare. Both paths share the parser, and the Feed
+    // tests check that they deliver the same frames.
+    bool Process() {
+        bool read = false;
+
+        ParseAvailable(read);
+
+        if(IsTimedOut()) {
+            LogFrameTimeout();
+            stats.frame_timeout++;
+
+            // Every buffered byte is as old as the partial frame,
+            // so none of them may start another partial frame.
+            while(parser.HasPartialFrame()) {
+                parser.DropPartialFrame();
+                ParseAvailable(read);
             }
         }
+
+        return read;
+    }
+
+    // Like Process(), but reads at most max_bytes and delivers at
+    // most max_frames frames, and takes what it did off both.
+    bool Process(uint16_t &max_bytes, uint16_t &max_frames) {
+        bool read = false;
+
+        ParseBudgeted(read, max_bytes, max_frames);
+
+        if(IsTimedOut()) {
+            LogFrameTimeout();
+            stats.frame_timeout++;
+
+            // Only the buffered bytes are parsed again, which
+            // bounds the work without the frame limit.
+            while(parser.HasPartialFrame()) {
+                uint16_t no_bytes = 0;
+                uint16_t frames = NoLimit;
+
+                parser.DropPartialFrame();
+                ParseBudgeted(read, no_bytes, frames);
+
+                uint16_t delivered = NoLimit - frames;
+
+                max_frames = delivered < max_frames
+                    ? max_frames - delivered
+                    : 0;
+            }
+        }
+
+        return read;
+    }
+
+    // Parses bytes the caller already holds, such as a block read
+    // from a file or a DMA buffer, instead of reading the stream.
+    // Frames within the bytes are delivered straight from them.
+    // Only the bytes of a frame that is not complete yet are
+    // copied, and the next call completes it.
+    void Feed(const uint8_t *bytes, size_t len) {
+        if(!len) {
+            return;
+        }
+
+        if constexpr(FrameTimeout != 0) {
+            last_read = Clock::Now();
+        }
+
+        while(len) {
+            uint16_t chunk = len < MaxChunk
+                ? static_cast<uint16_t>(len)
+                : MaxChunk;
+
+            auto used = parser.HasPartialFrame()
+                ? FeedBuffered(bytes, chunk)
+                : FeedInPlace(bytes, chunk);
+
+            flow_control.Consumed(used);
+
+            bytes += used;
+            len -= used;
+        }
+    }
+
+    // True while a partial frame waits for the timeout.
+    bool HasPendingTimeout() const {
+        return FrameTimeout && parser.HasPartialFrame();
     }
 
     const RcvStats &GetStats() const {
@@ -51,188 +151,201 @@ public:
         stats.Clear();
     }
 
+    // The frame being delivered, while a receiver
+    // callback runs. Null otherwise.
+    const RcvFrame *CurrentFrame() const {
+        return current;
+    }
+
+    // Keeps the payload being delivered after the receiver callback
+    // returns, so that it can be processed later while the next
+    // frame is received. A frame in the parser buffer stays where it
+    // is and the parser continues in a fresh buffer. Other payloads,
+    // such as decompressed ones or those fed from the memory of the
+    // caller, are copied. Returns a null buffer if there is no free
+    // buffer. The payload goes back with ReleaseFrame().
+    Buffer HoldFrame() {
+        if(!current || held) {
+            return Buffer { nullptr, 0 };
+        }
+
+        auto fresh = static_cast<uint8_t *>(rx_alloc.Alloc());
+
+        if(!fresh) {
+            LogNoHoldBuffer();
+            return Buffer { nullptr, 0 };
+        }
+
+        held = true;
+
+        if(current_in_parser) {
+            parser.TakeFrame(fresh);
+            taken = true;
+
+            return current_payload;
+        }
+
+        memcpy(fresh, current_payload.ptr, current_payload.len);
+
+        return Buffer { fresh, current_payload.len };
+    }
+
+    void ReleaseFrame(Buffer buf) {
+        rx_alloc.Free(buf.ptr);
+    }
 
 private:
     //
     // Constants.
     //
-    static constexpr uint16_t MinMsgSize =
-        sizeof(DatagramHdr) + sizeof(DatagramTrl);
+    // Without compression, a set compressed flag makes
+    // the size invalid.
+    static constexpr uint8_t SizeMask = Codec::Enabled
+        ? DatagramSizeMask
+        : 0xff;
+
+    static constexpr uint16_t MaxChunk = 0xffff;
+
+    static constexpr uint16_t NoLimit = 0xffff;
 
     //
     // Types.
     //
-    enum class State {
-        SearchStart,
-        SearchEnd
-    };
+    using Parser = typename Framing::template Parser<TotalBufLen, SizeMask>;
 
     //
     // Functions.
     //
-    DatagramHdr &Hdr() {
-        return *reinterpret_cast<DatagramHdr *>(data);
-    }
+    void ParseAvailable(bool &read) {
+        while(ReadMoreData(read)) {
+            parser.LogBuffer();
 
-    const DatagramHdr &Hdr() const {
-        return *reinterpret_cast<const DatagramHdr *>(data);
-    }
+            RcvFrame frame;
 
-    bool IsHdrReceived() const {
-        return next >= sizeof(DatagramHdr);
-    }
-
-    uint16_t TotalMsgSize() const {
-        return Hdr().size + sizeof(DatagramHdr) + sizeof(DatagramTrl);
+            if(parser.Parse(frame)) {
+                DeliverParsed(frame);
+            }
+        }
     }
 
-    uint16_t TrlOffset() const {
-        return Hdr().size + sizeof(DatagramHdr);
-    }
+    void ParseBudgeted(bool &read, uint16_t &max_bytes, uint16_t &max_frames) {
+        while(max_frames && ReadMoreData(read, max_bytes)) {
+            parser.LogBuffer();
 
-    bool ReadMoreData() {
-        auto available = stream.available();
-        auto bytes_to_read = MaxBytesToRead();
+            RcvFrame frame;
 
-        if(!available && bytes_to_read) {
-            return false;
+            if(parser.Parse(frame)) {
+                DeliverParsed(frame);
+                max_frames--;
+            }
         }
+    }
 
-        if(bytes_to_read > available) {
-            bytes_to_read = static_cast<uint16_t>(available);
+    // Delivers a frame from the parser buffer, which a receiver
+    // may take over.
+    void DeliverParsed(const RcvFrame &frame) {
+        current_in_parser = true;
+        InvokeCb(frame);
+        current_in_parser = false;
+
+        if(taken) {
+            taken = false;
+        } else {
+            parser.FrameDone();
         }
+    }
 
-        if(bytes_to_read) {
-            auto bytes_read = ReadBytes(
-                reinterpret_cast<void *>(data + next),
-                bytes_to_read);
+    uint16_t FeedInPlace(const uint8_t *bytes, uint16_t len) {
+        RcvFrame frame;
+        uint16_t used;
 
-            if(!bytes_read) {
-                return false;
-            }
+        if(parser.FindFrame(bytes, len, frame, used)) {
+            InvokeCb(frame);
 
-            LogBytesRead(bytes_read);
+            return used;
+        }
 
-            next += bytes_read;
+        if(used == len) {
+            return used;
         }
 
-        return true;
+        // the rest may start a frame
+        return used + FeedBuffered(bytes + used, len - used);
     }
 
-    uint16_t MaxBytesToRead() const {
-        if(state == State::SearchStart) {
-            return next < MinMsgSize
-                ? MinMsgSize - next :
-                0;
-        }
+    uint16_t FeedBuffered(const uint8_t *bytes, uint16_t len) {
+        auto bytes_to_read = parser.MaxBytesToRead();
 
-        if(next < sizeof(DatagramHdr)) {
-            return MinMsgSize - next;
+        if(bytes_to_read > len) {
+            bytes_to_read = len;
         }
 
-        auto bytes_to_read = TotalMsgSize() - next;
+        memcpy(parser.WritePtr(), bytes, bytes_to_read);
+        parser.BytesAdded(bytes_to_read);
 
-        auto ret = bytes_to_read + next < TotalBufLen
-            ? bytes_to_read
-            : 0;
+        RcvFrame frame;
 
-        return ret;
-    }
-
-    void ProcessSearchStart(uint16_t curr = 0) {
-        if(next < sizeof(DatagramHdrMagic)) {
-            LogIncompleteHdrMagic();
-            return;
+        if(parser.Parse(frame)) {
+            DeliverParsed(frame);
         }
 
-        while(curr < next - 1) {
-            uint16_t val = *reinterpret_cast<uint16_t *>(data + curr);
-
-            if(val == DatagramHdrMagic) {
-                LogFoundHdrMagic();
-
-                // We rarely need to copy data. This is only needed
-                // when we are recovering the lost sync.
-                if(curr) {
-                    LogBufMemmove();
-
-                    memmove(
-                        reinterpret_cast<void *>(data),
-                        reinterpret_cast<void *>(data + curr),
-                        next - curr);
-                    next -= curr;
+        return bytes_to_read;
+    }
 
-                    stats.dropped_bytes += curr;
-                }
+    bool IsTimedOut() const {
+        if constexpr(FrameTimeout != 0) {
+            return parser.HasPartialFrame()
+                && static_cast<uint32_t>(Clock::Now() - last_read) >= FrameTimeout;
+        } else {
+            return false;
+        }
+    }
 
-                state = State::SearchEnd;
+    bool ReadMoreData(bool &read) {
+        uint16_t max_bytes = NoLimit;
 
-                if(next >= sizeof(DatagramHdr)) {
-                    ProcessSearchEnd();
-                }
+        return ReadMoreData(read, max_bytes);
+    }
 
-                return;
-            }
+    // Reads at most max_bytes, and takes what it read off them.
+    bool ReadMoreData(bool &read, uint16_t &max_bytes) {
+        auto available = stream.available();
+        auto bytes_to_read = parser.MaxBytesToRead();
 
-            ++curr;
+        if((!available || !max_bytes) && bytes_to_read) {
+            return false;
         }
 
-        // curr should be next - 1
-        if(curr != 0) {
-            data[0] = data[curr];
-            stats.dropped_bytes += curr;
-            next = sizeof(uint8_t);
+        if(bytes_to_read > available) {
+            bytes_to_read = static_cast<uint16_t>(available);
         }
-    }
 
-    const DatagramTrl &Trl() const {
-        return *reinterpret_cast<const DatagramTrl *>(
-            data + TrlOffset());
-    }
-    
-    void ProcessSearchEnd() {
-        if(!IsHdrReceived()) {
-            return;
+        if(bytes_to_read > max_bytes) {
+            bytes_to_read = max_bytes;
         }
 
-        auto total_msg_size = TotalMsgSize();
-
-        if(total_msg_size > TotalBufLen) {
-            LogMsgTooLarge(total_msg_size);
-            stats.size_error++;
-            Recover();
-            return;
-        }
+        if(bytes_to_read) {
+            auto bytes_read = ReadBytes(
+                reinterpret_cast<void *>(parser.WritePtr()),
+                bytes_to_read);
 
-        if(next < total_msg_size) {
-            LogIncompleteMsg(total_msg_size);
-            return;
-        }
+            if(!bytes_read) {
+                return false;
+            }
 
-        if(Trl().magic != DatagramTrlMagic) {
-            LogTrailerMismatch();
-            stats.trl_error++;
+            LogBytesRead(bytes_read);
 
-            Recover();
-            return;
-        }
+            read = true;
+            max_bytes -= bytes_read;
 
-        if(!CheckCrc()) {
-            LogCrcMismatch();
-            stats.crc_error++;
+            if constexpr(FrameTimeout != 0) {
+                last_read = Clock::Now();
+            }
 
-            Recover();
-            return;
+            parser.BytesAdded(bytes_read);
         }
 
-        InvokeCb();
-
-        StartNextMsg(total_msg_size);
-    }
-
-    void Recover() {
-        state = State::SearchStart;
-        ProcessSearchStart(sizeof(uint16_t));
+        return true;
     }
 
     uint16_t ReadBytes(void *buf, uint16_t max_to_read) {
@@ -244,50 +357,45 @@ private:
             read_so_far++;
         }
 
+        flow_control.Consumed(read_so_far);
+
         return read_so_far;
     }
 
-    bool CheckCrc() {
-        auto rcv = Hdr().crc;
+    void InvokeCb(const RcvFrame &frame) {
+        auto buf = frame.payload;
 
-        Hdr().crc = 0;
-        auto calc = Crc16Usb::Calc(data, static_cast<size_t>(TotalMsgSize()));
+        if constexpr(Codec::Enabled) {
+            bool compressed = frame.size_flags & DatagramFlagCompressed;
 
-        return calc == rcv;
-    }
+            if(!codec.Decode(frame.port, compressed, buf)) {
+                LogDecodeError();
+                stats.decode_error++;
+                stats.dropped_bytes += frame.wire_len;
+                return;
+            }
+        }
 
-    void InvokeCb() {
-        auto status = rcv_table.Received(
-            Hdr().port,
-            Buffer {
-                reinterpret_cast<void *>(data + sizeof(DatagramHdr)),
-                Hdr().size });
+        // a decompressed payload is not in the parser buffer
+        current_in_parser = current_in_parser && buf.ptr == frame.payload.ptr;
+        current_payload = buf;
+
+        current = &frame;
+        auto status = rcv_table.Received(frame.port, buf);
+        current = nullptr;
+        held = false;
 
         if(status == Status::Success) {
             stats.msgs++;
-            stats.bytes += TotalMsgSize();
+            stats.bytes += frame.wire_len;
         } else if(status == Status::NoReceiver) {
             stats.rcv_error++;
-            stats.dropped_bytes += TotalMsgSize();
+            stats.dropped_bytes += frame.wire_len;
         } else {
             LogUnexpectedInvokeCb(status);
         }
     }
 
-    void StartNextMsg(uint16_t total_msg_size) {
-        state = State::SearchStart;
-        
-        if(next != total_msg_size) {
-            memmove(
-                reinterpret_cast<void *>(data),
-                reinterpret_cast<void *>(data + total_msg_size),
-                next - total_msg_size);
-            next -= total_msg_size;
-        } else {
-            next = 0;
-        }
-    }
-
     // logging
 #define LOGGER_PREFIX_RCV "[SDGRAM-RCV] "
 
@@ -297,59 +405,22 @@ private:
         LogVerboseLn(" bytes");
     }
 
-    void LogBuffer() {
-        char hex[3];
-
-        LogVerbose(LOGGER_PREFIX_RCV "Buf: ");
-
-        for(uint8_t i = 0;i < next;i++) {
-            sprintf(hex, "%02X", data[i]);
-            LogVerbose(hex);
-            LogVerbose(" ");
-        }
-
-        LogVerboseLn(" EOB");
-    }
-
-    static void LogCrcMismatch() {
-        LogVerboseLn(LOGGER_PREFIX_RCV "CRC mismatch");
-    }
-
-    void LogTrailerMismatch() const {
-        LogVerbose(LOGGER_PREFIX_RCV "trailer mismatch ");
-        LogVerboseLn(Trl().magic);
-    }
-
-    static void LogMsgTooLarge(uint16_t total_msg_size) {
-        LogVerbose(LOGGER_PREFIX_RCV "message too large (could be because of dropped bytes) ");
-        LogVerbose(total_msg_size);
-        LogVerbose(" > ");
-        LogVerboseLn(TotalBufLen);
-    }
-
-    void LogIncompleteMsg(uint16_t total_msg_size) const {
-        LogVerbose(LOGGER_PREFIX_RCV "not enough bytes in the message ");
-        LogVerbose(total_msg_size);
-        LogVerbose(" > ");
-        LogVerboseLn(next);
-    }
-
-    static void LogBufMemmove() {
-        LogVerboseLn(LOGGER_PREFIX_RCV "moving buffer data");
+    static void LogBytesRead(uint16_t bytes_read) {
+        LogVerbose(LOGGER_PREFIX_RCV "read ");
+        LogVerbose(bytes_read);
+        LogVerboseLn(" bytes");
     }
 
-    static void LogFoundHdrMagic() {
-        LogVerboseLn(LOGGER_PREFIX_RCV "found header magic");
+    static void LogFrameTimeout() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "partial frame timed out");
     }
 
-    static void LogIncompleteHdrMagic() {
-        LogVerboseLn(LOGGER_PREFIX_RCV "not enough bytes for header magic");
+    static void LogNoHoldBuffer() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "no buffer to hold the frame");
     }
 
-    static void LogBytesRead(uint16_t bytes_read) {
-        LogVerbose(LOGGER_PREFIX_RCV "read ");
-        LogVerbose(bytes_read);
-        LogVerboseLn(" bytes");
+    static void LogDecodeError() {
+        LogVerboseLn(LOGGER_PREFIX_RCV "cannot decode compressed payload");
     }
 
     static void LogUnexpectedInvokeCb(Status status) {
@@ -362,13 +433,26 @@ private:
     //
     Stream &stream;
     RcvTable &rcv_table;
+    RxAlloc &rx_alloc;
+    FlowControl &flow_control;
+    Codec &codec;
 
-    State state;
+    RcvStats stats;
 
-    uint8_t data[TotalBufLen];
-    uint16_t next;
+    Parser parser;
 
-    RcvStats stats;
+    const RcvFrame *current;
+    Buffer current_payload;
+
+    // the current payload can be taken over with its buffer
+    bool current_in_parser;
+
+    // held once per delivery, and taken over if in the parser
+    bool held;
+    bool taken;
+
+    // when bytes were last read
+    uint32_t last_read;
 };
 
 }
@@ -0,0 +1,184 @@
+//
+// Forwarding datagrams between networks.
+//
+// A route takes the datagrams that arrive on a port of one
+// network and sends them out of another network. The frame is
+// copied once, from the receive buffer of the incoming network
+// into a send buffer of the outgoing one, and goes out unchanged,
+// so its CRC is not computed again. Only a route that changes the
+// port frames the payload again.
+//
+// A route drops datagrams while the outgoing network has more
+// than the route's queue limit of bytes waiting to be written,
+// so that a slow link cannot hold up the others.
+//
+// All networks need the same configuration. A compressed port
+// needs compression enabled on the incoming network.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+struct RouteStats {
+    void Clear() {
+        forwarded = 0;
+        reframed = 0;
+        bytes = 0;
+        queue_full = 0;
+        no_buffer = 0;
+    }
+
+    uint16_t forwarded;
+
+    // forwarded with the port rewritten
+    uint16_t reframed;
+
+    uint16_t bytes;
+
+    // dropped datagrams
+    uint16_t queue_full;
+    uint16_t no_buffer;
+};
+
+template<
+    typename Net,
+    uint8_t MaxRoutes = 8>
+class Router {
+public:
+    static constexpr uint16_t DefaultQueueLimit = 256;
+
+    Router()
+            : route_count(0) {
+        for(auto &route : routes) {
+            route.router = this;
+        }
+    }
+
+    // Datagrams arriving on in_port of the from network are sent
+    // to out_port of the to network. Returns the route index in
+    // route_idx.
+    Status AddRoute(
+            Net &from,
+            Port in_port,
+            Net &to,
+            Port out_port,
+            uint16_t queue_limit = DefaultQueueLimit,
+            uint8_t *route_idx = nullptr) {
+        if(route_count == MaxRoutes) {
+            return Status::NoMoreSpace;
+        }
+
+        auto &route = routes[route_count];
+
+        auto status = from.RegisterReceiver(in_port, route);
+
+        if(status != Status::Success) {
+            return status;
+        }
+
+        route.from = &from;
+        route.to = &to;
+        route.out_port = out_port;
+        route.queue_limit = queue_limit;
+        route.stats.Clear();
+
+        if(route_idx) {
+            *route_idx = route_count;
+        }
+
+        route_count++;
+
+        return Status::Success;
+    }
+
+    const RouteStats &GetRouteStats(uint8_t route_idx) const {
+        return routes[route_idx].stats;
+    }
+
+    void ClearRouteStats() {
+        for(auto &route : routes) {
+            route.stats.Clear();
+        }
+    }
+
+private:
+    //
+    // Types.
+    //
+    class Route : public Rcv {
+    public:
+        Route()
+                : router(nullptr),
+                from(nullptr),
+                to(nullptr),
+                out_port(InvalidPort),
+                queue_limit(0),
+                stats() {
+            // empty
+        }
+
+        void ProcessMsg(Buffer) override {
+            router->Forward(*this);
+        }
+
+        Router *router;
+        Net *from;
+        Net *to;
+        Port out_port;
+        uint16_t queue_limit;
+
+        RouteStats stats;
+    };
+
+    //
+    // Functions.
+    //
+    void Forward(Route &route) {
+        auto frame = route.from->CurrentFrame();
+
+        if(route.to->QueuedBytes() + frame->wire_len > route.queue_limit) {
+            LogQueueFull(route.out_port);
+            route.stats.queue_full++;
+            return;
+        }
+
+        if(route.to->SendFrame(route.out_port, *frame) != Status::Success) {
+            LogNoBuffer(route.out_port);
+            route.stats.no_buffer++;
+            return;
+        }
+
+        route.stats.forwarded++;
+        route.stats.bytes += frame->wire_len;
+
+        if(route.out_port != frame->port || !frame->frame.ptr) {
+            route.stats.reframed++;
+        }
+    }
+
+    // logging
+#define LOGGER_PREFIX_ROUTER "[SDGRAM-ROUTER] "
+
+    static void LogQueueFull(Port port) {
+        LogVerbose(LOGGER_PREFIX_ROUTER "queue limit reached for port ");
+        LogVerboseLn(port);
+    }
+
+    static void LogNoBuffer(Port port) {
+        LogVerbose(LOGGER_PREFIX_ROUTER "cannot send to port ");
+        LogVerboseLn(port);
+    }
+
+    //
+    // Data.
+    //
+    Route routes[MaxRoutes];
+    uint8_t route_count;
+};
+
+}
@@ -0,0 +1,466 @@
+//
+// Remote procedure calls over a pair of ports.
+//
+// A client sends requests to the request port of a server, which
+// answers on the response port:
+//
+//   request:  tag, method, arguments
+//   response: tag, status, result
+//
+// The tag matches a response to its request, so a client can have
+// several calls outstanding and does not wait for one response
+// before sending the next request. A call without a response
+// within its timeout completes with RpcStatus::Timeout, and its
+// response is dropped if it arrives later.
+//
+// The server answers from the receive callback, so a handler
+// should return quickly. A request that finds no free buffer for
+// the response is dropped and the call times out.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+namespace SerialDatagram {
+
+#pragma pack(push, 1)
+struct RpcRequestHdr {
+    uint8_t tag;
+    uint8_t method;
+};
+
+struct RpcResponseHdr {
+    uint8_t tag;
+    uint8_t status;
+};
+#pragma pack(pop)
+
+enum class RpcStatus : uint8_t {
+    Ok,
+
+    // the server has no handler for the method
+    NoMethod,
+
+    // the handler could not complete the call
+    Failed,
+
+    // no response in time, reported by the client only
+    Timeout,
+};
+
+// A method handler on the server.
+class RpcMethod {
+public:
+    RpcMethod() = default;
+    virtual ~RpcMethod() = default;
+
+    // The arguments are valid until the call returns. The result
+    // buffer holds result.len bytes, and the handler sets the
+    // length to the size of the result it wrote.
+    virtual RpcStatus Call(Buffer args, Buffer &result) = 0;
+};
+
+// Completion of a call on the client.
+class RpcDone {
+public:
+    RpcDone() = default;
+    virtual ~RpcDone() = default;
+
+    // The result is valid until the callback returns. It is
+    // empty unless the status is Ok.
+    virtual void Done(uint8_t tag, RpcStatus status, Buffer result) = 0;
+};
+
+struct RpcServerStats {
+    void Clear() {
+        calls = 0;
+        no_method = 0;
+        malformed = 0;
+        no_buffer = 0;
+    }
+
+    uint16_t calls;
+    uint16_t no_method;
+    uint16_t malformed;
+
+    // requests dropped for lack of a response buffer
+    uint16_t no_buffer;
+};
+
+struct RpcClientStats {
+    void Clear() {
+        calls = 0;
+        responses = 0;
+        timeouts = 0;
+        late = 0;
+    }
+
+    uint16_t calls;
+    uint16_t responses;
+    uint16_t timeouts;
+
+    // responses without an outstanding call
+    uint16_t late;
+};
+
+template<
+    typename Net,
+    uint8_t MaxMethods = 8>
+class RpcServer : public Rcv {
+public:
+    static constexpr BufferLen MaxResultLen =
+        Net::MaxBufferLen - sizeof(RpcResponseHdr);
+
+    RpcServer(
+        Net &net,
+        Port request_port,
+        Port response_port)
+            : net(net),
+            request_port(request_port),
+            response_port(response_port),
+            methods(),
+            stats() {
+        stats.Clear();
+    }
+
+    // Starts receiving requests.
+    Status Start() {
+        return net.RegisterReceiver(request_port, *this);
+    }
+
+    Status Register(uint8_t method, RpcMethod &handler) {
+        if(Find(method)) {
+            return Status::Duplicate;
+        }
+
+        for(auto &entry : methods) {
+            if(!entry.handler) {
+                entry.method = method;
+                entry.handler = &handler;
+
+                return Status::Success;
+            }
+        }
+
+        return Status::NoMoreSpace;
+    }
+
+    void ProcessMsg(Buffer buf) override {
+        if(buf.len < sizeof(RpcRequestHdr)) {
+            stats.malformed++;
+            return;
+        }
+
+        auto out = net.AllocBuffer();
+
+        if(!out.ptr) {
+            LogNoBuffer();
+            stats.no_buffer++;
+            return;
+        }
+
+        auto req = static_cast<const RpcRequestHdr *>(buf.ptr);
+        auto resp = static_cast<RpcResponseHdr *>(out.ptr);
+
+        Buffer args {
+            static_cast<uint8_t *>(buf.ptr) + sizeof(RpcRequestHdr),
+            static_cast<BufferLen>(buf.len - sizeof(RpcRequestHdr)) };
+        Buffer result {
+            static_cast<uint8_t *>(out.ptr) + sizeof(RpcResponseHdr),
+            MaxResultLen };
+
+        auto handler = Find(req->method);
+        auto status = RpcStatus::NoMethod;
+
+        if(handler) {
+            stats.calls++;
+            status = handler->Call(args, result);
+        } else {
+            stats.no_method++;
+        }
+
+        if(status != RpcStatus::Ok) {
+            result.len = 0;
+        }
+
+        resp->tag = req->tag;
+        resp->status = static_cast<uint8_t>(status);
+        out.len = static_cast<BufferLen>(sizeof(RpcResponseHdr) + result.len);
+
+        if(net.Send(response_port, out) != Status::Success) {
+            net.FreeBuffer(out);
+            LogNoBuffer();
+            stats.no_buffer++;
+        }
+    }
+
+    const RpcServerStats &GetStats() const {
+        return stats;
+    }
+
+    void ClearStats() {
+        stats.Clear();
+    }
+
+private:
+    //
+    // Types.
+    //
+    struct Entry {
+        uint8_t method;
+        RpcMethod *handler;
+    };
+
+    //
+    // Functions.
+    //
+    RpcMethod *Find(uint8_t method) const {
+        for(auto &entry : methods) {
+            if(entry.handler && entry.method == method) {
+                return entry.handler;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // logging
+#define LOGGER_PREFIX_RPC "[SDGRAM-RPC] "
+
+    static void LogNoBuffer() {
+        LogVerboseLn(LOGGER_PREFIX_RPC "no buffer for the response");
+    }
+
+    //
+    // Data.
+    //
+    Net &net;
+    Port request_port;
+    Port response_port;
+
+    Entry methods[MaxMethods];
+
+    RpcServerStats stats;
+};
+
+template<
+    typename Net,
+    uint8_t MaxPending = 8,
+    typename Clock = DefaultClock>
+class RpcClient : public Rcv {
+public:
+    static constexpr BufferLen MaxArgsLen =
+        Net::MaxBufferLen - sizeof(RpcRequestHdr);
+
+    RpcClient(
+        Net &net,
+        Port request_port,
+        Port response_port)
+            : net(net),
+            request_port(request_port),
+            response_port(response_port),
+            next_tag(0),
+            pending(),
+            stats() {
+        stats.Clear();
+    }
+
+    // Starts receiving responses.
+    Status Start() {
+        return net.RegisterReceiver(response_port, *this);
+    }
+
+    // Sends the request. The done callback is invoked once, with
+    // the response or after timeout_ms milliseconds without one.
+    // The tag passed to the callback is stored in tag if given.
+    Status Call(
+            uint8_t method,
+            const void *args,
+            BufferLen len,
+            RpcDone &done,
+            uint16_t timeout_ms,
+            uint8_t *tag = nullptr) {
+        if(len > MaxArgsLen) {
+            return Status::Failure;
+        }
+
+        auto call = FindFree();
+
+        if(!call) {
+            return Status::NoMoreSpace;
+        }
+
+        auto buf = net.AllocBuffer();
+
+        if(!buf.ptr) {
+            return Status::NoMoreSpace;
+        }
+
+        auto hdr = static_cast<RpcRequestHdr *>(buf.ptr);
+        auto call_tag = NextTag();
+
+        hdr->tag = call_tag;
+        hdr->method = method;
+        memcpy(static_cast<uint8_t *>(buf.ptr) + sizeof(RpcRequestHdr), args, len);
+        buf.len = static_cast<BufferLen>(sizeof(RpcRequestHdr) + len);
+
+        auto status = net.Send(request_port, buf);
+
+        if(status != Status::Success) {
+            net.FreeBuffer(buf);
+            return status;
+        }
+
+        call->done = &done;
+        call->tag = call_tag;
+        call->deadline = Clock::Now() + timeout_ms;
+
+        stats.calls++;
+
+        if(tag) {
+            *tag = call->tag;
+        }
+
+        return Status::Success;
+    }
+
+    // Completes the calls that timed out.
+    void Process() {
+        auto now = Clock::Now();
+
+        for(auto &call : pending) {
+            if(!call.done || static_cast<int32_t>(now - call.deadline) < 0) {
+                continue;
+            }
+
+            stats.timeouts++;
+            Complete(call, RpcStatus::Timeout, Buffer { nullptr, 0 });
+        }
+    }
+
+    void ProcessMsg(Buffer buf) override {
+        if(buf.len < sizeof(RpcResponseHdr)) {
+            stats.late++;
+            return;
+        }
+
+        auto hdr = static_cast<const RpcResponseHdr *>(buf.ptr);
+        auto call = FindPending(hdr->tag);
+
+        if(!call) {
+            LogLateResponse(hdr->tag);
+            stats.late++;
+            return;
+        }
+
+        stats.responses++;
+
+        Complete(*call, static_cast<RpcStatus>(hdr->status), Buffer {
+            static_cast<uint8_t *>(buf.ptr) + sizeof(RpcResponseHdr),
+            static_cast<BufferLen>(buf.len - sizeof(RpcResponseHdr)) });
+    }
+
+    // Calls waiting for a response.
+    uint8_t Pending() const {
+        uint8_t count = 0;
+
+        for(auto &call : pending) {
+            if(call.done) {
+                count++;
+            }
+        }
+
+        return count;
+    }
+
+    const RpcClientStats &GetStats() const {
+        return stats;
+    }
+
+    void ClearStats() {
+        stats.Clear();
+    }
+
+private:
+    //
+    // Types.
+    //
+    struct Outstanding {
+        RpcDone *done;
+        uint8_t tag;
+        uint32_t deadline;
+    };
+
+    //
+    // Functions.
+    //
+    Outstanding *FindFree() {
+        for(auto &call : pending) {
+            if(!call.done) {
+                return &call;
+            }
+        }
+
+        return nullptr;
+    }
+
+    Outstanding *FindPending(uint8_t tag) {
+        for(auto &call : pending) {
+            if(call.done && call.tag == tag) {
+                return &call;
+            }
+        }
+
+        return nullptr;
+    }
+
+    // Tags cycle through all values, which keeps a late response
+    // from matching a newer call.
+    uint8_t NextTag() {
+        while(FindPending(next_tag)) {
+            next_tag++;
+        }
+
+        return next_tag++;
+    }
+
+    // The slot is free again when the callback runs, so the
+    // callback may make another call.
+    void Complete(Outstanding &call, RpcStatus status, Buffer result) {
+        auto done = call.done;
+        auto tag = call.tag;
+
+        call.done = nullptr;
+
+        if(status != RpcStatus::Ok) {
+            result.len = 0;
+        }
+
+        done->Done(tag, status, result);
+    }
+
+    // logging
+#define LOGGER_PREFIX_RPC "[SDGRAM-RPC] "
+
+    static void LogLateResponse(uint8_t tag) {
+        LogVerbose(LOGGER_PREFIX_RPC "response without a call ");
+        LogVerboseLn(tag);
+    }
+
+    //
+    // Data.
+    //
+    Net &net;
+    Port request_port;
+    Port response_port;
+
+    uint8_t next_tag;
+    Outstanding pending[MaxPending];
+
+    RpcClientStats stats;
+};
+
+}
@@ -0,0 +1,210 @@
+//
+// Typed messages bound to ports.
+//
+// A schema ties a packed message struct to a port and lists the
+// types of its fields:
+//
+//   #pragma pack(push, 1)
+//   struct Telemetry {
+//       uint16_t voltage;
+//       int16_t current;
+//       uint8_t flags[2];
+//   };
+//   #pragma pack(pop)
+//
+//   using TelemetryMsg = Schema<10, Telemetry, uint16_t, int16_t, uint8_t[2]>;
+//
+// Receivers get the message as a view into the receive buffer,
+// and senders fill the message in place in an allocated buffer,
+// so nothing is copied. A datagram whose size does not match the
+// message is dropped at dispatch.
+//
+// Format() is the matching Python struct format, "<HhBB" for the
+// message above, to use with send_struct and register_struct of
+// pysdgram. Messages are little-endian on both ends.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include "sdgram.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "typed messages assume a little-endian target"
+#endif
+
+namespace SerialDatagram {
+
+// The struct format character of a field type. Arrays repeat
+// the character of their element.
+template<typename T>
+struct FieldFormat;
+
+#define SDGRAM_FIELD_FORMAT(type, ch) \
+    template<> \
+    struct FieldFormat<type> { \
+        static constexpr char Char = ch; \
+        static constexpr uint16_t Count = 1; \
+    }
+
+SDGRAM_FIELD_FORMAT(char, 'c');
+SDGRAM_FIELD_FORMAT(bool, '?');
+SDGRAM_FIELD_FORMAT(int8_t, 'b');
+SDGRAM_FIELD_FORMAT(uint8_t, 'B');
+SDGRAM_FIELD_FORMAT(int16_t, 'h');
+SDGRAM_FIELD_FORMAT(uint16_t, 'H');
+SDGRAM_FIELD_FORMAT(int32_t, 'i');
+SDGRAM_FIELD_FORMAT(uint32_t, 'I');
+SDGRAM_FIELD_FORMAT(int64_t, 'q');
+SDGRAM_FIELD_FORMAT(uint64_t, 'Q');
+SDGRAM_FIELD_FORMAT(float, 'f');
+
+// double is four bytes on AVR
+SDGRAM_FIELD_FORMAT(double, sizeof(double) == 8 ? 'd' : 'f');
+
+#undef SDGRAM_FIELD_FORMAT
+
+template<typename T, uint16_t N>
+struct FieldFormat<T[N]> {
+    static constexpr char Char = FieldFormat<T>::Char;
+    static constexpr uint16_t Count = N * FieldFormat<T>::Count;
+};
+
+template<typename... Fields>
+struct SchemaFormat {
+    static constexpr uint16_t Len = 1 + (FieldFormat<Fields>::Count + ... + 0);
+
+    constexpr SchemaFormat()
+            : str() {
+        uint16_t next = 0;
+
+        str[next++] = '<';
+
+        const char chars[] = { FieldFormat<Fields>::Char..., 0 };
+        const uint16_t counts[] = { FieldFormat<Fields>::Count..., 0 };
+
+        for(uint16_t i = 0;i < sizeof...(Fields);i++) {
+            for(uint16_t j = 0;j < counts[i];j++) {
+                str[next++] = chars[i];
+            }
+        }
+
+        str[next] = '\0';
+    }
+
+    char str[Len + 1];
+};
+
+template<
+    Port P,
+    typename Msg,
+    typename... Fields>
+class Schema {
+public:
+    using Type = Msg;
+
+    static constexpr Port MsgPort = P;
+    static constexpr BufferLen Size = sizeof(Msg);
+
+    // The payload of a datagram has no alignment, and the layout
+    // must not depend on the compiler.
+    static_assert(alignof(Msg) == 1, "declare the message within #pragma pack(push, 1)");
+    static_assert((sizeof(Fields) + ... + 0) == sizeof(Msg), "the fields do not cover the message");
+
+    static constexpr const char *Format() {
+        return format.str;
+    }
+
+    // Returns null if the size does not match.
+    static const Msg *View(Buffer buf) {
+        return buf.len == Size
+            ? static_cast<const Msg *>(buf.ptr)
+            : nullptr;
+    }
+
+    // Allocates a buffer for the message. Returns null if there is
+    // no free buffer.
+    template<typename Net>
+    static Msg *Alloc(Net &net, Buffer &buf) {
+        static_assert(Size <= Net::MaxBufferLen);
+
+        buf = net.AllocBuffer();
+
+        if(!buf.ptr) {
+            return nullptr;
+        }
+
+        buf.len = Size;
+
+        return static_cast<Msg *>(buf.ptr);
+    }
+
+    // On failure the buffer stays with the caller.
+    template<typename Net>
+    static Status Send(Net &net, Buffer buf) {
+        return net.Send(MsgPort, buf);
+    }
+
+private:
+    static constexpr SchemaFormat<Fields...> format {};
+};
+
+// Receives the messages of a schema.
+template<typename Schema>
+class SchemaRcv : public Rcv {
+public:
+    using Msg = typename Schema::Type;
+
+    SchemaRcv()
+            : size_errors(0) {
+        // empty
+    }
+
+    template<typename Net>
+    Status Start(Net &net) {
+        return net.RegisterReceiver(Schema::MsgPort, *this);
+    }
+
+    void ProcessMsg(Buffer buf) final {
+        auto msg = Schema::View(buf);
+
+        if(!msg) {
+            LogSizeMismatch(buf.len);
+            size_errors++;
+            return;
+        }
+
+        ProcessTyped(*msg);
+    }
+
+    // The message is valid until the callback returns.
+    virtual void ProcessTyped(const Msg &msg) = 0;
+
+    // Datagrams dropped because of their size.
+    uint16_t SizeErrors() const {
+        return size_errors;
+    }
+
+private:
+    //
+    // Functions.
+    //
+
+    // logging
+#define LOGGER_PREFIX_SCHEMA "[SDGRAM-SCHEMA] "
+
+    static void LogSizeMismatch(BufferLen len) {
+        LogVerbose(LOGGER_PREFIX_SCHEMA "size mismatch on port ");
+        LogVerbose(Schema::MsgPort);
+        LogVerbose(" ");
+        LogVerboseLn(len);
+    }
+
+    //
+    // Data.
+    //
+    uint16_t size_errors;
+};
+
+}
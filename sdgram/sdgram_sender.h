@@ -6,9 +6,10 @@
 
 #pragma once
 
-#include "crc16.h"
-
 #include "sdgram_defs.h"
+#include "sdgram_prot.h"
+#include "sdgram_flow_control.h"
+#include "sdgram_framing.h"
 #include "sdgram_log.h"
 #include "static_queue.h"
 
@@ -17,34 +18,63 @@ namespace SerialDatagram {
 template<
     typename Stream,
     typename BufAlloc,
-    uint16_t TotalBufCount>
+    uint16_t TotalBufCount,
+    typename FlowControl = NoFlowControl,
+    typename Framing = MagicFraming<>>
 class Sender {
 public:
     Sender(
         Stream &stream,
-        BufAlloc &buf_alloc)
+        BufAlloc &buf_alloc,
+        FlowControl &flow_control)
             : stream(stream),
             buf_alloc(buf_alloc),
-            written(0) {
+            flow_control(flow_control),
+            written(0),
+            queued_bytes(0),
+            sent_bytes(0),
+            sent_frames(0),
+            coalesced(0),
+            ctrl_start(0),
+            ctrl_len(0),
+            ctrl_written(0) {
         // empty
     }
 
-    Status Send(Port port, Buffer buf) {
-        CreateHdrAndTrl(port, buf);
-
-        SendDatagram(buf);
-
-        return Status::Success;
+    // On failure the buffer stays with the caller.
+    Status Send(
+            Port port,
+            Buffer buf,
+            uint8_t size_flags = 0,
+            bool coalesce = false,
+            SendDone *done = nullptr,
+            uint16_t token = 0) {
+        Framing::CreateFrame(port, buf, size_flags);
+
+        return SendDatagram(buf, port, coalesce, done, token);
     }
 
-    // Adds the header and the trailer to the buffer.
-    void PrepareDatagram(Port port, Buffer &buf) {
-        CreateHdrAndTrl(port, buf);
+    // Turns the payload in the buffer into a frame.
+    void PrepareDatagram(Port port, Buffer &buf, uint8_t size_flags = 0) {
+        Framing::CreateFrame(port, buf, size_flags);
     }
 
-    // Send an already prepared datagram.
-    Status SendDatagram(Buffer &buf) {
-        if(!queued.IsEmpty()) {
+    // Send an already prepared datagram. When coalescing, the
+    // datagram takes the place of a queued datagram of the same
+    // port that has not been started yet. The done callback gets
+    // the token once the datagram leaves, which may be before this
+    // returns.
+    Status SendDatagram(
+            Buffer &buf,
+            Port port = InvalidPort,
+            bool coalesce = false,
+            SendDone *done = nullptr,
+            uint16_t token = 0) {
+        if(!queued.IsEmpty() || IsCtrlPending()) {
+            if(coalesce && Replace(port, buf, done, token)) {
+                return Status::Success;
+            }
+
             if(queued.IsFull()) {
                 LogQueueFull();
                 return Status::NoMoreSpace;
@@ -52,19 +82,26 @@ public:
 
             LogAddToQueue();
 
-            queued.Push(buf);
+            queued.Push(Queued { buf, port, done, token });
+            queued_bytes += buf.len;
             return Status::Success;
         }
 
-        auto just_written = WriteData(buf, 0);
+        auto just_written = WriteData(buf, 0, NoLimit);
 
         if(just_written == buf.len) {
             buf_alloc.Free(buf.ptr);
+            sent_frames++;
 
             LogMsgSend();
+
+            if(done) {
+                done->Done(token, true);
+            }
         } else {
             written = just_written;
-            queued.Push(buf);
+            queued.Push(Queued { buf, port, done, token });
+            queued_bytes += buf.len;
 
             LogMsgPartialSend();
         }
@@ -72,18 +109,130 @@ public:
         return Status::Success;
     }
 
-    void Process() {
-        while(!queued.IsEmpty()) {
-            auto &buf = queued.Peek();
+    // True if SendDatagram() would take a datagram of the port.
+    bool Accepts(Port port, bool coalesce) {
+        return !queued.IsFull()
+            || (coalesce && FindReplaceable(port));
+    }
+
+    // Control datagrams are sent from a dedicated buffer between
+    // queued datagrams. They bypass flow control.
+    Status SendControl(const void *payload, BufferLen len) {
+        if(IsCtrlPending() || len > MaxCtrlPayload) {
+            return Status::NoMoreSpace;
+        }
+
+        memcpy(ctrl + Framing::HdrRoom, payload, len);
+
+        Buffer buf { ctrl + Framing::HdrRoom, len };
+        Framing::CreateFrame(ControlPort, buf, 0);
+        ctrl_len = buf.len;
+        ctrl_start = static_cast<uint8_t>(static_cast<uint8_t *>(buf.ptr) - ctrl);
+
+        if(!written) {
+            uint16_t max_bytes = NoLimit;
+
+            WriteCtrl(max_bytes);
+        }
+
+        return Status::Success;
+    }
+
+    bool HasQueued() const {
+        return !queued.IsEmpty();
+    }
+
+    // The queued datagrams of the listener are still sent, but it
+    // is no longer told.
+    void ForgetDone(SendDone &done) {
+        for(uint8_t i = 0;i < queued.Size();i++) {
+            auto &entry = queued.At(i);
+
+            if(entry.done == &done) {
+                entry.done = nullptr;
+            }
+        }
+    }
+
+    // True if datagrams or a control datagram wait to be written.
+    bool HasPending() const {
+        return !queued.IsEmpty() || IsCtrlPending();
+    }
+
+    // True if the next bytes to write wait for credits.
+    bool IsBlocked() {
+        if(queued.IsEmpty()) {
+            return false;
+        }
+
+        return !flow_control.CanStart(written ? 1 : queued.Peek().buf.len);
+    }
+
+    // Bytes of queued datagrams that are still to be written.
+    uint16_t QueuedBytes() const {
+        return queued_bytes - written;
+    }
+
+    // Total bytes written to the stream. The counter wraps.
+    uint16_t SentBytes() const {
+        return sent_bytes;
+    }
+
+    // Datagrams that left the queue, either written to the
+    // stream in full or replaced by a newer datagram. Control
+    // datagrams are not counted. The counter wraps.
+    uint16_t SentFrames() const {
+        return sent_frames;
+    }
+
+    // Datagrams replaced by a newer one. The counter wraps.
+    uint16_t CoalescedFrames() const {
+        return coalesced;
+    }
+
+    // Returns true if any bytes were written.
+    bool Process() {
+        uint16_t max_bytes = NoLimit;
+        uint16_t max_frames = NoLimit;
+
+        return Process(max_bytes, max_frames);
+    }
+
+    // Writes at most max_bytes and finishes at most max_frames
+    // datagrams, and takes what it did off both. Returns true
+    // if any bytes were written.
+    bool Process(uint16_t &max_bytes, uint16_t &max_frames) {
+        auto start = sent_bytes;
+
+        while((!queued.IsEmpty() || IsCtrlPending()) && max_bytes && max_frames) {
+            if(!written && IsCtrlPending()) {
+                if(!WriteCtrl(max_bytes)) {
+                    break;
+                }
+
+                continue;
+            }
+
+            auto &buf = queued.Peek().buf;
 
-            auto just_written = WriteData(buf, written);
+            auto just_written = WriteData(buf, written, max_bytes);
+            max_bytes -= just_written;
 
             if(just_written + written == buf.len) {
                 buf_alloc.Free(buf.ptr);
-                queued.Pop();
+                queued_bytes -= buf.len;
                 written = 0;
+                sent_frames++;
+                max_frames--;
 
                 LogQueuedMsgSend(just_written);
+
+                // the callback may send again
+                auto sent = queued.Pop();
+
+                if(sent.done) {
+                    sent.done->Done(sent.token, true);
+                }
             } else {
                 written += just_written;
 
@@ -92,51 +241,127 @@ public:
                 break;
             }
         }
+
+        return sent_bytes != start;
     }
 
 protected:
+    //
+    // Types.
+    //
+    struct Queued {
+        Buffer buf;
+        Port port;
+        SendDone *done;
+        uint16_t token;
+    };
+
     //
     // Functions.
     //
-    static void CreateHdrAndTrl(Port port, Buffer &buf) {
-        auto buf_ptr = static_cast<uint8_t *>(buf.ptr);
-        auto len = static_cast<BufferLen>(
-            buf.len + sizeof(DatagramHdr) + sizeof(DatagramTrl));
+    bool Replace(Port port, Buffer &buf, SendDone *done, uint16_t token) {
+        auto entry = FindReplaceable(port);
+
+        if(!entry) {
+            return false;
+        }
+
+        auto replaced = *entry;
 
-        auto hdr = reinterpret_cast<DatagramHdr *>(
-            buf_ptr - sizeof(DatagramHdr));
+        buf_alloc.Free(entry->buf.ptr);
+        queued_bytes = queued_bytes - entry->buf.len + buf.len;
+        *entry = Queued { buf, port, done, token };
 
-        hdr->magic = DatagramHdrMagic;
-        hdr->port = port;
-        hdr->crc = 0;
-        hdr->size = buf.len;
+        sent_frames++;
+        coalesced++;
 
-        auto trl = reinterpret_cast<DatagramTrl *>(
-            buf_ptr + buf.len);
-        trl->magic = DatagramTrlMagic;
+        LogReplaced();
 
-        hdr->crc = Crc16Usb::Calc(hdr, len);
+        if(replaced.done) {
+            replaced.done->Done(replaced.token, false);
+        }
 
-        buf.ptr = hdr;
-        buf.len = len;
+        return true;
     }
 
-    uint16_t WriteData(const Buffer &buf, uint16_t offset) {
-        auto available = stream.availableForWrite();
+    Queued *FindReplaceable(Port port) {
+        // The head may be partly written.
+        for(uint8_t i = written ? 1 : 0;i < queued.Size();i++) {
+            auto &entry = queued.At(i);
 
-        if(!available) {
+            if(entry.port == port) {
+                return &entry;
+            }
+        }
+
+        return nullptr;
+    }
+
+    bool IsCtrlPending() const {
+        return ctrl_len != 0;
+    }
+
+    uint16_t WriteData(const Buffer &buf, uint16_t offset, uint16_t max_bytes) {
+        if(!offset && !flow_control.CanStart(buf.len)) {
+            return 0;
+        }
+
+        auto available = flow_control.TxAllowance(
+            static_cast<uint16_t>(stream.availableForWrite()));
+
+        if(available > max_bytes) {
+            available = max_bytes;
+        }
+
+        return WriteBytes(
+            static_cast<uint8_t *>(buf.ptr) + offset,
+            buf.len - offset,
+            available);
+    }
+
+    // Returns true when the whole control datagram is written.
+    bool WriteCtrl(uint16_t &max_bytes) {
+        auto available = static_cast<uint16_t>(stream.availableForWrite());
+
+        if(available > max_bytes) {
+            available = max_bytes;
+        }
+
+        auto just_written = WriteBytes(
+            ctrl + ctrl_start + ctrl_written,
+            ctrl_len - ctrl_written,
+            available);
+
+        ctrl_written += just_written;
+        max_bytes -= just_written;
+
+        if(ctrl_written < ctrl_len) {
             return false;
         }
 
-        auto left_to_write = buf.len - offset;
-        auto buf_ptr = static_cast<uint8_t *>(buf.ptr) + offset;
+        ctrl_len = 0;
+        ctrl_written = 0;
+
+        LogCtrlSend();
+
+        return true;
+    }
 
-        if(available >= left_to_write) {
-            stream.write(buf_ptr, left_to_write);
-            return left_to_write;
+    uint16_t WriteBytes(
+            uint8_t *buf_ptr,
+            uint16_t left_to_write,
+            uint16_t available) {
+        if(!available) {
+            return 0;
+        }
+
+        if(available > left_to_write) {
+            available = left_to_write;
         }
 
         stream.write(buf_ptr, available);
+        flow_control.Sent(available);
+        sent_bytes += available;
 
         return available;
     }
@@ -148,6 +373,10 @@ protected:
         LogVerboseLn(LOGGER_PREFIX "Deffered queue full");
     }
 
+    static void LogReplaced() {
+        LogVerboseLn(LOGGER_PREFIX "Queued datagram replaced");
+    }
+
     static void LogMsgSend() {
         LogVerboseLn(LOGGER_PREFIX "Datagram sent");
     }
@@ -171,14 +400,37 @@ protected:
         LogVerboseLn(just_written);
     }
 
+    static void LogCtrlSend() {
+        LogVerboseLn(LOGGER_PREFIX "Control datagram sent");
+    }
+
+    //
+    // Constants.
+    //
+    static constexpr BufferLen MaxCtrlPayload = 8;
+
+    // The queue holds less than this, so Process() without
+    // limits never runs out.
+    static constexpr uint16_t NoLimit = 0xffff;
+
     //
     // Data.
     //
     Stream &stream;
     BufAlloc &buf_alloc;
+    FlowControl &flow_control;
 
-    StaticQueue<Buffer, TotalBufCount> queued;
+    StaticQueue<Queued, TotalBufCount> queued;
     uint16_t written;
+    uint16_t queued_bytes;
+    uint16_t sent_bytes;
+    uint16_t sent_frames;
+    uint16_t coalesced;
+
+    uint8_t ctrl[Framing::HdrRoom + MaxCtrlPayload + Framing::TrlRoom];
+    uint8_t ctrl_start;
+    uint8_t ctrl_len;
+    uint8_t ctrl_written;
 };
 
 }
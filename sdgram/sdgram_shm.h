@@ -0,0 +1,438 @@
+//
+// A stream over shared memory.
+//
+// ShmStream connects two processes on one machine through a region
+// of POSIX shared memory, so that services that use the protocol
+// locally talk through the same ports and receivers without a tty:
+//
+//   ShmStream stream;
+//   stream.Create("/sdgram-local");    // the other end calls Open()
+//   Net<ShmStream> net(stream);
+//
+// The region holds a ring for each direction. A ring has a single
+// writer and a single reader, which agree through the free-running
+// head and tail counters alone, so neither ever takes a lock. Bytes
+// are copied in and out in bulk. The reader takes a snapshot of the
+// head and hands out bytes from it, and gives the space back when
+// the snapshot runs out, so reading a byte touches no shared line.
+//
+// Wait() sleeps until the other end has written bytes or freed space
+// since the last call. On Linux each end has a futex in the region,
+// which the other end bumps, and a system call is made only when
+// the end sleeps on it. Elsewhere Wait() polls.
+//
+// The creator removes the name when it closes, and the mapping stays
+// until both ends have closed. Both ends must run on the same
+// architecture and build, as the region holds std::atomic counters.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#if defined(ARDUINO)
+#error "sdgram_shm.h is for hosts only"
+#endif
+
+#include <atomic>
+#include <cstring>
+#include <new>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__linux__)
+#include <climits>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
+
+#include "sdgram_defs.h"
+
+namespace SerialDatagram {
+
+//
+// Constants.
+//
+constexpr uint32_t ShmMagic = 0x5344534d;
+
+constexpr uint32_t ShmDefaultCapacity = 0x10000;
+
+//
+// Types.
+//
+// One direction. The counters sit on lines of their own, so that the
+// writer and the reader do not take the line from each other.
+struct ShmRing {
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+};
+
+// What wakes one end.
+struct ShmWaker {
+    // bumped by the other end for every write and freed space
+    alignas(64) std::atomic<uint32_t> seq;
+    std::atomic<uint32_t> waiting;
+};
+
+struct ShmRegion {
+    std::atomic<uint32_t> magic;
+    uint32_t capacity;
+
+    // the creator writes to the first ring and reads from the
+    // second, and is woken through the first waker
+    ShmRing rings[2];
+    ShmWaker wakers[2];
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free);
+
+class ShmStream {
+public:
+    ShmStream()
+            : region(nullptr),
+            map_len(0),
+            rx(nullptr),
+            tx(nullptr),
+            rx_data(nullptr),
+            tx_data(nullptr),
+            mask(0),
+            waker(nullptr),
+            peer_waker(nullptr),
+            seen_seq(0),
+            rx_tail(0),
+            rx_head(0),
+            rx_released(0),
+            created(false) {
+        name[0] = 0;
+    }
+
+    ShmStream(const ShmStream &) = delete;
+    ShmStream &operator=(const ShmStream &) = delete;
+
+    ~ShmStream() {
+        Close();
+    }
+
+    // Creates the region with rings of capacity bytes, a power of
+    // two, and replaces a region left under the name.
+    Status Create(
+            const char *shm_name,
+            uint32_t capacity = ShmDefaultCapacity) {
+        if(region || !capacity || (capacity & (capacity - 1))
+                || strlen(shm_name) >= sizeof(name)) {
+            return Status::Failure;
+        }
+
+        shm_unlink(shm_name);
+
+        int fd = shm_open(shm_name, O_RDWR | O_CREAT | O_EXCL, 0600);
+
+        if(fd < 0) {
+            return Status::Failure;
+        }
+
+        size_t len = sizeof(ShmRegion) + 2 * static_cast<size_t>(capacity);
+
+        if(ftruncate(fd, static_cast<off_t>(len)) != 0 || !Map(fd, len)) {
+            close(fd);
+            shm_unlink(shm_name);
+            return Status::Failure;
+        }
+
+        close(fd);
+
+        auto shared = new(region) ShmRegion;
+
+        shared->capacity = capacity;
+
+        for(auto &ring : shared->rings) {
+            ring.head.store(0, std::memory_order_relaxed);
+            ring.tail.store(0, std::memory_order_relaxed);
+        }
+
+        for(auto &end : shared->wakers) {
+            end.seq.store(0, std::memory_order_relaxed);
+            end.waiting.store(0, std::memory_order_relaxed);
+        }
+
+        // the other end may map it from here on
+        shared->magic.store(ShmMagic, std::memory_order_release);
+
+        strcpy(name, shm_name);
+        created = true;
+
+        Attach(0);
+
+        return Status::Success;
+    }
+
+    // Opens the region another process created.
+    Status Open(const char *shm_name) {
+        if(region) {
+            return Status::Failure;
+        }
+
+        int fd = shm_open(shm_name, O_RDWR, 0);
+
+        if(fd < 0) {
+            return Status::Failure;
+        }
+
+        struct stat st;
+
+        if(fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) <= sizeof(ShmRegion)
+                || !Map(fd, static_cast<size_t>(st.st_size))) {
+            close(fd);
+            return Status::Failure;
+        }
+
+        close(fd);
+
+        if(region->magic.load(std::memory_order_acquire) != ShmMagic
+                || sizeof(ShmRegion) + 2 * static_cast<size_t>(region->capacity) != map_len) {
+            Unmap();
+            return Status::Failure;
+        }
+
+        Attach(1);
+
+        return Status::Success;
+    }
+
+    void Close() {
+        if(!region) {
+            return;
+        }
+
+        Release();
+        Unmap();
+
+        if(created) {
+            shm_unlink(name);
+            created = false;
+        }
+    }
+
+    bool IsOpen() const {
+        return region != nullptr;
+    }
+
+    uint16_t available() {
+        if(rx_tail == rx_head) {
+            Refill();
+        }
+
+        return Clamp(rx_head - rx_tail);
+    }
+
+    uint8_t read() {
+        return rx_data[rx_tail++ & mask];
+    }
+
+    // Reads up to len bytes, and returns how many it read.
+    uint16_t readBytes(void *buf, uint16_t len) {
+        if(rx_head - rx_tail < len) {
+            Refill();
+        }
+
+        uint32_t have = rx_head - rx_tail;
+
+        if(len > have) {
+            len = static_cast<uint16_t>(have);
+        }
+
+        Copy(static_cast<uint8_t *>(buf), rx_data, rx_tail, len);
+        rx_tail += len;
+
+        return len;
+    }
+
+    uint16_t availableForWrite() const {
+        uint32_t used = tx->head.load(std::memory_order_relaxed)
+            - tx->tail.load(std::memory_order_acquire);
+
+        return Clamp(mask + 1 - used);
+    }
+
+    uint16_t write(void *buf, uint16_t buf_len) {
+        uint32_t head = tx->head.load(std::memory_order_relaxed);
+        uint32_t space = mask + 1 - (head - tx->tail.load(std::memory_order_acquire));
+
+        if(buf_len > space) {
+            buf_len = static_cast<uint16_t>(space);
+        }
+
+        if(!buf_len) {
+            return 0;
+        }
+
+        uint32_t start = head & mask;
+        uint32_t first = mask + 1 - start;
+
+        if(first > buf_len) {
+            first = buf_len;
+        }
+
+        memcpy(tx_data + start, buf, first);
+        memcpy(tx_data, static_cast<uint8_t *>(buf) + first, buf_len - first);
+
+        tx->head.store(head + buf_len, std::memory_order_release);
+        Wake();
+
+        return buf_len;
+    }
+
+    // Waits up to timeout_ms for the other end to write bytes or
+    // free space, unless it did since the last call, or there are
+    // bytes to read. Returns false on a timeout.
+    bool Wait(uint32_t timeout_ms) {
+        waker->waiting.store(1, std::memory_order_seq_cst);
+
+        uint32_t seq = waker->seq.load(std::memory_order_seq_cst);
+        bool woken = seq != seen_seq || available();
+
+#if defined(__linux__)
+        if(!woken) {
+            timespec timeout {
+                static_cast<time_t>(timeout_ms / 1000),
+                static_cast<long>(timeout_ms % 1000) * 1000000 };
+
+            // returns at once if seq moved since it was loaded
+            syscall(SYS_futex, &waker->seq, FUTEX_WAIT, seq, &timeout, nullptr, 0);
+        }
+#else
+        for(uint32_t waited = 0;waited < timeout_ms && !woken;waited++) {
+            timespec ms { 0, 1000000 };
+
+            nanosleep(&ms, nullptr);
+
+            woken = waker->seq.load(std::memory_order_seq_cst) != seq;
+        }
+#endif
+
+        waker->waiting.store(0, std::memory_order_relaxed);
+        seen_seq = waker->seq.load(std::memory_order_seq_cst);
+
+        return woken || seen_seq != seq || available();
+    }
+
+private:
+    //
+    // Functions.
+    //
+    static uint16_t Clamp(uint32_t len) {
+        return len < 0xffff ? static_cast<uint16_t>(len) : 0xffff;
+    }
+
+    bool Map(int fd, size_t len) {
+        void *ptr = mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+
+        if(ptr == MAP_FAILED) {
+            return false;
+        }
+
+        region = static_cast<ShmRegion *>(ptr);
+        map_len = len;
+
+        return true;
+    }
+
+    void Unmap() {
+        munmap(region, map_len);
+
+        region = nullptr;
+        map_len = 0;
+        rx = nullptr;
+        tx = nullptr;
+        waker = nullptr;
+        peer_waker = nullptr;
+    }
+
+    void Attach(uint8_t tx_ring) {
+        auto data = reinterpret_cast<uint8_t *>(region + 1);
+        uint8_t rx_ring = tx_ring ^ 1;
+
+        mask = region->capacity - 1;
+
+        tx = &region->rings[tx_ring];
+        rx = &region->rings[rx_ring];
+        waker = &region->wakers[tx_ring];
+        peer_waker = &region->wakers[rx_ring];
+        seen_seq = waker->seq.load(std::memory_order_relaxed);
+        tx_data = data + tx_ring * region->capacity;
+        rx_data = data + rx_ring * region->capacity;
+
+        rx_tail = rx->tail.load(std::memory_order_relaxed);
+        rx_head = rx_tail;
+        rx_released = rx_tail;
+    }
+
+    // Gives the space of the bytes read back to the writer.
+    void Release() {
+        if(rx_released != rx_tail) {
+            rx->tail.store(rx_tail, std::memory_order_release);
+            rx_released = rx_tail;
+            Wake();
+        }
+    }
+
+    // Releases and takes a new snapshot.
+    void Refill() {
+        Release();
+        rx_head = rx->head.load(std::memory_order_acquire);
+    }
+
+    void Copy(uint8_t *out, const uint8_t *data, uint32_t pos, uint32_t len) const {
+        uint32_t start = pos & mask;
+        uint32_t first = mask + 1 - start;
+
+        if(first > len) {
+            first = len;
+        }
+
+        memcpy(out, data + start, first);
+        memcpy(out + first, data, len - first);
+    }
+
+    // Tells the other end, and wakes it if it sleeps.
+    void Wake() {
+        peer_waker->seq.fetch_add(1, std::memory_order_seq_cst);
+
+#if defined(__linux__)
+        if(peer_waker->waiting.load(std::memory_order_seq_cst)) {
+            syscall(SYS_futex, &peer_waker->seq, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+        }
+#endif
+    }
+
+    //
+    // Data.
+    //
+    ShmRegion *region;
+    size_t map_len;
+
+    ShmRing *rx;
+    ShmRing *tx;
+    uint8_t *rx_data;
+    uint8_t *tx_data;
+    uint32_t mask;
+
+    ShmWaker *waker;
+    ShmWaker *peer_waker;
+    uint32_t seen_seq;
+
+    // the bytes read, the head as last seen, and the tail the
+    // writer was last told of
+    uint32_t rx_tail;
+    uint32_t rx_head;
+    uint32_t rx_released;
+
+    char name[64];
+    bool created;
+};
+
+}
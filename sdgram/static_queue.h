@@ -32,6 +32,23 @@ public:
         return items[head];
     }
 
+    uint8_t Size() const {
+        if(is_full) {
+            return Capacity;
+        }
+
+        return tail >= head
+            ? tail - head
+            : Capacity - head + tail;
+    }
+
+    // Items are counted from the head.
+    T &At(uint8_t index) {
+        auto pos = static_cast<uint16_t>(head + index);
+
+        return items[pos >= Capacity ? pos - Capacity : pos];
+    }
+
     T Pop() {
         if(head == tail) {
             is_full = false;
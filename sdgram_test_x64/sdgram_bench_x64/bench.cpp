@@ -0,0 +1,1575 @@
+//
+// Benchmarking the sdgram on x64.
+//
+// Run all benchmarks, or only the ones whose names are
+// given on the command line.
+//
+// author: aleksandar
+//
+
+#include <array>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <random>
+#include <utility>
+#include <vector>
+
+#include "quiet_logger.h"
+#include "sdgram.h"
+#include "sdgram_bond.h"
+#include "sdgram_mux.h"
+#include "sdgram_packer.h"
+#include "sdgram_router.h"
+#include "sdgram_rpc.h"
+#include "memory_buffer_pair.h"
+#include "throttled_serial.h"
+
+#if defined(__linux__)
+#include <string>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sdgram_shm.h"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+// 115200 baud, 8N1
+constexpr double LinkBytesPerSec = 115200.0 / 10;
+
+constexpr size_t DefaultCapacity = 2048;
+constexpr SerialDatagram::Port DefaultPort = 1;
+
+constexpr size_t DatagramOverhead =
+    SerialDatagram::DatagramHdrSize +
+    SerialDatagram::DatagramTrlSize;
+
+using Payload = std::vector<uint8_t>;
+
+static double NsPerOp(Clock::duration elapsed, size_t ops) {
+    return std::chrono::duration<double, std::nano>(elapsed).count() / ops;
+}
+
+static double Goodput(size_t payload_bytes, size_t wire_bytes) {
+    return LinkBytesPerSec * payload_bytes / wire_bytes;
+}
+
+class CountRcv : public SerialDatagram::Rcv {
+public:
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        msgs++;
+        bytes += buf.len;
+    }
+
+    size_t msgs = 0;
+    size_t bytes = 0;
+};
+
+//
+// Compression.
+//
+
+struct CompressionConfig : SerialDatagram::DefaultConfig {
+    using Compression = SerialDatagram::RleCompression<1>;
+};
+
+using Codec = SerialDatagram::RleCompression<1>::Codec<
+    SerialDatagram::DefaultConfig::MaxBufferLen>;
+
+// A telemetry record: a counter, a few slowly changing
+// readings and mostly-zero sensor words.
+static Payload Telemetry(size_t i) {
+    Payload payload(SerialDatagram::DefaultConfig::MaxBufferLen, 0);
+
+    payload[0] = static_cast<uint8_t>(i);
+    payload[1] = static_cast<uint8_t>(i >> 8);
+
+    for(size_t s = 0;s < 4;s++) {
+        uint16_t reading = static_cast<uint16_t>(1000 + s * 100 + (i / 8) % 5);
+        memcpy(&payload[8 + s * 2], &reading, sizeof(reading));
+    }
+
+    payload[32] = static_cast<uint8_t>((i / 16) & 1);
+
+    return payload;
+}
+
+static Payload MostlyZero(size_t i) {
+    Payload payload(24, 0);
+
+    payload[(i * 5) % payload.size()] = static_cast<uint8_t>(i | 1);
+
+    return payload;
+}
+
+static Payload Random(size_t i) {
+    static std::mt19937 rng(1);
+
+    Payload payload(32);
+
+    for(auto &b : payload) {
+        b = static_cast<uint8_t>(rng());
+    }
+
+    return payload;
+}
+
+template<typename Net>
+static size_t WireBytes(
+        const std::function<Payload (size_t)> &gen,
+        size_t count,
+        bool compress) {
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_rcv = serial.CreateA();
+    auto serial_snd = serial.CreateB();
+    Net rcv_net(serial_rcv);
+    Net snd_net(serial_snd);
+    CountRcv rcv;
+
+    rcv_net.RegisterReceiver(DefaultPort, rcv);
+
+    if(compress) {
+        rcv_net.EnableCompression(DefaultPort);
+        snd_net.EnableCompression(DefaultPort);
+    }
+
+    size_t wire = 0;
+
+    for(size_t i = 0;i < count;i++) {
+        auto payload = gen(i);
+        auto buf = snd_net.AllocBuffer();
+
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        snd_net.Send(DefaultPort, buf);
+        wire += serial_rcv.available();
+
+        rcv_net.Process();
+    }
+
+    if(rcv.msgs != count) {
+        printf("  lost %zu datagrams\n", count - rcv.msgs);
+    }
+
+    return wire;
+}
+
+static void BenchCompression() {
+    constexpr size_t Count = 10000;
+
+    struct Workload {
+        const char *name;
+        std::function<Payload (size_t)> gen;
+    };
+
+    Workload workloads[] = {
+        { "telemetry", Telemetry },
+        { "mostly-zero", MostlyZero },
+        { "random", Random },
+    };
+
+    printf("%-12s %8s %8s %10s %10s %10s %10s\n",
+        "payload", "raw B", "rle B", "raw B/s", "rle B/s", "enc ns", "dec ns");
+
+    for(auto &w : workloads) {
+        size_t payload_bytes = 0;
+        std::vector<Payload> payloads;
+
+        for(size_t i = 0;i < Count;i++) {
+            payloads.push_back(w.gen(i));
+            payload_bytes += payloads.back().size();
+        }
+
+        auto raw = WireBytes<SerialDatagram::Net<SerialMock, CompressionConfig>>(
+            w.gen, Count, false);
+        auto rle = WireBytes<SerialDatagram::Net<SerialMock, CompressionConfig>>(
+            w.gen, Count, true);
+
+        // codec cost alone, without framing
+        Codec tx;
+        Codec rx;
+        tx.EnablePort(DefaultPort);
+        rx.EnablePort(DefaultPort);
+
+        std::vector<Payload> encoded;
+        std::vector<bool> compressed;
+
+        auto start = Clock::now();
+
+        for(auto &p : payloads) {
+            encoded.push_back(p);
+            SerialDatagram::Buffer buf {
+                encoded.back().data(),
+                static_cast<SerialDatagram::BufferLen>(p.size()) };
+            compressed.push_back(tx.Encode(DefaultPort, buf));
+            encoded.back().resize(buf.len);
+        }
+
+        auto enc = Clock::now() - start;
+
+        start = Clock::now();
+
+        for(size_t i = 0;i < Count;i++) {
+            SerialDatagram::Buffer buf {
+                encoded[i].data(),
+                static_cast<SerialDatagram::BufferLen>(encoded[i].size()) };
+            rx.Decode(DefaultPort, compressed[i], buf);
+        }
+
+        auto dec = Clock::now() - start;
+
+        printf("%-12s %8.1f %8.1f %10.0f %10.0f %10.1f %10.1f\n",
+            w.name,
+            static_cast<double>(raw) / Count,
+            static_cast<double>(rle) / Count,
+            Goodput(payload_bytes, raw),
+            Goodput(payload_bytes, rle),
+            NsPerOp(enc, Count),
+            NsPerOp(dec, Count));
+    }
+}
+
+//
+// Framing.
+//
+
+struct CobsConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::CobsFraming;
+};
+
+struct CompactConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::CompactFraming<>;
+};
+
+struct FramingResult {
+    double wire;
+    double ns;
+};
+
+template<typename Config>
+static FramingResult MeasureFraming(size_t size, size_t count) {
+    auto gen = [size](size_t i) {
+        Payload payload = Telemetry(i);
+        payload.resize(size);
+        return payload;
+    };
+
+    auto start = Clock::now();
+    auto wire = WireBytes<SerialDatagram::Net<SerialMock, Config>>(gen, count, false);
+    auto elapsed = Clock::now() - start;
+
+    return FramingResult {
+        static_cast<double>(wire) / count,
+        NsPerOp(elapsed, count) };
+}
+
+static void BenchFraming() {
+    constexpr size_t Count = 10000;
+
+    const size_t sizes[] = { 4, 8, 12, 24, 56 };
+
+    printf("%-8s %-8s %8s %10s %10s\n",
+        "payload", "framing", "wire B", "goodput", "ns/msg");
+
+    for(auto size : sizes) {
+        struct Row {
+            const char *name;
+            FramingResult result;
+        };
+
+        Row rows[] = {
+            { "magic", MeasureFraming<SerialDatagram::DefaultConfig>(size, Count) },
+            { "cobs", MeasureFraming<CobsConfig>(size, Count) },
+            { "compact", MeasureFraming<CompactConfig>(size, Count) },
+        };
+
+        for(auto &row : rows) {
+            printf("%-8zu %-8s %8.1f %10.0f %10.1f\n",
+                size,
+                row.name,
+                row.result.wire,
+                Goodput(size, static_cast<size_t>(row.result.wire)),
+                row.result.ns);
+        }
+    }
+}
+
+//
+// Feeding.
+//
+
+// Frames of the given framing, back to back.
+template<typename Config>
+static Payload EncodedFrames(size_t size, size_t count) {
+    using Framing = typename Config::Framing;
+
+    Payload bytes;
+    Payload storage(Framing::HdrRoom + size + Framing::TrlRoom);
+
+    for(size_t i = 0;i < count;i++) {
+        auto payload = Telemetry(i);
+        payload.resize(size);
+        memcpy(storage.data() + Framing::HdrRoom, payload.data(), size);
+
+        SerialDatagram::Buffer buf {
+            storage.data() + Framing::HdrRoom,
+            static_cast<SerialDatagram::BufferLen>(size) };
+
+        Framing::CreateFrame(DefaultPort, buf, 0);
+
+        auto frame = static_cast<uint8_t *>(buf.ptr);
+        bytes.insert(bytes.end(), frame, frame + buf.len);
+    }
+
+    return bytes;
+}
+
+// Returns the nanoseconds per frame of receiving the bytes
+// with Process() from the stream, or with Feed() in blocks.
+template<typename Config>
+static double ReceiveNs(const Payload &bytes, size_t count, bool feed) {
+    constexpr size_t Block = 1024;
+
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    MemoryBufferPair serial(Block);
+    auto serial_rcv = serial.CreateA();
+    auto serial_snd = serial.CreateB();
+    Net net(serial_rcv);
+    CountRcv rcv;
+
+    net.RegisterReceiver(DefaultPort, rcv);
+
+    Clock::duration elapsed { };
+
+    for(size_t i = 0;i < bytes.size();i += Block) {
+        auto len = static_cast<uint16_t>(std::min(Block, bytes.size() - i));
+        auto block = const_cast<uint8_t *>(bytes.data() + i);
+
+        if(feed) {
+            auto start = Clock::now();
+            net.Feed(block, len);
+            elapsed += Clock::now() - start;
+        } else {
+            serial_snd.write(block, len);
+
+            auto start = Clock::now();
+            net.Process();
+            elapsed += Clock::now() - start;
+        }
+    }
+
+    if(rcv.msgs != count) {
+        printf("  received %zu of %zu\n", rcv.msgs, count);
+    }
+
+    return NsPerOp(elapsed, count);
+}
+
+template<typename Config>
+static void PrintFeed(const char *name, size_t size) {
+    constexpr size_t Count = 20000;
+
+    auto bytes = EncodedFrames<Config>(size, Count);
+
+    printf("%-8zu %-8s %12.1f %12.1f\n",
+        size,
+        name,
+        ReceiveNs<Config>(bytes, Count, false),
+        ReceiveNs<Config>(bytes, Count, true));
+}
+
+static void BenchFeed() {
+    const size_t sizes[] = { 8, 24, 56 };
+
+    printf("%-8s %-8s %12s %12s\n", "payload", "framing", "process ns", "feed ns");
+
+    for(auto size : sizes) {
+        PrintFeed<SerialDatagram::DefaultConfig>("magic", size);
+        PrintFeed<CobsConfig>("cobs", size);
+        PrintFeed<CompactConfig>("compact", size);
+    }
+}
+
+//
+// Bonding.
+//
+
+constexpr uint16_t UnlimitedRate = 0xffff;
+
+static constexpr size_t Capacity(size_t) {
+    return DefaultCapacity;
+}
+
+// Sends datagrams whenever a buffer is available and returns
+// the ticks it took to deliver all of them. Every tick, each
+// sending link takes the given number of bytes.
+template<uint8_t Links, size_t... I>
+static size_t BondTicks(
+        const std::array<uint16_t, Links> &rates,
+        size_t count,
+        std::index_sequence<I...>) {
+    constexpr SerialDatagram::BufferLen PayloadLen = 24;
+
+    using BondNet = SerialDatagram::Bond<
+        ThrottledSerial,
+        Links,
+        SerialDatagram::DefaultConfig,
+        Links * SerialDatagram::DefaultConfig::TotalBufs,
+        256>;
+
+    MemoryBufferPair serial[] { MemoryBufferPair(Capacity(I))... };
+    ThrottledSerial serial_rcv[] { ThrottledSerial(serial[I].CreateA(), UnlimitedRate)... };
+    ThrottledSerial serial_snd[] { ThrottledSerial(serial[I].CreateB(), rates[I])... };
+
+    BondNet bond_rcv(serial_rcv[I]...);
+    BondNet bond_snd(serial_snd[I]...);
+    CountRcv rcv;
+
+    bond_rcv.RegisterReceiver(DefaultPort, rcv);
+
+    size_t sent = 0;
+    size_t ticks = 0;
+
+    while(rcv.msgs < count) {
+        for(auto &link : serial_snd) {
+            link.Tick();
+        }
+
+        while(sent < count) {
+            auto buf = bond_snd.AllocBuffer();
+
+            if(!buf.ptr) {
+                break;
+            }
+
+            memset(buf.ptr, static_cast<int>(sent), PayloadLen);
+            buf.len = PayloadLen;
+
+            bond_snd.Send(DefaultPort, buf);
+            sent++;
+        }
+
+        bond_snd.Process();
+        bond_rcv.Process();
+
+        ticks++;
+    }
+
+    auto &stats = bond_rcv.GetBondStats();
+
+    if(stats.skipped) {
+        printf("  skipped %u datagrams\n", stats.skipped);
+    }
+
+    return ticks;
+}
+
+template<uint8_t Links>
+static void PrintBond(const char *name, const std::array<uint16_t, Links> &rates) {
+    constexpr size_t Count = 5000;
+
+    size_t link_rate = 0;
+
+    for(auto rate : rates) {
+        link_rate += rate;
+    }
+
+    auto ticks = BondTicks<Links>(rates, Count, std::make_index_sequence<Links>());
+
+    printf("%-14s %12zu %10zu %12.1f\n",
+        name,
+        link_rate,
+        ticks,
+        static_cast<double>(Count) * 1000 / ticks);
+}
+
+static void BenchBonding() {
+    printf("%-14s %12s %10s %12s\n",
+        "links", "B/tick", "ticks", "msgs/ktick");
+
+    PrintBond<1>("1 x 8", { 8 });
+    PrintBond<2>("2 x 8", { 8, 8 });
+    PrintBond<3>("3 x 8", { 8, 8, 8 });
+    PrintBond<3>("8 + 4 + 2", { 8, 4, 2 });
+    PrintBond<3>("64 + 8 + 8", { 64, 8, 8 });
+}
+
+//
+// Routing.
+//
+
+using Net = SerialDatagram::Net<SerialMock>;
+
+// Forwarding by copying the payload and sending it again.
+class ResendRcv : public SerialDatagram::Rcv {
+public:
+    ResendRcv(Net &to)
+            : to(to) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        auto out = to.AllocBuffer();
+
+        memcpy(out.ptr, buf.ptr, buf.len);
+        out.len = buf.len;
+
+        to.Send(DefaultPort, out);
+    }
+
+private:
+    Net &to;
+};
+
+// Returns the nanoseconds per datagram the hub spends
+// receiving and forwarding.
+static double ForwardNs(bool router, size_t payload_len) {
+    constexpr size_t Count = 20000;
+
+    MemoryBufferPair serial_in(DefaultCapacity);
+    MemoryBufferPair serial_out(DefaultCapacity);
+    auto serial_src = serial_in.CreateA();
+    auto serial_hub_in = serial_in.CreateB();
+    auto serial_hub_out = serial_out.CreateA();
+    auto serial_dst = serial_out.CreateB();
+
+    Net src(serial_src);
+    Net hub_in(serial_hub_in);
+    Net hub_out(serial_hub_out);
+
+    SerialDatagram::Router<Net> routes;
+    ResendRcv resend(hub_out);
+
+    if(router) {
+        routes.AddRoute(hub_in, DefaultPort, hub_out, DefaultPort);
+    } else {
+        hub_in.RegisterReceiver(DefaultPort, resend);
+    }
+
+    Clock::duration elapsed { };
+
+    for(size_t i = 0;i < Count;i++) {
+        auto buf = src.AllocBuffer();
+        memset(buf.ptr, static_cast<int>(i), payload_len);
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload_len);
+        src.Send(DefaultPort, buf);
+
+        auto start = Clock::now();
+        hub_in.Process();
+        elapsed += Clock::now() - start;
+
+        while(serial_dst.available()) {
+            serial_dst.read();
+        }
+    }
+
+    return NsPerOp(elapsed, Count);
+}
+
+static void BenchRouting() {
+    const size_t sizes[] = { 8, 24, 56 };
+
+    printf("%-8s %12s %12s\n", "payload", "resend ns", "router ns");
+
+    for(auto size : sizes) {
+        printf("%-8zu %12.1f %12.1f\n",
+            size,
+            ForwardNs(false, size),
+            ForwardNs(true, size));
+    }
+}
+
+//
+// RPC.
+//
+
+// One tick is a millisecond, so a link rate of 12 bytes
+// per tick is about 115200 baud.
+constexpr uint16_t RpcLinkRate = 12;
+
+constexpr SerialDatagram::Port RpcRequestPort = 10;
+constexpr SerialDatagram::Port RpcResponsePort = 11;
+constexpr uint8_t RpcMethodAdd = 1;
+
+struct TickClock {
+    static uint32_t Now() {
+        return now;
+    }
+
+    static inline uint32_t now = 0;
+};
+
+// Enough buffers to keep eight calls in flight.
+struct RpcConfig : SerialDatagram::DefaultConfig {
+    static constexpr uint8_t TotalBufs = 8;
+};
+
+using RpcNet = SerialDatagram::Net<ThrottledSerial, RpcConfig>;
+
+class AddMethod : public SerialDatagram::RpcMethod {
+public:
+    SerialDatagram::RpcStatus Call(
+            SerialDatagram::Buffer args,
+            SerialDatagram::Buffer &result) override {
+        uint32_t operands[2];
+
+        memcpy(operands, args.ptr, sizeof(operands));
+
+        uint32_t sum = operands[0] + operands[1];
+
+        memcpy(result.ptr, &sum, sizeof(sum));
+        result.len = sizeof(sum);
+
+        return SerialDatagram::RpcStatus::Ok;
+    }
+};
+
+// Records the round trip of each call in ticks.
+class RttDone : public SerialDatagram::RpcDone {
+public:
+    void Done(
+            uint8_t tag,
+            SerialDatagram::RpcStatus status,
+            SerialDatagram::Buffer) override {
+        if(status != SerialDatagram::RpcStatus::Ok) {
+            failed++;
+            return;
+        }
+
+        rtts.push_back(TickClock::now - started[tag]);
+    }
+
+    uint32_t started[256] = { };
+    std::vector<uint32_t> rtts;
+    size_t failed = 0;
+};
+
+static void RpcCalls(uint8_t depth) {
+    constexpr size_t Count = 2000;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    ThrottledSerial serial_client(serial.CreateA(), RpcLinkRate);
+    ThrottledSerial serial_server(serial.CreateB(), RpcLinkRate);
+
+    RpcNet net_client(serial_client);
+    RpcNet net_server(serial_server);
+
+    SerialDatagram::RpcClient<RpcNet, 8, TickClock> client(
+        net_client, RpcRequestPort, RpcResponsePort);
+    SerialDatagram::RpcServer<RpcNet> server(
+        net_server, RpcRequestPort, RpcResponsePort);
+
+    AddMethod add;
+    RttDone done;
+
+    server.Register(RpcMethodAdd, add);
+    server.Start();
+    client.Start();
+
+    size_t issued = 0;
+    TickClock::now = 0;
+
+    while(done.rtts.size() + done.failed < Count) {
+        TickClock::now++;
+        serial_client.Tick();
+        serial_server.Tick();
+
+        while(issued < Count && client.Pending() < depth) {
+            uint32_t operands[2] = { static_cast<uint32_t>(issued), 1 };
+            uint8_t tag;
+
+            auto status = client.Call(
+                RpcMethodAdd, operands, sizeof(operands), done, 1000, &tag);
+
+            if(status != SerialDatagram::Status::Success) {
+                break;
+            }
+
+            done.started[tag] = TickClock::now;
+            issued++;
+        }
+
+        net_client.Process();
+        net_server.Process();
+        client.Process();
+    }
+
+    std::sort(done.rtts.begin(), done.rtts.end());
+
+    auto p50 = done.rtts[done.rtts.size() / 2];
+    auto p99 = done.rtts[done.rtts.size() * 99 / 100];
+
+    printf("%-8u %12.1f %10u %10u %8zu\n",
+        depth,
+        static_cast<double>(done.rtts.size()) * 1000 / TickClock::now,
+        p50,
+        p99,
+        done.failed);
+}
+
+static void BenchRpc() {
+    printf("%-8s %12s %10s %10s %8s\n",
+        "depth", "calls/s", "p50 ms", "p99 ms", "failed");
+
+    RpcCalls(1);
+    RpcCalls(2);
+    RpcCalls(4);
+    RpcCalls(8);
+}
+
+//
+// Budgets.
+//
+
+constexpr SerialDatagram::BufferLen BudgetPayloadLen = 56;
+
+// Bursts of frames arrive while one datagram waits to be sent,
+// and each round is processed until there is no more work. Gives
+// the time of a Process() call, in the median and at the 99th
+// percentile, and the frames received before the datagram left.
+// A null budget calls the Process() without one.
+static void BudgetRounds(const char *name, const SerialDatagram::Budget *budget) {
+    constexpr size_t Rounds = 2000;
+    constexpr uint8_t Burst = 24;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    ThrottledSerial serial_near(serial.CreateA(), 0);
+    SerialMock serial_far(serial.CreateB());
+
+    SerialDatagram::Net<ThrottledSerial> near(serial_near);
+    SerialDatagram::Net<SerialMock> far(serial_far);
+    CountRcv near_rcv;
+    CountRcv far_rcv;
+
+    near.RegisterReceiver(DefaultPort, near_rcv);
+    far.RegisterReceiver(DefaultPort, far_rcv);
+
+    std::vector<Clock::duration> calls;
+    size_t ahead = 0;
+
+    for(size_t round = 0;round < Rounds;round++) {
+        serial_near.SetRate(0);
+
+        auto buf = near.AllocBuffer();
+        buf.len = BudgetPayloadLen;
+        near.Send(DefaultPort, buf);
+
+        for(uint8_t i = 0;i < Burst;i++) {
+            buf = far.AllocBuffer();
+            buf.len = BudgetPayloadLen;
+            far.Send(DefaultPort, buf);
+        }
+
+        serial_near.SetRate(UnlimitedRate);
+        serial_near.Tick();
+
+        auto sent = near.SentFrames();
+        auto received = near_rcv.msgs;
+        bool more = true;
+
+        while(more) {
+            auto start = Clock::now();
+
+            more = budget
+                ? near.Process(*budget)
+                : near.Process();
+
+            calls.push_back(Clock::now() - start);
+
+            if(sent != near.SentFrames()) {
+                ahead += near_rcv.msgs - received;
+                sent = near.SentFrames();
+            }
+        }
+
+        far.Process();
+    }
+
+    std::sort(calls.begin(), calls.end());
+
+    printf("%-12s %10.0f %10.0f %12.1f %14.1f\n",
+        name,
+        NsPerOp(calls[calls.size() / 2], 1),
+        NsPerOp(calls[calls.size() * 99 / 100], 1),
+        static_cast<double>(calls.size()) / Rounds,
+        static_cast<double>(ahead) / Rounds);
+}
+
+static void BenchBudget() {
+    const SerialDatagram::Budget one_frame { 1, 0, 0 };
+    const SerialDatagram::Budget four_frames { 4, 0, 0 };
+    const SerialDatagram::Budget bytes_128 { 0, 128, 0 };
+    const SerialDatagram::Budget time_20us { 0, 0, 20 };
+
+    printf("%-12s %10s %10s %12s %14s\n",
+        "budget", "p50 ns", "p99 ns", "calls/round", "rcvd before tx");
+
+    BudgetRounds("none", nullptr);
+    BudgetRounds("1 frame", &one_frame);
+    BudgetRounds("4 frames", &four_frames);
+    BudgetRounds("128 bytes", &bytes_128);
+    BudgetRounds("20 us", &time_20us);
+}
+
+//
+// Frame sizes.
+//
+
+constexpr SerialDatagram::Port PackPort = 7;
+constexpr uint16_t PackMsgLen = 24;
+
+template<
+    SerialDatagram::BufferLen BufferLen,
+    typename Adapt = SerialDatagram::FixedFrameSize>
+struct FrameSizeConfig : SerialDatagram::DefaultConfig {
+    static constexpr SerialDatagram::BufferLen MaxBufferLen = BufferLen;
+
+    using FrameSize = Adapt;
+};
+
+// Moves the bytes from one buffer to the other, flipping each bit
+// with the given chance.
+class NoisyWire {
+public:
+    NoisyWire(double ber)
+            : rng(1),
+            next_error(ber > 0 ? ber : 0.5),
+            noisy(ber > 0),
+            until_error(0),
+            bytes(0) {
+        until_error = NextError();
+    }
+
+    void Pump(MemoryBuffer &from, MemoryBuffer &to) {
+        while(from.available() && to.availableForWrite()) {
+            uint8_t byte = from.read();
+
+            while(until_error < 8) {
+                byte ^= static_cast<uint8_t>(1 << until_error);
+                until_error += 1 + NextError();
+            }
+
+            until_error -= 8;
+
+            to.write(&byte, 1);
+            bytes++;
+        }
+    }
+
+    size_t Bytes() const {
+        return bytes;
+    }
+
+private:
+    uint64_t NextError() {
+        return noisy ? next_error(rng) : ~uint64_t(0) >> 1;
+    }
+
+    std::mt19937_64 rng;
+    std::geometric_distribution<uint64_t> next_error;
+    bool noisy;
+    uint64_t until_error;
+    size_t bytes;
+};
+
+// Streams messages through a Packer over a link with the given bit
+// error rate, and returns the share of the wire bytes that carried
+// messages that arrived intact.
+template<typename Config>
+static double PackedGoodput(double ber) {
+    using FsNet = SerialDatagram::Net<SerialMock, Config>;
+
+    constexpr size_t WireBytes = 200000;
+
+    MemoryBuffer near_in(DefaultCapacity);
+    MemoryBuffer far_in(DefaultCapacity);
+    MemoryBuffer wire(DefaultCapacity);
+    SerialMock serial_near(near_in, far_in);
+    SerialMock serial_far(far_in, wire);
+    NoisyWire noise(ber);
+
+    FsNet near(serial_near);
+    FsNet far(serial_far);
+    SerialDatagram::Packer<FsNet> packer_near(near, PackPort);
+    SerialDatagram::Packer<FsNet> packer_far(far, PackPort);
+    CountRcv rcv;
+
+    packer_near.Start();
+    packer_near.RegisterReceiver(DefaultPort, rcv);
+
+    Payload msg(PackMsgLen, 0x5a);
+
+    while(noise.Bytes() < WireBytes) {
+        while(packer_far.Send(DefaultPort, msg.data(), PackMsgLen) == SerialDatagram::Status::Success) {
+            // empty
+        }
+
+        packer_far.Flush();
+        far.Process();
+
+        noise.Pump(wire, near_in);
+
+        near.Process();
+        far.Process();
+    }
+
+    return static_cast<double>(rcv.bytes) / noise.Bytes();
+}
+
+static void BenchFrameSize() {
+    using Step = SerialDatagram::AdaptiveFrameSize<SerialDatagram::StepFramePolicy<>>;
+    using Goodput = SerialDatagram::AdaptiveFrameSize<>;
+
+    const double bers[] = { 0, 1e-5, 1e-4, 3e-4, 1e-3, 3e-3 };
+
+    printf("%-8s %8s %8s %8s %8s %8s %8s\n",
+        "ber", "8", "16", "32", "56", "step", "goodput");
+
+    for(auto ber : bers) {
+        const double goodput[] = {
+            PackedGoodput<FrameSizeConfig<8>>(ber),
+            PackedGoodput<FrameSizeConfig<16>>(ber),
+            PackedGoodput<FrameSizeConfig<32>>(ber),
+            PackedGoodput<FrameSizeConfig<56>>(ber),
+            PackedGoodput<FrameSizeConfig<56, Step>>(ber),
+            PackedGoodput<FrameSizeConfig<56, Goodput>>(ber),
+        };
+
+        printf("%-8g", ber);
+
+        for(auto share : goodput) {
+            printf(" %7.1f%%", 100 * share);
+        }
+
+        printf("\n");
+    }
+}
+
+//
+// Error correction.
+//
+
+template<uint8_t Parity>
+struct FecConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::FecFraming<Parity>;
+};
+
+struct FecDelivery {
+    double delivered;
+    double goodput;
+};
+
+// Sends full frames over a link with the given bit error rate, and
+// returns the share of them that arrived and the share of the wire
+// bytes that carried their payloads.
+template<typename Config>
+static FecDelivery NoisyDelivery(double ber) {
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    constexpr size_t Frames = 4000;
+
+    MemoryBuffer near_in(DefaultCapacity);
+    MemoryBuffer far_in(DefaultCapacity);
+    MemoryBuffer wire(DefaultCapacity);
+    SerialMock serial_near(near_in, far_in);
+    SerialMock serial_far(far_in, wire);
+    NoisyWire noise(ber);
+
+    Net near(serial_near);
+    Net far(serial_far);
+    CountRcv rcv;
+
+    near.RegisterReceiver(DefaultPort, rcv);
+
+    for(size_t i = 0;i < Frames;i++) {
+        auto payload = Telemetry(i);
+        payload.resize(Net::MaxBufferLen, static_cast<uint8_t>(i));
+
+        auto buf = far.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        far.Send(DefaultPort, buf);
+        far.Process();
+
+        noise.Pump(wire, near_in);
+        near.Process();
+    }
+
+    return FecDelivery {
+        static_cast<double>(rcv.msgs) / Frames,
+        static_cast<double>(rcv.bytes) / noise.Bytes() };
+}
+
+struct FecCost {
+    double encode;
+    double check;
+    double correct;
+};
+
+// Host time to encode a full frame, to check a clean one and to
+// correct one with as many errors as the code corrects.
+template<uint8_t Parity>
+static FecCost MeasureFecCost() {
+    using Framing = SerialDatagram::FecFraming<Parity>;
+    using Code = SerialDatagram::ReedSolomon<Parity>;
+
+    constexpr size_t Count = 20000;
+    constexpr uint16_t Len = 56;
+    constexpr uint16_t CodeLen = Len + sizeof(uint16_t) + Parity;
+
+    uint8_t frame[Framing::HdrRoom + Len + Framing::TrlRoom];
+    uint8_t code[CodeLen];
+    volatile uint8_t sink = 0;
+
+    auto start = Clock::now();
+
+    for(size_t i = 0;i < Count;i++) {
+        memset(frame + Framing::HdrRoom, static_cast<uint8_t>(i), Len);
+
+        SerialDatagram::Buffer buf { frame + Framing::HdrRoom, Len };
+        Framing::CreateFrame(DefaultPort, buf, 0);
+
+        sink = sink + frame[sizeof(frame) - 1];
+    }
+
+    auto encode = Clock::now() - start;
+
+    memcpy(code, frame + Framing::HdrRoom, CodeLen);
+
+    start = Clock::now();
+
+    for(size_t i = 0;i < Count;i++) {
+        sink = sink + Code::Check(code, CodeLen);
+    }
+
+    auto check = Clock::now() - start;
+
+    start = Clock::now();
+
+    for(size_t i = 0;i < Count;i++) {
+        for(uint8_t k = 0;k < Code::MaxErrors;k++) {
+            code[(i + 7 * k) % CodeLen] ^= 0x5a;
+        }
+
+        sink = sink + Code::Correct(code, CodeLen);
+    }
+
+    auto correct = Clock::now() - start;
+
+    return FecCost {
+        NsPerOp(encode, Count),
+        NsPerOp(check, Count),
+        NsPerOp(correct, Count) };
+}
+
+static void BenchFec() {
+    const double bers[] = { 0, 1e-4, 3e-4, 1e-3, 3e-3, 1e-2 };
+
+    printf("%-8s %15s %15s %15s %15s\n",
+        "ber", "magic", "fec 4", "fec 8", "fec 16");
+    printf("%-8s %15s %15s %15s %15s\n",
+        "", "frames goodput", "frames goodput", "frames goodput", "frames goodput");
+
+    for(auto ber : bers) {
+        const FecDelivery delivery[] = {
+            NoisyDelivery<SerialDatagram::DefaultConfig>(ber),
+            NoisyDelivery<FecConfig<4>>(ber),
+            NoisyDelivery<FecConfig<8>>(ber),
+            NoisyDelivery<FecConfig<16>>(ber),
+        };
+
+        printf("%-8g", ber);
+
+        for(auto &cell : delivery) {
+            printf(" %6.1f%% %6.1f%%", 100 * cell.delivered, 100 * cell.goodput);
+        }
+
+        printf("\n");
+    }
+
+    printf("\n%-8s %12s %12s %12s\n",
+        "parity", "encode ns", "check ns", "correct ns");
+
+    struct Row {
+        unsigned parity;
+        FecCost cost;
+    };
+
+    const Row rows[] = {
+        { 4, MeasureFecCost<4>() },
+        { 8, MeasureFecCost<8>() },
+        { 16, MeasureFecCost<16>() },
+    };
+
+    for(auto &row : rows) {
+        printf("%-8u %12.1f %12.1f %12.1f\n",
+            row.parity,
+            row.cost.encode,
+            row.cost.check,
+            row.cost.correct);
+    }
+}
+
+//
+// Integrity.
+//
+
+template<typename Integrity>
+struct IntegrityConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::MagicFraming<false, Integrity>;
+};
+
+template<typename Integrity>
+static double MeasureCheck(size_t size) {
+    constexpr size_t Count = 200000;
+
+    Payload bytes(size);
+    volatile uint32_t sink = 0;
+
+    for(size_t i = 0;i < size;i++) {
+        bytes[i] = static_cast<uint8_t>(i * 7);
+    }
+
+    auto start = Clock::now();
+
+    for(size_t i = 0;i < Count;i++) {
+        bytes[0] = static_cast<uint8_t>(i);
+        sink = sink + Integrity::Calc(bytes.data(), size);
+    }
+
+    return NsPerOp(Clock::now() - start, Count);
+}
+
+// The table the CRC-32C falls back on without the instructions.
+struct Crc32cSoftware {
+    static uint32_t Calc(const void *buf, size_t len) {
+        using Crc = SerialDatagram::Crc32cIntegrity;
+
+        return Crc::Final(Crc::UpdateSoftware(Crc::Init, buf, len));
+    }
+};
+
+static void BenchIntegrity() {
+    constexpr size_t Count = 10000;
+
+    using SerialDatagram::Crc16Integrity;
+    using SerialDatagram::Crc32cIntegrity;
+    using SerialDatagram::NoIntegrity;
+
+    printf("crc32c instructions: %s\n\n",
+        Crc32cIntegrity::Accelerated() ? "yes" : "no");
+
+    const size_t check_sizes[] = { 8, 56, 255, 1024 };
+
+    printf("%-8s %10s %10s %10s\n",
+        "bytes", "crc16", "crc32c", "crc32c sw");
+
+    for(auto size : check_sizes) {
+        printf("%-8zu %10.1f %10.1f %10.1f\n",
+            size,
+            MeasureCheck<Crc16Integrity>(size),
+            MeasureCheck<Crc32cIntegrity>(size),
+            MeasureCheck<Crc32cSoftware>(size));
+    }
+
+    printf("\n%-8s %-8s %8s %10s %10s\n",
+        "payload", "check", "wire B", "goodput", "ns/msg");
+
+    const size_t sizes[] = { 8, 24, 56 };
+
+    for(auto size : sizes) {
+        struct Row {
+            const char *name;
+            FramingResult result;
+        };
+
+        Row rows[] = {
+            { "crc16", MeasureFraming<IntegrityConfig<Crc16Integrity>>(size, Count) },
+            { "crc32c", MeasureFraming<IntegrityConfig<Crc32cIntegrity>>(size, Count) },
+            { "none", MeasureFraming<IntegrityConfig<NoIntegrity>>(size, Count) },
+        };
+
+        for(auto &row : rows) {
+            printf("%-8zu %-8s %8.1f %10.0f %10.1f\n",
+                size,
+                row.name,
+                row.result.wire,
+                Goodput(size, static_cast<size_t>(row.result.wire)),
+                row.result.ns);
+        }
+    }
+}
+
+//
+// Multiplexing.
+//
+
+struct MuxBenchConfig : SerialDatagram::DefaultConfig {
+    static constexpr uint16_t TotalBufs = 16;
+};
+
+using LocalMux = SerialDatagram::Mux<SerialMock, SerialMock, MuxBenchConfig, 8>;
+
+// An application and its network at the mux.
+struct MuxBenchEnd {
+    MuxBenchEnd()
+            : pair(DefaultCapacity),
+            app_serial(pair.CreateA()),
+            mux_serial(pair.CreateB()),
+            app(app_serial),
+            at_mux(mux_serial) {
+        app.Subscribe(0, SerialDatagram::MuxPort - 1, rcv);
+    }
+
+    MemoryBufferPair pair;
+    SerialMock app_serial;
+    SerialMock mux_serial;
+    LocalMux::ClientNet app;
+    LocalMux::ClientNet at_mux;
+
+    CountRcv rcv;
+};
+
+struct MuxResult {
+    double fan_out;
+    double send;
+};
+
+// Times a datagram of the link fanned out to every client, and one
+// sent by each client in turn, per datagram on the link.
+static MuxResult MeasureMux(uint8_t clients, size_t count) {
+    MemoryBufferPair link_pair(DefaultCapacity);
+    auto device_serial = link_pair.CreateA();
+    auto link_serial = link_pair.CreateB();
+
+    LocalMux::LinkNet device(device_serial);
+    LocalMux::LinkNet link(link_serial);
+    LocalMux mux(link);
+    CountRcv device_rcv;
+
+    std::vector<std::unique_ptr<MuxBenchEnd>> ends;
+
+    mux.Start();
+    device.RegisterReceiver(DefaultPort, device_rcv);
+
+    for(uint8_t i = 0;i < clients;i++) {
+        ends.push_back(std::make_unique<MuxBenchEnd>());
+        mux.AddClient(ends.back()->at_mux);
+        mux.Attach(i, DefaultPort, DefaultPort);
+    }
+
+    auto run = [&]() {
+        device.Process();
+        mux.Process();
+
+        for(auto &end : ends) {
+            end->app.Process();
+        }
+    };
+
+    auto delivered = [&]() {
+        size_t least = count;
+
+        for(auto &end : ends) {
+            least = std::min(least, end->rcv.msgs);
+        }
+
+        return least;
+    };
+
+    size_t sent = 0;
+    auto start = Clock::now();
+
+    while(delivered() < count) {
+        auto buf = sent < count
+            ? device.AllocBuffer()
+            : SerialDatagram::Buffer { nullptr, 0 };
+
+        if(buf.ptr) {
+            buf.len = 24;
+            memset(buf.ptr, static_cast<int>(sent), buf.len);
+            device.Send(DefaultPort, buf);
+            sent++;
+        }
+
+        run();
+    }
+
+    auto fan_out = Clock::now() - start;
+
+    sent = 0;
+    start = Clock::now();
+
+    while(device_rcv.msgs < count) {
+        auto &app = ends[sent % clients]->app;
+        auto buf = sent < count
+            ? app.AllocBuffer()
+            : SerialDatagram::Buffer { nullptr, 0 };
+
+        if(buf.ptr) {
+            buf.len = 24;
+            memset(buf.ptr, static_cast<int>(sent), buf.len);
+            app.Send(DefaultPort, buf);
+            sent++;
+        }
+
+        run();
+    }
+
+    return MuxResult {
+        NsPerOp(fan_out, count),
+        NsPerOp(Clock::now() - start, count) };
+}
+
+static void BenchMux() {
+    constexpr size_t Count = 5000;
+
+    const uint8_t client_counts[] = { 1, 2, 4, 8 };
+
+    printf("%-8s %14s %16s %14s\n",
+        "clients", "fan out ns", "ns per client", "send ns");
+
+    for(auto clients : client_counts) {
+        auto result = MeasureMux(clients, Count);
+
+        printf("%-8u %14.1f %16.1f %14.1f\n",
+            clients,
+            result.fan_out,
+            result.fan_out / clients,
+            result.send);
+    }
+}
+
+//
+// Shared memory.
+//
+#if defined(__linux__)
+
+using ShmNet = SerialDatagram::Net<SerialDatagram::ShmStream>;
+
+constexpr SerialDatagram::Port ShmQuitPort = 2;
+
+class ShmEchoRcv : public SerialDatagram::Rcv {
+public:
+    ShmEchoRcv(ShmNet &net)
+            : net(net),
+            quit(false) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        pending.emplace_back(
+            static_cast<const uint8_t *>(buf.ptr),
+            static_cast<const uint8_t *>(buf.ptr) + buf.len);
+    }
+
+    // Sends back what it can, and returns false once the
+    // other end asked to quit.
+    bool Echo() {
+        while(!pending.empty()) {
+            auto out = net.AllocBuffer();
+
+            if(!out.ptr) {
+                break;
+            }
+
+            out.len = static_cast<SerialDatagram::BufferLen>(pending.front().size());
+            memcpy(out.ptr, pending.front().data(), out.len);
+            net.Send(DefaultPort, out);
+
+            pending.erase(pending.begin());
+        }
+
+        return !quit;
+    }
+
+    ShmNet &net;
+    bool quit;
+
+    std::vector<Payload> pending;
+};
+
+class ShmQuitRcv : public SerialDatagram::Rcv {
+public:
+    ShmQuitRcv(ShmEchoRcv &echo)
+            : echo(echo) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer) override {
+        echo.quit = true;
+    }
+
+    ShmEchoRcv &echo;
+};
+
+static void ShmEcho(const char *name) {
+    SerialDatagram::ShmStream stream;
+
+    if(stream.Open(name) != SerialDatagram::Status::Success) {
+        _exit(1);
+    }
+
+    ShmNet net(stream);
+    ShmEchoRcv echo(net);
+    ShmQuitRcv quit(echo);
+
+    net.RegisterReceiver(DefaultPort, echo);
+    net.RegisterReceiver(ShmQuitPort, quit);
+
+    while(echo.Echo()) {
+        if(!net.Process() && echo.pending.empty()) {
+            stream.Wait(100);
+        }
+    }
+
+    _exit(0);
+}
+
+// Sends count datagrams of size bytes with at most window of them
+// waiting for their echo, and returns the time per datagram.
+static double MeasureShmEcho(
+        ShmNet &net,
+        SerialDatagram::ShmStream &stream,
+        CountRcv &rcv,
+        size_t size,
+        size_t count,
+        size_t window) {
+    size_t sent = 0;
+
+    rcv.msgs = 0;
+    rcv.bytes = 0;
+
+    auto start = Clock::now();
+
+    while(rcv.msgs < count) {
+        bool sending = sent < count && sent - rcv.msgs < window;
+        auto buf = sending
+            ? net.AllocBuffer()
+            : SerialDatagram::Buffer { nullptr, 0 };
+
+        if(buf.ptr) {
+            buf.len = static_cast<SerialDatagram::BufferLen>(size);
+            memset(buf.ptr, static_cast<int>(sent), size);
+            net.Send(DefaultPort, buf);
+            sent++;
+        }
+
+        if(!net.Process() && !buf.ptr) {
+            stream.Wait(100);
+        }
+    }
+
+    auto elapsed = Clock::now() - start;
+
+    return NsPerOp(elapsed, count);
+}
+
+static void BenchShm() {
+    constexpr size_t Count = 100000;
+    constexpr size_t RttCount = 10000;
+
+    auto name = "/sdgram-bench-" + std::to_string(getpid());
+
+    SerialDatagram::ShmStream stream;
+
+    if(stream.Create(name.c_str()) != SerialDatagram::Status::Success) {
+        printf("no shared memory\n");
+        return;
+    }
+
+    pid_t child = fork();
+
+    if(!child) {
+        ShmEcho(name.c_str());
+    }
+
+    ShmNet net(stream);
+    CountRcv rcv;
+
+    net.RegisterReceiver(DefaultPort, rcv);
+
+    printf("%-8s %-10s %10s %12s\n",
+        "payload", "window", "ns/msg", "MB/s each");
+
+    const size_t sizes[] = { 8, 56 };
+
+    for(auto size : sizes) {
+        double rtt = MeasureShmEcho(net, stream, rcv, size, RttCount, 1);
+        double ns = MeasureShmEcho(net, stream, rcv, size, Count, ShmNet::TotalBufs);
+
+        printf("%-8zu %-10s %10.1f %12.1f\n", size, "1 (rtt)", rtt, size * 1e3 / rtt);
+        printf("%-8zu %-10d %10.1f %12.1f\n", size, ShmNet::TotalBufs, ns, size * 1e3 / ns);
+    }
+
+    auto buf = net.AllocBuffer();
+    buf.len = 0;
+    net.Send(ShmQuitPort, buf);
+
+    while(net.HasWork()) {
+        net.Process();
+    }
+
+    int status = 0;
+    waitpid(child, &status, 0);
+
+    auto local = MeasureFraming<SerialDatagram::DefaultConfig>(56, 10000);
+
+    printf("\nin process over MemoryBuffer, 56 B: %.1f ns/msg one way\n", local.ns);
+}
+
+#endif
+
+//
+// Main.
+//
+
+struct Bench {
+    const char *name;
+    void (*run)();
+};
+
+static const Bench benches[] = {
+    { "compression", BenchCompression },
+    { "framing", BenchFraming },
+    { "feed", BenchFeed },
+    { "bonding", BenchBonding },
+    { "routing", BenchRouting },
+    { "rpc", BenchRpc },
+    { "budget", BenchBudget },
+    { "frame_size", BenchFrameSize },
+    { "fec", BenchFec },
+    { "integrity", BenchIntegrity },
+    { "mux", BenchMux },
+#if defined(__linux__)
+    { "shm", BenchShm },
+#endif
+};
+
+int main(int argc, char **argv) {
+    for(auto &bench : benches) {
+        bool selected = argc == 1;
+
+        for(int i = 1;i < argc;i++) {
+            selected = selected || !strcmp(argv[i], bench.name);
+        }
+
+        if(!selected) {
+            continue;
+        }
+
+        printf("=== %s\n", bench.name);
+        bench.run();
+        printf("\n");
+    }
+
+    return 0;
+}
@@ -0,0 +1,16 @@
+//
+// Logging is disabled in benchmarks, as it would
+// dominate the measurements.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#define LOG_DEFINED
+
+#define LogVerbose(...)
+#define LogVerboseLn(...)
+
+#define LogTrace(...)
+#define LogTraceLn(...)
@@ -0,0 +1,268 @@
+//
+// Sharing a serial link between local processes.
+//
+// Owns the tty and lets clients connect over a Unix domain socket.
+// Each connection runs the protocol as a link of its own, so a
+// client is a Net over the connected socket, for example with
+// FdSerial, that attaches to its ports with SendMuxAttach():
+//
+//   int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+//   connect(fd, ...);
+//   FdSerial serial(fd);
+//   Net<FdSerial, MuxConfig> net(serial);
+//   SendMuxAttach(net, first, last);
+//
+// See sdgram_mux.h for how the datagrams are shared. Clients need
+// the configuration below. The stats of a client are printed when
+// it leaves, and those of all clients on SIGUSR1.
+//
+// It needs a POSIX system. To build:
+//
+//   g++ -std=c++17 -O2 -I../sdgram_pty_echo -I../sdgram_bench_x64 -I../../sdgram -I<crc16> mux.cpp -o sdgram_mux
+//
+// usage: sdgram_mux <tty> <socket>
+//
+// author: aleksandar
+//
+
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "quiet_logger.h"
+#include "sdgram.h"
+#include "sdgram_mux.h"
+#include "fd_serial.h"
+
+// Clients get buffers for the datagrams fanned out to them.
+struct MuxConfig : SerialDatagram::DefaultConfig {
+    static constexpr uint16_t TotalBufs = 16;
+};
+
+constexpr uint8_t MaxClients = 16;
+
+// How long to wait for the descriptors when there is nothing to do.
+constexpr int IdleWaitMs = 10;
+
+using Mux = SerialDatagram::Mux<FdSerial, FdSerial, MuxConfig, MaxClients>;
+
+struct Session {
+    Session(int fd)
+            : serial(fd),
+            net(serial) {
+        // empty
+    }
+
+    ~Session() {
+        close(serial.Fd());
+    }
+
+    FdSerial serial;
+    Mux::ClientNet net;
+};
+
+static volatile sig_atomic_t quit = 0;
+static volatile sig_atomic_t dump = 0;
+
+static void OnQuit(int) {
+    quit = 1;
+}
+
+static void OnDump(int) {
+    dump = 1;
+}
+
+static int OpenTty(const char *path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+
+    if(fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    termios tio;
+
+    if(!tcgetattr(fd, &tio)) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    return fd;
+}
+
+static int Listen(const char *path) {
+    sockaddr_un addr {};
+
+    if(strlen(path) >= sizeof(addr.sun_path)) {
+        fprintf(stderr, "%s: path too long\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    if(fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+    unlink(path);
+
+    if(bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0
+            || listen(fd, MaxClients) < 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+    return fd;
+}
+
+static void PrintStats(uint8_t client_idx, const SerialDatagram::MuxClientStats &stats) {
+    fprintf(stderr,
+        "client %u: sent %u (%u B, %u dropped), received %u (%u B, %u dropped)\n",
+        client_idx,
+        stats.sent,
+        stats.bytes_sent,
+        stats.send_dropped,
+        stats.received,
+        stats.bytes_received,
+        stats.rcv_dropped);
+}
+
+int main(int argc, char **argv) {
+    if(argc != 3) {
+        fprintf(stderr, "usage: %s <tty> <socket>\n", argv[0]);
+        return 2;
+    }
+
+    int tty = OpenTty(argv[1]);
+
+    if(tty < 0) {
+        return 1;
+    }
+
+    int listener = Listen(argv[2]);
+
+    if(listener < 0) {
+        return 1;
+    }
+
+    signal(SIGINT, OnQuit);
+    signal(SIGTERM, OnQuit);
+    signal(SIGUSR1, OnDump);
+    signal(SIGPIPE, SIG_IGN);
+
+    FdSerial serial(tty);
+    Mux::LinkNet link(serial);
+    Mux mux(link);
+
+    mux.Start();
+
+    std::unique_ptr<Session> sessions[MaxClients];
+
+    while(!quit) {
+        if(dump) {
+            dump = 0;
+
+            for(uint8_t i = 0;i < MaxClients;i++) {
+                if(sessions[i]) {
+                    PrintStats(i, mux.GetClientStats(i));
+                }
+            }
+        }
+
+        if(mux.Process()) {
+            continue;
+        }
+
+        serial.Flush();
+
+        // the tty, the listener, and the clients by index
+        pollfd fds[2 + MaxClients];
+
+        fds[0] = pollfd { tty, POLLIN, 0 };
+        fds[1] = pollfd { listener, POLLIN, 0 };
+
+        if(link.QueuedBytes() || serial.Pending()) {
+            fds[0].events |= POLLOUT;
+        }
+
+        for(uint8_t i = 0;i < MaxClients;i++) {
+            auto &session = sessions[i];
+
+            fds[2 + i] = pollfd { session ? session->serial.Fd() : -1, POLLIN, 0 };
+
+            if(session) {
+                session->serial.Flush();
+
+                if(session->net.QueuedBytes() || session->serial.Pending()) {
+                    fds[2 + i].events |= POLLOUT;
+                }
+            }
+        }
+
+        if(poll(fds, 2 + MaxClients, IdleWaitMs) < 0 && errno != EINTR) {
+            perror("poll");
+            break;
+        }
+
+        // a client that hung up goes once its last bytes are read
+        for(uint8_t i = 0;i < MaxClients;i++) {
+            auto revents = fds[2 + i].revents;
+
+            if(!sessions[i]
+                    || !(revents & (POLLHUP | POLLERR))
+                    || (!(revents & POLLERR) && sessions[i]->serial.available())) {
+                continue;
+            }
+
+            PrintStats(i, mux.GetClientStats(i));
+
+            mux.RemoveClient(i);
+            sessions[i].reset();
+        }
+
+        if(fds[1].revents & POLLIN) {
+            int fd = accept(listener, nullptr, nullptr);
+
+            if(fd < 0) {
+                continue;
+            }
+
+            auto session = std::make_unique<Session>(fd);
+            uint8_t client_idx;
+
+            if(mux.AddClient(session->net, &client_idx) != SerialDatagram::Status::Success) {
+                fprintf(stderr, "no room for another client\n");
+                continue;
+            }
+
+            sessions[client_idx] = std::move(session);
+        }
+    }
+
+    for(uint8_t i = 0;i < MaxClients;i++) {
+        if(sessions[i]) {
+            PrintStats(i, mux.GetClientStats(i));
+        }
+    }
+
+    close(listener);
+    unlink(argv[2]);
+    close(tty);
+
+    return 0;
+}
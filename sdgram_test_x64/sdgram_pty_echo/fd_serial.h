@@ -0,0 +1,98 @@
+//
+// A serial endpoint over a POSIX file descriptor.
+//
+// The descriptor is used in non-blocking mode, typically a tty or
+// a pty. Bytes are buffered on both sides, so that the sender can
+// rely on availableForWrite() and the receiver reads in chunks
+// instead of a system call per byte.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+class FdSerial {
+public:
+    static constexpr uint16_t BufLen = 1024;
+
+    FdSerial(int fd)
+            : fd(fd),
+            rx_start(0),
+            rx_end(0),
+            tx_len(0) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+    }
+
+    uint16_t available() {
+        if(rx_start == rx_end) {
+            auto bytes = ::read(fd, rx, BufLen);
+
+            rx_start = 0;
+            rx_end = bytes > 0 ? static_cast<uint16_t>(bytes) : 0;
+        }
+
+        return rx_end - rx_start;
+    }
+
+    uint8_t read() {
+        return rx[rx_start++];
+    }
+
+    uint16_t availableForWrite() {
+        Flush();
+
+        return BufLen - tx_len;
+    }
+
+    uint16_t write(void *buf, uint16_t buf_len) {
+        memcpy(tx + tx_len, buf, buf_len);
+        tx_len += buf_len;
+
+        Flush();
+
+        return buf_len;
+    }
+
+    // Bytes written but not yet taken by the descriptor.
+    uint16_t Pending() const {
+        return tx_len;
+    }
+
+    void Flush() {
+        if(!tx_len) {
+            return;
+        }
+
+        auto bytes = ::write(fd, tx, tx_len);
+
+        if(bytes <= 0) {
+            return;
+        }
+
+        tx_len -= static_cast<uint16_t>(bytes);
+        memmove(tx, tx + bytes, tx_len);
+    }
+
+    int Fd() const {
+        return fd;
+    }
+
+private:
+    //
+    // Data.
+    //
+    int fd;
+
+    uint8_t rx[BufLen];
+    uint16_t rx_start;
+    uint16_t rx_end;
+
+    uint8_t tx[BufLen];
+    uint16_t tx_len;
+};
@@ -0,0 +1,187 @@
+//
+// The C++ end of the pysdgram benchmark.
+//
+// Echoes the datagrams it receives on the echo port back to the
+// sender, and answers a request on the stats port with the
+// datagrams echoed, the datagrams dropped for lack of a buffer and
+// the CPU time used, so the other end can tell how much each
+// datagram costs here. A datagram on the quit port ends it.
+//
+// pysdgram/bench_pty.py starts it on one side of a pty. It needs
+// a POSIX system. To build:
+//
+//   g++ -std=c++17 -O2 -I. -I../sdgram_bench_x64 -I../../sdgram -I<crc16> pty_echo.cpp -o pty_echo
+//
+// usage: pty_echo <tty>
+//
+// author: aleksandar
+//
+
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+
+#include "quiet_logger.h"
+#include "sdgram.h"
+#include "fd_serial.h"
+
+constexpr SerialDatagram::Port EchoPort = 1;
+constexpr SerialDatagram::Port StatsPort = 2;
+constexpr SerialDatagram::Port QuitPort = 3;
+
+// How long to wait for the tty when there is nothing to do.
+constexpr int IdleWaitMs = 10;
+
+using Net = SerialDatagram::Net<FdSerial>;
+
+#pragma pack(push, 1)
+struct EchoStats {
+    uint32_t echoed;
+    uint32_t dropped;
+    uint64_t cpu_ns;
+};
+#pragma pack(pop)
+
+static uint64_t CpuNs() {
+    timespec ts;
+
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+    return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+class EchoRcv : public SerialDatagram::Rcv {
+public:
+    EchoRcv(Net &net)
+            : net(net),
+            quit(false),
+            stats() {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        Reply(EchoPort, buf.ptr, buf.len);
+    }
+
+    // Replies with a copy of the payload. Drops it if
+    // there is no free buffer.
+    bool Reply(SerialDatagram::Port port, const void *payload, SerialDatagram::BufferLen len) {
+        auto out = net.AllocBuffer();
+
+        if(!out.ptr) {
+            stats.dropped++;
+            return false;
+        }
+
+        memcpy(out.ptr, payload, len);
+        out.len = len;
+        net.Send(port, out);
+
+        if(port == EchoPort) {
+            stats.echoed++;
+        }
+
+        return true;
+    }
+
+    Net &net;
+    bool quit;
+    EchoStats stats;
+};
+
+class StatsRcv : public SerialDatagram::Rcv {
+public:
+    StatsRcv(EchoRcv &echo)
+            : echo(echo) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer) override {
+        echo.stats.cpu_ns = CpuNs();
+        echo.Reply(StatsPort, &echo.stats, sizeof(echo.stats));
+    }
+
+private:
+    EchoRcv &echo;
+};
+
+class QuitRcv : public SerialDatagram::Rcv {
+public:
+    QuitRcv(EchoRcv &echo)
+            : echo(echo) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer) override {
+        echo.quit = true;
+    }
+
+private:
+    EchoRcv &echo;
+};
+
+static int OpenTty(const char *path) {
+    int fd = open(path, O_RDWR | O_NOCTTY);
+
+    if(fd < 0) {
+        perror(path);
+        return -1;
+    }
+
+    termios tio;
+
+    if(!tcgetattr(fd, &tio)) {
+        cfmakeraw(&tio);
+        tcsetattr(fd, TCSANOW, &tio);
+    }
+
+    return fd;
+}
+
+int main(int argc, char **argv) {
+    if(argc != 2) {
+        fprintf(stderr, "usage: %s <tty>\n", argv[0]);
+        return 2;
+    }
+
+    int fd = OpenTty(argv[1]);
+
+    if(fd < 0) {
+        return 1;
+    }
+
+    FdSerial serial(fd);
+    Net net(serial);
+    EchoRcv echo(net);
+    StatsRcv stats(echo);
+    QuitRcv quit(echo);
+
+    net.RegisterReceiver(EchoPort, echo);
+    net.RegisterReceiver(StatsPort, stats);
+    net.RegisterReceiver(QuitPort, quit);
+
+    while(!echo.quit) {
+        if(net.Process()) {
+            continue;
+        }
+
+        serial.Flush();
+
+        pollfd pfd { fd, POLLIN, 0 };
+
+        if(net.QueuedBytes() || serial.Pending()) {
+            pfd.events |= POLLOUT;
+        }
+
+        poll(&pfd, 1, IdleWaitMs);
+    }
+
+    close(fd);
+
+    return 0;
+}
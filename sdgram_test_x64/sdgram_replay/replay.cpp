@@ -0,0 +1,309 @@
+//
+// Replaying a link capture.
+//
+// Parses the bytes of a capture made by CaptureStream with a
+// Receiver, the bytes read and the bytes written each by their own
+// network, and reports the frames, the errors, the dropped bytes
+// and the parse throughput of each direction. The bytes are handed
+// to the receiver record by record, as the link delivered them.
+//
+// By default the replay runs as fast as it can, while the clock of
+// the networks follows the capture, so frame timeouts behave as
+// they did on the link. With --timed it also waits out the time
+// between records. --repeat runs the capture again, to use it as
+// a benchmark. To build:
+//
+//   g++ -std=c++17 -O2 -I../sdgram_bench_x64 -I../../sdgram -I<crc16> replay.cpp -o replay
+//
+// The networks use the default config with the chosen framing.
+// Links with another payload size or frame timeout need
+// -DREPLAY_MAX_BUFFER_LEN or -DREPLAY_FRAME_TIMEOUT.
+//
+// usage: replay <capture> [--framing magic|cobs|compact|fec] [--timed]
+//            [--repeat N]
+//
+// author: aleksandar
+//
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <thread>
+#include <vector>
+
+#include "quiet_logger.h"
+#include "sdgram.h"
+#include "sdgram_capture.h"
+
+#if !defined(REPLAY_MAX_BUFFER_LEN)
+#define REPLAY_MAX_BUFFER_LEN 56
+#endif
+
+#if !defined(REPLAY_FRAME_TIMEOUT)
+#define REPLAY_FRAME_TIMEOUT 0
+#endif
+
+using WallClock = std::chrono::steady_clock;
+
+// Milliseconds of the capture being replayed.
+struct ReplayClock {
+    static uint32_t Now() {
+        return now;
+    }
+
+    static inline uint32_t now = 0;
+};
+
+template<typename FrameFormat>
+struct ReplayConfig : SerialDatagram::DefaultConfig {
+    static constexpr SerialDatagram::BufferLen MaxBufferLen = REPLAY_MAX_BUFFER_LEN;
+    static constexpr uint16_t FrameTimeout = REPLAY_FRAME_TIMEOUT;
+
+    using Framing = FrameFormat;
+    using Clock = ReplayClock;
+};
+
+// Hands out the bytes of one direction as far as the replay got.
+class ReplayStream {
+public:
+    ReplayStream()
+            : next(0),
+            end(0) {
+        // empty
+    }
+
+    uint16_t available() const {
+        auto left = end - next;
+
+        return static_cast<uint16_t>(left < 0xffff ? left : 0xffff);
+    }
+
+    uint8_t read() {
+        return bytes[next++];
+    }
+
+    uint16_t availableForWrite() const {
+        return 0;
+    }
+
+    uint16_t write(void *, uint16_t) {
+        return 0;
+    }
+
+    void Add(const uint8_t *record, uint8_t len) {
+        bytes.insert(bytes.end(), record, record + len);
+    }
+
+    // Makes the next len bytes available.
+    void Release(uint8_t len) {
+        end += len;
+    }
+
+    void Rewind() {
+        next = 0;
+        end = 0;
+    }
+
+private:
+    std::vector<uint8_t> bytes;
+    size_t next;
+    size_t end;
+};
+
+class CountRcv : public SerialDatagram::Rcv {
+public:
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        payload_bytes += buf.len;
+    }
+
+    uint64_t payload_bytes = 0;
+};
+
+struct Totals {
+    void Add(const SerialDatagram::RcvStats &stats) {
+        msgs += stats.msgs;
+        bytes += stats.bytes;
+        dropped_bytes += stats.dropped_bytes;
+        crc_error += stats.crc_error;
+        hdr_error += stats.hdr_error;
+        trl_error += stats.trl_error;
+        size_error += stats.size_error;
+        frame_timeout += stats.frame_timeout;
+        corrected += stats.corrected;
+    }
+
+    uint64_t msgs = 0;
+    uint64_t bytes = 0;
+    uint64_t dropped_bytes = 0;
+    uint64_t crc_error = 0;
+    uint64_t hdr_error = 0;
+    uint64_t trl_error = 0;
+    uint64_t size_error = 0;
+    uint64_t frame_timeout = 0;
+    uint64_t corrected = 0;
+};
+
+struct Record {
+    uint64_t time;
+    SerialDatagram::CaptureDir dir;
+    uint8_t len;
+};
+
+template<typename Config>
+class Direction {
+public:
+    using Net = SerialDatagram::Net<ReplayStream, Config>;
+
+    Direction()
+            : net(stream),
+            wire_bytes(0),
+            parse_time() {
+        net.Subscribe(0, SerialDatagram::ControlPort - 1, rcv);
+    }
+
+    void Deliver(uint8_t len) {
+        stream.Release(len);
+        wire_bytes += len;
+
+        auto start = WallClock::now();
+
+        net.Process();
+
+        parse_time += WallClock::now() - start;
+
+        // the counters of the network wrap
+        totals.Add(net.GetRcvStats());
+        net.ClearRcvStats();
+    }
+
+    void Print(const char *name) const {
+        auto secs = std::chrono::duration<double>(parse_time).count();
+
+        printf("%-8s %12llu %10llu %12llu %10llu %8llu %8llu %8llu %8llu %8llu %8llu %10.1f\n",
+            name,
+            static_cast<unsigned long long>(wire_bytes),
+            static_cast<unsigned long long>(totals.msgs),
+            static_cast<unsigned long long>(rcv.payload_bytes),
+            static_cast<unsigned long long>(totals.dropped_bytes),
+            static_cast<unsigned long long>(totals.crc_error),
+            static_cast<unsigned long long>(totals.hdr_error),
+            static_cast<unsigned long long>(totals.trl_error),
+            static_cast<unsigned long long>(totals.size_error),
+            static_cast<unsigned long long>(totals.frame_timeout),
+            static_cast<unsigned long long>(totals.corrected),
+            secs > 0 ? wire_bytes / secs / 1e6 : 0.0);
+    }
+
+    ReplayStream stream;
+    Net net;
+    CountRcv rcv;
+
+    Totals totals;
+    uint64_t wire_bytes;
+    WallClock::duration parse_time;
+};
+
+template<typename Framing>
+static void Replay(const std::vector<Record> &records, Direction<ReplayConfig<Framing>> *dirs, bool timed) {
+    auto start = WallClock::now();
+
+    for(auto &record : records) {
+        ReplayClock::now = static_cast<uint32_t>(record.time / 1000);
+
+        if(timed) {
+            std::this_thread::sleep_until(start + std::chrono::microseconds(record.time));
+        }
+
+        dirs[static_cast<uint8_t>(record.dir)].Deliver(record.len);
+    }
+}
+
+template<typename Framing>
+static int Run(FILE *file, bool timed, unsigned repeat) {
+    SerialDatagram::CaptureReader reader(file);
+
+    if(!reader.IsValid()) {
+        fprintf(stderr, "not a capture\n");
+        return 1;
+    }
+
+    Direction<ReplayConfig<Framing>> dirs[2];
+    std::vector<Record> records;
+    SerialDatagram::CaptureRecord record;
+
+    while(reader.Next(record)) {
+        records.push_back(Record { record.time, record.dir, record.len });
+        dirs[static_cast<uint8_t>(record.dir)].stream.Add(record.bytes, record.len);
+    }
+
+    for(unsigned i = 0;i < repeat;i++) {
+        for(auto &dir : dirs) {
+            dir.stream.Rewind();
+        }
+
+        Replay<Framing>(records, dirs, timed);
+    }
+
+    printf("%-8s %12s %10s %12s %10s %8s %8s %8s %8s %8s %8s %10s\n",
+        "dir", "wire bytes", "frames", "payload", "dropped",
+        "crc", "hdr", "trl", "size", "timeout", "fixed", "MB/s");
+
+    dirs[static_cast<uint8_t>(SerialDatagram::CaptureDir::Read)].Print("read");
+    dirs[static_cast<uint8_t>(SerialDatagram::CaptureDir::Written)].Print("written");
+
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    const char *path = nullptr;
+    const char *framing = "magic";
+    bool timed = false;
+    unsigned repeat = 1;
+
+    for(int i = 1;i < argc;i++) {
+        if(!strcmp(argv[i], "--framing") && i + 1 < argc) {
+            framing = argv[++i];
+        } else if(!strcmp(argv[i], "--timed")) {
+            timed = true;
+        } else if(!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            repeat = static_cast<unsigned>(atoi(argv[++i]));
+        } else if(!path) {
+            path = argv[i];
+        } else {
+            path = nullptr;
+            break;
+        }
+    }
+
+    if(!path) {
+        fprintf(stderr, "usage: replay <capture> [--framing magic|cobs|compact|fec] [--timed] [--repeat N]\n");
+        return 2;
+    }
+
+    FILE *file = fopen(path, "rb");
+
+    if(!file) {
+        perror(path);
+        return 1;
+    }
+
+    int ret;
+
+    if(!strcmp(framing, "magic")) {
+        ret = Run<SerialDatagram::MagicFraming<>>(file, timed, repeat);
+    } else if(!strcmp(framing, "cobs")) {
+        ret = Run<SerialDatagram::CobsFraming>(file, timed, repeat);
+    } else if(!strcmp(framing, "compact")) {
+        ret = Run<SerialDatagram::CompactFraming<>>(file, timed, repeat);
+    } else if(!strcmp(framing, "fec")) {
+        ret = Run<SerialDatagram::FecFraming<>>(file, timed, repeat);
+    } else {
+        fprintf(stderr, "unknown framing %s\n", framing);
+        ret = 2;
+    }
+
+    fclose(file);
+
+    return ret;
+}
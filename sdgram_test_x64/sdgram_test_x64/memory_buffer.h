@@ -3,6 +3,10 @@
 //
 // This is used for testing, so not very efficient.
 //
+// By default, writers see only the free space. A buffer that
+// drops on overrun behaves like a UART receive FIFO instead:
+// writers always see space and bytes that do not fit are lost.
+//
 // author: aleksandar
 //
 
@@ -15,8 +19,12 @@
 class MemoryBuffer {
 public:
     MemoryBuffer(
-        size_t capacity)
-            : capacity(capacity) {
+        size_t capacity,
+        bool drop_on_overrun = false)
+            : capacity(capacity),
+            drop_on_overrun(drop_on_overrun),
+            overrun_bytes(0),
+            max_used(0) {
         // empty
     }
 
@@ -31,6 +39,10 @@ public:
     }
 
     uint16_t availableForWrite() const {
+        if(drop_on_overrun) {
+            return OverrunWriteSpace;
+        }
+
         return static_cast<uint16_t>(capacity - data.size());
     }
 
@@ -46,14 +58,38 @@ public:
             data.push_back(in[i]);
         }
 
+        max_used = std::max(max_used, data.size());
+
+        if(drop_on_overrun) {
+            overrun_bytes += buf_len - to_write;
+            return buf_len;
+        }
+
         return to_write;
     }
 
+    size_t OverrunBytes() const {
+        return overrun_bytes;
+    }
+
+    size_t MaxUsed() const {
+        return max_used;
+    }
+
 private:
+    //
+    // Constants.
+    //
+    static constexpr uint16_t OverrunWriteSpace = 1024;
+
     //
     // Data.
     //
     const size_t capacity;
+    const bool drop_on_overrun;
+
+    size_t overrun_bytes;
+    size_t max_used;
 
     std::deque<uint8_t> data;
 };
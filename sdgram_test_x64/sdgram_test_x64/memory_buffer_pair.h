@@ -11,9 +11,9 @@
 
 class MemoryBufferPair {
 public:
-    MemoryBufferPair(size_t capacity)
-            : a(capacity),
-            b(capacity) {
+    MemoryBufferPair(size_t capacity, bool drop_on_overrun = false)
+            : a(capacity, drop_on_overrun),
+            b(capacity, drop_on_overrun) {
         // empty
     }
 
@@ -25,6 +25,14 @@ public:
         return SerialMock(b, a);
     }
 
+    const MemoryBuffer &A() const {
+        return a;
+    }
+
+    const MemoryBuffer &B() const {
+        return b;
+    }
+
 private:
     //
     // Data.
@@ -6,12 +6,41 @@
 
 #include "gtest/gtest.h"
 
+#include <array>
 #include <iostream>
 #include <cstdio>
+#include <cstring>
+#include <memory>
+#include <random>
+#include <string>
+#include <utility>
+#include <vector>
 
 #include "logger.h"
 #include "sdgram.h"
+#include "sdgram_bond.h"
+#include "sdgram_capture.h"
+#include "sdgram_mux.h"
+#include "sdgram_packer.h"
+#include "sdgram_router.h"
+#include "sdgram_rpc.h"
+#include "sdgram_schema.h"
 #include "memory_buffer_pair.h"
+#include "throttled_serial.h"
+
+#if defined(__linux__)
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sdgram_shm.h"
+#endif
+
+#if defined(__cpp_impl_coroutine)
+#include <chrono>
+#include <set>
+
+#include "sdgram_coro.h"
+#endif
 
 constexpr size_t DefaultCapacity = 2048;
 constexpr SerialDatagram::Port DefaultPort = 1;
@@ -473,3 +502,4057 @@ TEST(SdgramTests, SendQueueFull) {
     auto status = test.sdgram_snd.SendDatagram(buf);
     EXPECT_EQ(SerialDatagram::Status::NoMoreSpace, status);
 }
+
+//
+// Flow control tests.
+//
+
+struct FlowControlConfig : SerialDatagram::DefaultConfig {
+    using FlowControl = SerialDatagram::CreditFlowControl<40>;
+};
+
+using SDgramFc = SerialDatagram::Net<SerialMock, FlowControlConfig>;
+
+// The channels behave like UARTs: the sender never blocks and
+// bytes that do not fit into the receive FIFO are lost.
+template<typename Net>
+struct OverrunTest {
+    static constexpr size_t UartCapacity = 64;
+    static constexpr size_t BytesToSend = 20;
+    static constexpr size_t MaxRounds = 10000;
+
+    OverrunTest()
+            : serial(UartCapacity, true),
+            serial_rcv(serial.CreateA()),
+            serial_snd(serial.CreateB()),
+            sdgram_rcv(new Net(serial_rcv)),
+            sdgram_snd(serial_snd),
+            sent(0) {
+        sdgram_rcv->RegisterReceiver(DefaultPort, rcv);
+    }
+
+    void RestartReceiver() {
+        sdgram_rcv.reset(new Net(serial_rcv));
+        sdgram_rcv->RegisterReceiver(DefaultPort, rcv);
+    }
+
+    // The receiver drains its stream only every few rounds,
+    // like a busy control loop.
+    void Run(size_t msgs_to_send, size_t rcv_interval) {
+        auto expected = rcv.msgs_received + msgs_to_send;
+        msgs_to_send += sent;
+
+        for(size_t round = 0;round < MaxRounds;round++) {
+            if(sent < msgs_to_send) {
+                auto buf = sdgram_snd.AllocBuffer();
+
+                if(buf.ptr) {
+                    memset(buf.ptr, static_cast<int>(sent), BytesToSend);
+                    buf.len = BytesToSend;
+                    sdgram_snd.Send(DefaultPort, buf);
+                    sent++;
+                }
+            }
+
+            sdgram_snd.Process();
+
+            if(round % rcv_interval == 0) {
+                sdgram_rcv->Process();
+            }
+
+            if(rcv.msgs_received == expected) {
+                break;
+            }
+        }
+    }
+
+    MemoryBufferPair serial;
+    SerialMock serial_rcv;
+    SerialMock serial_snd;
+    std::unique_ptr<Net> sdgram_rcv;
+    Net sdgram_snd;
+
+    TestRcv rcv;
+
+    size_t sent;
+};
+
+TEST(SdgramTests, FlowControlOffOverruns) {
+    constexpr size_t MsgsToSend = 50;
+
+    OverrunTest<SDgram> test;
+
+    test.Run(MsgsToSend, 4);
+
+    EXPECT_LT(0, test.serial.A().OverrunBytes());
+    EXPECT_GT(MsgsToSend, test.rcv.msgs_received);
+}
+
+TEST(SdgramTests, FlowControlNoOverruns) {
+    constexpr size_t MsgsToSend = 50;
+
+    OverrunTest<SDgramFc> test;
+
+    test.Run(MsgsToSend, 4);
+
+    EXPECT_EQ(0, test.serial.A().OverrunBytes());
+    EXPECT_EQ(0, test.serial.B().OverrunBytes());
+    EXPECT_EQ(MsgsToSend, test.rcv.msgs_received);
+    EXPECT_EQ(MsgsToSend * OverrunTest<SDgramFc>::BytesToSend, test.rcv.bytes_received);
+
+    auto stats = test.sdgram_rcv->GetRcvStats();
+
+    EXPECT_EQ(0, stats.dropped_bytes);
+    EXPECT_EQ(0, stats.rcv_error);
+}
+
+TEST(SdgramTests, FlowControlReceiverRestart) {
+    constexpr size_t MsgsToSend = 20;
+
+    OverrunTest<SDgramFc> test;
+
+    test.Run(MsgsToSend, 3);
+    EXPECT_EQ(MsgsToSend, test.rcv.msgs_received);
+
+    test.RestartReceiver();
+
+    test.Run(MsgsToSend, 3);
+    EXPECT_EQ(MsgsToSend * 2, test.rcv.msgs_received);
+
+    EXPECT_EQ(0, test.serial.A().OverrunBytes());
+    EXPECT_EQ(0, test.sdgram_rcv->GetRcvStats().dropped_bytes);
+}
+
+// Both ends send at once, with payloads of random sizes. Each end
+// needs the adverts of the other while its own frames go out.
+template<typename Net>
+static bool RunBothWays(uint32_t seed, size_t msgs_to_send, MemoryBufferPair &serial) {
+    constexpr size_t MaxRounds = 20000;
+
+    std::mt19937 gen(seed);
+    std::uniform_int_distribution<int> size(4, 20);
+    std::uniform_int_distribution<int> interval(1, 4);
+
+    auto serial_a = serial.CreateA();
+    auto serial_b = serial.CreateB();
+    Net net_a(serial_a);
+    Net net_b(serial_b);
+    TestRcv rcv_a;
+    TestRcv rcv_b;
+
+    net_a.RegisterReceiver(DefaultPort, rcv_a);
+    net_b.RegisterReceiver(DefaultPort, rcv_b);
+
+    Net *nets[] = { &net_a, &net_b };
+    size_t sent[] = { 0, 0 };
+
+    for(size_t round = 0;round < MaxRounds;round++) {
+        for(int i = 0;i < 2;i++) {
+            if(sent[i] == msgs_to_send) {
+                continue;
+            }
+
+            auto buf = nets[i]->AllocBuffer();
+
+            if(buf.ptr) {
+                buf.len = static_cast<SerialDatagram::BufferLen>(size(gen));
+                memset(buf.ptr, static_cast<int>(sent[i]), buf.len);
+                nets[i]->Send(DefaultPort, buf);
+                sent[i]++;
+            }
+        }
+
+        for(auto net : nets) {
+            if(round % interval(gen) == 0) {
+                net->Process();
+            }
+        }
+
+        if(rcv_a.msgs_received == msgs_to_send && rcv_b.msgs_received == msgs_to_send) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+TEST(SdgramTests, FlowControlBothWays) {
+    constexpr size_t MsgsToSend = 50;
+    constexpr uint32_t Runs = 100;
+
+    for(uint32_t seed = 0;seed < Runs;seed++) {
+        MemoryBufferPair serial(OverrunTest<SDgramFc>::UartCapacity, true);
+
+        EXPECT_TRUE(RunBothWays<SDgramFc>(seed, MsgsToSend, serial)) << "seed " << seed;
+        EXPECT_EQ(0, serial.A().OverrunBytes()) << "seed " << seed;
+        EXPECT_EQ(0, serial.B().OverrunBytes()) << "seed " << seed;
+    }
+}
+
+// Once the adverts went out, an idle network has nothing to do,
+// so that a loop can wait instead of calling Process().
+TEST(SdgramTests, FlowControlIdle) {
+    constexpr int MaxRounds = 100;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    auto serial_b = serial.CreateB();
+    SDgramFc a(serial_a);
+    SDgramFc b(serial_b);
+    TestRcv rcv;
+
+    b.RegisterReceiver(DefaultPort, rcv);
+
+    // the first adverts are due
+    EXPECT_TRUE(a.HasWork());
+    EXPECT_TRUE(b.HasWork());
+
+    auto buf = a.AllocBuffer();
+    buf.len = 8;
+    memset(buf.ptr, 0, buf.len);
+    ASSERT_EQ(SerialDatagram::Status::Success, a.Send(DefaultPort, buf));
+
+    int rounds = 0;
+
+    while((a.HasWork() || b.HasWork()) && rounds < MaxRounds) {
+        a.Process();
+        b.Process();
+        rounds++;
+    }
+
+    EXPECT_LT(rounds, MaxRounds);
+    EXPECT_EQ(1, rcv.msgs_received);
+    EXPECT_FALSE(a.HasWork());
+    EXPECT_FALSE(b.HasWork());
+
+    EXPECT_FALSE(a.Process());
+    EXPECT_FALSE(b.Process());
+}
+
+//
+// Compression tests.
+//
+
+struct CompressionConfig : SerialDatagram::DefaultConfig {
+    using Compression = SerialDatagram::RleCompression<2, true, 4>;
+};
+
+using SDgramZ = SerialDatagram::Net<SerialMock, CompressionConfig>;
+
+class CopyRcv : public SerialDatagram::Rcv {
+public:
+    virtual ~CopyRcv() = default;
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        auto data = static_cast<uint8_t *>(buf.ptr);
+
+        msgs.emplace_back(data, data + buf.len);
+    }
+
+    std::vector<std::vector<uint8_t>> msgs;
+};
+
+template<typename SndNet, typename RcvNet = SndNet>
+struct PayloadTest {
+    PayloadTest()
+            : serial(DefaultCapacity),
+            serial_rcv(serial.CreateA()),
+            serial_snd(serial.CreateB()),
+            sdgram_rcv(serial_rcv),
+            sdgram_snd(serial_snd) {
+        sdgram_rcv.RegisterReceiver(DefaultPort, rcv);
+    }
+
+    // Returns the number of bytes put on the wire.
+    size_t Send(const std::vector<uint8_t> &payload, bool deliver = true) {
+        auto buf = sdgram_snd.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        auto before = serial_rcv.available();
+        sdgram_snd.Send(DefaultPort, buf);
+        size_t on_wire = serial_rcv.available() - before;
+
+        if(deliver) {
+            sdgram_rcv.Process();
+        } else {
+            std::vector<uint8_t> dropped(on_wire);
+            for(auto &b : dropped) {
+                b = serial_rcv.read();
+            }
+        }
+
+        return on_wire;
+    }
+
+    MemoryBufferPair serial;
+    SerialMock serial_rcv;
+    SerialMock serial_snd;
+    RcvNet sdgram_rcv;
+    SndNet sdgram_snd;
+
+    CopyRcv rcv;
+};
+
+static std::vector<uint8_t> TelemetryPayload(uint8_t counter) {
+    std::vector<uint8_t> payload(SDgram::MaxBufferLen, 0);
+
+    payload[0] = counter;
+    payload[4] = 0x12;
+    payload[5] = 0x34;
+    payload[20] = 0xff;
+    payload[21] = 0xff;
+    payload[22] = 0xff;
+    payload[23] = 0xff;
+    payload[40] = static_cast<uint8_t>(counter * 3);
+
+    return payload;
+}
+
+TEST(SdgramTests, RleRoundTrip) {
+    using SerialDatagram::Rle;
+
+    std::vector<std::vector<uint8_t>> inputs = {
+        { },
+        { 0 },
+        { 1 },
+        { 0, 0, 0, 0, 0, 0, 0, 0 },
+        { 7, 7, 7, 7, 1, 2, 3, 0, 0, 4 },
+        std::vector<uint8_t>(200, 0),
+        std::vector<uint8_t>(200, 9),
+    };
+
+    std::vector<uint8_t> literal;
+
+    for(int i = 0;i < 300;i++) {
+        literal.push_back(static_cast<uint8_t>(i * 7 + 1));
+    }
+
+    inputs.push_back(literal);
+
+    for(auto &in : inputs) {
+        uint8_t encoded[512];
+        uint8_t decoded[512];
+
+        auto len = static_cast<uint16_t>(in.size());
+        auto encoded_len = Rle::Encode(in.data(), len, encoded, sizeof(encoded));
+
+        EXPECT_EQ(in.empty(), encoded_len == 0);
+
+        auto decoded_len = Rle::Decode(encoded, encoded_len, decoded, sizeof(decoded));
+
+        ASSERT_EQ(in.size(), decoded_len);
+        EXPECT_EQ(0, memcmp(in.data(), decoded, in.size()));
+    }
+
+    std::vector<uint8_t> zeros(64, 0);
+    uint8_t small[2];
+
+    EXPECT_EQ(1, Rle::Encode(zeros.data(), 64, small, sizeof(small)));
+    EXPECT_EQ(0, Rle::Encode(literal.data(), 8, small, sizeof(small)));
+    EXPECT_EQ(0, Rle::Decode(small, 1, small, 0));
+}
+
+TEST(SdgramTests, CompressionSendAndReceive) {
+    constexpr size_t MsgsToSend = 10;
+
+    PayloadTest<SDgramZ> test;
+
+    test.sdgram_snd.EnableCompression(DefaultPort);
+    test.sdgram_rcv.EnableCompression(DefaultPort);
+
+    auto uncompressed = TelemetryPayload(0).size()
+        + SerialDatagram::DatagramHdrSize
+        + SerialDatagram::DatagramTrlSize;
+
+    size_t key_size = 0;
+
+    for(size_t i = 0;i < MsgsToSend;i++) {
+        auto payload = TelemetryPayload(static_cast<uint8_t>(i));
+        auto on_wire = test.Send(payload);
+
+        EXPECT_GT(uncompressed / 2, on_wire);
+
+        // key frames every four, deltas in between
+        if(i % 4 == 0) {
+            key_size = on_wire;
+        } else {
+            EXPECT_GT(key_size, on_wire);
+        }
+
+        ASSERT_EQ(i + 1, test.rcv.msgs.size());
+        EXPECT_EQ(payload, test.rcv.msgs.back());
+    }
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(MsgsToSend, stats.msgs);
+    EXPECT_EQ(0, stats.decode_error);
+}
+
+TEST(SdgramTests, CompressionIncompressible) {
+    PayloadTest<SDgramZ> test;
+
+    test.sdgram_snd.EnableCompression(DefaultPort);
+    test.sdgram_rcv.EnableCompression(DefaultPort);
+
+    std::vector<uint8_t> payload;
+
+    for(size_t i = 0;i < SDgram::MaxBufferLen;i++) {
+        payload.push_back(static_cast<uint8_t>(i * 13 + 1));
+    }
+
+    auto on_wire = test.Send(payload);
+
+    EXPECT_EQ(
+        payload.size()
+            + SerialDatagram::DatagramHdrSize
+            + SerialDatagram::DatagramTrlSize,
+        on_wire);
+
+    // the next frame is a key frame, since the receiver
+    // does not know the sequence of the uncompressed one
+    auto telemetry = TelemetryPayload(1);
+    test.Send(telemetry);
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[0]);
+    EXPECT_EQ(telemetry, test.rcv.msgs[1]);
+}
+
+TEST(SdgramTests, CompressionLostDelta) {
+    PayloadTest<SDgramZ> test;
+
+    test.sdgram_snd.EnableCompression(DefaultPort);
+    test.sdgram_rcv.EnableCompression(DefaultPort);
+
+    test.Send(TelemetryPayload(0));
+    test.Send(TelemetryPayload(1), false);
+    test.Send(TelemetryPayload(2));
+    test.Send(TelemetryPayload(3));
+
+    // key frame
+    auto payload = TelemetryPayload(4);
+    test.Send(payload);
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(TelemetryPayload(0), test.rcv.msgs[0]);
+    EXPECT_EQ(payload, test.rcv.msgs[1]);
+
+    EXPECT_EQ(2, test.sdgram_rcv.GetRcvStats().decode_error);
+}
+
+TEST(SdgramTests, CompressionPortNotEnabled) {
+    PayloadTest<SDgramZ, SDgram> test;
+
+    test.sdgram_snd.EnableCompression(DefaultPort);
+
+    auto uncompressed = std::vector<uint8_t> { 1, 2, 3, 4, 5, 6 };
+
+    test.Send(TelemetryPayload(0));
+    test.Send(uncompressed);
+
+    ASSERT_EQ(1, test.rcv.msgs.size());
+    EXPECT_EQ(uncompressed, test.rcv.msgs[0]);
+
+    EXPECT_EQ(1, test.sdgram_rcv.GetRcvStats().size_error);
+}
+
+//
+// COBS framing tests.
+//
+
+struct CobsConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::CobsFraming;
+};
+
+using SDgramCobs = SerialDatagram::Net<SerialMock, CobsConfig>;
+
+// Payload full of zeros and header magic words.
+static std::vector<uint8_t> AdversarialPayload(uint8_t counter) {
+    std::vector<uint8_t> payload;
+
+    for(uint8_t i = 0;i < 8;i++) {
+        payload.push_back(0);
+        payload.push_back(0x57);
+        payload.push_back(0xa3);
+        payload.push_back(counter);
+    }
+
+    return payload;
+}
+
+TEST(SdgramTests, CobsSendAndReceive) {
+    constexpr size_t MsgsToSend = 10;
+
+    PayloadTest<SDgramCobs> test;
+
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        auto payload = AdversarialPayload(i);
+        auto on_wire = test.Send(payload);
+
+        EXPECT_EQ(payload.size() + SerialDatagram::CobsFraming::Overhead, on_wire);
+
+        ASSERT_EQ(i + 1u, test.rcv.msgs.size());
+        EXPECT_EQ(payload, test.rcv.msgs.back());
+    }
+
+    std::vector<uint8_t> full(SDgramCobs::MaxBufferLen, 0xa5);
+    test.Send(full);
+    test.Send({ });
+
+    ASSERT_EQ(MsgsToSend + 2, test.rcv.msgs.size());
+    EXPECT_EQ(full, test.rcv.msgs[MsgsToSend]);
+    EXPECT_TRUE(test.rcv.msgs.back().empty());
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(MsgsToSend + 2, stats.msgs);
+    EXPECT_EQ(0, stats.dropped_bytes);
+}
+
+// Pushes the datagram through the channel byte by byte,
+// optionally with bits of one byte flipped.
+template<typename Framing>
+static std::vector<uint8_t> EncodeFrame(const std::vector<uint8_t> &payload) {
+    std::vector<uint8_t> storage(Framing::HdrRoom + payload.size() + Framing::TrlRoom);
+    memcpy(storage.data() + Framing::HdrRoom, payload.data(), payload.size());
+
+    SerialDatagram::Buffer buf {
+        storage.data() + Framing::HdrRoom,
+        static_cast<SerialDatagram::BufferLen>(payload.size()) };
+
+    Framing::CreateFrame(DefaultPort, buf, 0);
+
+    auto data = static_cast<uint8_t *>(buf.ptr);
+
+    return std::vector<uint8_t>(data, data + buf.len);
+}
+
+template<typename Framing, typename Test>
+static void WriteFrame(
+        Test &test,
+        const std::vector<uint8_t> &payload,
+        int corrupt = -1,
+        uint8_t flip = 0x10) {
+    auto frame = EncodeFrame<Framing>(payload);
+
+    if(corrupt >= 0) {
+        frame[corrupt] ^= flip;
+    }
+
+    for(size_t i = 0;i < frame.size();i++) {
+        test.serial_snd.write(frame.data() + i, 1);
+        test.sdgram_rcv.Process();
+    }
+}
+
+TEST(SdgramTests, CobsPartial) {
+    PayloadTest<SDgramCobs> test;
+
+    auto payload = AdversarialPayload(1);
+
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[1]);
+}
+
+TEST(SdgramTests, CobsResyncAfterError) {
+    PayloadTest<SDgramCobs> test;
+
+    auto payload = AdversarialPayload(1);
+    auto frame_len = payload.size() + SerialDatagram::CobsFraming::Overhead;
+
+    // Every corrupted frame costs only itself.
+    for(size_t i = 0;i < frame_len - 1;i++) {
+        WriteFrame<SerialDatagram::CobsFraming>(test, payload, static_cast<int>(i));
+        WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+    }
+
+    EXPECT_EQ(frame_len - 1, test.rcv.msgs.size());
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(frame_len - 1, stats.crc_error + stats.size_error);
+    EXPECT_EQ((frame_len - 1) * frame_len, stats.dropped_bytes);
+}
+
+TEST(SdgramTests, CobsLostDelimiter) {
+    PayloadTest<SDgramCobs> test;
+
+    auto payload = AdversarialPayload(1);
+    auto frame_len = payload.size() + SerialDatagram::CobsFraming::Overhead;
+
+    // a frame without its delimiter merges into the next one
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload, static_cast<int>(frame_len - 1));
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+
+    EXPECT_EQ(1, test.rcv.msgs.size());
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(2 * frame_len, stats.dropped_bytes);
+}
+
+TEST(SdgramTests, CobsNoDelimiter) {
+    PayloadTest<SDgramCobs> test;
+
+    std::vector<uint8_t> garbage(200, 0x55);
+    test.serial_snd.write(garbage.data(), static_cast<uint16_t>(garbage.size()));
+    test.sdgram_rcv.Process();
+
+    auto payload = AdversarialPayload(2);
+
+    // the first frame terminates the garbage
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+    WriteFrame<SerialDatagram::CobsFraming>(test, payload);
+
+    ASSERT_EQ(1, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[0]);
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(1, stats.size_error);
+    EXPECT_EQ(
+        garbage.size() + payload.size() + SerialDatagram::CobsFraming::Overhead,
+        stats.dropped_bytes);
+}
+
+//
+// Compact framing tests.
+//
+
+struct CompactConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::CompactFraming<>;
+};
+
+struct CompactTrlConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::CompactFraming<true>;
+};
+
+using SDgramCompact = SerialDatagram::Net<SerialMock, CompactConfig>;
+using SDgramCompactTrl = SerialDatagram::Net<SerialMock, CompactTrlConfig>;
+
+TEST(SdgramTests, CompactSendAndReceive) {
+    constexpr size_t MsgsToSend = 10;
+    constexpr SerialDatagram::Port FarPort = 200;
+
+    PayloadTest<SDgramCompact> test;
+
+    CopyRcv far_rcv;
+    test.sdgram_rcv.RegisterReceiver(FarPort, far_rcv);
+
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        auto payload = TelemetryPayload(i);
+        auto on_wire = test.Send(payload);
+
+        EXPECT_EQ(payload.size() + SerialDatagram::CompactFraming<>::Overhead, on_wire);
+
+        ASSERT_EQ(i + 1u, test.rcv.msgs.size());
+        EXPECT_EQ(payload, test.rcv.msgs.back());
+    }
+
+    std::vector<uint8_t> full(SDgramCompact::MaxBufferLen, 0xa5);
+    test.Send(full);
+    test.Send({ });
+
+    ASSERT_EQ(MsgsToSend + 2, test.rcv.msgs.size());
+    EXPECT_EQ(full, test.rcv.msgs[MsgsToSend]);
+    EXPECT_TRUE(test.rcv.msgs.back().empty());
+
+    // ports above 2 take an extra header byte
+    auto payload = TelemetryPayload(0);
+    auto buf = test.sdgram_snd.AllocBuffer();
+    memcpy(buf.ptr, payload.data(), payload.size());
+    buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+    test.sdgram_snd.Send(FarPort, buf);
+    EXPECT_EQ(
+        SerialDatagram::CompactFraming<>::FrameLen(FarPort, buf.len),
+        test.serial_rcv.available());
+    test.sdgram_rcv.Process();
+
+    ASSERT_EQ(1, far_rcv.msgs.size());
+    EXPECT_EQ(payload, far_rcv.msgs[0]);
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(MsgsToSend + 3, stats.msgs);
+    EXPECT_EQ(0, stats.dropped_bytes);
+}
+
+TEST(SdgramTests, CompactTrailer) {
+    PayloadTest<SDgramCompactTrl> test;
+
+    auto payload = TelemetryPayload(3);
+
+    EXPECT_EQ(payload.size() + 6, test.Send(payload));
+    EXPECT_EQ(payload.size() + 6, test.Send(payload));
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[1]);
+}
+
+TEST(SdgramTests, CompactResyncAfterError) {
+    using Framing = SerialDatagram::CompactFraming<>;
+
+    PayloadTest<SDgramCompact> test;
+
+    auto payload = AdversarialPayload(1);
+    auto frame_len = payload.size() + Framing::Overhead;
+
+    // A corrupted frame never takes the next one with it.
+    for(size_t i = 0;i < frame_len;i++) {
+        WriteFrame<Framing>(test, payload, static_cast<int>(i));
+        WriteFrame<Framing>(test, payload);
+    }
+
+    EXPECT_EQ(frame_len, test.rcv.msgs.size());
+
+    for(auto &msg : test.rcv.msgs) {
+        EXPECT_EQ(payload, msg);
+    }
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    // a corrupted sync byte leaves nothing to check
+    EXPECT_EQ(2, stats.hdr_error);
+    EXPECT_EQ(frame_len - 3, stats.crc_error);
+}
+
+// Frames that start inside the allocated buffer still
+// return it to the pool.
+TEST(SdgramTests, FramingReusesBuffers) {
+    constexpr size_t MsgsToSend = 1000;
+
+    PayloadTest<SDgramCobs> cobs;
+    PayloadTest<SDgramCompact> compact;
+
+    for(size_t i = 0;i < MsgsToSend;i++) {
+        auto payload = TelemetryPayload(static_cast<uint8_t>(i));
+
+        cobs.Send(payload);
+        compact.Send(payload);
+    }
+
+    EXPECT_EQ(MsgsToSend, cobs.rcv.msgs.size());
+    EXPECT_EQ(MsgsToSend, compact.rcv.msgs.size());
+}
+
+template<typename FrameFormat>
+struct FullFrameConfig : SerialDatagram::DefaultConfig {
+    using Framing = FrameFormat;
+
+    static constexpr SerialDatagram::BufferLen MaxBufferLen = FrameFormat::MaxPayload;
+};
+
+// The largest payload the framing allows makes the largest frame.
+template<typename Framing>
+static void CheckFullFrame() {
+    using Net = SerialDatagram::Net<SerialMock, FullFrameConfig<Framing>>;
+
+    PayloadTest<Net> test;
+    std::vector<uint8_t> payload(Framing::MaxPayload);
+
+    for(size_t i = 0;i < payload.size();i++) {
+        payload[i] = static_cast<uint8_t>(i % 7 ? i : 0);
+    }
+
+    EXPECT_EQ(Framing::FrameLen(DefaultPort, Framing::MaxPayload), test.Send(payload));
+
+    ASSERT_EQ(1, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[0]);
+}
+
+TEST(SdgramTests, FramingFullFrame) {
+    CheckFullFrame<SerialDatagram::MagicFraming<>>();
+    CheckFullFrame<SerialDatagram::MagicFraming<true>>();
+    CheckFullFrame<SerialDatagram::MagicFraming<false, SerialDatagram::Crc32cIntegrity>>();
+    CheckFullFrame<SerialDatagram::CobsFraming>();
+    CheckFullFrame<SerialDatagram::CompactFraming<>>();
+    CheckFullFrame<SerialDatagram::CompactFraming<true>>();
+}
+
+//
+// Header check tests.
+//
+
+struct HdrCheckConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::MagicFraming<true>;
+};
+
+using SDgramHdrCheck = SerialDatagram::Net<SerialMock, HdrCheckConfig>;
+
+TEST(SdgramTests, HdrCheckSendAndReceive) {
+    using Framing = SerialDatagram::MagicFraming<true>;
+
+    PayloadTest<SDgramHdrCheck> test;
+
+    auto payload = TelemetryPayload(1);
+
+    EXPECT_EQ(payload.size() + Framing::Overhead, test.Send(payload));
+
+    // size 10 turned into 42, which still fits the buffer
+    std::vector<uint8_t> small(10, 0x11);
+    WriteFrame<Framing>(test, small, 2, 0x20);
+    WriteFrame<Framing>(test, small);
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[0]);
+    EXPECT_EQ(small, test.rcv.msgs[1]);
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(1, stats.hdr_error);
+    EXPECT_EQ(0, stats.crc_error);
+}
+
+// Flips every bit of a frame in turn, each time followed by
+// good frames, and counts the good frames that were not
+// delivered when their last byte arrived. Such frames wait for
+// bytes of later frames and are lost if the link goes quiet.
+template<typename Config>
+static size_t CollateralLosses() {
+    using Framing = typename Config::Framing;
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    constexpr size_t GoodFrames = 4;
+
+    std::vector<uint8_t> payload { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10 };
+    size_t lost = 0;
+
+    for(size_t i = 0;i < payload.size() + Framing::Overhead;i++) {
+        for(uint8_t bit = 0;bit < 8;bit++) {
+            PayloadTest<Net> test;
+
+            WriteFrame<Framing>(test, payload, static_cast<int>(i), 1 << bit);
+
+            for(size_t frame = 1;frame <= GoodFrames;frame++) {
+                WriteFrame<Framing>(test, payload);
+
+                if(test.rcv.msgs.size() < frame) {
+                    lost++;
+                }
+            }
+
+            EXPECT_EQ(GoodFrames, test.rcv.msgs.size());
+        }
+    }
+
+    return lost;
+}
+
+TEST(SdgramTests, HdrCheckCollateralLosses) {
+    auto unchecked = CollateralLosses<SerialDatagram::DefaultConfig>();
+    auto checked = CollateralLosses<HdrCheckConfig>();
+
+    printf("good frames held: %zu without header check, %zu with\n",
+        unchecked, checked);
+
+    EXPECT_GT(unchecked, 0);
+    EXPECT_EQ(0, checked);
+}
+
+//
+// Bonding tests.
+//
+
+constexpr uint16_t UnlimitedRate = 0xffff;
+
+class SeqRcv : public SerialDatagram::Rcv {
+public:
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        uint16_t seq;
+        memcpy(&seq, buf.ptr, sizeof(seq));
+
+        in_order = in_order && (seqs.empty() || seq > seqs.back());
+        seqs.push_back(seq);
+    }
+
+    std::vector<uint16_t> seqs;
+    bool in_order = true;
+};
+
+// The sending links have the given rates in bytes per tick.
+// A gap is given up on after a few frame times of the slowest
+// link.
+template<uint8_t Links>
+struct BondTest {
+    using BondNet = SerialDatagram::Bond<
+        ThrottledSerial,
+        Links,
+        SerialDatagram::DefaultConfig,
+        Links * SerialDatagram::DefaultConfig::TotalBufs,
+        256>;
+
+    BondTest(const std::array<uint16_t, Links> &rates)
+            : BondTest(rates, std::make_index_sequence<Links>()) {
+        // empty
+    }
+
+    template<size_t... I>
+    BondTest(
+        const std::array<uint16_t, Links> &rates,
+        std::index_sequence<I...>)
+            : serial { MemoryBufferPair(Capacity(I))... },
+            serial_rcv { ThrottledSerial(serial[I].CreateA(), UnlimitedRate)... },
+            serial_snd { ThrottledSerial(serial[I].CreateB(), rates[I])... },
+            bond_rcv(serial_rcv[I]...),
+            bond_snd(serial_snd[I]...) {
+        bond_rcv.RegisterReceiver(DefaultPort, rcv);
+    }
+
+    // Sends whenever a buffer is available and returns
+    // the number of ticks it took to deliver all messages.
+    size_t Run(uint16_t msgs, size_t max_ticks = 100000) {
+        size_t ticks = 0;
+
+        while(rcv.seqs.size() < msgs && ticks < max_ticks) {
+            for(auto &link : serial_snd) {
+                link.Tick();
+            }
+
+            while(sent < msgs) {
+                auto buf = bond_snd.AllocBuffer();
+
+                if(!buf.ptr) {
+                    break;
+                }
+
+                memset(buf.ptr, 0, PayloadLen);
+                memcpy(buf.ptr, &sent, sizeof(sent));
+                buf.len = PayloadLen;
+
+                bond_snd.Send(DefaultPort, buf);
+                sent++;
+            }
+
+            bond_snd.Process();
+            bond_rcv.Process();
+
+            ticks++;
+        }
+
+        return ticks;
+    }
+
+    static constexpr size_t Capacity(size_t) {
+        return DefaultCapacity;
+    }
+
+    static constexpr SerialDatagram::BufferLen PayloadLen = 24;
+
+    MemoryBufferPair serial[Links];
+    ThrottledSerial serial_rcv[Links];
+    ThrottledSerial serial_snd[Links];
+    BondNet bond_rcv;
+    BondNet bond_snd;
+
+    SeqRcv rcv;
+    uint16_t sent = 0;
+};
+
+TEST(SdgramTests, BondThroughputScales) {
+    constexpr uint16_t MsgsToSend = 500;
+
+    BondTest<1> single({ 8 });
+    BondTest<3> bonded({ 8, 4, 2 });
+
+    auto single_ticks = single.Run(MsgsToSend);
+    auto bonded_ticks = bonded.Run(MsgsToSend);
+
+    ASSERT_EQ(MsgsToSend, single.rcv.seqs.size());
+    ASSERT_EQ(MsgsToSend, bonded.rcv.seqs.size());
+    EXPECT_TRUE(bonded.rcv.in_order);
+
+    printf("ticks for %u datagrams: %zu over one link, %zu bonded\n",
+        MsgsToSend, single_ticks, bonded_ticks);
+
+    // 14 bytes per tick instead of 8
+    EXPECT_LT(bonded_ticks * 3, single_ticks * 2);
+
+    // faster links carry more
+    EXPECT_GT(bonded.bond_rcv.GetRcvStats(0).msgs, bonded.bond_rcv.GetRcvStats(1).msgs);
+    EXPECT_GT(bonded.bond_rcv.GetRcvStats(1).msgs, bonded.bond_rcv.GetRcvStats(2).msgs);
+
+    auto stats = bonded.bond_rcv.GetBondStats();
+
+    EXPECT_GT(stats.reordered, 0);
+    EXPECT_EQ(0, stats.skipped);
+}
+
+TEST(SdgramTests, BondSilentLink) {
+    constexpr uint16_t MsgsToSend = 400;
+
+    BondTest<2> test({ 6, 6 });
+
+    test.Run(100);
+    ASSERT_EQ(100, test.rcv.seqs.size());
+
+    // the datagrams queued on the stalled link never arrive
+    test.serial_snd[1].SetRate(0);
+    test.Run(MsgsToSend, 2000);
+
+    EXPECT_TRUE(test.rcv.in_order);
+    EXPECT_EQ(MsgsToSend - 1, test.rcv.seqs.back());
+
+    auto stats = test.bond_rcv.GetBondStats();
+
+    EXPECT_GT(stats.skipped, 0);
+    EXPECT_EQ(MsgsToSend, test.rcv.seqs.size() + stats.skipped);
+}
+
+// A link that refuses the receiver leaves it on none of them.
+TEST(SdgramTests, BondRegisterRollsBack) {
+    constexpr SerialDatagram::Port OtherPort = DefaultPort + 1;
+
+    BondTest<3> test({ 6, 6, 6 });
+    SeqRcv other;
+    SeqRcv rcv;
+
+    auto &link = test.bond_rcv.GetLink(2);
+
+    ASSERT_EQ(SerialDatagram::Status::Success, link.RegisterReceiver(OtherPort, other));
+    EXPECT_EQ(SerialDatagram::Status::Duplicate, test.bond_rcv.RegisterReceiver(OtherPort, rcv));
+
+    ASSERT_EQ(SerialDatagram::Status::Success, link.UnregisterReceiver(OtherPort, other));
+    EXPECT_EQ(SerialDatagram::Status::Failure, link.UnregisterReceiver(OtherPort, other));
+    EXPECT_EQ(SerialDatagram::Status::Success, test.bond_rcv.RegisterReceiver(OtherPort, rcv));
+}
+
+// The default depth of 12 does not divide the 256 sequence
+// numbers, so the slots must not follow from the numbers alone.
+TEST(SdgramTests, BondReorderAcrossWrap) {
+    constexpr uint16_t MsgsToSend = 700;
+
+    const std::array<uint16_t, 3> rates[] = {
+        { 8, 4, 2 },
+        { 7, 5, 5 },
+        { 7, 7, 5 },
+        { 10, 8, 7 },
+    };
+
+    for(auto &link_rates : rates) {
+        BondTest<3> test(link_rates);
+
+        test.Run(MsgsToSend);
+
+        EXPECT_EQ(MsgsToSend, test.rcv.seqs.size());
+        EXPECT_TRUE(test.rcv.in_order);
+
+        auto stats = test.bond_rcv.GetBondStats();
+
+        EXPECT_GT(stats.reordered, 0);
+        EXPECT_EQ(0, stats.skipped);
+        EXPECT_EQ(0, stats.stale);
+    }
+}
+
+//
+// Router tests.
+//
+
+// Two endpoints, each connected to the hub by its own channel.
+struct RouterTest {
+    RouterTest(size_t b_capacity = DefaultCapacity)
+            : serial_a(DefaultCapacity),
+            serial_b(b_capacity),
+            serial_a_end(serial_a.CreateA()),
+            serial_hub_a(serial_a.CreateB()),
+            serial_hub_b(serial_b.CreateA()),
+            serial_b_end(serial_b.CreateB()),
+            a(serial_a_end),
+            hub_a(serial_hub_a),
+            hub_b(serial_hub_b),
+            b(serial_b_end) {
+        b.RegisterReceiver(DefaultPort, rcv);
+        b.RegisterReceiver(OtherPort, other_rcv);
+    }
+
+    void Send(const std::vector<uint8_t> &payload) {
+        auto buf = a.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        a.Send(DefaultPort, buf);
+    }
+
+    static std::vector<uint8_t> ReadAll(SerialMock &serial) {
+        std::vector<uint8_t> data;
+
+        while(serial.available()) {
+            data.push_back(serial.read());
+        }
+
+        return data;
+    }
+
+    static constexpr SerialDatagram::Port OtherPort = 9;
+
+    MemoryBufferPair serial_a;
+    MemoryBufferPair serial_b;
+
+    SerialMock serial_a_end;
+    SerialMock serial_hub_a;
+    SerialMock serial_hub_b;
+    SerialMock serial_b_end;
+
+    SDgram a;
+    SDgram hub_a;
+    SDgram hub_b;
+    SDgram b;
+
+    SerialDatagram::Router<SDgram> router;
+
+    CopyRcv rcv;
+    CopyRcv other_rcv;
+};
+
+TEST(SdgramTests, RouterForwardsFrameUnchanged) {
+    RouterTest test;
+
+    ASSERT_EQ(SerialDatagram::Status::Success,
+        test.router.AddRoute(test.hub_a, DefaultPort, test.hub_b, DefaultPort));
+
+    auto payload = TelemetryPayload(7);
+    test.Send(payload);
+
+    // put the bytes back after looking at them
+    auto sent = RouterTest::ReadAll(test.serial_hub_a);
+    test.serial_a_end.write(sent.data(), static_cast<uint16_t>(sent.size()));
+
+    test.hub_a.Process();
+
+    auto forwarded = RouterTest::ReadAll(test.serial_b_end);
+
+    EXPECT_EQ(sent, forwarded);
+
+    auto &stats = test.router.GetRouteStats(0);
+
+    EXPECT_EQ(1, stats.forwarded);
+    EXPECT_EQ(0, stats.reframed);
+    EXPECT_EQ(sent.size(), stats.bytes);
+}
+
+TEST(SdgramTests, RouterRewritesPort) {
+    RouterTest test;
+
+    test.router.AddRoute(test.hub_a, DefaultPort, test.hub_b, RouterTest::OtherPort);
+
+    auto payload = TelemetryPayload(3);
+    test.Send(payload);
+    test.hub_a.Process();
+    test.b.Process();
+
+    EXPECT_TRUE(test.rcv.msgs.empty());
+    ASSERT_EQ(1, test.other_rcv.msgs.size());
+    EXPECT_EQ(payload, test.other_rcv.msgs[0]);
+
+    EXPECT_EQ(1, test.router.GetRouteStats(0).reframed);
+}
+
+TEST(SdgramTests, RouterQueueLimit) {
+    constexpr size_t MsgsToSend = 20;
+
+    // the hub to b channel takes a single frame at a time
+    RouterTest test(40);
+
+    test.router.AddRoute(test.hub_a, DefaultPort, test.hub_b, DefaultPort, 40);
+
+    auto payload = TelemetryPayload(1);
+
+    for(size_t i = 0;i < MsgsToSend;i++) {
+        test.Send(payload);
+        test.hub_a.Process();
+    }
+
+    auto stats = test.router.GetRouteStats(0);
+
+    EXPECT_GT(stats.queue_full, 0);
+    EXPECT_EQ(0, stats.no_buffer);
+    EXPECT_EQ(MsgsToSend, stats.forwarded + stats.queue_full);
+    EXPECT_LE(test.hub_b.QueuedBytes(), 40);
+
+    for(size_t i = 0;i < MsgsToSend;i++) {
+        test.hub_b.Process();
+        test.b.Process();
+    }
+
+    EXPECT_EQ(stats.forwarded, test.rcv.msgs.size());
+}
+
+TEST(SdgramTests, RouterDuplicateRoute) {
+    RouterTest test;
+
+    EXPECT_EQ(SerialDatagram::Status::Success,
+        test.router.AddRoute(test.hub_a, DefaultPort, test.hub_b, DefaultPort));
+    EXPECT_EQ(SerialDatagram::Status::Duplicate,
+        test.router.AddRoute(test.hub_a, DefaultPort, test.hub_b, RouterTest::OtherPort));
+}
+
+//
+// Frame timeout tests.
+//
+
+// Time only moves when a test says so.
+struct VirtualClock {
+    static uint32_t Now() {
+        return now;
+    }
+
+    static inline uint32_t now = 0;
+};
+
+template<typename FrameFormat>
+struct TimeoutConfig : SerialDatagram::DefaultConfig {
+    using Framing = FrameFormat;
+    using Clock = VirtualClock;
+
+    static constexpr uint16_t FrameTimeout = 20;
+};
+
+static const std::vector<uint8_t> ShortPayload { 1, 2, 3, 4 };
+
+// The sender stops in the middle of a long frame and sends
+// a short frame after a pause.
+template<typename Framing, typename Net>
+static void SendTruncatedFrame(PayloadTest<Net> &test, uint32_t pause) {
+    auto frame = EncodeFrame<Framing>(TelemetryPayload(1));
+
+    test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size() / 2));
+    test.sdgram_rcv.Process();
+
+    VirtualClock::now += pause;
+    test.sdgram_rcv.Process();
+
+    frame = EncodeFrame<Framing>(ShortPayload);
+
+    test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size()));
+    test.sdgram_rcv.Process();
+}
+
+template<typename Framing>
+static void CheckFrameTimeout() {
+    using Net = SerialDatagram::Net<SerialMock, TimeoutConfig<Framing>>;
+
+    auto frame_len = EncodeFrame<Framing>(TelemetryPayload(1)).size();
+
+    PayloadTest<Net> test;
+    SendTruncatedFrame<Framing>(test, 20);
+
+    auto &stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(1, stats.frame_timeout);
+    EXPECT_EQ(frame_len / 2, stats.dropped_bytes);
+    ASSERT_EQ(1, test.rcv.msgs.size());
+    EXPECT_EQ(ShortPayload, test.rcv.msgs[0]);
+}
+
+TEST(SdgramTests, FrameTimeoutDropsTruncatedFrame) {
+    CheckFrameTimeout<SerialDatagram::MagicFraming<>>();
+    CheckFrameTimeout<SerialDatagram::CobsFraming>();
+    CheckFrameTimeout<SerialDatagram::CompactFraming<>>();
+}
+
+// Without the timeout, the short frame is taken for the rest
+// of the truncated one, which waits for more bytes.
+TEST(SdgramTests, FrameTimeoutBoundsRecovery) {
+    PayloadTest<SDgram> stalled;
+    SendTruncatedFrame<SerialDatagram::MagicFraming<>>(stalled, 1000);
+
+    EXPECT_EQ(0, stalled.rcv.msgs.size());
+
+    PayloadTest<SerialDatagram::Net<SerialMock, TimeoutConfig<SerialDatagram::MagicFraming<>>>> recovered;
+    SendTruncatedFrame<SerialDatagram::MagicFraming<>>(recovered, 19);
+
+    EXPECT_EQ(0, recovered.rcv.msgs.size());
+    EXPECT_EQ(0, recovered.sdgram_rcv.GetRcvStats().frame_timeout);
+
+    VirtualClock::now += 1;
+    recovered.sdgram_rcv.Process();
+
+    // the timeout runs from the last byte
+    EXPECT_EQ(0, recovered.rcv.msgs.size());
+
+    VirtualClock::now += 20;
+    recovered.sdgram_rcv.Process();
+
+    EXPECT_EQ(1, recovered.sdgram_rcv.GetRcvStats().frame_timeout);
+    ASSERT_EQ(1, recovered.rcv.msgs.size());
+    EXPECT_EQ(ShortPayload, recovered.rcv.msgs[0]);
+}
+
+TEST(SdgramTests, FrameTimeoutAllowsSlowBytes) {
+    using Net = SerialDatagram::Net<SerialMock, TimeoutConfig<SerialDatagram::MagicFraming<>>>;
+
+    PayloadTest<Net> test;
+
+    auto frame = EncodeFrame<SerialDatagram::MagicFraming<>>(TelemetryPayload(1));
+
+    for(auto byte : frame) {
+        test.serial_snd.write(&byte, 1);
+        VirtualClock::now += 19;
+        test.sdgram_rcv.Process();
+    }
+
+    EXPECT_EQ(0, test.sdgram_rcv.GetRcvStats().frame_timeout);
+    EXPECT_EQ(1, test.rcv.msgs.size());
+}
+
+//
+// Coalescing tests.
+//
+
+// The receiving end leaves room for about one frame, so
+// that the sender backs up.
+struct CoalesceTest {
+    static constexpr SerialDatagram::Port OtherPort = 9;
+
+    CoalesceTest()
+            : serial(SDgram::MaxBufferLen + 20),
+            serial_rcv(serial.CreateA()),
+            serial_snd(serial.CreateB()),
+            sdgram_rcv(serial_rcv),
+            sdgram_snd(serial_snd) {
+        sdgram_rcv.RegisterReceiver(DefaultPort, rcv);
+        sdgram_rcv.RegisterReceiver(OtherPort, other_rcv);
+    }
+
+    bool Send(SerialDatagram::Port port, const std::vector<uint8_t> &payload) {
+        auto buf = sdgram_snd.AllocBuffer();
+
+        if(!buf.ptr) {
+            return false;
+        }
+
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        return sdgram_snd.Send(port, buf) == SerialDatagram::Status::Success;
+    }
+
+    void Drain() {
+        while(sdgram_snd.QueuedBytes() || serial_rcv.available()) {
+            sdgram_rcv.Process();
+            sdgram_snd.Process();
+        }
+    }
+
+    MemoryBufferPair serial;
+    SerialMock serial_rcv;
+    SerialMock serial_snd;
+    SDgram sdgram_rcv;
+    SDgram sdgram_snd;
+
+    CopyRcv rcv;
+    CopyRcv other_rcv;
+};
+
+TEST(SdgramTests, CoalesceKeepsLatest) {
+    constexpr uint8_t Samples = 20;
+
+    CoalesceTest test;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, test.sdgram_snd.EnableCoalescing(DefaultPort));
+
+    for(uint8_t i = 0;i < Samples;i++) {
+        ASSERT_TRUE(test.Send(DefaultPort, TelemetryPayload(i)));
+    }
+
+    // the stream took the first frame and part of the second
+    EXPECT_EQ(Samples - 3, test.sdgram_snd.CoalescedFrames());
+
+    test.Drain();
+
+    ASSERT_EQ(3, test.rcv.msgs.size());
+    EXPECT_EQ(TelemetryPayload(0), test.rcv.msgs[0]);
+    EXPECT_EQ(TelemetryPayload(1), test.rcv.msgs[1]);
+    EXPECT_EQ(TelemetryPayload(Samples - 1), test.rcv.msgs[2]);
+    EXPECT_EQ(Samples, test.sdgram_snd.SentFrames());
+}
+
+TEST(SdgramTests, CoalesceOnlySamePort) {
+    using Port = SerialDatagram::Port;
+
+    constexpr Port Other = CoalesceTest::OtherPort;
+
+    CoalesceTest test;
+
+    test.sdgram_snd.EnableCoalescing(DefaultPort);
+
+    // the first frame is written, the second one partly
+    const Port ports[] = { DefaultPort, Other, DefaultPort, Other };
+
+    for(uint8_t i = 0;i < 4;i++) {
+        ASSERT_TRUE(test.Send(ports[i], TelemetryPayload(i)));
+    }
+
+    EXPECT_EQ(0, test.sdgram_snd.CoalescedFrames());
+
+    // replaces the third frame and frees its buffer
+    ASSERT_TRUE(test.Send(DefaultPort, TelemetryPayload(4)));
+    EXPECT_EQ(1, test.sdgram_snd.CoalescedFrames());
+
+    // the other port is not coalesced, so the buffers run out
+    ASSERT_TRUE(test.Send(Other, TelemetryPayload(5)));
+    EXPECT_FALSE(test.Send(Other, TelemetryPayload(6)));
+
+    test.Drain();
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(TelemetryPayload(4), test.rcv.msgs[1]);
+    EXPECT_EQ(3, test.other_rcv.msgs.size());
+}
+
+TEST(SdgramTests, CoalesceRejectsDelta) {
+    PayloadTest<SDgramZ> test;
+    auto &net = test.sdgram_snd;
+
+    EXPECT_EQ(SerialDatagram::Status::Success, net.EnableCompression(DefaultPort));
+    EXPECT_EQ(SerialDatagram::Status::Failure, net.EnableCoalescing(DefaultPort));
+
+    EXPECT_EQ(SerialDatagram::Status::Success, net.EnableCoalescing(CoalesceTest::OtherPort));
+    EXPECT_EQ(SerialDatagram::Status::Duplicate, net.EnableCoalescing(CoalesceTest::OtherPort));
+    EXPECT_EQ(SerialDatagram::Status::Failure, net.EnableCompression(CoalesceTest::OtherPort));
+}
+
+//
+// RPC tests.
+//
+
+constexpr uint8_t RpcAdd = 1;
+constexpr uint8_t RpcFail = 2;
+
+class AddMethod : public SerialDatagram::RpcMethod {
+public:
+    SerialDatagram::RpcStatus Call(
+            SerialDatagram::Buffer args,
+            SerialDatagram::Buffer &result) override {
+        auto in = static_cast<const uint8_t *>(args.ptr);
+        auto out = static_cast<uint8_t *>(result.ptr);
+
+        out[0] = 0;
+
+        for(uint8_t i = 0;i < args.len;i++) {
+            out[0] += in[i];
+        }
+
+        result.len = 1;
+
+        return SerialDatagram::RpcStatus::Ok;
+    }
+};
+
+class FailMethod : public SerialDatagram::RpcMethod {
+public:
+    SerialDatagram::RpcStatus Call(
+            SerialDatagram::Buffer,
+            SerialDatagram::Buffer &) override {
+        return SerialDatagram::RpcStatus::Failed;
+    }
+};
+
+class RecordDone : public SerialDatagram::RpcDone {
+public:
+    struct Result {
+        uint8_t tag;
+        SerialDatagram::RpcStatus status;
+        std::vector<uint8_t> data;
+    };
+
+    void Done(
+            uint8_t tag,
+            SerialDatagram::RpcStatus status,
+            SerialDatagram::Buffer result) override {
+        auto data = static_cast<const uint8_t *>(result.ptr);
+
+        results.push_back(Result { tag, status, std::vector<uint8_t>(data, data + result.len) });
+    }
+
+    std::vector<Result> results;
+};
+
+struct RpcTest {
+    static constexpr SerialDatagram::Port RequestPort = 10;
+    static constexpr SerialDatagram::Port ResponsePort = 11;
+
+    RpcTest()
+            : serial(DefaultCapacity),
+            serial_host(serial.CreateA()),
+            serial_device(serial.CreateB()),
+            host(serial_host),
+            device(serial_device),
+            client(host, RequestPort, ResponsePort),
+            server(device, RequestPort, ResponsePort) {
+        client.Start();
+        server.Start();
+        server.Register(RpcAdd, add);
+        server.Register(RpcFail, fail);
+    }
+
+    SerialDatagram::Status Call(uint8_t method, std::vector<uint8_t> args, uint16_t timeout = 100) {
+        return client.Call(
+            method,
+            args.data(),
+            static_cast<SerialDatagram::BufferLen>(args.size()),
+            done,
+            timeout);
+    }
+
+    void Process() {
+        device.Process();
+        host.Process();
+        client.Process();
+    }
+
+    MemoryBufferPair serial;
+    SerialMock serial_host;
+    SerialMock serial_device;
+
+    SDgram host;
+    SDgram device;
+
+    SerialDatagram::RpcClient<SDgram, 8, VirtualClock> client;
+    SerialDatagram::RpcServer<SDgram> server;
+
+    AddMethod add;
+    FailMethod fail;
+    RecordDone done;
+};
+
+TEST(SdgramTests, RpcCall) {
+    RpcTest test;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, test.Call(RpcAdd, { 1, 2, 3 }));
+    test.Process();
+
+    ASSERT_EQ(1, test.done.results.size());
+    EXPECT_EQ(SerialDatagram::RpcStatus::Ok, test.done.results[0].status);
+    EXPECT_EQ(std::vector<uint8_t>({ 6 }), test.done.results[0].data);
+    EXPECT_EQ(0, test.client.Pending());
+}
+
+TEST(SdgramTests, RpcPipelined) {
+    constexpr uint8_t Calls = 8;
+
+    RpcTest test;
+    uint8_t tags[Calls];
+
+    for(uint8_t i = 0;i < Calls;i++) {
+        uint8_t arg = i * 3;
+
+        ASSERT_EQ(SerialDatagram::Status::Success,
+            test.client.Call(RpcAdd, &arg, 1, test.done, 100, tags + i));
+    }
+
+    EXPECT_EQ(Calls, test.client.Pending());
+
+    uint8_t arg = 0;
+    EXPECT_EQ(SerialDatagram::Status::NoMoreSpace,
+        test.client.Call(RpcAdd, &arg, 1, test.done, 100));
+
+    test.Process();
+
+    ASSERT_EQ(Calls, test.done.results.size());
+
+    for(uint8_t i = 0;i < Calls;i++) {
+        EXPECT_EQ(tags[i], test.done.results[i].tag);
+        EXPECT_EQ(std::vector<uint8_t>({ static_cast<uint8_t>(i * 3) }), test.done.results[i].data);
+    }
+
+    EXPECT_EQ(Calls, test.server.GetStats().calls);
+}
+
+TEST(SdgramTests, RpcErrors) {
+    RpcTest test;
+
+    test.Call(RpcFail, { 1 });
+    test.Call(42, { 1 });
+    test.Process();
+
+    ASSERT_EQ(2, test.done.results.size());
+    EXPECT_EQ(SerialDatagram::RpcStatus::Failed, test.done.results[0].status);
+    EXPECT_TRUE(test.done.results[0].data.empty());
+    EXPECT_EQ(SerialDatagram::RpcStatus::NoMethod, test.done.results[1].status);
+    EXPECT_EQ(1, test.server.GetStats().no_method);
+}
+
+TEST(SdgramTests, RpcTimeout) {
+    RpcTest test;
+
+    test.Call(RpcAdd, { 1 }, 50);
+
+    VirtualClock::now += 49;
+    test.client.Process();
+
+    EXPECT_TRUE(test.done.results.empty());
+
+    VirtualClock::now += 1;
+    test.client.Process();
+
+    ASSERT_EQ(1, test.done.results.size());
+    EXPECT_EQ(SerialDatagram::RpcStatus::Timeout, test.done.results[0].status);
+
+    // the response comes too late
+    test.Process();
+
+    EXPECT_EQ(1, test.done.results.size());
+    EXPECT_EQ(1, test.client.GetStats().late);
+    EXPECT_EQ(1, test.client.GetStats().timeouts);
+}
+
+//
+// Schema tests.
+//
+
+#pragma pack(push, 1)
+struct Telemetry {
+    uint16_t voltage;
+    int16_t current;
+    uint8_t flags[2];
+    float temperature;
+};
+#pragma pack(pop)
+
+using TelemetryMsg = SerialDatagram::Schema<
+    12, Telemetry, uint16_t, int16_t, uint8_t[2], float>;
+
+class TelemetryRcv : public SerialDatagram::SchemaRcv<TelemetryMsg> {
+public:
+    void ProcessTyped(const Telemetry &msg) override {
+        msgs.push_back(msg);
+    }
+
+    std::vector<Telemetry> msgs;
+};
+
+static_assert(TelemetryMsg::Size == 10);
+
+TEST(SdgramTests, SchemaFormat) {
+    EXPECT_STREQ("<HhBBf", TelemetryMsg::Format());
+}
+
+TEST(SdgramTests, SchemaSendReceive) {
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    auto serial_b = serial.CreateB();
+    SDgram sdgram_a(serial_a);
+    SDgram sdgram_b(serial_b);
+    TelemetryRcv rcv;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, rcv.Start(sdgram_b));
+
+    SerialDatagram::Buffer buf;
+    auto msg = TelemetryMsg::Alloc(sdgram_a, buf);
+
+    ASSERT_NE(nullptr, msg);
+    EXPECT_EQ(TelemetryMsg::Size, buf.len);
+
+    msg->voltage = 5000;
+    msg->current = -120;
+    msg->flags[0] = 1;
+    msg->flags[1] = 2;
+    msg->temperature = 21.5f;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, TelemetryMsg::Send(sdgram_a, buf));
+    sdgram_b.Process();
+
+    ASSERT_EQ(1, rcv.msgs.size());
+    EXPECT_EQ(5000, rcv.msgs[0].voltage);
+    EXPECT_EQ(-120, rcv.msgs[0].current);
+    EXPECT_EQ(2, rcv.msgs[0].flags[1]);
+    EXPECT_EQ(21.5f, static_cast<float>(rcv.msgs[0].temperature));
+}
+
+TEST(SdgramTests, SchemaSizeMismatch) {
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    auto serial_b = serial.CreateB();
+    SDgram sdgram_a(serial_a);
+    SDgram sdgram_b(serial_b);
+    TelemetryRcv rcv;
+
+    rcv.Start(sdgram_b);
+
+    auto buf = sdgram_a.AllocBuffer();
+    buf.len = TelemetryMsg::Size - 1;
+    sdgram_a.Send(TelemetryMsg::MsgPort, buf);
+    sdgram_b.Process();
+
+    EXPECT_TRUE(rcv.msgs.empty());
+    EXPECT_EQ(1, rcv.SizeErrors());
+}
+
+//
+// Feed tests.
+//
+
+// Good frames mixed with noise and corrupted frames.
+template<typename Framing>
+static std::vector<uint8_t> MixedStream() {
+    std::vector<uint8_t> bytes;
+
+    for(uint8_t i = 0;i < 20;i++) {
+        auto frame = EncodeFrame<Framing>(TelemetryPayload(i));
+
+        if(i % 5 == 1) {
+            bytes.insert(bytes.end(), { 0x11, 0x57, 0x22 });
+        }
+
+        if(i % 7 == 3) {
+            frame[frame.size() / 2] ^= 0x10;
+        }
+
+        bytes.insert(bytes.end(), frame.begin(), frame.end());
+    }
+
+    return bytes;
+}
+
+// Feeding in chunks of any size delivers what reading
+// the same bytes from the stream delivers.
+template<typename Config>
+static void FeedMatchesProcess() {
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    auto bytes = MixedStream<typename Config::Framing>();
+
+    PayloadTest<Net> ref;
+
+    for(auto byte : bytes) {
+        ref.serial_snd.write(&byte, 1);
+        ref.sdgram_rcv.Process();
+    }
+
+    ASSERT_GT(ref.rcv.msgs.size(), 10);
+
+    for(size_t chunk : { 1, 2, 5, 13, 64, 1000 }) {
+        PayloadTest<Net> test;
+
+        for(size_t i = 0;i < bytes.size();i += chunk) {
+            test.sdgram_rcv.Feed(bytes.data() + i, std::min(chunk, bytes.size() - i));
+        }
+
+        EXPECT_EQ(ref.rcv.msgs, test.rcv.msgs) << "chunk " << chunk;
+
+        auto ref_stats = ref.sdgram_rcv.GetRcvStats();
+        auto stats = test.sdgram_rcv.GetRcvStats();
+
+        EXPECT_EQ(ref_stats.msgs, stats.msgs) << "chunk " << chunk;
+        EXPECT_EQ(ref_stats.bytes, stats.bytes) << "chunk " << chunk;
+        EXPECT_EQ(ref_stats.dropped_bytes, stats.dropped_bytes) << "chunk " << chunk;
+    }
+}
+
+TEST(SdgramTests, FeedMagic) {
+    FeedMatchesProcess<SerialDatagram::DefaultConfig>();
+}
+
+TEST(SdgramTests, FeedHdrCheck) {
+    FeedMatchesProcess<HdrCheckConfig>();
+}
+
+TEST(SdgramTests, FeedCobs) {
+    FeedMatchesProcess<CobsConfig>();
+}
+
+TEST(SdgramTests, FeedCompact) {
+    FeedMatchesProcess<CompactTrlConfig>();
+}
+
+class PtrRcv : public SerialDatagram::Rcv {
+public:
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        ptrs.push_back(static_cast<const uint8_t *>(buf.ptr));
+    }
+
+    std::vector<const uint8_t *> ptrs;
+};
+
+TEST(SdgramTests, FeedInPlace) {
+    using Framing = SerialDatagram::MagicFraming<>;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    SDgram sdgram(serial_a);
+    PtrRcv rcv;
+
+    sdgram.RegisterReceiver(DefaultPort, rcv);
+
+    auto first = EncodeFrame<Framing>(TelemetryPayload(1));
+    auto second = EncodeFrame<Framing>(TelemetryPayload(2));
+
+    std::vector<uint8_t> bytes(first);
+    bytes.insert(bytes.end(), second.begin(), second.end());
+
+    // the second frame is cut short
+    sdgram.Feed(bytes.data(), bytes.size() - 3);
+
+    ASSERT_EQ(1, rcv.ptrs.size());
+    EXPECT_EQ(bytes.data() + Framing::HdrRoom, rcv.ptrs[0]);
+
+    sdgram.Feed(bytes.data() + bytes.size() - 3, 3);
+
+    ASSERT_EQ(2, rcv.ptrs.size());
+    EXPECT_EQ(0, sdgram.GetRcvStats().dropped_bytes);
+}
+
+TEST(SdgramTests, Crc16UsbParts) {
+    auto payload = TelemetryPayload(3);
+
+    auto crc = SerialDatagram::Crc16UsbParts::Update(
+        SerialDatagram::Crc16UsbParts::Init, payload.data(), 5);
+    crc = SerialDatagram::Crc16UsbParts::Update(crc, payload.data() + 5, payload.size() - 5);
+
+    EXPECT_EQ(
+        Crc16Usb::Calc(payload.data(), payload.size()),
+        SerialDatagram::Crc16UsbParts::Final(crc));
+}
+
+//
+// Hold tests.
+//
+
+template<typename Net>
+class HoldRcv : public SerialDatagram::Rcv {
+public:
+    HoldRcv(Net &net)
+            : net(net) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        auto held = net.HoldFrame();
+
+        if(!held.ptr) {
+            missed.emplace_back(
+                static_cast<uint8_t *>(buf.ptr),
+                static_cast<uint8_t *>(buf.ptr) + buf.len);
+            return;
+        }
+
+        EXPECT_EQ(buf.len, held.len);
+        frames.push_back(held);
+    }
+
+    std::vector<uint8_t> Payload(size_t i) const {
+        auto data = static_cast<uint8_t *>(frames[i].ptr);
+
+        return std::vector<uint8_t>(data, data + frames[i].len);
+    }
+
+    void ReleaseAll() {
+        for(auto buf : frames) {
+            net.ReleaseFrame(buf);
+        }
+
+        frames.clear();
+    }
+
+    Net &net;
+    std::vector<SerialDatagram::Buffer> frames;
+    std::vector<std::vector<uint8_t>> missed;
+};
+
+template<typename Base>
+struct HoldConfig : Base {
+    static constexpr uint16_t RxBufs = 3;
+};
+
+template<typename Config>
+static void HoldWhileReceiving() {
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    PayloadTest<Net> test;
+    HoldRcv<Net> rcv(test.sdgram_rcv);
+
+    test.sdgram_rcv.RegisterReceiver(2, rcv);
+
+    // Frames arrive together, so the parser has the next
+    // one buffered when the first one is held.
+    for(uint8_t i = 0;i < 3;i++) {
+        auto payload = AdversarialPayload(i);
+        auto buf = test.sdgram_snd.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+        test.sdgram_snd.Send(2, buf);
+    }
+
+    test.sdgram_rcv.Process();
+
+    // one buffer receives, two hold
+    ASSERT_EQ(2, rcv.frames.size());
+    ASSERT_EQ(1, rcv.missed.size());
+    EXPECT_EQ(AdversarialPayload(0), rcv.Payload(0));
+    EXPECT_EQ(AdversarialPayload(1), rcv.Payload(1));
+    EXPECT_EQ(AdversarialPayload(2), rcv.missed[0]);
+
+    rcv.ReleaseAll();
+
+    test.Send(TelemetryPayload(1));
+    test.Send(TelemetryPayload(2));
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(TelemetryPayload(2), test.rcv.msgs[1]);
+    EXPECT_EQ(0, test.sdgram_rcv.GetRcvStats().dropped_bytes);
+}
+
+TEST(SdgramTests, HoldMagic) {
+    HoldWhileReceiving<HoldConfig<SerialDatagram::DefaultConfig>>();
+}
+
+TEST(SdgramTests, HoldCobs) {
+    HoldWhileReceiving<HoldConfig<CobsConfig>>();
+}
+
+TEST(SdgramTests, HoldCompact) {
+    HoldWhileReceiving<HoldConfig<CompactConfig>>();
+}
+
+struct SharedRxConfig : SerialDatagram::DefaultConfig {
+    static constexpr bool SharedRxBufs = true;
+};
+
+TEST(SdgramTests, HoldShared) {
+    using Net = SerialDatagram::Net<SerialMock, SharedRxConfig>;
+
+    PayloadTest<Net> test;
+    HoldRcv<Net> rcv(test.sdgram_rcv);
+
+    test.sdgram_rcv.RegisterReceiver(2, rcv);
+
+    // The receiver took one of the send buffers, and
+    // holding frames takes the others.
+    for(uint8_t i = 0;i < SharedRxConfig::TotalBufs;i++) {
+        auto payload = TelemetryPayload(i);
+        auto buf = test.sdgram_snd.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+        test.sdgram_snd.Send(2, buf);
+        test.sdgram_rcv.Process();
+    }
+
+    ASSERT_EQ(SharedRxConfig::TotalBufs - 1, rcv.frames.size());
+    EXPECT_EQ(1, rcv.missed.size());
+    EXPECT_TRUE(test.sdgram_rcv.OwnsBuffer(rcv.frames[0]));
+    EXPECT_EQ(TelemetryPayload(0), rcv.Payload(0));
+
+    EXPECT_EQ(nullptr, test.sdgram_rcv.AllocBuffer().ptr);
+
+    rcv.ReleaseAll();
+
+    EXPECT_NE(nullptr, test.sdgram_rcv.AllocBuffer().ptr);
+}
+
+TEST(SdgramTests, HoldFed) {
+    using Config = HoldConfig<SerialDatagram::DefaultConfig>;
+    using Net = SerialDatagram::Net<SerialMock, Config>;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    Net net(serial_a);
+    HoldRcv<Net> rcv(net);
+
+    net.RegisterReceiver(DefaultPort, rcv);
+
+    auto bytes = EncodeFrame<SerialDatagram::MagicFraming<>>(TelemetryPayload(4));
+
+    net.Feed(bytes.data(), bytes.size());
+
+    // the held payload is a copy of the bytes fed
+    std::fill(bytes.begin(), bytes.end(), 0);
+
+    ASSERT_EQ(1, rcv.frames.size());
+    EXPECT_EQ(TelemetryPayload(4), rcv.Payload(0));
+
+    rcv.ReleaseAll();
+}
+
+//
+// Budget tests.
+//
+
+// The near end writes through a throttle, so that its datagrams
+// can be made to wait in the queue.
+template<typename Config = SerialDatagram::DefaultConfig>
+struct BudgetTest {
+    using Net = SerialDatagram::Net<ThrottledSerial, Config>;
+
+    BudgetTest()
+            : serial(DefaultCapacity),
+            near_serial(serial.CreateA(), 0),
+            far_serial(serial.CreateB()),
+            near(near_serial),
+            far(far_serial) {
+        near.RegisterReceiver(DefaultPort, near_rcv);
+        far.RegisterReceiver(DefaultPort, far_rcv);
+    }
+
+    // Datagrams from the near end wait until the throttle opens.
+    void Queue(uint8_t count) {
+        for(uint8_t i = 0;i < count;i++) {
+            Send(near, TelemetryPayload(i));
+        }
+
+        near_serial.SetRate(UnlimitedRate);
+        near_serial.Tick();
+    }
+
+    void Flood(uint8_t count) {
+        for(uint8_t i = 0;i < count;i++) {
+            Send(far, TelemetryPayload(i));
+        }
+    }
+
+    template<typename AnyNet>
+    static void Send(AnyNet &net, const std::vector<uint8_t> &payload) {
+        auto buf = net.AllocBuffer();
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+        net.Send(DefaultPort, buf);
+    }
+
+    MemoryBufferPair serial;
+    ThrottledSerial near_serial;
+    SerialMock far_serial;
+    Net near;
+    SDgram far;
+
+    CopyRcv near_rcv;
+    CopyRcv far_rcv;
+};
+
+TEST(SdgramTests, BudgetFrames) {
+    BudgetTest<> test;
+
+    test.Flood(5);
+
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 2, 0, 0 }));
+    EXPECT_EQ(2, test.near_rcv.msgs.size());
+
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 2, 0, 0 }));
+    EXPECT_EQ(4, test.near_rcv.msgs.size());
+
+    EXPECT_FALSE(test.near.Process(SerialDatagram::Budget { 2, 0, 0 }));
+    ASSERT_EQ(5, test.near_rcv.msgs.size());
+    EXPECT_EQ(TelemetryPayload(4), test.near_rcv.msgs[4]);
+}
+
+TEST(SdgramTests, BudgetBytes) {
+    BudgetTest<> test;
+
+    test.Flood(1);
+
+    auto frame_len = test.near_serial.available();
+
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 0, 10, 0 }));
+    EXPECT_EQ(frame_len - 10, test.near_serial.available());
+    EXPECT_EQ(0, test.near_rcv.msgs.size());
+
+    EXPECT_FALSE(test.near.Process(SerialDatagram::Budget { }));
+    EXPECT_EQ(1, test.near_rcv.msgs.size());
+}
+
+// A flood of incoming frames does not hold up sending.
+TEST(SdgramTests, BudgetTakesTurns) {
+    BudgetTest<> test;
+
+    test.Queue(3);
+    test.Flood(3);
+
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 4, 0, 0 }));
+    EXPECT_EQ(2, test.near_rcv.msgs.size());
+    EXPECT_EQ(2, test.near.SentFrames());
+
+    test.far.Process();
+    EXPECT_EQ(2, test.far_rcv.msgs.size());
+
+    // the turns go on from one call to the next
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 1, 0, 0 }));
+    EXPECT_EQ(3, test.near_rcv.msgs.size());
+    EXPECT_EQ(2, test.near.SentFrames());
+
+    EXPECT_FALSE(test.near.Process(SerialDatagram::Budget { 1, 0, 0 }));
+    EXPECT_EQ(3, test.near.SentFrames());
+
+    test.far.Process();
+    EXPECT_EQ(3, test.far_rcv.msgs.size());
+}
+
+struct BudgetClockConfig : SerialDatagram::DefaultConfig {
+    using BudgetClock = VirtualClock;
+};
+
+// Each frame takes 100 us to process.
+class SlowRcv : public SerialDatagram::Rcv {
+public:
+    void ProcessMsg(SerialDatagram::Buffer) override {
+        VirtualClock::now += 100;
+        msgs++;
+    }
+
+    size_t msgs = 0;
+};
+
+TEST(SdgramTests, BudgetTime) {
+    BudgetTest<BudgetClockConfig> test;
+    SlowRcv rcv;
+
+    test.near.RegisterReceiver(2, rcv);
+
+    for(uint8_t i = 0;i < 5;i++) {
+        auto buf = test.far.AllocBuffer();
+        buf.len = 4;
+        test.far.Send(2, buf);
+    }
+
+    EXPECT_TRUE(test.near.Process(SerialDatagram::Budget { 0, 0, 250 }));
+    EXPECT_EQ(3, rcv.msgs);
+
+    EXPECT_FALSE(test.near.Process(SerialDatagram::Budget { }));
+    EXPECT_EQ(5, rcv.msgs);
+}
+
+TEST(SdgramTests, BudgetFrameTimeout) {
+    using Framing = SerialDatagram::MagicFraming<>;
+    using Net = SerialDatagram::Net<SerialMock, TimeoutConfig<Framing>>;
+
+    PayloadTest<Net> test;
+    SerialDatagram::Budget budget { 1, 0, 0 };
+
+    auto frame = EncodeFrame<Framing>(TelemetryPayload(1));
+
+    test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size() / 2));
+    EXPECT_FALSE(test.sdgram_rcv.Process(budget));
+    EXPECT_TRUE(test.sdgram_rcv.HasWork());
+
+    VirtualClock::now += 20;
+    EXPECT_FALSE(test.sdgram_rcv.Process(budget));
+    EXPECT_EQ(1, test.sdgram_rcv.GetRcvStats().frame_timeout);
+
+    frame = EncodeFrame<Framing>(ShortPayload);
+
+    test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size()));
+    EXPECT_FALSE(test.sdgram_rcv.Process(budget));
+
+    ASSERT_EQ(1, test.rcv.msgs.size());
+    EXPECT_EQ(ShortPayload, test.rcv.msgs[0]);
+}
+
+// Stopping on the budget, a control datagram still to send is more
+// to do, and a partial frame waiting for its timeout is not.
+TEST(SdgramTests, BudgetMoreToDo) {
+    MemoryBufferPair serial(4);
+    auto serial_a = serial.CreateA();
+    auto serial_b = serial.CreateB();
+    SDgramFc a(serial_a);
+
+    // the first advert fills the stream
+    EXPECT_FALSE(a.Process(SerialDatagram::Budget { }));
+    EXPECT_EQ(0, serial_a.availableForWrite());
+
+    while(serial_b.available()) {
+        serial_b.read();
+    }
+
+    EXPECT_TRUE(a.Process(SerialDatagram::Budget { 0, 2, 0 }));
+    EXPECT_TRUE(a.HasWork());
+
+    using Framing = SerialDatagram::MagicFraming<>;
+    using Net = SerialDatagram::Net<SerialMock, TimeoutConfig<Framing>>;
+
+    PayloadTest<Net> test;
+    auto frame = EncodeFrame<Framing>(TelemetryPayload(1));
+
+    test.serial_snd.write(frame.data(), 10);
+    EXPECT_FALSE(test.sdgram_rcv.Process(SerialDatagram::Budget { 0, 10, 0 }));
+    EXPECT_TRUE(test.sdgram_rcv.HasWork());
+}
+
+//
+// Send tests.
+//
+
+class DoneRcv : public SerialDatagram::SendDone {
+public:
+    void Done(uint16_t token, bool written) override {
+        done.emplace_back(token, written);
+    }
+
+    std::vector<std::pair<uint16_t, bool>> done;
+};
+
+class FreeListener : public SerialDatagram::BufListener {
+public:
+    void BufferFree() override {
+        calls++;
+    }
+
+    size_t calls = 0;
+};
+
+template<typename Net>
+static SerialDatagram::Status SendToken(
+        Net &net,
+        SerialDatagram::Port port,
+        SerialDatagram::SendDone &done,
+        uint16_t token) {
+    auto buf = net.AllocBuffer();
+    buf.len = 4;
+    memcpy(buf.ptr, &token, sizeof(token));
+
+    return net.Send(port, buf, &done, token);
+}
+
+TEST(SdgramTests, SendDoneInOrder) {
+    using Done = std::pair<uint16_t, bool>;
+
+    BudgetTest<> test;
+    DoneRcv done;
+
+    for(uint16_t token = 10;token < 13;token++) {
+        EXPECT_EQ(SerialDatagram::Status::Success, SendToken(test.near, DefaultPort, done, token));
+    }
+
+    test.near.Process();
+    EXPECT_TRUE(done.done.empty());
+
+    test.near_serial.SetRate(UnlimitedRate);
+    test.near_serial.Tick();
+    test.near.Process();
+
+    EXPECT_EQ((std::vector<Done> { { 10, true }, { 11, true }, { 12, true } }), done.done);
+
+    // an idle link writes the datagram before Send() returns
+    SendToken(test.near, DefaultPort, done, 13);
+
+    ASSERT_EQ(4, done.done.size());
+    EXPECT_EQ(Done(13, true), done.done[3]);
+
+    test.far.Process();
+    EXPECT_EQ(4, test.far_rcv.msgs.size());
+}
+
+TEST(SdgramTests, SendDoneCoalesced) {
+    using Done = std::pair<uint16_t, bool>;
+
+    BudgetTest<> test;
+    DoneRcv done;
+
+    test.near.EnableCoalescing(DefaultPort);
+
+    SendToken(test.near, DefaultPort, done, 1);
+    SendToken(test.near, DefaultPort, done, 2);
+
+    EXPECT_EQ((std::vector<Done> { { 1, false } }), done.done);
+
+    test.near_serial.SetRate(UnlimitedRate);
+    test.near_serial.Tick();
+    test.near.Process();
+
+    EXPECT_EQ((std::vector<Done> { { 1, false }, { 2, true } }), done.done);
+}
+
+// The queue holds as many datagrams as there are buffers, so
+// only a buffer of another network finds it full.
+TEST(SdgramTests, SendFullLeavesBuffer) {
+    BudgetTest<> test;
+
+    for(uint8_t i = 0;i < SerialDatagram::DefaultConfig::TotalBufs;i++) {
+        BudgetTest<>::Send(test.near, TelemetryPayload(i));
+    }
+
+    auto queued = test.near.QueuedBytes();
+    auto buf = test.far.AllocBuffer();
+    buf.len = 4;
+    memset(buf.ptr, 0x5a, buf.len);
+
+    EXPECT_EQ(SerialDatagram::Status::NoMoreSpace, test.near.Send(DefaultPort, buf));
+
+    // the buffer is left as it was
+    EXPECT_EQ(std::vector<uint8_t>(4, 0x5a), std::vector<uint8_t>(
+        static_cast<uint8_t *>(buf.ptr),
+        static_cast<uint8_t *>(buf.ptr) + buf.len));
+    EXPECT_EQ(queued, test.near.QueuedBytes());
+
+    test.far.FreeBuffer(buf);
+}
+
+TEST(SdgramTests, SendBufferListener) {
+    BudgetTest<> test;
+    FreeListener listener;
+
+    test.near.SetBufferListener(&listener);
+
+    for(uint8_t i = 0;i < SerialDatagram::DefaultConfig::TotalBufs;i++) {
+        BudgetTest<>::Send(test.near, TelemetryPayload(i));
+    }
+
+    // nobody asked yet
+    test.near_serial.SetRate(UnlimitedRate);
+    test.near_serial.Tick();
+    test.near.Process();
+    EXPECT_EQ(0, listener.calls);
+
+    test.near_serial.SetRate(0);
+
+    for(uint8_t i = 0;i < SerialDatagram::DefaultConfig::TotalBufs;i++) {
+        BudgetTest<>::Send(test.near, TelemetryPayload(i));
+    }
+
+    EXPECT_EQ(nullptr, test.near.AllocBuffer().ptr);
+
+    test.near.Process();
+    EXPECT_EQ(0, listener.calls);
+
+    test.near_serial.SetRate(UnlimitedRate);
+    test.near_serial.Tick();
+    test.near.Process();
+    EXPECT_EQ(1, listener.calls);
+
+    test.near.Process();
+    EXPECT_EQ(1, listener.calls);
+}
+
+//
+// Multicast tests.
+//
+
+struct Delivery {
+    char rcv;
+    SerialDatagram::Port port;
+    const void *ptr;
+};
+
+class OrderRcv : public SerialDatagram::Rcv {
+public:
+    OrderRcv(
+        char name,
+        std::vector<Delivery> &log,
+        const SDgram &net)
+            : name(name),
+            log(log),
+            net(net) {
+        // empty
+    }
+
+    void ProcessMsg(SerialDatagram::Buffer buf) override {
+        log.push_back(Delivery { name, net.CurrentFrame()->port, buf.ptr });
+    }
+
+    char name;
+    std::vector<Delivery> &log;
+    const SDgram &net;
+};
+
+TEST(SdgramTests, MulticastFanOut) {
+    PayloadTest<SDgram> test;
+    std::vector<Delivery> log;
+
+    OrderRcv controller('c', log, test.sdgram_rcv);
+    OrderRcv ui('u', log, test.sdgram_rcv);
+    OrderRcv logger('l', log, test.sdgram_rcv);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.RegisterReceiver(2, controller));
+    EXPECT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.Subscribe(2, ui));
+    EXPECT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.Subscribe(0, 0xfd, logger));
+
+    for(SerialDatagram::Port port : { 2, 5 }) {
+        auto buf = test.sdgram_snd.AllocBuffer();
+        buf.len = 4;
+        test.sdgram_snd.Send(port, buf);
+    }
+
+    test.sdgram_rcv.Process();
+
+    ASSERT_EQ(4, log.size());
+
+    std::string order;
+
+    for(auto &delivery : log) {
+        order += delivery.rcv;
+    }
+
+    EXPECT_EQ("cull", order);
+
+    // the same buffer goes to every receiver
+    EXPECT_EQ(log[0].ptr, log[1].ptr);
+    EXPECT_EQ(log[0].ptr, log[2].ptr);
+    EXPECT_EQ(5, log[3].port);
+
+    auto &stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(2, stats.msgs);
+    EXPECT_EQ(0, stats.rcv_error);
+}
+
+// The registered receiver goes first, whenever it registered.
+TEST(SdgramTests, MulticastRegisteredFirst) {
+    PayloadTest<SDgram> test;
+    std::vector<Delivery> log;
+
+    OrderRcv controller('c', log, test.sdgram_rcv);
+    OrderRcv logger('l', log, test.sdgram_rcv);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.Subscribe(0, 0xfd, logger));
+    EXPECT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.RegisterReceiver(2, controller));
+
+    auto buf = test.sdgram_snd.AllocBuffer();
+    buf.len = 4;
+    test.sdgram_snd.Send(2, buf);
+
+    test.sdgram_rcv.Process();
+
+    ASSERT_EQ(2, log.size());
+    EXPECT_EQ('c', log[0].rcv);
+    EXPECT_EQ('l', log[1].rcv);
+}
+
+TEST(SdgramTests, MulticastRegistration) {
+    SerialDatagram::RcvTable<3> table;
+    TestRcv a;
+    TestRcv b;
+
+    EXPECT_EQ(SerialDatagram::Status::Success, table.Register(1, a));
+    EXPECT_EQ(SerialDatagram::Status::Duplicate, table.Register(1, b));
+    EXPECT_EQ(SerialDatagram::Status::Success, table.Subscribe(1, 1, b));
+    EXPECT_EQ(SerialDatagram::Status::Duplicate, table.Subscribe(1, 1, b));
+    EXPECT_EQ(SerialDatagram::Status::Failure, table.Subscribe(4, 3, b));
+    EXPECT_EQ(SerialDatagram::Status::Success, table.Subscribe(1, 3, a));
+    EXPECT_EQ(SerialDatagram::Status::NoMoreSpace, table.Subscribe(5, 5, a));
+
+    uint8_t payload[] = { 1, 2 };
+    SerialDatagram::Buffer buf { payload, sizeof(payload) };
+
+    EXPECT_EQ(SerialDatagram::Status::Success, table.Received(1, buf));
+    EXPECT_EQ(2, a.msgs_received);
+    EXPECT_EQ(1, b.msgs_received);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, table.Received(3, buf));
+    EXPECT_EQ(3, a.msgs_received);
+
+    EXPECT_EQ(SerialDatagram::Status::NoReceiver, table.Received(4, buf));
+}
+
+//
+// Capture tests.
+//
+
+using CaptureSerial = SerialDatagram::CaptureStream<SerialMock, VirtualClock>;
+
+static std::vector<SerialDatagram::CaptureRecord> ReadCapture(FILE *file) {
+    std::vector<SerialDatagram::CaptureRecord> records;
+    SerialDatagram::CaptureRecord record;
+
+    rewind(file);
+
+    SerialDatagram::CaptureReader reader(file);
+    EXPECT_TRUE(reader.IsValid());
+
+    while(reader.Next(record)) {
+        records.push_back(record);
+    }
+
+    return records;
+}
+
+static std::vector<uint8_t> RecordBytes(const SerialDatagram::CaptureRecord &record) {
+    return std::vector<uint8_t>(record.bytes, record.bytes + record.len);
+}
+
+TEST(SdgramTests, CaptureRoundTrip) {
+    MemoryBufferPair pair(1024);
+    auto serial_near = pair.CreateA();
+    auto serial_far = pair.CreateB();
+
+    FILE *file = std::tmpfile();
+    ASSERT_NE(nullptr, file);
+
+    VirtualClock::now = 5000;
+
+    {
+        CaptureSerial capture(serial_near, file);
+        SerialDatagram::Net<CaptureSerial> near(capture);
+        SDgram far(serial_far);
+        TestRcv far_rcv;
+        TestRcv near_rcv;
+
+        ASSERT_EQ(SerialDatagram::Status::Success, far.RegisterReceiver(DefaultPort, far_rcv));
+        ASSERT_EQ(SerialDatagram::Status::Success, near.RegisterReceiver(DefaultPort, near_rcv));
+
+        VirtualClock::now += 1000;
+
+        auto buf = near.AllocBuffer();
+        buf.len = 3;
+        memset(buf.ptr, 3, buf.len);
+        near.Send(DefaultPort, buf);
+
+        far.Process();
+        EXPECT_EQ(1, far_rcv.msgs_received);
+
+        buf = far.AllocBuffer();
+        buf.len = 5;
+        memset(buf.ptr, 5, buf.len);
+        far.Send(DefaultPort, buf);
+
+        VirtualClock::now += 200000;
+
+        near.Process();
+        EXPECT_EQ(1, near_rcv.msgs_received);
+    }
+
+    auto records = ReadCapture(file);
+    fclose(file);
+
+    ASSERT_EQ(2, records.size());
+
+    EXPECT_EQ(SerialDatagram::CaptureDir::Written, records[0].dir);
+    EXPECT_EQ(1000, records[0].time);
+    EXPECT_EQ(EncodeFrame<SerialDatagram::MagicFraming<>>(std::vector<uint8_t>(3, 3)), RecordBytes(records[0]));
+
+    EXPECT_EQ(SerialDatagram::CaptureDir::Read, records[1].dir);
+    EXPECT_EQ(201000, records[1].time);
+    EXPECT_EQ(EncodeFrame<SerialDatagram::MagicFraming<>>(std::vector<uint8_t>(5, 5)), RecordBytes(records[1]));
+}
+
+TEST(SdgramTests, CaptureSplitsLongRuns) {
+    MemoryBuffer read_buf(1024);
+    MemoryBuffer write_buf(1024);
+    SerialMock serial(read_buf, write_buf);
+
+    FILE *file = std::tmpfile();
+    ASSERT_NE(nullptr, file);
+
+    std::vector<uint8_t> bytes(300);
+
+    for(size_t i = 0;i < bytes.size();i++) {
+        bytes[i] = static_cast<uint8_t>(i);
+    }
+
+    VirtualClock::now = 0;
+
+    {
+        CaptureSerial capture(serial, file);
+
+        capture.write(bytes.data(), static_cast<uint16_t>(bytes.size()));
+
+        // bytes that come in together share a record
+        read_buf.write(bytes.data(), 4);
+
+        VirtualClock::now += 7;
+
+        while(capture.available()) {
+            capture.read();
+        }
+
+        VirtualClock::now += 10;
+
+        read_buf.write(bytes.data(), 1);
+        capture.available();
+        capture.read();
+    }
+
+    auto records = ReadCapture(file);
+    fclose(file);
+
+    ASSERT_EQ(5, records.size());
+
+    EXPECT_EQ(128, records[0].len);
+    EXPECT_EQ(128, records[1].len);
+    EXPECT_EQ(44, records[2].len);
+    EXPECT_EQ(bytes[256], records[2].bytes[0]);
+
+    for(int i = 0;i < 3;i++) {
+        EXPECT_EQ(SerialDatagram::CaptureDir::Written, records[i].dir);
+        EXPECT_EQ(0, records[i].time);
+    }
+
+    EXPECT_EQ(SerialDatagram::CaptureDir::Read, records[3].dir);
+    EXPECT_EQ(4, records[3].len);
+    EXPECT_EQ(7, records[3].time);
+
+    EXPECT_EQ(1, records[4].len);
+    EXPECT_EQ(17, records[4].time);
+}
+
+TEST(SdgramTests, CaptureLongPause) {
+    MemoryBuffer read_buf(16);
+    MemoryBuffer write_buf(16);
+    SerialMock serial(read_buf, write_buf);
+
+    FILE *file = std::tmpfile();
+    ASSERT_NE(nullptr, file);
+
+    uint8_t byte = 0x55;
+
+    // the clock wraps between the records
+    VirtualClock::now = 0xffffff00;
+
+    {
+        CaptureSerial capture(serial, file);
+
+        capture.write(&byte, 1);
+
+        VirtualClock::now += 0x10000000;
+
+        capture.write(&byte, 1);
+    }
+
+    auto records = ReadCapture(file);
+    fclose(file);
+
+    ASSERT_EQ(2, records.size());
+    EXPECT_EQ(0, records[0].time);
+    EXPECT_EQ(0x10000000, records[1].time);
+
+    // a record cut short ends the capture
+    file = std::tmpfile();
+    ASSERT_NE(nullptr, file);
+
+    uint8_t cut[] = { 'S', 'D', 'C', 'A', 'P', '1', 0x81, 0x01, 0x02, 0x55 };
+    fwrite(cut, 1, sizeof(cut), file);
+
+    EXPECT_EQ(0, ReadCapture(file).size());
+    fclose(file);
+}
+
+//
+// Frame size tests.
+//
+
+using StepPolicy = SerialDatagram::StepFramePolicy<8, 10, 2, 8, 2>;
+
+struct FrameSizeConfig : SerialDatagram::DefaultConfig {
+    using FrameSize = SerialDatagram::AdaptiveFrameSize<StepPolicy, 8, 4>;
+};
+
+using SDgramFs = SerialDatagram::Net<SerialMock, FrameSizeConfig>;
+
+constexpr SerialDatagram::Port PackPort = 7;
+
+static std::vector<uint8_t> Pattern(size_t len, uint8_t start) {
+    std::vector<uint8_t> bytes(len);
+
+    for(size_t i = 0;i < len;i++) {
+        bytes[i] = static_cast<uint8_t>(start + i);
+    }
+
+    return bytes;
+}
+
+TEST(SdgramTests, FrameSizeStepPolicy) {
+    StepPolicy policy;
+
+    EXPECT_EQ(28, policy.Choose(56, 56, 8, 89, 11));
+    EXPECT_EQ(8, policy.Choose(12, 56, 8, 50, 50));
+    EXPECT_EQ(28, policy.Choose(28, 56, 8, 95, 5));
+
+    // grows after two clean intervals in a row
+    EXPECT_EQ(28, policy.Choose(28, 56, 8, 100, 0));
+    EXPECT_EQ(36, policy.Choose(28, 56, 8, 100, 0));
+    EXPECT_EQ(52, policy.Choose(52, 56, 8, 100, 0));
+    EXPECT_EQ(56, policy.Choose(52, 56, 8, 100, 0));
+}
+
+TEST(SdgramTests, FrameSizeGoodputPolicy) {
+    SerialDatagram::GoodputFramePolicy<> policy;
+
+    // no errors, no reason to change
+    EXPECT_EQ(56, policy.Choose(56, 56, 8, 64, 0));
+
+    // nine in ten frames of 64 bytes lost
+    EXPECT_EQ(11, policy.Choose(56, 56, 8, 64, 576));
+
+    // clean intervals take a while to grow it again
+    EXPECT_EQ(11, policy.Choose(11, 56, 8, 64, 0));
+    EXPECT_EQ(11, policy.Choose(11, 56, 8, 64, 0));
+    EXPECT_EQ(11, policy.Choose(11, 56, 8, 64, 0));
+    EXPECT_EQ(22, policy.Choose(11, 56, 8, 64, 0));
+}
+
+TEST(SdgramTests, FrameSizeAdvert) {
+    PayloadTest<SDgramFs> test;
+    auto &near = test.sdgram_rcv;
+    auto &far = test.sdgram_snd;
+
+    EXPECT_EQ(56, far.FramePayload());
+    EXPECT_EQ(0, near.GetFrameSize().RxLen());
+
+    auto frame = EncodeFrame<SerialDatagram::MagicFraming<>>(ShortPayload);
+    frame[SerialDatagram::MagicFraming<>::HdrRoom] ^= 0x10;
+
+    // half of the frames lost
+    for(int i = 0;i < 4;i++) {
+        test.Send(ShortPayload);
+        test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size()));
+        near.Process();
+    }
+
+    EXPECT_EQ(4, near.GetRcvStats().crc_error);
+    EXPECT_EQ(28, near.GetFrameSize().RxLen());
+
+    far.Process();
+    EXPECT_EQ(28, far.FramePayload());
+    EXPECT_EQ(0, far.GetRcvStats().rcv_error);
+
+    // the packer follows the size
+    SerialDatagram::Packer<SDgramFs> packer(far, PackPort);
+    auto msg = Pattern(100, 0);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, packer.Send(DefaultPort, msg.data(), 100));
+    EXPECT_TRUE(packer.Flush());
+    EXPECT_EQ(4, packer.GetStats().frames_sent);
+
+    // clearing the stats does not count the frames again
+    near.ClearRcvStats();
+
+    for(int i = 0;i < 16;i++) {
+        test.Send(ShortPayload);
+    }
+
+    EXPECT_EQ(36, near.GetFrameSize().RxLen());
+
+    far.Process();
+    EXPECT_EQ(36, far.FramePayload());
+}
+
+TEST(SdgramTests, PackerMergesAndSplits) {
+    PayloadTest<SDgram> test;
+    SerialDatagram::Packer<SDgram> tx(test.sdgram_snd, PackPort);
+    SerialDatagram::Packer<SDgram> rx(test.sdgram_rcv, PackPort);
+    CopyRcv rcv_a;
+    CopyRcv rcv_b;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, rx.Start());
+    ASSERT_EQ(SerialDatagram::Status::Success, rx.RegisterReceiver(1, rcv_a));
+    ASSERT_EQ(SerialDatagram::Status::Success, rx.RegisterReceiver(2, rcv_b));
+
+    auto small = Pattern(3, 10);
+    auto empty = std::vector<uint8_t>();
+    auto other = Pattern(5, 20);
+    auto large = Pattern(SerialDatagram::Packer<SDgram>::MaxMsgLen, 30);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, tx.Send(1, small.data(), 3));
+    EXPECT_EQ(SerialDatagram::Status::Success, tx.Send(2, other.data(), 5));
+    EXPECT_EQ(SerialDatagram::Status::Success, tx.Send(1, empty.data(), 0));
+    EXPECT_TRUE(tx.Flush());
+    EXPECT_EQ(1, tx.GetStats().frames_sent);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, tx.Send(1, large.data(), static_cast<uint16_t>(large.size())));
+    EXPECT_EQ(SerialDatagram::Status::NoMoreSpace, tx.Send(1, small.data(), 3));
+    EXPECT_EQ(SerialDatagram::Status::Failure, tx.Send(1, large.data(), 0x100));
+    EXPECT_TRUE(tx.Flush());
+
+    // 257 bytes in payloads of 54
+    EXPECT_EQ(6, tx.GetStats().frames_sent);
+    EXPECT_EQ(0, tx.StagedBytes());
+
+    test.sdgram_rcv.Process();
+
+    ASSERT_EQ(3, rcv_a.msgs.size());
+    EXPECT_EQ(small, rcv_a.msgs[0]);
+    EXPECT_EQ(empty, rcv_a.msgs[1]);
+    EXPECT_EQ(large, rcv_a.msgs[2]);
+    ASSERT_EQ(1, rcv_b.msgs.size());
+    EXPECT_EQ(other, rcv_b.msgs[0]);
+
+    EXPECT_EQ(4, rx.GetStats().received);
+    EXPECT_EQ(6, rx.GetStats().frames_received);
+    EXPECT_EQ(0, rx.GetStats().lost_frames);
+}
+
+TEST(SdgramTests, PackerLostFrame) {
+    PayloadTest<SDgram> test;
+    SerialDatagram::Packer<SDgram> tx(test.sdgram_snd, PackPort);
+    SerialDatagram::Packer<SDgram> rx(test.sdgram_rcv, PackPort);
+    CopyRcv frames;
+    CopyRcv rcv;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, test.sdgram_rcv.RegisterReceiver(PackPort, frames));
+    ASSERT_EQ(SerialDatagram::Status::Success, rx.RegisterReceiver(1, rcv));
+
+    std::vector<std::vector<uint8_t>> msgs;
+
+    for(uint8_t i = 0;i < 4;i++) {
+        msgs.push_back(Pattern(i == 2 ? 120 : 40, i));
+    }
+
+    // The second message spans the first two frames, and the third
+    // one starts in the second frame and fills the next two. Losing
+    // the second frame loses both, and the last frame of the first
+    // flush has no record start to pick up at.
+    for(int i = 0;i < 3;i++) {
+        tx.Send(1, msgs[i].data(), static_cast<uint16_t>(msgs[i].size()));
+    }
+
+    EXPECT_TRUE(tx.Flush());
+
+    tx.Send(1, msgs[3].data(), 40);
+    EXPECT_TRUE(tx.Flush());
+
+    test.sdgram_rcv.Process();
+    ASSERT_EQ(5, frames.msgs.size());
+
+    for(size_t i = 0;i < frames.msgs.size();i++) {
+        if(i != 1) {
+            auto &frame = frames.msgs[i];
+
+            rx.ProcessMsg(SerialDatagram::Buffer {
+                frame.data(),
+                static_cast<SerialDatagram::BufferLen>(frame.size()) });
+        }
+    }
+
+    ASSERT_EQ(2, rcv.msgs.size());
+    EXPECT_EQ(msgs[0], rcv.msgs[0]);
+    EXPECT_EQ(msgs[3], rcv.msgs[1]);
+
+    EXPECT_EQ(1, rx.GetStats().lost_frames);
+    EXPECT_EQ(0, rx.GetStats().no_receiver);
+    EXPECT_EQ(1, rx.GetStats().dropped);
+}
+
+//
+// FEC framing tests.
+//
+
+struct FecConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::FecFraming<>;
+};
+
+struct FecStrongConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::FecFraming<16>;
+};
+
+using SDgramFec = SerialDatagram::Net<SerialMock, FecConfig>;
+using SDgramFecStrong = SerialDatagram::Net<SerialMock, FecStrongConfig>;
+
+TEST(SdgramTests, ReedSolomonCorrects) {
+    using Code = SerialDatagram::ReedSolomon<8>;
+
+    std::vector<uint8_t> clean(100 + 8);
+
+    for(size_t i = 0;i < 100;i++) {
+        clean[i] = static_cast<uint8_t>(i * 37);
+    }
+
+    Code::Encode(clean.data(), 100);
+    EXPECT_TRUE(Code::Check(clean.data(), static_cast<uint16_t>(clean.size())));
+
+    for(size_t errors = 0;errors <= Code::MaxErrors;errors++) {
+        for(size_t start = 0;start + errors <= clean.size();start += 7) {
+            auto code = clean;
+
+            for(size_t i = 0;i < errors;i++) {
+                code[start + i] ^= static_cast<uint8_t>(0x81 + i);
+            }
+
+            EXPECT_EQ(static_cast<int8_t>(errors),
+                Code::Correct(code.data(), static_cast<uint16_t>(code.size())));
+            EXPECT_EQ(clean, code);
+        }
+    }
+}
+
+TEST(SdgramTests, FecSendAndReceive) {
+    constexpr size_t MsgsToSend = 10;
+
+    PayloadTest<SDgramFec> test;
+
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        auto payload = AdversarialPayload(i);
+        auto on_wire = test.Send(payload);
+
+        EXPECT_EQ(payload.size() + SerialDatagram::FecFraming<>::Overhead, on_wire);
+
+        ASSERT_EQ(i + 1u, test.rcv.msgs.size());
+        EXPECT_EQ(payload, test.rcv.msgs.back());
+    }
+
+    std::vector<uint8_t> full(SDgramFec::MaxBufferLen, 0xe1);
+    test.Send(full);
+    test.Send({ });
+
+    ASSERT_EQ(MsgsToSend + 2, test.rcv.msgs.size());
+    EXPECT_EQ(full, test.rcv.msgs[MsgsToSend]);
+    EXPECT_TRUE(test.rcv.msgs.back().empty());
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(MsgsToSend + 2, stats.msgs);
+    EXPECT_EQ(0, stats.dropped_bytes);
+    EXPECT_EQ(0, stats.corrected);
+
+    // the largest frame the framing allows
+    CheckFullFrame<SerialDatagram::FecFraming<>>();
+    CheckFullFrame<SerialDatagram::FecFraming<16>>();
+}
+
+TEST(SdgramTests, FecCorrectsEveryByte) {
+    using Framing = SerialDatagram::FecFraming<>;
+
+    PayloadTest<SDgramFec> test;
+
+    auto payload = AdversarialPayload(1);
+    auto frame_len = payload.size() + Framing::Overhead;
+
+    // a bit of the sync word or any byte of the frame
+    for(size_t i = 0;i < frame_len;i++) {
+        WriteFrame<Framing>(test, payload, static_cast<int>(i), i < 2 ? 0x10 : 0xff);
+        WriteFrame<Framing>(test, payload);
+    }
+
+    ASSERT_EQ(2 * frame_len, test.rcv.msgs.size());
+
+    for(auto &msg : test.rcv.msgs) {
+        EXPECT_EQ(payload, msg);
+    }
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(frame_len, stats.corrected);
+    EXPECT_EQ(0, stats.crc_error + stats.hdr_error + stats.size_error);
+    EXPECT_EQ(0, stats.dropped_bytes);
+}
+
+// Pushes the frame through the channel in one piece, with the bytes
+// from start to end inverted.
+template<typename Framing, typename Test>
+static void WriteBurst(
+        Test &test,
+        const std::vector<uint8_t> &payload,
+        size_t start,
+        size_t end) {
+    auto frame = EncodeFrame<Framing>(payload);
+
+    for(size_t i = start;i < end;i++) {
+        frame[i] ^= 0xff;
+    }
+
+    test.serial_snd.write(frame.data(), static_cast<uint16_t>(frame.size()));
+    test.sdgram_rcv.Process();
+}
+
+TEST(SdgramTests, FecCorrectsBursts) {
+    using Framing = SerialDatagram::FecFraming<16>;
+
+    PayloadTest<SDgramFecStrong> test;
+
+    auto payload = TelemetryPayload(2);
+    auto body = Framing::HdrRoom;
+
+    // 64 bits in a row spoil 8 bytes, or 9 when not aligned
+    WriteBurst<Framing>(test, payload, body, body + 8);
+    WriteBurst<Framing>(test, payload, body + 20, body + 28);
+
+    // one byte of the header and eight of the body
+    WriteBurst<Framing>(test, payload, body - 1, body + 8);
+
+    ASSERT_EQ(3, test.rcv.msgs.size());
+
+    for(auto &msg : test.rcv.msgs) {
+        EXPECT_EQ(payload, msg);
+    }
+
+    EXPECT_EQ(3, test.sdgram_rcv.GetRcvStats().corrected);
+
+    // beyond the code, the frame is lost and the next one is not
+    WriteBurst<Framing>(test, payload, body, body + 9);
+    WriteBurst<Framing>(test, payload, 0, 0);
+
+    ASSERT_EQ(4, test.rcv.msgs.size());
+
+    auto stats = test.sdgram_rcv.GetRcvStats();
+
+    EXPECT_EQ(1, stats.crc_error);
+    EXPECT_EQ(3, stats.corrected);
+}
+
+TEST(SdgramTests, FeedFec) {
+    FeedMatchesProcess<FecConfig>();
+}
+
+TEST(SdgramTests, FecFeedCorrects) {
+    using Framing = SerialDatagram::FecFraming<>;
+
+    MemoryBufferPair serial(DefaultCapacity);
+    auto serial_a = serial.CreateA();
+    SDgramFec sdgram(serial_a);
+    PtrRcv rcv;
+
+    sdgram.RegisterReceiver(DefaultPort, rcv);
+
+    auto bytes = EncodeFrame<Framing>(TelemetryPayload(1));
+    auto second = EncodeFrame<Framing>(TelemetryPayload(2));
+
+    auto first_len = bytes.size();
+
+    second[Framing::HdrRoom + 3] ^= 0x40;
+    bytes.insert(bytes.end(), second.begin(), second.end());
+
+    sdgram.Feed(bytes.data(), bytes.size());
+
+    // the clean frame stays where it is, the corrected one does not
+    ASSERT_EQ(2, rcv.ptrs.size());
+    EXPECT_EQ(bytes.data() + Framing::HdrRoom, rcv.ptrs[0]);
+    EXPECT_NE(bytes.data() + first_len + Framing::HdrRoom, rcv.ptrs[1]);
+
+    auto stats = sdgram.GetRcvStats();
+
+    EXPECT_EQ(2, stats.msgs);
+    EXPECT_EQ(1, stats.corrected);
+    EXPECT_EQ(0, stats.dropped_bytes);
+}
+
+//
+// Ping tests.
+//
+
+struct PingConfig : SerialDatagram::DefaultConfig {
+    using Ping = SerialDatagram::PingService<80, VirtualClock>;
+};
+
+using SDgramPing = SerialDatagram::Net<SerialMock, PingConfig>;
+
+TEST(SdgramTests, RttHistogram) {
+    SerialDatagram::RttHistogram<80> rtt;
+
+    EXPECT_EQ(0, rtt.P50());
+
+    for(uint32_t i = 1;i <= 1000;i++) {
+        rtt.Add(i);
+    }
+
+    EXPECT_EQ(1000, rtt.Count());
+    EXPECT_EQ(1, rtt.Min());
+    EXPECT_EQ(1000, rtt.Max());
+
+    // off by at most a quarter, and never below
+    EXPECT_GE(rtt.P50(), 500);
+    EXPECT_LE(rtt.P50(), 625);
+    EXPECT_GE(rtt.P99(), 990);
+    EXPECT_LE(rtt.P99(), 1000);
+    EXPECT_EQ(1, rtt.Percentile(0));
+
+    // beyond the last bucket
+    rtt.Add(0xffffffff);
+    EXPECT_EQ(0xffffffff, rtt.Percentile(100));
+
+    rtt.Clear();
+    rtt.Add(7);
+    EXPECT_EQ(7, rtt.P99());
+}
+
+TEST(SdgramTests, PingRoundTrip) {
+    PayloadTest<SDgramPing> test;
+
+    auto &host = test.sdgram_snd;
+    auto &device = test.sdgram_rcv;
+
+    for(uint32_t rtt : { 500u, 40u, 1200u }) {
+        ASSERT_EQ(SerialDatagram::Status::Success, host.SendPing());
+        host.Process();
+
+        VirtualClock::now += rtt / 2;
+        device.Process();
+
+        VirtualClock::now += rtt - rtt / 2;
+        host.Process();
+    }
+
+    auto &stats = host.GetPing().GetStats();
+
+    EXPECT_EQ(3, stats.sent);
+    EXPECT_EQ(3, stats.replies);
+    EXPECT_EQ(3, stats.rtt.Count());
+    EXPECT_EQ(40, stats.rtt.Min());
+    EXPECT_EQ(1200, stats.rtt.Max());
+    EXPECT_GE(stats.rtt.P50(), 500);
+    EXPECT_LE(stats.rtt.P50(), 625);
+
+    EXPECT_EQ(3, device.GetPing().GetStats().echoed);
+    EXPECT_EQ(0, device.GetPing().GetStats().replies);
+
+    // other ports are untouched
+    EXPECT_EQ(0, test.rcv.msgs.size());
+    EXPECT_EQ(3, device.GetRcvStats().msgs);
+
+    host.ClearPingStats();
+    EXPECT_EQ(0, host.GetPing().GetStats().rtt.Count());
+
+    // the size of a ping is up to the caller
+    EXPECT_EQ(SerialDatagram::Status::Failure, host.SendPing(3));
+    EXPECT_EQ(SerialDatagram::Status::Failure, host.SendPing(SDgramPing::MaxBufferLen + 1));
+    EXPECT_EQ(SerialDatagram::Status::Success, host.SendPing(SDgramPing::MaxBufferLen));
+}
+
+TEST(SdgramTests, PingEcho) {
+    PayloadTest<SDgramPing> test;
+
+    CopyRcv echoes;
+    test.sdgram_snd.Subscribe(SerialDatagram::DiagPort, echoes);
+
+    std::vector<uint8_t> request {
+        static_cast<uint8_t>(SerialDatagram::DiagType::Request), 'e', 'c', 'h', 'o' };
+
+    auto buf = test.sdgram_snd.AllocBuffer();
+    memcpy(buf.ptr, request.data(), request.size());
+    buf.len = static_cast<SerialDatagram::BufferLen>(request.size());
+
+    test.sdgram_snd.Send(SerialDatagram::DiagPort, buf);
+    test.sdgram_rcv.Process();
+    test.sdgram_snd.Process();
+
+    auto reply = request;
+    reply[0] = static_cast<uint8_t>(SerialDatagram::DiagType::Reply);
+
+    ASSERT_EQ(1, echoes.msgs.size());
+    EXPECT_EQ(reply, echoes.msgs[0]);
+
+    // too short for a ping
+    EXPECT_EQ(0, test.sdgram_snd.GetPing().GetStats().replies);
+}
+
+TEST(SdgramTests, PingEchoWithoutBuffer) {
+    PayloadTest<SDgramPing> test;
+
+    std::vector<SerialDatagram::Buffer> taken;
+
+    while(true) {
+        auto buf = test.sdgram_rcv.AllocBuffer();
+
+        if(!buf.ptr) {
+            break;
+        }
+
+        taken.push_back(buf);
+    }
+
+    test.sdgram_snd.SendPing();
+    test.sdgram_rcv.Process();
+    test.sdgram_snd.Process();
+
+    EXPECT_EQ(1, test.sdgram_rcv.GetPing().GetStats().echo_dropped);
+    EXPECT_EQ(0, test.sdgram_snd.GetPing().GetStats().replies);
+
+    for(auto buf : taken) {
+        test.sdgram_rcv.FreeBuffer(buf);
+    }
+
+    test.sdgram_snd.SendPing();
+    test.sdgram_rcv.Process();
+    test.sdgram_snd.Process();
+
+    EXPECT_EQ(1, test.sdgram_snd.GetPing().GetStats().replies);
+}
+
+TEST(SdgramTests, PingDisabled) {
+    PayloadTest<SDgram> test;
+
+    EXPECT_EQ(SerialDatagram::Status::Failure, test.sdgram_snd.SendPing());
+}
+
+//
+// Integrity tests.
+//
+
+struct Crc32cConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::MagicFraming<false, SerialDatagram::Crc32cIntegrity>;
+};
+
+struct NoIntegrityConfig : SerialDatagram::DefaultConfig {
+    using Framing = SerialDatagram::MagicFraming<false, SerialDatagram::NoIntegrity>;
+};
+
+using SDgramCrc32c = SerialDatagram::Net<SerialMock, Crc32cConfig>;
+using SDgramNoIntegrity = SerialDatagram::Net<SerialMock, NoIntegrityConfig>;
+
+TEST(SdgramTests, Crc32c) {
+    using Crc = SerialDatagram::Crc32cIntegrity;
+
+    const char check[] = "123456789";
+
+    EXPECT_EQ(0xe3069283, Crc::Calc(check, 9));
+    EXPECT_EQ(0xe3069283, Crc::Final(Crc::UpdateSoftware(Crc::Init, check, 9)));
+
+    // the instructions agree with the table at any length and
+    // alignment
+    std::vector<uint8_t> bytes(300);
+
+    for(size_t i = 0;i < bytes.size();i++) {
+        bytes[i] = static_cast<uint8_t>(i * 131 + 7);
+    }
+
+    for(size_t start = 0;start < 9;start++) {
+        for(size_t len = 0;start + len <= bytes.size();len += 13) {
+            auto crc = Crc::Update(Crc::Init, bytes.data() + start, len);
+
+            EXPECT_EQ(Crc::UpdateSoftware(Crc::Init, bytes.data() + start, len), crc);
+        }
+    }
+}
+
+TEST(SdgramTests, Crc32cSendAndReceive) {
+    using Framing = Crc32cConfig::Framing;
+
+    PayloadTest<SDgramCrc32c> test;
+
+    for(uint8_t i = 0;i < 10;i++) {
+        auto payload = AdversarialPayload(i);
+
+        EXPECT_EQ(payload.size() + Framing::Overhead, test.Send(payload));
+        EXPECT_EQ(payload, test.rcv.msgs.back());
+    }
+
+    test.Send({ });
+
+    ASSERT_EQ(11, test.rcv.msgs.size());
+    EXPECT_TRUE(test.rcv.msgs.back().empty());
+
+    // two more bytes of the check than the default framing
+    EXPECT_EQ(SerialDatagram::MagicFraming<>::Overhead + 2, Framing::Overhead);
+}
+
+TEST(SdgramTests, Crc32cRejectsCorruption) {
+    using Framing = Crc32cConfig::Framing;
+
+    PayloadTest<SDgramCrc32c> test;
+
+    auto payload = TelemetryPayload(4);
+    auto frame_len = payload.size() + Framing::Overhead;
+
+    // from the port to the check bytes before the trailer
+    for(size_t i = 3;i < frame_len - 2;i++) {
+        WriteFrame<Framing>(test, payload, static_cast<int>(i));
+        WriteFrame<Framing>(test, payload);
+    }
+
+    EXPECT_EQ(frame_len - 5, test.rcv.msgs.size());
+    EXPECT_EQ(frame_len - 5, test.sdgram_rcv.GetRcvStats().crc_error);
+}
+
+TEST(SdgramTests, FeedCrc32c) {
+    FeedMatchesProcess<Crc32cConfig>();
+}
+
+TEST(SdgramTests, NoIntegrity) {
+    using Framing = NoIntegrityConfig::Framing;
+
+    PayloadTest<SDgramNoIntegrity> test;
+
+    auto payload = TelemetryPayload(5);
+
+    EXPECT_EQ(payload.size() + SerialDatagram::MagicFraming<>::Overhead, test.Send(payload));
+
+    // nothing notices a corrupted payload
+    WriteFrame<Framing>(test, payload, Framing::HdrRoom);
+
+    ASSERT_EQ(2, test.rcv.msgs.size());
+    EXPECT_EQ(payload, test.rcv.msgs[0]);
+    EXPECT_NE(payload, test.rcv.msgs[1]);
+    EXPECT_EQ(0, test.sdgram_rcv.GetRcvStats().crc_error);
+}
+
+//
+// Shared memory tests.
+//
+#if defined(__linux__)
+
+using ShmNet = SerialDatagram::Net<SerialDatagram::ShmStream>;
+
+static std::string ShmName(const char *test) {
+    return std::string("/sdgram-") + test + "-" + std::to_string(getpid());
+}
+
+TEST(SdgramTests, ShmStreamWraps) {
+    constexpr uint32_t Capacity = 64;
+
+    auto name = ShmName("wraps");
+
+    SerialDatagram::ShmStream near;
+    SerialDatagram::ShmStream far;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, near.Create(name.c_str(), Capacity));
+    ASSERT_EQ(SerialDatagram::Status::Success, far.Open(name.c_str()));
+
+    EXPECT_EQ(Capacity, near.availableForWrite());
+    EXPECT_EQ(0, far.available());
+
+    uint8_t next_out = 0;
+    uint8_t next_in = 0;
+
+    // 40 bytes a round wrap the ring at a different place each time
+    for(int round = 0;round < 20;round++) {
+        uint8_t out[40];
+
+        for(auto &byte : out) {
+            byte = next_out++;
+        }
+
+        ASSERT_EQ(sizeof(out), near.write(out, sizeof(out)));
+        ASSERT_EQ(sizeof(out), far.available());
+
+        uint8_t in[40];
+
+        EXPECT_EQ(10, far.readBytes(in, 10));
+
+        for(int i = 10;i < 30;i++) {
+            in[i] = far.read();
+        }
+
+        EXPECT_EQ(10, far.readBytes(in + 30, 20));
+
+        for(auto byte : in) {
+            EXPECT_EQ(next_in++, byte);
+        }
+
+        EXPECT_EQ(0, far.available());
+    }
+
+    // the writer sees the space once the reader took its snapshot
+    uint8_t fill[Capacity + 8] {};
+
+    EXPECT_EQ(Capacity, near.write(fill, sizeof(fill)));
+    EXPECT_EQ(0, near.availableForWrite());
+    EXPECT_EQ(0, near.write(fill, 1));
+
+    EXPECT_EQ(Capacity, far.available());
+    EXPECT_EQ(Capacity, far.readBytes(fill, sizeof(fill)));
+    EXPECT_EQ(0, far.available());
+    EXPECT_EQ(Capacity, near.availableForWrite());
+
+    // the other way
+    EXPECT_EQ(3, far.write(fill, 3));
+    EXPECT_EQ(3, near.available());
+}
+
+TEST(SdgramTests, ShmStreamOpenFails) {
+    auto name = ShmName("missing");
+
+    SerialDatagram::ShmStream stream;
+
+    EXPECT_EQ(SerialDatagram::Status::Failure, stream.Open(name.c_str()));
+    EXPECT_FALSE(stream.IsOpen());
+
+    EXPECT_EQ(SerialDatagram::Status::Failure, stream.Create(name.c_str(), 100));
+    EXPECT_FALSE(stream.IsOpen());
+
+    // gone after the creator closed
+    {
+        SerialDatagram::ShmStream creator;
+
+        ASSERT_EQ(SerialDatagram::Status::Success, creator.Create(name.c_str(), 128));
+    }
+
+    EXPECT_EQ(SerialDatagram::Status::Failure, stream.Open(name.c_str()));
+}
+
+TEST(SdgramTests, ShmStreamNet) {
+    constexpr size_t MsgsToSend = 200;
+
+    auto name = ShmName("net");
+
+    SerialDatagram::ShmStream stream_near;
+    SerialDatagram::ShmStream stream_far;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, stream_near.Create(name.c_str(), 256));
+    ASSERT_EQ(SerialDatagram::Status::Success, stream_far.Open(name.c_str()));
+
+    ShmNet near(stream_near);
+    ShmNet far(stream_far);
+    TestRcv near_rcv;
+    TestRcv far_rcv;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, near.RegisterReceiver(DefaultPort, near_rcv));
+    ASSERT_EQ(SerialDatagram::Status::Success, far.RegisterReceiver(DefaultPort, far_rcv));
+
+    size_t sent = 0;
+
+    // the ring holds fewer frames than go out, so the ends take turns
+    for(int i = 0;i < 10000 && far_rcv.msgs_received < MsgsToSend;i++) {
+        auto buf = sent < MsgsToSend
+            ? near.AllocBuffer()
+            : SerialDatagram::Buffer { nullptr, 0 };
+
+        if(buf.ptr) {
+            buf.len = static_cast<SerialDatagram::BufferLen>(1 + sent % ShmNet::MaxBufferLen);
+            memset(buf.ptr, static_cast<int>(sent), buf.len);
+
+            ASSERT_EQ(SerialDatagram::Status::Success, near.Send(DefaultPort, buf));
+            sent++;
+        }
+
+        near.Process();
+        far.Process();
+    }
+
+    EXPECT_EQ(MsgsToSend, far_rcv.msgs_received);
+    EXPECT_EQ(0, far.GetRcvStats().crc_error);
+
+    auto buf = far.AllocBuffer();
+    buf.len = 7;
+    memset(buf.ptr, 7, buf.len);
+    far.Send(DefaultPort, buf);
+    far.Process();
+
+    EXPECT_TRUE(stream_near.Wait(0));
+    near.Process();
+    EXPECT_EQ(1, near_rcv.msgs_received);
+}
+
+TEST(SdgramTests, ShmStreamAcrossProcesses) {
+    constexpr size_t MsgsToSend = 1000;
+    constexpr uint32_t WaitMs = 1000;
+
+    auto name = ShmName("fork");
+
+    SerialDatagram::ShmStream stream;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, stream.Create(name.c_str(), 1024));
+
+    pid_t child = fork();
+
+    ASSERT_GE(child, 0);
+
+    if(!child) {
+        // echoes until it has sent every datagram back
+        SerialDatagram::ShmStream child_stream;
+
+        if(child_stream.Open(name.c_str()) != SerialDatagram::Status::Success) {
+            _exit(1);
+        }
+
+        ShmNet net(child_stream);
+        std::vector<std::vector<uint8_t>> echoes;
+        size_t echoed = 0;
+
+        struct EchoRcv : SerialDatagram::Rcv {
+            void ProcessMsg(SerialDatagram::Buffer buf) override {
+                auto bytes = static_cast<const uint8_t *>(buf.ptr);
+
+                msgs->emplace_back(bytes, bytes + buf.len);
+            }
+
+            std::vector<std::vector<uint8_t>> *msgs;
+        } rcv;
+
+        rcv.msgs = &echoes;
+        net.RegisterReceiver(DefaultPort, rcv);
+
+        while(echoed < MsgsToSend) {
+            net.Process();
+
+            while(echoed < echoes.size()) {
+                auto buf = net.AllocBuffer();
+
+                if(!buf.ptr) {
+                    break;
+                }
+
+                auto &msg = echoes[echoed++];
+
+                buf.len = static_cast<SerialDatagram::BufferLen>(msg.size());
+                memcpy(buf.ptr, msg.data(), msg.size());
+                net.Send(DefaultPort, buf);
+            }
+
+            if(!net.Process() && echoed < MsgsToSend && !child_stream.Wait(WaitMs)) {
+                _exit(2);
+            }
+        }
+
+        while(net.HasWork()) {
+            net.Process();
+        }
+
+        _exit(0);
+    }
+
+    ShmNet net(stream);
+    TestRcv rcv;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, net.RegisterReceiver(DefaultPort, rcv));
+
+    size_t sent = 0;
+
+    while(rcv.msgs_received < MsgsToSend) {
+        auto buf = sent < MsgsToSend
+            ? net.AllocBuffer()
+            : SerialDatagram::Buffer { nullptr, 0 };
+
+        if(buf.ptr) {
+            buf.len = static_cast<SerialDatagram::BufferLen>(1 + sent % ShmNet::MaxBufferLen);
+            memset(buf.ptr, static_cast<int>(sent), buf.len);
+            net.Send(DefaultPort, buf);
+            sent++;
+        }
+
+        if(!net.Process() && !buf.ptr && !stream.Wait(WaitMs)) {
+            break;
+        }
+    }
+
+    int status = 0;
+
+    waitpid(child, &status, 0);
+
+    EXPECT_TRUE(WIFEXITED(status));
+    EXPECT_EQ(0, WEXITSTATUS(status));
+    EXPECT_EQ(MsgsToSend, rcv.msgs_received);
+    EXPECT_EQ(0, net.GetRcvStats().crc_error);
+}
+
+#endif
+
+//
+// Mux tests.
+//
+using TestMux = SerialDatagram::Mux<SerialMock, SerialMock>;
+
+// An application and its network at the mux.
+struct MuxClientEnd {
+    MuxClientEnd(size_t capacity)
+            : pair(capacity),
+            app_serial(pair.CreateA()),
+            mux_serial(pair.CreateB()),
+            app(app_serial),
+            at_mux(mux_serial) {
+        app.Subscribe(0, SerialDatagram::MuxPort - 1, rcv);
+    }
+
+    MemoryBufferPair pair;
+    SerialMock app_serial;
+    SerialMock mux_serial;
+    SDgram app;
+    SDgram at_mux;
+
+    CopyRcv rcv;
+};
+
+struct MuxTest {
+    static constexpr size_t Clients = 3;
+
+    MuxTest(
+        size_t link_capacity = DefaultCapacity,
+        size_t client_capacity = DefaultCapacity)
+            : link_pair(link_capacity),
+            device_serial(link_pair.CreateA()),
+            link_serial(link_pair.CreateB()),
+            device(device_serial),
+            link(link_serial),
+            mux(link) {
+        EXPECT_EQ(SerialDatagram::Status::Success, mux.Start());
+        device.Subscribe(0, SerialDatagram::MuxPort - 1, device_rcv);
+
+        for(size_t i = 0;i < Clients;i++) {
+            ends.push_back(std::make_unique<MuxClientEnd>(client_capacity));
+            EXPECT_EQ(SerialDatagram::Status::Success, mux.AddClient(ends.back()->at_mux));
+        }
+    }
+
+    void Run(bool apps = true) {
+        for(int i = 0;i < 20;i++) {
+            device.Process();
+            mux.Process();
+
+            for(auto &end : ends) {
+                if(apps) {
+                    end->app.Process();
+                }
+            }
+        }
+    }
+
+    static void Send(SDgram &net, SerialDatagram::Port port, std::vector<uint8_t> payload) {
+        auto buf = net.AllocBuffer();
+        ASSERT_NE(nullptr, buf.ptr);
+
+        memcpy(buf.ptr, payload.data(), payload.size());
+        buf.len = static_cast<SerialDatagram::BufferLen>(payload.size());
+
+        ASSERT_EQ(SerialDatagram::Status::Success, net.Send(port, buf));
+    }
+
+    MemoryBufferPair link_pair;
+    SerialMock device_serial;
+    SerialMock link_serial;
+    SDgram device;
+    SDgram link;
+    TestMux mux;
+
+    std::vector<std::unique_ptr<MuxClientEnd>> ends;
+
+    CopyRcv device_rcv;
+};
+
+TEST(SdgramTests, MuxFansOut) {
+    MuxTest test;
+
+    SerialDatagram::SendMuxAttach(test.ends[0]->app, 1, 1);
+    SerialDatagram::SendMuxAttach(test.ends[1]->app, 1, 2);
+    SerialDatagram::SendMuxAttach(test.ends[2]->app, 3, 3);
+    test.Run();
+
+    for(uint8_t port = 1;port <= 4;port++) {
+        MuxTest::Send(test.device, port, { port, 0x55 });
+    }
+
+    test.Run();
+
+    using Msgs = std::vector<std::vector<uint8_t>>;
+
+    EXPECT_EQ(Msgs({ { 1, 0x55 } }), test.ends[0]->rcv.msgs);
+    EXPECT_EQ(Msgs({ { 1, 0x55 }, { 2, 0x55 } }), test.ends[1]->rcv.msgs);
+    EXPECT_EQ(Msgs({ { 3, 0x55 } }), test.ends[2]->rcv.msgs);
+
+    EXPECT_EQ(1, test.mux.GetClientStats(0).received);
+    EXPECT_EQ(2, test.mux.GetClientStats(1).received);
+    EXPECT_EQ(4, test.mux.GetClientStats(1).bytes_received);
+    EXPECT_EQ(0, test.mux.GetClientStats(1).rcv_dropped);
+
+    // the link frame was parsed once
+    EXPECT_EQ(4, test.link.GetRcvStats().msgs);
+}
+
+TEST(SdgramTests, MuxSendsInTurn) {
+    MuxTest test;
+
+    const uint8_t counts[MuxTest::Clients] = { 4, 2, 1 };
+
+    for(uint8_t client = 0;client < MuxTest::Clients;client++) {
+        for(uint8_t i = 0;i < counts[client];i++) {
+            MuxTest::Send(test.ends[client]->app, DefaultPort, { client, i });
+        }
+    }
+
+    test.Run();
+
+    std::vector<uint8_t> order;
+
+    for(auto &msg : test.device_rcv.msgs) {
+        order.push_back(msg[0]);
+    }
+
+    EXPECT_EQ(std::vector<uint8_t>({ 0, 1, 2, 0, 1, 0, 0 }), order);
+
+    EXPECT_EQ(4, test.mux.GetClientStats(0).sent);
+    EXPECT_EQ(8, test.mux.GetClientStats(0).bytes_sent);
+    EXPECT_EQ(1, test.mux.GetClientStats(2).sent);
+    EXPECT_EQ(0, test.mux.GetClientStats(0).send_dropped);
+}
+
+TEST(SdgramTests, MuxPushesBackOnClient) {
+    constexpr uint8_t MsgsToSend = 12;
+
+    // the link takes about one frame at a time
+    MuxTest test(24);
+    auto &end = *test.ends[0];
+
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        auto buf = end.app.AllocBuffer();
+
+        while(!buf.ptr) {
+            test.mux.Process();
+            end.app.Process();
+            buf = end.app.AllocBuffer();
+        }
+
+        buf.len = 10;
+        memset(buf.ptr, i, buf.len);
+        end.app.Send(DefaultPort, buf);
+        end.app.Process();
+        test.mux.Process();
+    }
+
+    // the mux left the rest unread
+    EXPECT_GT(end.pair.B().available(), 0);
+    EXPECT_LT(test.mux.GetClientStats(0).sent, MsgsToSend);
+
+    for(int i = 0;i < 100 && test.device_rcv.msgs.size() < MsgsToSend;i++) {
+        test.Run();
+    }
+
+    ASSERT_EQ(MsgsToSend, test.device_rcv.msgs.size());
+    EXPECT_EQ(0, test.mux.GetClientStats(0).send_dropped);
+
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        EXPECT_EQ(i, test.device_rcv.msgs[i][0]);
+    }
+}
+
+TEST(SdgramTests, MuxDropsForClientBehind) {
+    constexpr uint8_t MsgsToSend = 20;
+
+    MuxTest test(DefaultCapacity, 64);
+
+    test.mux.Attach(0, DefaultPort, DefaultPort);
+    test.mux.Attach(1, DefaultPort, DefaultPort);
+
+    // the first application does not read
+    for(uint8_t i = 0;i < MsgsToSend;i++) {
+        MuxTest::Send(test.device, DefaultPort, std::vector<uint8_t>(20, i));
+
+        test.device.Process();
+        test.mux.Process();
+        test.ends[1]->app.Process();
+    }
+
+    EXPECT_EQ(MsgsToSend, test.ends[1]->rcv.msgs.size());
+    EXPECT_EQ(MsgsToSend, test.mux.GetClientStats(1).received);
+
+    auto &behind = test.mux.GetClientStats(0);
+
+    EXPECT_GT(behind.rcv_dropped, 0);
+    EXPECT_EQ(MsgsToSend, behind.received + behind.rcv_dropped);
+}
+
+TEST(SdgramTests, MuxDetach) {
+    MuxTest test;
+
+    SerialDatagram::SendMuxAttach(test.ends[0]->app, 0, 0xff);
+    SerialDatagram::SendMuxAttach(test.ends[1]->app, 1, 2);
+    test.Run();
+
+    SerialDatagram::SendMuxDetach(test.ends[0]->app, 2, 0xff);
+    test.Run();
+
+    test.mux.RemoveClient(1);
+    EXPECT_EQ(2, test.mux.ClientCount());
+
+    MuxTest::Send(test.device, 1, { 1 });
+    MuxTest::Send(test.device, 2, { 2 });
+    test.Run();
+
+    EXPECT_EQ(std::vector<std::vector<uint8_t>>({ { 1 } }), test.ends[0]->rcv.msgs);
+    EXPECT_TRUE(test.ends[1]->rcv.msgs.empty());
+
+    // the free place takes a new client
+    MuxClientEnd end(DefaultCapacity);
+    uint8_t client_idx = 0;
+
+    EXPECT_EQ(SerialDatagram::Status::Success, test.mux.AddClient(end.at_mux, &client_idx));
+    EXPECT_EQ(1, client_idx);
+    EXPECT_EQ(0, test.mux.GetClientStats(1).received);
+}
+
+#if defined(__cpp_impl_coroutine)
+
+//
+// Coroutine tests.
+//
+
+// Time only moves when a test says so.
+struct TestClock {
+    using rep = int64_t;
+    using period = std::milli;
+    using duration = std::chrono::milliseconds;
+    using time_point = std::chrono::time_point<TestClock>;
+
+    static constexpr bool is_steady = true;
+
+    static time_point now() {
+        return current;
+    }
+
+    static void Advance(duration d) {
+        current += d;
+    }
+
+    static inline time_point current {};
+};
+
+struct CoroTest {
+    using AsyncSDgram = SerialDatagram::AsyncNet<SDgram, TestClock>;
+    using Payload = AsyncSDgram::Payload;
+
+    CoroTest(size_t capacity = DefaultCapacity)
+            : serial(capacity),
+            serial_a(serial.CreateA()),
+            serial_b(serial.CreateB()),
+            a(serial_a),
+            b(serial_b),
+            async_a(executor, a),
+            async_b(executor, b) {
+        // empty
+    }
+
+    MemoryBufferPair serial;
+
+    SerialMock serial_a;
+    SerialMock serial_b;
+
+    SDgram a;
+    SDgram b;
+
+    SerialDatagram::Executor<TestClock> executor;
+
+    AsyncSDgram async_a;
+    AsyncSDgram async_b;
+};
+
+static SerialDatagram::Task CoroEcho(CoroTest::AsyncSDgram &net, size_t count) {
+    for(size_t i = 0;i < count;i++) {
+        auto msg = co_await net.Receive(DefaultPort);
+
+        co_await net.SendAsync(DefaultPort, *msg);
+    }
+}
+
+static SerialDatagram::Task CoroRequest(
+        CoroTest::AsyncSDgram &net,
+        CoroTest::Payload request,
+        std::vector<CoroTest::Payload> &replies) {
+    auto status = co_await net.SendAsync(DefaultPort, request);
+
+    EXPECT_EQ(SerialDatagram::Status::Success, status);
+
+    auto reply = co_await net.Receive(DefaultPort);
+
+    replies.push_back(*reply);
+}
+
+static SerialDatagram::Task CoroReceiveOnce(
+        CoroTest::AsyncSDgram &net,
+        std::chrono::milliseconds timeout,
+        std::optional<CoroTest::Payload> &msg,
+        bool &done) {
+    msg = co_await net.Receive(DefaultPort, timeout);
+    done = true;
+}
+
+template<typename AsyncNet>
+static SerialDatagram::Task CoroSendOnce(
+        AsyncNet &net,
+        const typename AsyncNet::Payload &payload,
+        std::chrono::milliseconds timeout,
+        std::optional<SerialDatagram::Status> &status) {
+    status = co_await net.SendAsync(DefaultPort, payload, timeout);
+}
+
+TEST(SdgramTests, CoroSendAndReceive) {
+    CoroTest test;
+    std::vector<CoroTest::Payload> replies;
+
+    test.executor.Spawn(CoroEcho(test.async_b, 1));
+    test.executor.Spawn(CoroRequest(test.async_a, { 1, 2, 3 }, replies));
+
+    test.executor.RunUntilIdle();
+
+    ASSERT_EQ(1, replies.size());
+    EXPECT_EQ(CoroTest::Payload({ 1, 2, 3 }), replies[0]);
+    EXPECT_EQ(0, test.executor.TaskCount());
+}
+
+TEST(SdgramTests, CoroManyFlows) {
+    constexpr size_t Flows = 2000;
+
+    CoroTest test;
+    std::vector<CoroTest::Payload> replies;
+
+    for(size_t i = 0;i < Flows;i++) {
+        CoroTest::Payload request {
+            static_cast<uint8_t>(i),
+            static_cast<uint8_t>(i >> 8) };
+
+        test.executor.Spawn(CoroEcho(test.async_b, 1));
+        test.executor.Spawn(CoroRequest(test.async_a, request, replies));
+    }
+
+    test.executor.RunUntilIdle();
+
+    std::set<CoroTest::Payload> unique(replies.begin(), replies.end());
+
+    EXPECT_EQ(Flows, replies.size());
+    EXPECT_EQ(Flows, unique.size());
+    EXPECT_EQ(0, test.executor.TaskCount());
+    EXPECT_EQ(0, test.async_a.Dropped());
+    EXPECT_EQ(0, test.async_b.Dropped());
+}
+
+TEST(SdgramTests, CoroReceiveTimeout) {
+    CoroTest test;
+    bool done = false;
+    std::optional<CoroTest::Payload> msg;
+
+    test.executor.Spawn(CoroReceiveOnce(
+        test.async_b, std::chrono::milliseconds(10), msg, done));
+
+    test.executor.RunUntilIdle();
+    TestClock::Advance(std::chrono::milliseconds(9));
+    test.executor.RunUntilIdle();
+
+    EXPECT_FALSE(done);
+
+    TestClock::Advance(std::chrono::milliseconds(1));
+    test.executor.RunUntilIdle();
+
+    EXPECT_TRUE(done);
+    EXPECT_FALSE(msg);
+}
+
+// The send completes only once the peer made room for the rest
+// of the frame.
+TEST(SdgramTests, CoroSendWaitsForStream) {
+    CoroTest test(8);
+    test.executor.Remove(test.async_b);
+
+    CoroTest::Payload payload(20, 0x42);
+    std::optional<SerialDatagram::Status> status;
+
+    test.executor.Spawn(CoroSendOnce(
+        test.async_a, payload, CoroTest::AsyncSDgram::Forever, status));
+
+    test.executor.RunUntilIdle();
+
+    EXPECT_FALSE(status);
+    EXPECT_GT(test.a.QueuedBytes(), 0);
+
+    std::vector<uint8_t> wire;
+
+    while(!status) {
+        while(test.serial_b.available()) {
+            wire.push_back(test.serial_b.read());
+        }
+
+        test.executor.RunUntilIdle();
+    }
+
+    EXPECT_EQ(SerialDatagram::Status::Success, *status);
+    EXPECT_EQ(0, test.a.QueuedBytes());
+    EXPECT_EQ(payload.size() + SerialDatagram::DatagramHdrSize + SerialDatagram::DatagramTrlSize,
+        wire.size() + test.serial_b.available());
+}
+
+TEST(SdgramTests, CoroSendTimeout) {
+    CoroTest test(8);
+    test.executor.Remove(test.async_b);
+
+    CoroTest::Payload payload(20, 0x42);
+    std::optional<SerialDatagram::Status> status;
+
+    test.executor.Spawn(CoroSendOnce(
+        test.async_a, payload, std::chrono::milliseconds(5), status));
+
+    test.executor.RunUntilIdle();
+    TestClock::Advance(std::chrono::milliseconds(5));
+    test.executor.RunUntilIdle();
+
+    ASSERT_TRUE(status);
+    EXPECT_EQ(SerialDatagram::Status::Timeout, *status);
+}
+
+// Echo replies go out on the network besides the sends of the
+// AsyncNet, and must not complete them.
+TEST(SdgramTests, CoroSendAfterPings) {
+    using AsyncPing = SerialDatagram::AsyncNet<SDgramPing, TestClock>;
+
+    MemoryBufferPair serial(30);
+    auto serial_host = serial.CreateA();
+    auto serial_device = serial.CreateB();
+    SDgramPing host(serial_host);
+    SDgramPing device(serial_device);
+
+    SerialDatagram::Executor<TestClock> executor;
+    AsyncPing async(executor, device);
+
+    // a frame of 48 bytes
+    AsyncPing::Payload payload(40, 0x42);
+
+    for(int round = 0;round < 3;round++) {
+        ASSERT_EQ(SerialDatagram::Status::Success, host.SendPing());
+        host.Process();
+        executor.RunUntilIdle();
+        host.Process();
+
+        EXPECT_EQ(round + 1, host.GetPing().GetStats().replies);
+
+        std::optional<SerialDatagram::Status> status;
+
+        executor.Spawn(CoroSendOnce(async, payload, AsyncPing::Forever, status));
+        executor.RunUntilIdle();
+
+        EXPECT_FALSE(status);
+        EXPECT_GT(device.QueuedBytes(), 0);
+
+        while(!status) {
+            host.Process();
+            executor.RunUntilIdle();
+        }
+
+        EXPECT_EQ(SerialDatagram::Status::Success, *status);
+        EXPECT_EQ(0, device.QueuedBytes());
+    }
+}
+
+// The network goes on after the AsyncNet is gone, with a frame
+// it still had to send and one for its port.
+TEST(SdgramTests, CoroNetOutlivesAsync) {
+    CoroTest test(8);
+    test.executor.Remove(test.async_b);
+
+    auto async = std::make_unique<CoroTest::AsyncSDgram>(test.executor, test.a);
+
+    CoroTest::Payload payload(20, 0x42);
+    std::optional<SerialDatagram::Status> status;
+    std::optional<CoroTest::Payload> msg;
+    bool done = false;
+
+    test.executor.Spawn(CoroSendOnce(*async, payload, CoroTest::AsyncSDgram::Forever, status));
+    test.executor.Spawn(CoroReceiveOnce(*async, CoroTest::AsyncSDgram::Forever, msg, done));
+    test.executor.RunUntilIdle();
+
+    EXPECT_FALSE(status);
+    EXPECT_GT(test.a.QueuedBytes(), 0);
+
+    async.reset();
+
+    std::vector<uint8_t> wire;
+
+    while(test.a.QueuedBytes()) {
+        while(test.serial_b.available()) {
+            wire.push_back(test.serial_b.read());
+        }
+
+        test.a.Process();
+    }
+
+    CopyRcv rcv;
+
+    ASSERT_EQ(SerialDatagram::Status::Success, test.a.RegisterReceiver(DefaultPort, rcv));
+
+    auto buf = test.b.AllocBuffer();
+    buf.len = 3;
+    memset(buf.ptr, 7, buf.len);
+    test.b.Send(DefaultPort, buf);
+
+    for(int i = 0;i < 4;i++) {
+        test.a.Process();
+        test.b.Process();
+    }
+
+    EXPECT_EQ(1, rcv.msgs.size());
+    EXPECT_FALSE(status);
+    EXPECT_FALSE(done);
+}
+
+// Tasks still waiting are torn down with the test.
+TEST(SdgramTests, CoroDestroyWhileWaiting) {
+    CoroTest test;
+    bool done = false;
+    std::optional<CoroTest::Payload> msg;
+
+    test.executor.Spawn(CoroReceiveOnce(
+        test.async_b, CoroTest::AsyncSDgram::Forever, msg, done));
+    test.executor.Spawn(CoroReceiveOnce(
+        test.async_b, std::chrono::milliseconds(10), msg, done));
+
+    test.executor.RunUntilIdle();
+
+    EXPECT_EQ(2, test.executor.TaskCount());
+    EXPECT_FALSE(done);
+}
+
+#endif
@@ -0,0 +1,64 @@
+//
+// A serial endpoint with a limited write rate.
+//
+// Each tick lets the writer put up to the given number of bytes
+// into the channel, which makes links of different speeds out of
+// memory buffers. A rate of zero stalls the link.
+//
+// author: aleksandar
+//
+
+#pragma once
+
+#include <algorithm>
+
+#include "serial_mock.h"
+
+class ThrottledSerial {
+public:
+    ThrottledSerial(
+        SerialMock serial,
+        uint16_t rate)
+            : serial(serial),
+            rate(rate),
+            budget(rate) {
+        // empty
+    }
+
+    uint16_t available() const {
+        return serial.available();
+    }
+
+    uint8_t read() {
+        return serial.read();
+    }
+
+    uint16_t availableForWrite() const {
+        return std::min(serial.availableForWrite(), budget);
+    }
+
+    uint16_t write(void *buf, uint16_t buf_len) {
+        auto written = serial.write(buf, std::min(buf_len, budget));
+        budget -= written;
+
+        return written;
+    }
+
+    void Tick() {
+        budget = rate;
+    }
+
+    void SetRate(uint16_t new_rate) {
+        rate = new_rate;
+        budget = std::min(budget, rate);
+    }
+
+private:
+    //
+    // Data.
+    //
+    SerialMock serial;
+
+    uint16_t rate;
+    uint16_t budget;
+};